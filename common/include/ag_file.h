@@ -4,6 +4,8 @@
 #include <string_view>
 #include <string>
 #include <optional>
+#include <utility>
+#include <cstdint>
 #include <cstdlib>
 #include <fcntl.h>
 #include <sys/types.h>
@@ -11,6 +13,7 @@
 
 #if defined(__linux__) || defined(__LINUX__) || defined(__MACH__)
     #include <unistd.h>
+    #include <sys/mman.h>
 #elif defined(_WIN32)
     #include <windows.h>
     #include <io.h>
@@ -28,6 +31,7 @@ namespace ag::file {
         WRONLY = O_WRONLY,
         RDWR = O_RDWR,
         CREAT = O_CREAT,
+        TRUNC = O_TRUNC,
     };
 #elif defined(_WIN32)
     enum flags {
@@ -35,6 +39,7 @@ namespace ag::file {
         WRONLY = _O_WRONLY,
         RDWR = _O_RDWR,
         CREAT = _O_CREAT,
+        TRUNC = _O_TRUNC,
     };
 #else
     #error not supported
@@ -121,6 +126,29 @@ namespace ag::file {
      */
     int get_size(const handle f);
 
+    /**
+     * @brief      Get file last modification time
+     * @param[in]  f     file handle
+     * @return     Modification time in nanoseconds since epoch (<0 in case of error)
+     *             (the precision depends on the platform)
+     */
+    int64_t get_modification_time(const handle f);
+
+    /**
+     * @brief      Map the whole file in memory for reading
+     * @param[in]  f     file handle
+     * @return     Pointer to the mapped data and its size, or {nullptr, 0} in case of error
+     *             (successfully mapped file must be unmapped with `unmap`)
+     */
+    std::pair<const char *, size_t> map(const handle f);
+
+    /**
+     * @brief      Unmap the file mapped with `map`
+     * @param[in]  data  mapped data
+     * @param[in]  size  mapped data size
+     */
+    void unmap(const char *data, size_t size);
+
     /**
      * Function to be called from `for_each_line`
      * @param file position of read line
@@ -143,4 +171,22 @@ namespace ag::file {
      */
     int for_each_line(const handle f, line_action action, void *arg);
 
+    /**
+     * @brief      Apply user function to each line in buffer (e.g. a mapped file or a part of it
+     *             which starts at a line boundary), while user function return true
+     * @param[in]  data    buffer
+     * @param[in]  size    buffer size
+     * @param[in]  offset  file position of the buffer, which is added to the line positions
+     * @param[in]  action  user function
+     * @param      arg     user argument
+     * @param[out] tail    if not null, the line which is not terminated by a line break at the end
+     *                     of the buffer is not passed to user function, and its position in the buffer
+     *                     is stored here instead
+     *
+     * @return     false if user function stopped the loop,
+     *             true otherwise
+     */
+    bool for_each_line(const char *data, size_t size, size_t offset, line_action action, void *arg,
+                       size_t *tail = nullptr);
+
 } // namespace ag::file
@@ -10,30 +10,43 @@ namespace ag {
 
 class regex {
 public:
-    explicit regex(std::string_view text, uint32_t pcre2_compile_options = PCRE2_CASELESS)
-        : re(compile_regex(text, pcre2_compile_options))
+    /**
+     * @param text                   regex text
+     * @param pcre2_compile_options  PCRE2 compile options
+     * @param jit                    if true, try to JIT-compile the regex (if JIT is not available
+     *                               on the platform, the interpreter is used)
+     * @param pcre2_compile_context  PCRE2 compile context (e.g. with a custom memory allocator, which then
+     *                               must outlive the regex and its copies), null means the default one
+     */
+    explicit regex(std::string_view text, uint32_t pcre2_compile_options = PCRE2_CASELESS, bool jit = true,
+            pcre2_compile_context *pcre2_compile_context = nullptr)
+        : re(compile_regex(text, pcre2_compile_options, jit, pcre2_compile_context))
     {}
 
     ~regex() {
         pcre2_code_free(this->re);
     }
 
-    regex(const regex &other) {
-        *this = other;
-    }
+    regex(const regex &other)
+        : re(copy_regex(other.re))
+    {}
 
-    regex(regex &&other) {
-        *this = std::move(other);
+    regex(regex &&other)
+        : re(other.re)
+    {
+        other.re = nullptr;
     }
 
     regex &operator=(const regex &other) {
-        this->re = pcre2_code_copy(other.re);
+        if (this != &other) {
+            pcre2_code_free(this->re);
+            this->re = copy_regex(other.re);
+        }
         return *this;
     }
 
     regex &operator=(regex &&other) {
-        this->re = other.re;
-        other.re = nullptr;
+        std::swap(this->re, other.re);
         return *this;
     }
 
@@ -42,6 +55,39 @@ public:
      */
     bool is_valid() const { return this->re != nullptr; }
 
+    /**
+     * @brief      Check if regex is JIT-compiled
+     */
+    bool is_jit_compiled() const {
+        size_t jit_size = 0;
+        return is_valid() && 0 == pcre2_pattern_info(this->re, PCRE2_INFO_JITSIZE, &jit_size) && jit_size > 0;
+    }
+
+    /**
+     * @brief      Get memory consumed by the compiled regex, including the JIT-compiled code
+     */
+    size_t memory_usage() const {
+        size_t size = 0;
+        size_t jit_size = 0;
+        if (is_valid()) {
+            pcre2_pattern_info(this->re, PCRE2_INFO_SIZE, &size);
+            pcre2_pattern_info(this->re, PCRE2_INFO_JITSIZE, &jit_size);
+        }
+        return size + jit_size;
+    }
+
+    /**
+     * @brief      Get memory consumed by the JIT-compiled code of the regex (PCRE2 allocates it on its own,
+     *             not through the memory allocator of the compile context)
+     */
+    size_t jit_memory_usage() const {
+        size_t jit_size = 0;
+        if (is_valid()) {
+            pcre2_pattern_info(this->re, PCRE2_INFO_JITSIZE, &jit_size);
+        }
+        return jit_size;
+    }
+
     /**
      * @brief      Match string against regex
      * @param[in]  str   string to match
@@ -52,10 +98,13 @@ public:
             return false;
         }
 
-        pcre2_match_data *match_data = pcre2_match_data_create_from_pattern(this->re, nullptr);
+        match_scratch &scratch = get_match_scratch();
+        if (scratch.match_data == nullptr) {
+            SPDLOG_ERROR("Failed to allocate regex match data");
+            return false;
+        }
         int retval = pcre2_match(this->re, (PCRE2_SPTR8)str.data(), str.length(),
-            0, 0, match_data, nullptr);
-        pcre2_match_data_free(match_data);
+            0, 0, scratch.match_data, scratch.match_context);
         if (retval < 0 && retval != PCRE2_ERROR_NOMATCH && retval != PCRE2_ERROR_PARTIAL) {
             SPDLOG_ERROR("Matching string '{}' failed against URL: %d", str, retval);
         }
@@ -69,9 +118,12 @@ public:
      * @return     Apply result (empty in case of error)
      */
     std::string replace(std::string_view subject, std::string_view replacement) const {
+        // with `PCRE2_SUBSTITUTE_OVERFLOW_LENGTH` the length needed for the result is reported
+        // if the buffer is too small, so the second attempt has enough room
         uint32_t options = PCRE2_SUBSTITUTE_GLOBAL
             | PCRE2_SUBSTITUTE_UNSET_EMPTY
-            | PCRE2_SUBSTITUTE_EXTENDED;
+            | PCRE2_SUBSTITUTE_EXTENDED
+            | PCRE2_SUBSTITUTE_OVERFLOW_LENGTH;
 
         std::string result;
         size_t result_length = subject.length() + 1;
@@ -102,11 +154,58 @@ public:
 private:
     pcre2_code *re;
 
-    static pcre2_code *compile_regex(std::string_view text, uint32_t options) {
+    static constexpr size_t JIT_STACK_START_SIZE = 32 * 1024;
+    static constexpr size_t JIT_STACK_MAX_SIZE = 512 * 1024;
+
+    // Per-thread matching data which is reused by all the regexes matched on the thread.
+    // Only the fact of a match is needed, so the match data has a room for a single
+    // pair of offsets regardless of the number of the regex capturing groups.
+    struct match_scratch {
+        pcre2_match_data *match_data = pcre2_match_data_create(1, nullptr);
+        pcre2_match_context *match_context = pcre2_match_context_create(nullptr);
+        pcre2_jit_stack *jit_stack = pcre2_jit_stack_create(JIT_STACK_START_SIZE, JIT_STACK_MAX_SIZE, nullptr);
+
+        match_scratch() {
+            if (this->match_context != nullptr && this->jit_stack != nullptr) {
+                pcre2_jit_stack_assign(this->match_context, nullptr, this->jit_stack);
+            }
+        }
+
+        ~match_scratch() {
+            pcre2_match_data_free(this->match_data);
+            pcre2_match_context_free(this->match_context);
+            pcre2_jit_stack_free(this->jit_stack);
+        }
+
+        match_scratch(const match_scratch &) = delete;
+        match_scratch &operator=(const match_scratch &) = delete;
+    };
+
+    static match_scratch &get_match_scratch() {
+        static thread_local match_scratch scratch;
+        return scratch;
+    }
+
+    static pcre2_code *copy_regex(const pcre2_code *other) {
+        if (other == nullptr) {
+            return nullptr;
+        }
+        // JIT-compiled code is not copied along with the regex, so it must be compiled once again
+        size_t jit_size = 0;
+        bool jit = 0 == pcre2_pattern_info(other, PCRE2_INFO_JITSIZE, &jit_size) && jit_size > 0;
+        pcre2_code *re = pcre2_code_copy(other);
+        if (re != nullptr && jit) {
+            pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
+        }
+        return re;
+    }
+
+    static pcre2_code *compile_regex(std::string_view text, uint32_t options, bool jit,
+            pcre2_compile_context *context) {
         int err = 0;
         PCRE2_SIZE err_offset = 0;
         pcre2_code *re = pcre2_compile((PCRE2_SPTR8)text.data(), text.length(),
-            options, &err, &err_offset, nullptr);
+            options, &err, &err_offset, context);
         if (re == nullptr) {
             PCRE2_UCHAR error_message[256];
             pcre2_get_error_message(err, error_message, sizeof(error_message));
@@ -114,6 +213,10 @@ private:
                 text, error_message, err_offset);
             return nullptr;
         }
+        if (jit) {
+            // In case of failure (e.g. JIT support is not compiled in) `pcre2_match` falls back to the interpreter
+            pcre2_jit_compile(re, PCRE2_JIT_COMPLETE);
+        }
         return re;
     }
 };
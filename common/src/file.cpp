@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <ag_file.h>
@@ -44,6 +45,36 @@ int ag::file::get_size(const handle f) {
     return (0 == fstat(f, &stat)) ? stat.st_size : -1;
 }
 
+int64_t ag::file::get_modification_time(const handle f) {
+    struct stat stat;
+    if (0 != fstat(f, &stat)) {
+        return -1;
+    }
+#if defined(__MACH__)
+    return (int64_t)stat.st_mtimespec.tv_sec * 1000000000 + stat.st_mtimespec.tv_nsec;
+#else
+    return (int64_t)stat.st_mtim.tv_sec * 1000000000 + stat.st_mtim.tv_nsec;
+#endif
+}
+
+std::pair<const char *, size_t> ag::file::map(const handle f) {
+    int size = get_size(f);
+    if (size <= 0) {
+        return {nullptr, 0};
+    }
+    void *data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, f, 0);
+    if (data == MAP_FAILED) {
+        return {nullptr, 0};
+    }
+    return {(const char *)data, (size_t)size};
+}
+
+void ag::file::unmap(const char *data, size_t size) {
+    if (data != nullptr) {
+        ::munmap((void *)data, size);
+    }
+}
+
 #elif defined(_WIN32)
 
 bool ag::file::is_valid(const handle f) {
@@ -89,10 +120,75 @@ int ag::file::get_size(const handle f) {
     return (0 == _fstat(f, &stat)) ? stat.st_size : -1;
 }
 
+int64_t ag::file::get_modification_time(const handle f) {
+    struct _stat stat;
+    return (0 == _fstat(f, &stat)) ? (int64_t)stat.st_mtime * 1000000000 : -1;
+}
+
+std::pair<const char *, size_t> ag::file::map(const handle f) {
+    int size = get_size(f);
+    if (size <= 0) {
+        return {nullptr, 0};
+    }
+    HANDLE mapping = CreateFileMappingW((HANDLE)_get_osfhandle(f), nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping == nullptr) {
+        return {nullptr, 0};
+    }
+    void *data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    // the view keeps a reference to the mapping object
+    CloseHandle(mapping);
+    if (data == nullptr) {
+        return {nullptr, 0};
+    }
+    return {(const char *)data, (size_t)size};
+}
+
+void ag::file::unmap(const char *data, size_t size) {
+    if (data != nullptr) {
+        UnmapViewOfFile(data);
+    }
+}
+
 #else
     #error not supported
 #endif
 
+/**
+ * Find the first occurrence of the character in the range (`end` if there is none)
+ */
+static const char *find_char(const char *begin, const char *end, char c) {
+    const auto *found = (const char *)std::memchr(begin, c, end - begin);
+    return (found != nullptr) ? found : end;
+}
+
+bool ag::file::for_each_line(const char *data, size_t size, size_t offset, line_action action, void *arg,
+                             size_t *tail) {
+    // The line breaks of each kind are found by `memchr`, which checks a machine word or a vector
+    // at a time, and the next one of each kind is kept until the lines pass it
+    const char *end = data + size;
+    const char *lf = find_char(data, end, '\n');
+    const char *cr = find_char(data, end, '\r');
+    const char *start = data;
+    for (const char *eol = std::min(lf, cr); eol != end; eol = std::min(lf, cr)) {
+        if (!action(offset + (start - data), ag::utils::trim({ start, (size_t)(eol - start) }), arg)) {
+            return false;
+        }
+        start = eol + 1;
+        if (lf < start) {
+            lf = find_char(start, end, '\n');
+        }
+        if (cr < start) {
+            cr = find_char(start, end, '\r');
+        }
+    }
+    if (tail != nullptr) {
+        *tail = start - data;
+    } else if (start < end) {
+        return action(offset + (start - data), ag::utils::trim({ start, (size_t)(end - start) }), arg);
+    }
+    return true;
+}
+
 int ag::file::for_each_line(const handle f, line_action action, void *arg) {
     static constexpr size_t MAX_CHUNK_SIZE = 64 * 1024;
 
@@ -104,24 +200,34 @@ int ag::file::for_each_line(const handle f, line_action action, void *arg) {
     const size_t chunk_size = std::min(MAX_CHUNK_SIZE, (size_t)file_size);
 
     std::vector<char> buffer(chunk_size);
-    std::string line;
+    std::string line; // beginning of a line which crosses the chunks
     size_t file_idx = 0;
     size_t line_idx = 0;
     int r;
     while (0 < (r = file::read(f, &buffer[0], buffer.size()))) {
-        for (int i = 0; i < r; ++i) {
-            int c = buffer[i];
-            if (c != '\r' && c != '\n') {
-                line.push_back(c);
+        const char *begin = buffer.data();
+        const char *end = begin + r;
+        const char *start = begin;
+        if (!line.empty()) {
+            // The line which crosses the chunks ends at the first line break of this one
+            const char *eol = std::min(find_char(begin, end, '\n'), find_char(begin, end, '\r'));
+            line.append(begin, eol - begin);
+            if (eol == end) {
+                file_idx += r;
                 continue;
             }
-            std::string_view line_view = ag::utils::trim(line);
-            if (!action(line_idx, line_view, arg)) {
+            if (!action(line_idx, ag::utils::trim(line), arg)) {
                 return 0;
             }
             line.clear();
-            line_idx = file_idx + i + 1;
+            start = eol + 1;
+        }
+        size_t tail = 0;
+        if (!for_each_line(start, end - start, file_idx + (start - begin), action, arg, &tail)) {
+            return 0;
         }
+        line.assign(start + tail, end);
+        line_idx = file_idx + (start - begin) + tail;
         file_idx += r;
     }
 
@@ -2,7 +2,9 @@
 
 
 #include <string>
+#include <string_view>
 #include <vector>
+#include <memory>
 #include <optional>
 #include <bitset>
 #include <tuple>
@@ -21,12 +23,97 @@ public:
 
     struct filter_params {
         int32_t id; // filter id
-        std::string path; // path to file with rules
+        std::string path; // path to file with rules (if `data` or `fd` is set, it only names the filter
+                          // in the log and its compiled image)
+        std::string_view data; // if not null, the rules are loaded from and matched against this buffer
+                               // instead of the file, without copying it (the buffer must stay valid
+                               // as long as the engine, unless it is owned by `data_owner`)
+        std::shared_ptr<const void> data_owner; // owner of `data`, which the engine keeps alive
+        int fd{-1}; // if not -1, the rules are loaded from this file descriptor instead of `path`
+                    // (the file is mapped in memory, so the descriptor may be closed once the engine
+                    // is created)
     };
 
     struct engine_params {
         std::vector<filter_params> filters; // filter list
-        size_t mem_limit{0}; // the upper limit, in bytes, on the filtering engine memory usage, 0 means no limit
+        size_t mem_limit{0}; // the upper limit, in bytes, on the memory the filters take (their tables, compiled
+                             // regexes, mapped compiled images, and the index merging their tables), 0 means
+                             // no limit (a filter which does not fit in the rest of the limit is not loaded,
+                             // nor are the ones after it; the merged index, the rule hit counters and
+                             // the disabled duplicate rules are skipped if they don't fit)
+        bool resident_rules{false}; // if true, the rules are kept pre-parsed in memory, so matching never
+                                    // touches the filter files (faster, but takes more memory)
+        std::string compiled_filters_dir; // if not empty, each loaded filter is compiled into a binary image
+                                          // `<dir>/<filter id>-<file name>.compiled`, which is mapped in memory
+                                          // on subsequent loads instead of parsing the filter file again
+                                          // (the image is rebuilt once the filter file changes)
+        size_t load_threads_num{0}; // maximum number of threads to load the filters with, 0 means the number
+                                    // of CPU cores (1 means loading the filters one by one on the calling thread)
+        bool merge_filters{true}; // if true, the lookup tables of the filters are merged into a single index,
+                                  // so a domain is looked up once for all the filters instead of once per filter
+        size_t match_cache_size{0}; // maximum number of domains which match results are cached by the engine,
+                                    // 0 means no caching (the cache lives as long as the engine, so the results
+                                    // of a reloaded engine never come from the cache of the previous one)
+        bool fingerprint_tables{false}; // if true, the domains are looked up by 64-bit fingerprints in tables
+                                        // probed by groups of slots, otherwise by 32-bit hashes behind a Bloom
+                                        // filter (fewer false candidates to check, but more memory, and no Bloom
+                                        // filter pre-check of the absent domains)
+        bool domain_trie{false}; // if true, the exact domain and subdomain rules (e.g. `||example.org^`) are
+                                 // looked up in a trie of the domain labels, which finds all the parent
+                                 // domains of a domain in a single walk, instead of a hash table lookup
+                                 // per parent domain
+        bool deduplicate_rules{false}; // if true, a rule which text occurs in several filters (or several times
+                                       // in a filter) is looked up and matched only as the rule of the first
+                                       // of them: the matched rules are the same, as such a rule is reported
+                                       // once with the id of the first filter anyway, but the merged lookup
+                                       // tables do not keep its copies (see `merge_filters`; the separate
+                                       // tables of the filters keep them, and skip them on matching)
+        bool count_rule_hits{false}; // if true, the engine counts how many times each rule is matched and how many
+                                     // candidate rules each lookup table yields (see `get_hit_stats`); the counters
+                                     // are relaxed atomics, so matching takes no locks (the matches served from
+                                     // the match cache are not counted)
+    };
+
+    struct match_cache_stats {
+        size_t hits; // number of matches served from the cache
+        size_t misses; // number of matches which were not found in the cache
+        size_t size; // number of currently cached domains
+        size_t capacity; // maximum number of cached domains (0 if the cache is disabled)
+    };
+
+    /**
+     * Lookup tables the candidate rules for a domain are found in
+     */
+    enum match_table {
+        MT_ADDRESSES, // address and network rules (e.g. `1.2.3.4`, `10.0.0.0/8`)
+        MT_DOMAINS, // exact domain and subdomain rules (e.g. `example.org`, `||example.org^`)
+        MT_SHORTCUTS, // rules found by a substring of the domain (e.g. `ads*.example.org`, `/ads[0-9]+\./`)
+        MT_LEFTOVERS, // rules without a suitable substring, which are checked by their parts and regexes
+        MT_ADDRESS_PATTERNS, // rules which may match an IP address text (e.g. `172.16.*.1`)
+        MT_NUM
+    };
+
+    struct table_hits {
+        uint64_t candidates; // number of the candidate rules found in the table and checked against domains
+        uint64_t matched; // number of the candidates which matched
+    };
+
+    struct filter_hit_stats {
+        int32_t filter_id; // filter id
+        table_hits tables[MT_NUM]; // see `match_table`
+    };
+
+    struct rule_hits {
+        int32_t filter_id; // id of a filter which contains the rule
+        std::string text; // rule text
+        uint64_t hits; // number of times the rule was matched
+    };
+
+    struct hit_stats {
+        std::vector<rule_hits> top_rules; // the most matched rules, the most matched first
+        std::vector<filter_hit_stats> filters; // per-filter statistics in the order of the filters
+        uint64_t candidates; // number of the candidate rules checked in all the filters
+        uint64_t matched; // number of the candidates which matched
     };
 
     enum rule_props {
@@ -43,6 +130,63 @@ public:
         std::optional<std::string> ip; // non-nullopt if the rule has hosts syntax
     };
 
+    /**
+     * Matched rule which refers to the text stored in a match context (see `match_context`)
+     */
+    struct rule_view {
+        int32_t filter_id; // id of a filter which contains the matched rule
+        std::string_view text; // rule text
+        std::bitset<RP_NUM> props; // properties (see `rule_props`)
+        std::optional<std::string_view> ip; // non-nullopt if the rule has hosts syntax
+
+        /**
+         * Make a rule which owns its text
+         */
+        rule to_rule() const;
+
+        /**
+         * Make a view of a rule (it is valid as long as the rule is not changed or destroyed)
+         */
+        static rule_view of(const rule &r);
+    };
+
+    /**
+     * Domain or IP address to be matched by `match_batch`
+     */
+    struct match_target {
+        std::string_view domain; // domain to be matched (ignored if `address` is not empty)
+        uint8_view address; // 4 bytes of IPv4 or 16 bytes of IPv6 address in the network byte order
+                            // to be matched as by `match_address`, or empty
+    };
+
+    /**
+     * Reusable state of domain matching.
+     * It keeps its buffers between matches, so matching a domain which does not match any rule
+     * with a context which has already been used does not allocate memory.
+     * A context must not be used by several threads at the same time.
+     */
+    class match_context {
+    public:
+        match_context();
+        ~match_context();
+
+        match_context(match_context &&);
+        match_context &operator=(match_context &&);
+
+        match_context(const match_context &) = delete;
+        match_context &operator=(const match_context &) = delete;
+
+        /**
+         * Get the rules found by the last match (valid until the next match with the context)
+         */
+        std::vector<rule_view> &rules();
+
+    private:
+        friend class dnsfilter;
+        struct impl;
+        std::unique_ptr<impl> pimpl;
+    };
+
     dnsfilter();
     dnsfilter(const dnsfilter &) = delete;
     dnsfilter(dnsfilter &&) = delete;
@@ -72,19 +216,89 @@ public:
      * @param[in]  domain  domain to be matched
      * @return     List of matched rules (please note, that it contains all matched rules
      *             in undefined order, so the one should use `get_effective_rule` to get
-     *             the rule, which should be considered in request blocking logic)
+     *             the rule, which should be considered in request blocking logic).
+     *             The badfilter rules are applied on loading: the rules they disable are
+     *             never matched, and they are not in the list themselves.
      */
     std::vector<rule> match(handle obj, std::string_view domain);
 
+    /**
+     * Match domain against added rules using a caller-owned context
+     * @detail     Unlike `match`, the rules are not copied out: the returned views refer
+     *             to the context and stay valid until the next match with it
+     * @param[in]  obj     filtering engine handle
+     * @param[in]  domain  domain to be matched
+     * @param[in]  ctx     match context
+     * @return     List of matched rules (see `match`), stored in the context
+     */
+    std::vector<rule_view> &match(handle obj, std::string_view domain, match_context &ctx);
+
+    /**
+     * Match IP address (e.g. of an A or AAAA record of a response) against added rules using
+     * a caller-owned context
+     * @detail     The address is looked up in the tree of the address and network rules (e.g. `1.2.3.4`,
+     *             `||1.2.3.4^`, `10.0.0.0/8`), and the other rules are checked only if they may match
+     *             the address text (e.g. `172.16.*.1` or `/^192\.168\./`), so it matches the same rules
+     *             as matching the address text with `match`, but much cheaper.
+     * @param[in]  obj      filtering engine handle
+     * @param[in]  address  4 bytes of IPv4 or 16 bytes of IPv6 address in the network byte order
+     * @param[in]  ctx      match context
+     * @return     List of matched rules (see `match`), stored in the context
+     */
+    std::vector<rule_view> &match_address(handle obj, uint8_view address, match_context &ctx);
+
+    /**
+     * Match several domains and IP addresses (e.g. the CNAMEs and the addresses of a response)
+     * against added rules using a caller-owned context
+     * @detail     It is equivalent to calling `match` on each domain and `match_address` on each
+     *             address with the context, except that the lists of all the targets stay valid
+     *             until the next match with the context. As with a single match, the context buffers
+     *             are reused, so they are allocated only while they grow.
+     * @param[in]  obj          filtering engine handle
+     * @param[in]  targets      domains and addresses to be matched
+     * @param[in]  targets_num  number of the targets
+     * @param[in]  ctx          match context
+     * @return     Lists of matched rules (see `match`) in the same order as the targets,
+     *             stored in the context
+     */
+    std::vector<std::vector<rule_view>> &match_batch(handle obj, const match_target *targets, size_t targets_num,
+            match_context &ctx);
+
+    /**
+     * Get the match cache statistics of the engine (see `engine_params::match_cache_size`)
+     * @param[in]  obj     filtering engine handle
+     * @return     Cache statistics
+     */
+    match_cache_stats get_match_cache_stats(handle obj);
+
+    /**
+     * Get the rule hit statistics of the engine (see `engine_params::count_rule_hits`)
+     * @detail     The counters keep running while the statistics are collected, so the numbers
+     *             of a busy engine may be slightly inconsistent with each other
+     * @param[in]  obj     filtering engine handle
+     * @param[in]  top_k   maximum number of the most matched rules to get
+     * @return     Statistics (empty if the hits are not counted)
+     */
+    hit_stats get_hit_stats(handle obj, size_t top_k);
+
     /**
      * Select the rules which should be applied to the request
      * @detail     In the case of several rules which have hosts file syntax were matched this
      *             function returns all those rules. In other cases returns just the only rule.
+     *             A badfilter rule in the list disables the rules of the list having its text
+     *             without the `badfilter` modifier (a matched list has no badfilter rules, see `match`).
      * @param[in]  rules  matched rules
      * @return     Selected rules
      */
     static std::vector<const rule *> get_effective_rules(const std::vector<rule> &rules);
 
+    /**
+     * Select the rules which should be applied to the request (see `get_effective_rules` above)
+     * @param[in]  rules  matched rules
+     * @return     Selected rules
+     */
+    static std::vector<const rule_view *> get_effective_rules(const std::vector<rule_view> &rules);
+
     /**
      * Check if string is a valid rule
      * @param str string to check
@@ -0,0 +1,192 @@
+#include <cassert>
+#include <iterator>
+#include "aho_corasick.h"
+
+
+aho_corasick::aho_corasick()
+    : trie(1)
+    , trie_memory(sizeof(trie_node))
+{}
+
+uint32_t aho_corasick::add(std::string_view pattern) {
+    assert(!pattern.empty());
+    assert(this->nodes.empty()); // must not be built yet
+
+    uint32_t state = ROOT;
+    for (unsigned char c : pattern) {
+        std::vector<std::pair<uint8_t, uint32_t>> &next = this->trie[state].next;
+        auto iter = std::lower_bound(next.begin(), next.end(), std::make_pair((uint8_t)c, (uint32_t)0),
+            [] (const auto &l, const auto &r) { return l.first < r.first; });
+        if (iter != next.end() && iter->first == c) {
+            state = iter->second;
+            continue;
+        }
+        uint32_t new_state = this->trie.size();
+        size_t next_capacity = next.capacity();
+        next.emplace(iter, c, new_state);
+        this->trie_memory += (next.capacity() - next_capacity) * sizeof(next[0]);
+        size_t trie_capacity = this->trie.capacity();
+        this->trie.emplace_back(); // invalidates `next`
+        this->trie_memory += (this->trie.capacity() - trie_capacity) * sizeof(trie_node);
+        state = new_state;
+    }
+
+    trie_node &n = this->trie[state];
+    if (n.output == NONE) {
+        n.output = this->patterns_num++;
+    }
+    return n.output;
+}
+
+void aho_corasick::build() {
+    assert(this->nodes.empty());
+
+    // number the states in the breadth-first order, so the children of a state are contiguous
+    std::vector<uint32_t> order; // new index -> trie index
+    std::vector<uint32_t> new_index(this->trie.size());
+    order.reserve(this->trie.size());
+    order.push_back(ROOT);
+    for (size_t i = 0; i < order.size(); ++i) {
+        for (auto &[label, child] : this->trie[order[i]].next) {
+            new_index[child] = order.size();
+            order.push_back(child);
+        }
+    }
+
+    std::vector<node> nodes(order.size());
+    std::vector<uint8_t> labels;
+    std::vector<uint32_t> targets;
+    labels.reserve(order.size() - 1);
+    targets.reserve(order.size() - 1);
+    for (size_t i = 0; i < order.size(); ++i) {
+        const trie_node &t = this->trie[order[i]];
+        node &n = nodes[i];
+        n.first_child = labels.size();
+        n.children_num = t.next.size();
+        n.fail = ROOT;
+        n.output = t.output;
+        n.dict = NONE;
+        for (auto &[label, child] : t.next) {
+            labels.push_back(label);
+            targets.push_back(new_index[child]);
+        }
+    }
+    this->trie = {};
+    this->trie_memory = 0;
+
+    // the root transitions table is complete: the missing transitions lead to the root itself
+    std::fill(std::begin(this->root_next), std::end(this->root_next), ROOT);
+    const node &root = nodes[ROOT];
+    for (uint32_t i = root.first_child; i < root.first_child + root.children_num; ++i) {
+        this->root_next[labels[i]] = targets[i];
+    }
+
+    // the breadth-first order guarantees that the failure link of a state is computed
+    // before the failure links of its children
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const node &n = nodes[i];
+        for (uint32_t j = n.first_child; j < n.first_child + n.children_num; ++j) {
+            node &child = nodes[targets[j]];
+            child.fail = (i == ROOT)
+                    ? ROOT
+                    : next_state(nodes.data(), labels.data(), targets.data(), this->root_next, n.fail, labels[j]);
+            const node &fail = nodes[child.fail];
+            child.dict = (fail.output != NONE) ? child.fail : fail.dict;
+        }
+    }
+
+    this->nodes = flat_array<node>(std::move(nodes));
+    this->labels = flat_array<uint8_t>(std::move(labels));
+    this->targets = flat_array<uint32_t>(std::move(targets));
+}
+
+std::vector<std::string> aho_corasick::patterns() const {
+    std::vector<std::string> result(this->patterns_num);
+    if (this->nodes.empty()) {
+        return result;
+    }
+
+    // the trie is walked in depth-first order, `path` holds the labels leading to the current state
+    std::string path;
+    std::vector<std::pair<uint32_t, uint32_t>> stack; // state -> next child to visit
+    stack.emplace_back(ROOT, 0);
+    while (!stack.empty()) {
+        auto &[state, child] = stack.back();
+        const node &n = this->nodes[state];
+        if (child == 0 && n.output != NONE) {
+            result[n.output] = path;
+        }
+        if (child == n.children_num) {
+            stack.pop_back();
+            if (!path.empty()) {
+                path.pop_back();
+            }
+            continue;
+        }
+        uint32_t i = n.first_child + child++;
+        path.push_back(this->labels[i]);
+        stack.emplace_back(this->targets[i], 0);
+    }
+    return result;
+}
+
+size_t aho_corasick::memory_usage() const {
+    if (this->nodes.empty()) {
+        return sizeof(*this) + this->trie_memory;
+    }
+    return sizeof(*this) + this->nodes.memory_usage() + this->labels.memory_usage() + this->targets.memory_usage();
+}
+
+void aho_corasick::move_to(mem_arena &arena) {
+    this->nodes.move_to(arena);
+    this->labels.move_to(arena);
+    this->targets.move_to(arena);
+}
+
+void aho_corasick::serialize(image_writer &writer) const {
+    assert(!this->nodes.empty());
+    writer.write_value(this->patterns_num);
+    writer.write_array(this->nodes);
+    writer.write_array(this->labels);
+    writer.write_array(this->targets);
+    writer.write_array(this->root_next, std::size(this->root_next));
+}
+
+bool aho_corasick::deserialize(image_reader &reader) {
+    flat_array<uint32_t> root_next;
+    if (!reader.read_value(this->patterns_num)
+            || !reader.read_array(this->nodes)
+            || !reader.read_array(this->labels)
+            || !reader.read_array(this->targets)
+            || !reader.read_array(root_next)
+            || this->nodes.empty()
+            || this->labels.size() != this->targets.size()
+            || root_next.size() != std::size(this->root_next)) {
+        return false;
+    }
+    // a search relies on the failure and dictionary links leading to the preceding states in the breadth-first
+    // order, and on the children following their parents, so neither the links nor a walk down the trie loop,
+    // and on the dictionary links leading to the states which output a pattern
+    size_t n = this->nodes.size();
+    for (size_t i = 0; i < n; ++i) {
+        const node &x = this->nodes[i];
+        if (x.first_child > this->labels.size() || x.children_num > this->labels.size() - x.first_child
+                || (i != ROOT && x.fail >= i)
+                || (x.dict != NONE && (x.dict >= i || this->nodes[x.dict].output == NONE))
+                || (x.output != NONE && x.output >= this->patterns_num)) {
+            return false;
+        }
+        for (uint32_t j = x.first_child; j < x.first_child + x.children_num; ++j) {
+            if (this->targets[j] <= i || this->targets[j] >= n) {
+                return false;
+            }
+        }
+    }
+    if (std::any_of(root_next.begin(), root_next.end(), [n] (uint32_t s) { return s >= n; })) {
+        return false;
+    }
+    std::copy(root_next.begin(), root_next.end(), std::begin(this->root_next));
+    this->trie = {};
+    this->trie_memory = 0;
+    return true;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include "flat_array.h"
+#include "image_io.h"
+
+
+/**
+ * Aho-Corasick automaton matching a set of literal patterns against a text in a single pass.
+ * Patterns are added one by one into a trie, then `build` computes the failure links and
+ * flattens the trie into contiguous arrays in the breadth-first order, so that a search
+ * walks through a few cache-friendly tables.
+ */
+class aho_corasick {
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    aho_corasick();
+
+    /**
+     * Add pattern to the automaton (must be called before `build`)
+     * @param pattern non-empty pattern
+     * @return pattern id (identical patterns share the same id, ids are assigned sequentially
+     *         starting from 0)
+     */
+    uint32_t add(std::string_view pattern);
+
+    /**
+     * Compute the failure links and freeze the automaton layout
+     */
+    void build();
+
+    /**
+     * Find all the occurrences of the added patterns in the text
+     * (automaton must be built)
+     * @param text     text to search in
+     * @param on_match function to call on each occurrence (`void (uint32_t pattern_id)`)
+     */
+    template <typename F>
+    void search(std::string_view text, F &&on_match) const {
+        if (this->patterns_num == 0) {
+            return;
+        }
+
+        uint32_t state = ROOT;
+        for (unsigned char c : text) {
+            state = next_state(state, c);
+            const node &n = this->nodes[state];
+            for (uint32_t s = (n.output != NONE) ? state : n.dict; s != NONE; s = this->nodes[s].dict) {
+                on_match(this->nodes[s].output);
+            }
+        }
+    }
+
+    /**
+     * Get the added patterns (automaton must be built)
+     * @return patterns indexed by their ids
+     */
+    std::vector<std::string> patterns() const;
+
+    /**
+     * Get number of distinct patterns
+     */
+    size_t size() const { return this->patterns_num; }
+
+    /**
+     * Get number of automaton states
+     */
+    size_t states_num() const { return this->nodes.size(); }
+
+    /**
+     * Get approximate memory consumed by the automaton
+     */
+    size_t memory_usage() const;
+
+    /**
+     * Move the arrays of the built automaton to the arena (see `flat_array::move_to`)
+     */
+    void move_to(mem_arena &arena);
+
+    /**
+     * Write the built automaton into an image
+     */
+    void serialize(image_writer &writer) const;
+
+    /**
+     * Restore the built automaton from an image (the automaton refers to the image data)
+     * @return false if the image is corrupted
+     */
+    bool deserialize(image_reader &reader);
+
+private:
+    static constexpr uint32_t ROOT = 0;
+
+    struct node {
+        uint32_t first_child; // index of the first outgoing transition in `labels` and `targets`
+        uint32_t children_num; // number of outgoing transitions
+        uint32_t fail; // failure link
+        uint32_t output; // id of the pattern ending in this state, or `NONE`
+        uint32_t dict; // nearest state reachable by the failure links which has an output, or `NONE`
+    };
+
+    // Trie node used while the patterns are added
+    struct trie_node {
+        std::vector<std::pair<uint8_t, uint32_t>> next; // outgoing transitions sorted by label
+        uint32_t output = NONE;
+    };
+
+    static uint32_t next_state(const node *nodes, const uint8_t *labels, const uint32_t *targets,
+            const uint32_t *root_next, uint32_t state, uint8_t c) {
+        while (state != ROOT) {
+            const node &n = nodes[state];
+            const uint8_t *begin = &labels[n.first_child];
+            const uint8_t *end = begin + n.children_num;
+            const uint8_t *found = std::lower_bound(begin, end, c);
+            if (found != end && *found == c) {
+                return targets[found - labels];
+            }
+            state = n.fail;
+        }
+        return root_next[c];
+    }
+
+    uint32_t next_state(uint32_t state, uint8_t c) const {
+        return next_state(this->nodes.data(), this->labels.data(), this->targets.data(), this->root_next, state, c);
+    }
+
+    uint64_t patterns_num = 0;
+    std::vector<trie_node> trie; // not empty only before `build`
+    size_t trie_memory; // memory consumed by the trie
+    flat_array<node> nodes;
+    flat_array<uint8_t> labels;
+    flat_array<uint32_t> targets;
+    uint32_t root_next[256] = {}; // complete transitions table of the root
+};
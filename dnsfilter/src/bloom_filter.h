@@ -0,0 +1,108 @@
+#pragma once
+
+
+#include <cstdint>
+#include <vector>
+
+
+/**
+ * Blocked Bloom filter over 32-bit keys (e.g. hashes of domains).
+ * A key sets one bit in each of the 8 words of a single 32-byte block, so a check touches
+ * one cache line instead of probing a large table which is likely not in the cache.
+ */
+class bloom_filter {
+public:
+    // Memory spent per key (about 0.1% false positives)
+    static constexpr size_t BITS_PER_KEY = 16;
+
+    bloom_filter() = default;
+
+    /**
+     * @param keys_num number of keys to be added
+     */
+    explicit bloom_filter(size_t keys_num)
+        : blocks((keys_num * BITS_PER_KEY + BLOCK_BITS - 1) / BLOCK_BITS)
+    {}
+
+    /**
+     * Add key to the filter
+     */
+    void add(uint32_t key) {
+        uint32_t bits = 0;
+        block &b = this->blocks[get_block(key, &bits)];
+        for (size_t i = 0; i < WORDS_NUM; ++i) {
+            b.words[i] |= 1u << ((bits * SALT[i]) >> 27);
+        }
+    }
+
+    /**
+     * Check if the key may have been added to the filter
+     * @return false if the key was definitely not added (true if the filter is empty)
+     */
+    bool may_contain(uint32_t key) const {
+        if (this->blocks.empty()) {
+            return true;
+        }
+        uint32_t bits = 0;
+        const block &b = this->blocks[get_block(key, &bits)];
+        for (size_t i = 0; i < WORDS_NUM; ++i) {
+            if (!(b.words[i] & (1u << ((bits * SALT[i]) >> 27)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Measure the false positive rate of the filter by checking the keys which were not added
+     * @param contains function checking if a key was added (`bool (uint32_t key)`)
+     * @return share of the checked absent keys the filter does not reject (0 if the filter is empty,
+     *         as it is not checked at all then)
+     */
+    template <typename F>
+    double false_positive_rate(F &&contains) const {
+        if (this->blocks.empty()) {
+            return 0;
+        }
+        static constexpr uint32_t PROBES_NUM = 10000;
+        uint32_t absent = 0;
+        uint32_t false_positives = 0;
+        for (uint32_t i = 0; i < PROBES_NUM; ++i) {
+            // pseudo-random keys (the murmur3 finalizer of the probe number)
+            uint32_t key = i + 1;
+            key = (key ^ (key >> 16)) * 0x85ebca6bu;
+            key = (key ^ (key >> 13)) * 0xc2b2ae35u;
+            key ^= key >> 16;
+            if (!contains(key)) {
+                ++absent;
+                false_positives += may_contain(key);
+            }
+        }
+        return (absent != 0) ? (double)false_positives / absent : 0;
+    }
+
+    /**
+     * Get memory allocated for the filter
+     */
+    size_t memory_usage() const { return this->blocks.capacity() * sizeof(block); }
+
+private:
+    static constexpr size_t WORDS_NUM = 8;
+    static constexpr size_t BLOCK_BITS = WORDS_NUM * 32;
+    static constexpr uint32_t SALT[WORDS_NUM] = {
+        0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du, 0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+    };
+
+    struct alignas(32) block {
+        uint32_t words[WORDS_NUM];
+    };
+
+    size_t get_block(uint32_t key, uint32_t *bits) const {
+        uint64_t h = key * 0x9e3779b97f4a7c15ull;
+        *bits = (uint32_t)h;
+        // maps the high half of the hash onto the blocks range without a division
+        return ((h >> 32) * this->blocks.size()) >> 32;
+    }
+
+    std::vector<block> blocks;
+};
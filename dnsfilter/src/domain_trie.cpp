@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cassert>
+#include <tuple>
+#include "domain_trie.h"
+
+
+void domain_trie::builder::add(std::string_view domain, uint32_t index) {
+    assert(!(index & POSTINGS_FLAG));
+    this->entries.push_back({ (uint32_t)this->domains.size(), (uint32_t)domain.length(), index });
+    this->domains.append(domain);
+}
+
+domain_trie domain_trie::builder::finish() {
+    domain_trie trie;
+    if (this->entries.empty()) {
+        return trie;
+    }
+
+    // A label of a domain which is yet to be put in the trie
+    struct item {
+        uint32_t parent; // node of the label on the right of this one
+        uint32_t hash;
+        uint32_t entry;
+        uint32_t start; // label position in `domains`
+        uint32_t end;
+    };
+    auto label_of = [this] (const item &i) {
+        return std::string_view(this->domains).substr(i.start, i.end - i.start);
+    };
+    // Get the item of the label preceding the one ending at `end`
+    auto make_item = [this] (uint32_t parent, uint32_t e, uint32_t end) -> item {
+        uint32_t offset = this->entries[e].offset;
+        std::string_view domain = std::string_view(this->domains).substr(offset, end - offset);
+        size_t dot = domain.rfind('.');
+        uint32_t start = offset + ((dot == domain.npos) ? 0 : dot + 1);
+        return { parent, hash_label(domain.substr(start - offset)), e, start, end };
+    };
+
+    std::vector<item> items;
+    items.reserve(this->entries.size());
+    for (uint32_t e = 0; e < this->entries.size(); ++e) {
+        items.push_back(make_item(0, e, this->entries[e].offset + this->entries[e].length));
+    }
+
+    // The trie is built level by level: the labels of a level sorted by the parent nodes (which
+    // are already in the breadth-first order) and then by the label hash are the nodes of the level
+    // in the breadth-first order as well.
+    // The number of the labels of all the domains bounds the number of the nodes, which spares
+    // reallocating the largest arrays on growth.
+    size_t max_nodes = 1 + this->entries.size() + std::count(this->domains.begin(), this->domains.end(), '.');
+    std::vector<node> nodes;
+    nodes.reserve(max_nodes + 1);
+    nodes.push_back({ 0, NONE, 0, NO_VALUE });
+    std::vector<uint32_t> parents;
+    parents.reserve(max_nodes);
+    parents.push_back(NONE);
+    std::vector<uint32_t> postings;
+    std::string labels;
+    // The identical labels are stored once: an open-addressing table of the stored labels
+    // (a single array instead of an allocation per label)
+    struct label_slot {
+        uint32_t hash;
+        uint32_t offset;
+    };
+    std::vector<label_slot> label_slots;
+    size_t labels_num = 0;
+    auto put_label = [&] (std::string_view label, uint32_t hash) -> uint32_t {
+        if ((labels_num + 1) * 2 > label_slots.size()) {
+            std::vector<label_slot> slots(std::max(label_slots.size() * 2, (size_t)1024), { 0, NONE });
+            for (const label_slot &x : label_slots) {
+                size_t i = x.hash & (slots.size() - 1);
+                for (; x.offset != NONE && slots[i].offset != NONE; i = (i + 1) & (slots.size() - 1)) {
+                }
+                slots[i] = x;
+            }
+            label_slots.swap(slots);
+        }
+        for (size_t i = hash & (label_slots.size() - 1); ; i = (i + 1) & (label_slots.size() - 1)) {
+            label_slot &x = label_slots[i];
+            if (x.offset == NONE) {
+                x = { hash, (uint32_t)labels.size() };
+                labels.append(label);
+                labels.push_back(LABEL_END);
+                ++labels_num;
+                return x.offset;
+            }
+            if (x.hash == hash && 0 == labels.compare(x.offset, label.length(), label)
+                    && labels[x.offset + label.length()] == LABEL_END) {
+                return x.offset;
+            }
+        }
+    };
+    uint64_t keys_num = 0;
+    std::vector<uint32_t> indexes;
+    while (!items.empty()) {
+        std::sort(items.begin(), items.end(), [&label_of] (const item &l, const item &r) {
+            if (l.parent != r.parent || l.hash != r.hash) {
+                return std::tie(l.parent, l.hash) < std::tie(r.parent, r.hash);
+            }
+            int c = label_of(l).compare(label_of(r));
+            // the indexes of a domain keep the adding order
+            return c < 0 || (c == 0 && l.entry < r.entry);
+        });
+
+        // an item is replaced with the one of its next label in place, as the writing
+        // position never outruns the reading one
+        size_t next_num = 0;
+        for (size_t i = 0; i < items.size(); ) {
+            const item head = items[i];
+            std::string_view label = label_of(head);
+            uint32_t n = nodes.size();
+            nodes.push_back({ head.hash, put_label(label, head.hash), 0, NO_VALUE });
+            parents.push_back(head.parent);
+
+            indexes.clear();
+            for (; i < items.size() && items[i].parent == head.parent && items[i].hash == head.hash
+                    && label_of(items[i]) == label; ++i) {
+                const item x = items[i];
+                if (x.start == this->entries[x.entry].offset) {
+                    indexes.push_back(this->entries[x.entry].index);
+                } else {
+                    items[next_num++] = make_item(n, x.entry, x.start - 1);
+                }
+            }
+
+            if (indexes.size() == 1) {
+                nodes.back().value = indexes[0];
+            } else if (indexes.size() > 1) {
+                nodes.back().value = postings.size() | POSTINGS_FLAG;
+                postings.push_back(indexes.size());
+                postings.insert(postings.end(), indexes.begin(), indexes.end());
+            }
+            keys_num += !indexes.empty();
+        }
+        items.resize(next_num);
+    }
+    items = {};
+    label_slots = {};
+    this->entries = {};
+    this->domains = {};
+
+    // the parents are in ascending order, so the children of each node follow the ones of the previous node
+    uint32_t child = 1;
+    for (uint32_t n = 0; n < nodes.size(); ++n) {
+        for (; child < nodes.size() && parents[child] < n; ++child) {
+        }
+        nodes[n].first_child = child;
+    }
+    nodes.push_back({ 0, 0, (uint32_t)(nodes.size()), NO_VALUE });
+
+    // the arrays are copied to fit, as `shrink_to_fit` does nothing if the exceptions are disabled
+    trie.nodes = flat_array<node>(std::vector<node>(nodes.begin(), nodes.end()));
+    trie.labels = flat_array<char>(std::vector<char>(labels.begin(), labels.end()));
+    trie.postings = flat_array<uint32_t>(std::vector<uint32_t>(postings.begin(), postings.end()));
+    trie.keys_num = keys_num;
+    return trie;
+}
+
+void domain_trie::serialize(image_writer &writer) const {
+    writer.write_value(this->keys_num);
+    writer.write_array(this->nodes);
+    writer.write_array(this->labels);
+    writer.write_array(this->postings);
+}
+
+bool domain_trie::deserialize(image_reader &reader) {
+    if (!reader.read_value(this->keys_num)
+            || !reader.read_array(this->nodes)
+            || !reader.read_array(this->labels)
+            || !reader.read_array(this->postings)) {
+        return false;
+    }
+    if (this->nodes.empty()) {
+        return this->keys_num == 0;
+    }
+    // a lookup relies on the children ranges being within the nodes, and on the labels being terminated
+    size_t n = this->nodes.size();
+    if (this->nodes[0].first_child != 1 || this->nodes[n - 1].first_child != n - 1
+            || this->labels.empty() || this->labels[this->labels.size() - 1] != LABEL_END) {
+        return false;
+    }
+    for (size_t i = 1; i < n; ++i) {
+        const node &x = this->nodes[i];
+        if (x.first_child < this->nodes[i - 1].first_child || x.first_child > n - 1
+                || (i < n - 1 && x.label >= this->labels.size())) {
+            return false;
+        }
+        if (x.value != NO_VALUE && (x.value & POSTINGS_FLAG)) {
+            size_t offset = x.value & ~POSTINGS_FLAG;
+            if (offset >= this->postings.size() || this->postings[offset] > this->postings.size() - offset - 1) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,218 @@
+#pragma once
+
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "flat_array.h"
+#include "image_io.h"
+
+
+/**
+ * Read-only trie of domains split by labels, starting from the top-level one, which maps
+ * a domain to one or several rule indexes.
+ * A lookup walks the labels of a domain from the right once and finds the indexes of the domain
+ * and of all its parent domains on the way, instead of looking up each parent domain separately.
+ * The common suffixes (e.g. `.com`) are stored once, as well as the identical labels.
+ * The nodes are stored in the breadth-first order, so the children of a node are contiguous
+ * and sorted by the label hash, and the trie consists of plain arrays, so it can be used right
+ * from a mapped compiled filter image.
+ */
+class domain_trie {
+private:
+    struct node {
+        uint32_t label_hash;
+        uint32_t label; // offset of the label in `labels`
+        uint32_t first_child; // the children end where the ones of the next node start
+        uint32_t value; // rule index, offset of a postings list if `POSTINGS_FLAG` is set, or `NO_VALUE`
+    };
+
+public:
+    /**
+     * Helper for building the trie
+     */
+    class builder {
+    public:
+        /**
+         * Add domain with a rule index (a domain may be added several times)
+         * @param domain lowercased domain
+         * @param index  rule index (must be less than 2^31)
+         */
+        void add(std::string_view domain, uint32_t index);
+
+        /**
+         * Get the built trie (the builder must not be used afterwards)
+         */
+        domain_trie finish();
+
+    private:
+        struct entry {
+            uint32_t offset; // offset of the domain in `domains`
+            uint32_t length;
+            uint32_t index;
+        };
+
+        std::string domains;
+        std::vector<entry> entries;
+    };
+
+    /**
+     * Find indexes of the domain and of its parent domains, except the top-level one (unless the domain
+     * consists of a single label), i.e. the same domains as in `filter::match_context::subdomains`
+     * @param domain   lowercased domain
+     * @param on_index function to call on each found index (`void (uint32_t index)`)
+     */
+    template <typename F>
+    void find(std::string_view domain, F &&on_index) const {
+        if (this->nodes.empty()) {
+            return;
+        }
+        uint32_t n = 0;
+        size_t end = domain.length();
+        for (size_t depth = 1; ; ++depth) {
+            size_t dot = (end == 0) ? domain.npos : domain.rfind('.', end - 1);
+            size_t start = (dot == domain.npos) ? 0 : dot + 1;
+            n = find_child(n, domain.substr(start, end - start));
+            if (n == NONE) {
+                return;
+            }
+            if (depth > 1 || dot == domain.npos) {
+                on_value(this->nodes[n].value, on_index);
+            }
+            if (dot == domain.npos) {
+                return;
+            }
+            end = dot;
+        }
+    }
+
+    /**
+     * Enumerate all the domains with their indexes
+     * @param on_key function to call on each domain (`void (std::string_view domain, const uint32_t *indexes, size_t num)`)
+     */
+    template <typename F>
+    void for_each(F &&on_key) const {
+        if (!this->nodes.empty()) {
+            std::string domain;
+            for_each_child(0, domain, on_key);
+        }
+    }
+
+    /**
+     * Get number of domains
+     */
+    size_t size() const { return this->keys_num; }
+
+    /**
+     * Get number of nodes (i.e. of the distinct domains and parent domains)
+     */
+    size_t nodes_num() const { return this->nodes.empty() ? 0 : this->nodes.size() - 2; }
+
+    /**
+     * Get memory allocated for the trie (the memory of a mapped image is not counted)
+     */
+    size_t memory_usage() const {
+        return this->nodes.memory_usage() + this->labels.memory_usage() + this->postings.memory_usage();
+    }
+
+    /**
+     * Move the arrays to the arena (see `flat_array::move_to`)
+     */
+    void move_to(mem_arena &arena) {
+        this->nodes.move_to(arena);
+        this->labels.move_to(arena);
+        this->postings.move_to(arena);
+    }
+
+    void serialize(image_writer &writer) const;
+    bool deserialize(image_reader &reader);
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr uint32_t NO_VALUE = UINT32_MAX;
+    static constexpr uint32_t POSTINGS_FLAG = 1u << 31;
+    // Terminates each label in `labels` (a label never contains it)
+    static constexpr char LABEL_END = '.';
+
+    static uint32_t hash_label(std::string_view label) {
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        for (char c : label) {
+            hash ^= (uint8_t)c;
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+
+    std::string_view label_at(uint32_t offset) const {
+        const char *start = &this->labels[offset];
+        return { start, (size_t)((const char *)std::memchr(start, LABEL_END, this->labels.size() - offset) - start) };
+    }
+
+    uint32_t find_child(uint32_t parent, std::string_view label) const {
+        uint32_t hash = hash_label(label);
+        uint32_t lo = this->nodes[parent].first_child;
+        uint32_t hi = this->nodes[parent + 1].first_child;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (this->nodes[mid].label_hash < hash) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        for (; lo < this->nodes[parent + 1].first_child && this->nodes[lo].label_hash == hash; ++lo) {
+            uint32_t offset = this->nodes[lo].label;
+            if (this->labels.size() - offset > label.length()
+                    && 0 == std::memcmp(&this->labels[offset], label.data(), label.length())
+                    && this->labels[offset + label.length()] == LABEL_END) {
+                return lo;
+            }
+        }
+        return NONE;
+    }
+
+    template <typename F>
+    void on_value(uint32_t value, F &&on_index) const {
+        if (value == NO_VALUE) {
+            return;
+        }
+        if (!(value & POSTINGS_FLAG)) {
+            on_index(value);
+            return;
+        }
+        // the first element of a postings list is its length
+        const uint32_t *postings = &this->postings[value & ~POSTINGS_FLAG];
+        for (uint32_t j = 1; j <= postings[0]; ++j) {
+            on_index(postings[j]);
+        }
+    }
+
+    template <typename F>
+    void for_each_child(uint32_t parent, std::string &suffix, F &&on_key) const {
+        size_t suffix_length = suffix.length();
+        for (uint32_t i = this->nodes[parent].first_child; i < this->nodes[parent + 1].first_child; ++i) {
+            std::string_view label = label_at(this->nodes[i].label);
+            if (parent != 0) {
+                suffix.insert(0, 1, '.');
+            }
+            suffix.insert(0, label);
+            uint32_t value = this->nodes[i].value;
+            if (value != NO_VALUE && !(value & POSTINGS_FLAG)) {
+                on_key(std::string_view(suffix), &this->nodes[i].value, 1);
+            } else if (value != NO_VALUE) {
+                const uint32_t *postings = &this->postings[value & ~POSTINGS_FLAG];
+                on_key(std::string_view(suffix), postings + 1, postings[0]);
+            }
+            for_each_child(i, suffix, on_key);
+            suffix.erase(0, suffix.length() - suffix_length);
+        }
+    }
+
+    flat_array<node> nodes; // the root is the first one, and the last one only ends the children of the others
+    flat_array<char> labels; // unique labels, each one followed by `LABEL_END`
+    flat_array<uint32_t> postings; // lists of indexes of the domains having more than one index
+    uint64_t keys_num = 0;
+};
@@ -1,12 +1,20 @@
 #include <algorithm>
+#include <atomic>
+#include <shared_mutex>
 #include <dnsfilter.h>
 #include <ag_logger.h>
+#include <ag_cache.h>
 #include "filter.h"
 #include "rule_utils.h"
+#include "parallel.h"
 #include <ag_utils.h>
 
 using namespace ag;
 
+static std::string describe_filter(const dnsfilter::filter_params &p) {
+    return !p.path.empty() ? p.path : AG_FMT("{} (rules in memory)", p.id);
+}
+
 class engine {
 public:
     engine() : log(ag::create_logger("dnsfilter")) {}
@@ -17,28 +25,99 @@ public:
      * @return {true, optional warning} or {false, error description}
      */
     std::pair<bool, err_string> init(const dnsfilter::engine_params &p) {
-        size_t mem_limit = p.mem_limit;
         std::string warnings;
 
+        // The threads are created once and parse the chunks of all the lists. Without a memory limit
+        // the lists are loaded concurrently. With a limit, they are loaded one by one, each against
+        // what is left of the limit, so the peak memory stays within the limit instead of growing with
+        // the number of the lists loaded at once, and a list which doesn't fit is dropped before the next
+        // one is loaded.
+        thread_pool pool(get_threads_num(p.load_threads_num));
+        size_t lists_threads_num = std::clamp(p.filters.size(), (size_t)1, pool.threads_num());
+        std::vector<filter> loaded(p.filters.size());
+        std::vector<filter::load_result> results(p.filters.size());
+        if (p.mem_limit == 0) {
+            pool.parallel_for(p.filters.size(), [&] (size_t i) {
+                results[i] = loaded[i].load(p.filters[i], p, this->arena, 0, &pool,
+                    pool.threads_num() / lists_threads_num).first;
+            });
+        }
+
         this->filters.reserve(p.filters.size());
         for (size_t i = 0; i < p.filters.size(); ++i) {
-            filter f = {};
-            auto [res, f_mem] = f.load(p.filters[i], mem_limit);
+            if (p.mem_limit != 0) {
+                results[i] = loaded[i].load(p.filters[i], p, this->arena, get_memory_left(p.mem_limit), &pool,
+                    pool.threads_num()).first;
+            }
+            filter::load_result res = results[i];
             if (res == filter::LR_OK) {
-                mem_limit -= f_mem;
-                this->filters.emplace_back(std::move(f));
-                infolog(log, "Filter added successfully: {}", p.filters[i].path);
+                // the tables are moved right away, so the memory they leave is reused by the lists loaded next
+                loaded[i].move_to(this->arena);
+                this->filters.emplace_back(std::move(loaded[i]));
+                infolog(log, "Filter added successfully: {}", describe_filter(p.filters[i]));
             } else if (res == filter::LR_ERROR) {
-                auto err = AG_FMT("Filter was not added because of an error: {}\n", p.filters[i].path);
+                auto err = AG_FMT("Filter was not added because of an error: {}\n", describe_filter(p.filters[i]));
                 errlog(log, "{}", err);
                 filters.clear();
                 return {false, std::move(err)};
             } else if (res == filter::LR_MEM_LIMIT_REACHED) {
                 warnings += AG_FMT("Memory limit has been reached, some rules were not loaded\n", p.filters[i].path);
+                loaded[i] = filter();
                 break;
             }
         }
         this->filters.shrink_to_fit();
+        // the badfilter rules are applied to all the loaded filters at once, so they are never looked up on matching
+        filter::apply_badfilter_rules(this->filters);
+        // the rest is optional, so it is skipped if it doesn't fit in the rest of the memory limit
+        if (p.deduplicate_rules) {
+            std::optional<size_t> disabled = filter::deduplicate_rules(this->filters, get_memory_left(p.mem_limit));
+            if (disabled.has_value()) {
+                infolog(log, "Duplicate rules disabled: {}", disabled.value());
+            } else {
+                warnings += "Memory limit has been reached, duplicate rules were not disabled\n";
+            }
+        }
+        if (p.count_rule_hits) {
+            // the counters find the rules by the tables, so they are set up before the tables are merged
+            for (filter &f : this->filters) {
+                f.enable_hit_counters();
+            }
+            if (p.mem_limit != 0 && get_memory_usage() > p.mem_limit) {
+                for (filter &f : this->filters) {
+                    f.disable_hit_counters();
+                }
+                warnings += "Memory limit has been reached, rule hits are not counted\n";
+            } else {
+                infolog(log, "Rule hits are counted");
+            }
+        }
+        this->match_cache_size = p.match_cache_size;
+        if (this->match_cache_size != 0) {
+            this->match_cache.val.set_capacity(this->match_cache_size);
+        }
+        if (p.merge_filters && this->filters.size() > 1) {
+            switch (this->index.build(this->filters, this->arena, get_memory_left(p.mem_limit))) {
+            case merged_index::BR_OK:
+                infolog(log, "Lookup tables of {} filters merged, index size: {}kB", this->filters.size(),
+                    this->index.memory_usage() / 1024);
+                if (this->index.saved_memory() != 0) {
+                    // the duplicate rules are left out along with the ones disabled by the badfilter rules
+                    infolog(log, "Disabled rules left out of merged index, memory saved: ~{}kB",
+                        this->index.saved_memory() / 1024);
+                }
+                break;
+            case merged_index::BR_TOO_MANY_RULES:
+                warnlog(log, "Filters have too many rules to merge their lookup tables, they are kept separate");
+                break;
+            case merged_index::BR_MEM_LIMIT_REACHED:
+                warnings += "Memory limit has been reached, lookup tables of filters were not merged\n";
+                break;
+            }
+        }
+        infolog(log, "Memory usage: {}K (tables in arena: {}K in {} chunks, compiled regexes: {}K)",
+            (get_memory_usage() / 1024) + 1, (this->arena.chunks_memory() / 1024) + 1, this->arena.chunks_num(),
+            (this->arena.regex_memory() / 1024) + 1);
         if (!warnings.empty()) {
             warnlog(log, "Filters loaded with warnings:\n{}", warnings);
             return {true, std::move(warnings)};
@@ -46,10 +125,125 @@ public:
         return {true, std::nullopt};
     }
 
+    /**
+     * Get memory held by the engine: the arena, and the tables and the JIT-compiled code
+     * of the regexes outside it
+     */
+    size_t get_memory_usage() const {
+        size_t size = this->arena.memory_usage() + this->index.memory_usage(false);
+        for (const filter &f : this->filters) {
+            size += f.memory_usage(false);
+        }
+        return size;
+    }
+
+    /**
+     * Get memory left to the engine
+     * @param mem_limit memory limit (0 means no limit)
+     * @return 0 if there is no limit, otherwise the memory left, but at least 1 byte,
+     *         so that a limit is never mistaken for no limit
+     */
+    size_t get_memory_left(size_t mem_limit) const {
+        if (mem_limit == 0) {
+            return 0;
+        }
+        size_t used = get_memory_usage();
+        return (used < mem_limit) ? mem_limit - used : 1;
+    }
+
+    /**
+     * Match the domain against all the filters
+     */
+    void match(filter::match_context &ctx) {
+        // a raw address is checked against a part of the rules only, and fast enough not to be cached
+        bool use_cache = this->match_cache_size != 0 && !ctx.address_only;
+        if (use_cache && get_cached_match(ctx)) {
+            return;
+        }
+
+        if (!this->index.empty()) {
+            this->index.match(this->filters, ctx);
+        } else {
+            for (filter &f : this->filters) {
+                f.match(ctx);
+            }
+        }
+
+        if (use_cache) {
+            std::unique_lock l(this->match_cache.mtx);
+            this->match_cache.val.insert(ctx.host, { ctx.matched_rules, ctx.texts });
+        }
+    }
+
+    /**
+     * Fill the matched rules from the cache
+     * @return true if the domain was found in the cache
+     */
+    bool get_cached_match(filter::match_context &ctx) {
+        std::shared_lock l(this->match_cache.mtx);
+        auto cached = this->match_cache.val.get(ctx.host);
+        if (!cached) {
+            this->cache_misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        this->cache_hits.fetch_add(1, std::memory_order_relaxed);
+        // assigning keeps the capacity of the context buffers
+        ctx.matched_rules = cached->rules;
+        ctx.texts = cached->texts;
+        tracelog(log, "Match result of {} found in cache", ctx.host);
+        return true;
+    }
+
     ag::logger log;
+    // must outlive the filters and the index, as their tables and regexes are allocated from it
+    mem_arena arena;
     std::vector<filter> filters;
+    merged_index index; // empty if the filters are matched one by one
+
+    struct cached_match {
+        std::vector<filter::matched_rule> rules;
+        std::string texts;
+    };
+
+    // lowercased domain -> matched rules
+    with_mtx<lru_cache<std::string, cached_match>, std::shared_mutex> match_cache;
+    size_t match_cache_size = 0; // 0 if the cache is disabled
+    std::atomic<size_t> cache_hits = 0;
+    std::atomic<size_t> cache_misses = 0;
+};
+
+
+struct dnsfilter::match_context::impl {
+    filter::match_context ctx;
+    std::vector<rule_view> rules;
+    // state of `match_batch`: the rules of all the targets with their texts, and the lists of views
+    std::vector<filter::matched_rule> batch_rules;
+    std::vector<size_t> batch_ends; // target -> end of its rules in `batch_rules`
+    std::string batch_texts;
+    std::vector<std::vector<rule_view>> batch_lists;
 };
 
+dnsfilter::match_context::match_context() : pimpl(new impl) {}
+
+dnsfilter::match_context::~match_context() = default;
+
+dnsfilter::match_context::match_context(match_context &&) = default;
+
+dnsfilter::match_context &dnsfilter::match_context::operator=(match_context &&) = default;
+
+std::vector<dnsfilter::rule_view> &dnsfilter::match_context::rules() {
+    return this->pimpl->rules;
+}
+
+dnsfilter::rule dnsfilter::rule_view::to_rule() const {
+    return { this->filter_id, std::string(this->text), this->props,
+        this->ip.has_value() ? std::make_optional(std::string(this->ip.value())) : std::nullopt };
+}
+
+dnsfilter::rule_view dnsfilter::rule_view::of(const rule &r) {
+    return { r.filter_id, r.text, r.props,
+        r.ip.has_value() ? std::make_optional(std::string_view(r.ip.value())) : std::nullopt };
+}
 
 dnsfilter::dnsfilter() = default;
 
@@ -80,16 +274,161 @@ std::vector<dnsfilter::rule> dnsfilter::match(handle obj, std::string_view domai
 
     filter::match_context context = filter::create_match_context(domain);
 
-    for (filter &f : e->filters) {
-        f.match(context);
+    e->match(context);
+
+    tracelog(e->log, "Matched {} rules", context.matched_rules.size());
+
+    std::vector<rule> rules;
+    rules.reserve(context.matched_rules.size());
+    for (const filter::matched_rule &r : context.matched_rules) {
+        rules.emplace_back(context.make_rule(r));
+    }
+    return rules;
+}
+
+std::vector<dnsfilter::rule_view> &dnsfilter::match(handle obj, std::string_view domain, match_context &ctx) {
+    engine *e = (engine *)obj;
+    filter::match_context &context = ctx.pimpl->ctx;
+    std::vector<rule_view> &rules = ctx.pimpl->rules;
+
+    tracelog(e->log, "Matching {}", domain);
+
+    filter::reset_match_context(context, domain);
+    e->match(context);
+
+    tracelog(e->log, "Matched {} rules", context.matched_rules.size());
+
+    // the views are made after the match as the texts buffer may be reallocated while it is filled
+    rules.clear();
+    for (const filter::matched_rule &r : context.matched_rules) {
+        rules.push_back({ r.filter_id, context.text(r), r.props, context.ip(r) });
     }
+    return rules;
+}
+
+/**
+ * Match the IP address, leaving no rules in the context if the address size is wrong
+ */
+static void match_address_bytes(engine *e, filter::match_context &context, uint8_view address) {
+    if (address.size() != ipv4_address_size && address.size() != ipv6_address_size) {
+        context.matched_rules.clear();
+        context.texts.clear();
+        return;
+    }
+
+    filter::reset_match_context(context, address);
+    tracelog(e->log, "Matching address {}", context.host);
+
+    e->match(context);
 
     tracelog(e->log, "Matched {} rules", context.matched_rules.size());
+}
+
+std::vector<dnsfilter::rule_view> &dnsfilter::match_address(handle obj, uint8_view address, match_context &ctx) {
+    engine *e = (engine *)obj;
+    filter::match_context &context = ctx.pimpl->ctx;
+    std::vector<rule_view> &rules = ctx.pimpl->rules;
+
+    match_address_bytes(e, context, address);
+
+    rules.clear();
+    for (const filter::matched_rule &r : context.matched_rules) {
+        rules.push_back({ r.filter_id, context.text(r), r.props, context.ip(r) });
+    }
+    return rules;
+}
 
-    return context.matched_rules;
+std::vector<std::vector<dnsfilter::rule_view>> &dnsfilter::match_batch(handle obj, const match_target *targets,
+        size_t targets_num, match_context &ctx) {
+    engine *e = (engine *)obj;
+    filter::match_context &context = ctx.pimpl->ctx;
+    std::vector<filter::matched_rule> &rules = ctx.pimpl->batch_rules;
+    std::vector<size_t> &ends = ctx.pimpl->batch_ends;
+    std::string &texts = ctx.pimpl->batch_texts;
+    rules.clear();
+    ends.clear();
+    texts.clear();
+
+    // the texts of each target are appended to the ones of the previous targets, as the context
+    // buffer is refilled on each match
+    for (size_t i = 0; i < targets_num; ++i) {
+        const match_target &t = targets[i];
+        if (!t.address.empty()) {
+            match_address_bytes(e, context, t.address);
+        } else {
+            tracelog(e->log, "Matching {}", t.domain);
+            filter::reset_match_context(context, t.domain);
+            e->match(context);
+            tracelog(e->log, "Matched {} rules", context.matched_rules.size());
+        }
+
+        uint32_t base = texts.size();
+        texts.append(context.texts);
+        for (filter::matched_rule r : context.matched_rules) {
+            r.text_offset += base;
+            r.ip_offset += base;
+            rules.push_back(r);
+        }
+        ends.push_back(rules.size());
+    }
+
+    // the views are made after all the matches as the texts buffer may be reallocated while it is filled
+    std::vector<std::vector<rule_view>> &lists = ctx.pimpl->batch_lists;
+    lists.resize(targets_num);
+    size_t begin = 0;
+    for (size_t i = 0; i < targets_num; ++i) {
+        lists[i].clear();
+        for (size_t j = begin; j < ends[i]; ++j) {
+            const filter::matched_rule &r = rules[j];
+            std::string_view text = { texts.data() + r.text_offset, r.text_length };
+            std::optional<std::string_view> ip;
+            if (r.ip_length != 0) {
+                ip.emplace(texts.data() + r.ip_offset, r.ip_length);
+            }
+            lists[i].push_back({ r.filter_id, text, r.props, ip });
+        }
+        begin = ends[i];
+    }
+    return lists;
+}
+
+dnsfilter::match_cache_stats dnsfilter::get_match_cache_stats(handle obj) {
+    engine *e = (engine *)obj;
+    std::shared_lock l(e->match_cache.mtx);
+    return { e->cache_hits.load(std::memory_order_relaxed), e->cache_misses.load(std::memory_order_relaxed),
+        (e->match_cache_size != 0) ? e->match_cache.val.size() : 0, e->match_cache_size };
 }
 
-static bool has_higher_priority(const dnsfilter::rule &l, const dnsfilter::rule &r) {
+dnsfilter::hit_stats dnsfilter::get_hit_stats(handle obj, size_t top_k) {
+    engine *e = (engine *)obj;
+    hit_stats stats = {};
+    for (const filter &f : e->filters) {
+        std::optional<filter::hit_stats> fs = f.get_hit_stats(top_k);
+        if (!fs.has_value()) {
+            continue;
+        }
+        filter_hit_stats &s = stats.filters.emplace_back();
+        s.filter_id = f.params.id;
+        for (size_t t = 0; t < MT_NUM; ++t) {
+            s.tables[t] = fs->tables[t];
+            stats.candidates += fs->tables[t].candidates;
+            stats.matched += fs->tables[t].matched;
+        }
+        for (auto &[hits, text] : fs->top_rules) {
+            stats.top_rules.push_back({ f.params.id, std::move(text), hits });
+        }
+    }
+    // the rules of each filter are in order already, so the equally matched ones stay in the filters order
+    std::stable_sort(stats.top_rules.begin(), stats.top_rules.end(),
+        [] (const rule_hits &l, const rule_hits &r) { return l.hits > r.hits; });
+    if (stats.top_rules.size() > top_k) {
+        stats.top_rules.erase(stats.top_rules.begin() + top_k, stats.top_rules.end());
+    }
+    return stats;
+}
+
+template <typename R>
+static bool has_higher_priority(const R &l, const R &r) {
     // in ascending order (the higher index, the higher priority)
     static constexpr std::bitset<dnsfilter::RP_NUM> PRIORITY_TABLE[] = {
         {},
@@ -107,14 +446,16 @@ static bool has_higher_priority(const dnsfilter::rule &l, const dnsfilter::rule
     return !l.ip.has_value() && r.ip.has_value();
 }
 
-std::vector<const dnsfilter::rule *> dnsfilter::get_effective_rules(const std::vector<rule> &rules) {
-    const rule *effective_rules[rules.size()];
+// `R` is either `dnsfilter::rule` or `dnsfilter::rule_view`
+template <typename R>
+static std::vector<const R *> get_effective_rules(const std::vector<R> &rules) {
+    const R *effective_rules[rules.size()];
     size_t effective_rules_num = 0;
-    const rule *badfilter_rules[rules.size()];
+    const R *badfilter_rules[rules.size()];
     size_t badfilter_rules_num = 0;
 
-    for (const rule &r : rules) {
-        if (!r.props.test(RP_BADFILTER)) {
+    for (const R &r : rules) {
+        if (!r.props.test(dnsfilter::RP_BADFILTER)) {
             effective_rules[effective_rules_num++] = &r;
         } else {
             badfilter_rules[badfilter_rules_num++] = &r;
@@ -122,20 +463,21 @@ std::vector<const dnsfilter::rule *> dnsfilter::get_effective_rules(const std::v
     }
 
     std::stable_sort(effective_rules, effective_rules + effective_rules_num,
-        [] (const rule *l, const rule *r) { return !has_higher_priority(*l, *r); });
+        [] (const R *l, const R *r) { return !has_higher_priority(*l, *r); });
 
+    // the engine applies the badfilter rules on loading, so only a list made by the caller may have them
     std::string badfilter_rule_texts[badfilter_rules_num];
     for (size_t i = 0; i < badfilter_rules_num; ++i) {
-        const rule *r = badfilter_rules[i];
-        badfilter_rule_texts[i] = rule_utils::get_text_without_badfilter(*r);
+        const R *r = badfilter_rules[i];
+        badfilter_rule_texts[i] = rule_utils::get_text_without_badfilter(r->text);
     }
 
     std::string *badfilter_rules_end = badfilter_rule_texts + badfilter_rules_num;
     size_t i;
     for (i = 0; i < effective_rules_num; ++i) {
-        const rule *r = effective_rules[i];
-        const std::string *found = std::find(badfilter_rule_texts, badfilter_rules_end, r->text);
-        if (found == badfilter_rules_end) {
+        const R *r = effective_rules[i];
+        if (badfilter_rules_num == 0
+                || std::find(badfilter_rule_texts, badfilter_rules_end, r->text) == badfilter_rules_end) {
             if (!r->ip.has_value()) {
                 // faced with some more important rule than the one with hosts file syntax
                 // or there are no such rules in the list
@@ -159,7 +501,7 @@ std::vector<const dnsfilter::rule *> dnsfilter::get_effective_rules(const std::v
     }
     assert(seek > i);
 
-    std::vector<const rule *> result;
+    std::vector<const R *> result;
     result.reserve(seek - i);
     for (; i < seek; ++i) {
         result.emplace_back(effective_rules[i]);
@@ -167,6 +509,14 @@ std::vector<const dnsfilter::rule *> dnsfilter::get_effective_rules(const std::v
     return result;
 }
 
+std::vector<const dnsfilter::rule *> dnsfilter::get_effective_rules(const std::vector<rule> &rules) {
+    return ::get_effective_rules(rules);
+}
+
+std::vector<const dnsfilter::rule_view *> dnsfilter::get_effective_rules(const std::vector<rule_view> &rules) {
+    return ::get_effective_rules(rules);
+}
+
 bool dnsfilter::is_valid_rule(std::string_view str) {
     return rule_utils::parse(str).has_value();
 }
@@ -4,29 +4,64 @@
 #include <algorithm>
 #include <cassert>
 #include <tuple>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <atomic>
 #include <ag_regex.h>
 #include <ag_logger.h>
 #include <ag_utils.h>
 #include <ag_file.h>
 #include <ag_sys.h>
+#include <ag_net_utils.h>
+#include <ag_socket_address.h>
 #include <dnsfilter.h>
 #include <khash.h>
 #include "filter.h"
 #include "rule_utils.h"
-
-
-static constexpr size_t APPROX_COMPILED_REGEX_BYTES = 1024; // Empirical
-
-// Any rules besides simple domain rules, which into a somewhat
-// contiguous table, cause significant memory fragmentation
-// This coefficient was determined empirically
-static constexpr double APPROX_FRAGMENTATION_COEF = 1.5;
-
-
-static constexpr size_t SHORTCUT_LENGTH = 5;
-
-KHASH_MAP_INIT_INT(hash_to_unique_index, uint32_t)
-KHASH_MAP_INIT_INT(hash_to_indexes, std::vector<uint32_t>*)
+#include "aho_corasick.h"
+#include "leftovers_matcher.h"
+#include "flat_array.h"
+#include "flat_index.h"
+#include "fingerprint_index.h"
+#include "domain_trie.h"
+#include "ip_radix.h"
+#include "image_io.h"
+#include "mem_arena.h"
+#include "parallel.h"
+
+
+// Approximate memory per key of the domains and badfilter tables: (k + v) * empty buckets coef,
+// plus a Bloom filter in the layout with 32-bit keys (see `flat_index`)
+static constexpr size_t FINGERPRINT_TABLE_BYTES_PER_KEY = 2 * (sizeof(uint64_t) + sizeof(uint32_t));
+static constexpr size_t HASH_TABLE_BYTES_PER_KEY = 4 * sizeof(uint32_t) + bloom_filter::BITS_PER_KEY / 8;
+// Approximate memory per domain of the domains trie: a node and a label (most of the labels are unique)
+static constexpr size_t TRIE_BYTES_PER_KEY = 4 * sizeof(uint32_t) + 16;
+// Approximate memory per network of the addresses tree: two nodes with IPv6 keys at most
+static constexpr size_t RADIX_BYTES_PER_KEY = 2 * (4 * sizeof(uint32_t) + ag::ipv6_address_size);
+
+
+// A shortcut is a substring of a rule matching part, which a domain must contain to match the rule.
+// Each rule gets its rarest substring of these lengths among the shortcut rules of the filter
+// (see `filter::impl::assign_shortcuts`), so that a domain finds few rules by each shortcut.
+static constexpr size_t MIN_SHORTCUT_LENGTH = 3;
+static constexpr size_t MAX_SHORTCUT_LENGTH = 8;
+// Approximate memory per rule of the shortcuts table: its position, its offset and a few automaton states
+// (most of the shortcuts are unique)
+static constexpr size_t SHORTCUT_BYTES_PER_RULE = 12 * sizeof(uint32_t);
+// Separates the matching parts of the shortcut rules while loading (a rule never contains it)
+static constexpr char PARTS_SEPARATOR = '\n';
+
+// Files smaller than this are loaded on the calling thread
+static constexpr size_t MIN_PARALLEL_LOAD_SIZE = 256 * 1024;
+// A file loaded in parallel is split into chunks: about this number of chunks per thread,
+// but not smaller or larger than the limits below
+static constexpr size_t CHUNKS_PER_THREAD = 4;
+static constexpr size_t MIN_LOAD_CHUNK_SIZE = 64 * 1024;
+static constexpr size_t MAX_LOAD_CHUNK_SIZE = 256 * 1024;
+
+KHASH_MAP_INIT_INT64(hash_to_unique_index, uint32_t)
 
 
 struct match_arg {
@@ -47,93 +82,437 @@ static void destroy_unique_index_table(kh_hash_to_unique_index_t *table) {
     }
 }
 
-static void destroy_multi_index_table(kh_hash_to_indexes_t *table) {
-    if (table != nullptr) {
-        for (khiter_t i = kh_begin(table); i != kh_end(table); ++i) {
-            if (kh_exist(table, i)) {
-                delete kh_value(table, i);
-                kh_del(hash_to_indexes, table, i);
+static uint64_t hash_content(const char *data, size_t size) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= (uint8_t)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Get the 64-bit fingerprint of a domain or a rule text, the domains and badfilter tables are keyed by
+ */
+static uint64_t fingerprint(std::string_view str) {
+    return hash_content(str.data(), str.length());
+}
+
+/**
+ * Table of rule indexes keyed by domains or rule texts fingerprints in one of the layouts
+ * (see `ag::dnsfilter::engine_params::fingerprint_tables`)
+ */
+class keyed_index {
+public:
+    /**
+     * Build the table
+     * @param fingerprints if true, the table is keyed by the whole fingerprints, otherwise by their 32-bit folds
+     * @param entries      (fingerprint, rule index) pairs (the vector is sorted by the function)
+     */
+    static keyed_index build(bool fingerprints, std::vector<std::pair<uint64_t, uint32_t>> &entries) {
+        for (auto &e : entries) {
+            e.first = get_key(fingerprints, e.first);
+        }
+        // the indexes of a key keep the rules order
+        std::sort(entries.begin(), entries.end());
+
+        size_t keys_num = 0;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            keys_num += (i == 0 || entries[i].first != entries[i - 1].first);
+        }
+        keyed_index index;
+        index.fingerprints = fingerprints;
+        std::optional<fingerprint_index::builder> wide;
+        std::optional<flat_index::builder> compact;
+        if (fingerprints) {
+            wide.emplace(keys_num);
+        } else {
+            compact.emplace(keys_num);
+        }
+        std::vector<uint32_t> positions;
+        for (size_t i = 0; i < entries.size(); ) {
+            positions.clear();
+            uint64_t key = entries[i].first;
+            for (; i < entries.size() && entries[i].first == key; ++i) {
+                positions.push_back(entries[i].second);
             }
+            if (fingerprints) {
+                wide->add(key, positions.data(), positions.size());
+            } else {
+                compact->add(key, positions.data(), positions.size());
+            }
+        }
+        if (fingerprints) {
+            index.wide = wide->finish();
+        } else {
+            index.compact = compact->finish();
+        }
+        return index;
+    }
+
+    /**
+     * Find indexes of the fingerprint (see `flat_index::find`)
+     */
+    template <typename F>
+    void find(uint64_t fp, F &&on_index) const {
+        if (this->fingerprints) {
+            this->wide.find(fp, std::forward<F>(on_index));
+        } else {
+            this->compact.find(get_key(false, fp), std::forward<F>(on_index));
+        }
+    }
+
+    /**
+     * Enumerate all the keys with their indexes (see `flat_index::for_each`)
+     * @note the keys of a table with folded fingerprints are the folds, which may be passed to
+     *       `build` as the fingerprints
+     */
+    template <typename F>
+    void for_each(F &&on_key) const {
+        if (this->fingerprints) {
+            this->wide.for_each(std::forward<F>(on_key));
+        } else {
+            this->compact.for_each(std::forward<F>(on_key));
+        }
+    }
+
+    bool has_fingerprints() const { return this->fingerprints; }
+    size_t size() const { return this->fingerprints ? this->wide.size() : this->compact.size(); }
+    size_t memory_usage() const { return this->wide.memory_usage() + this->compact.memory_usage(); }
+    const flat_index &compact_table() const { return this->compact; }
+    void move_to(mem_arena &arena) {
+        this->wide.move_to(arena);
+        this->compact.move_to(arena);
+    }
+
+    void serialize(image_writer &writer) const {
+        if (this->fingerprints) {
+            this->wide.serialize(writer);
+        } else {
+            this->compact.serialize(writer);
         }
-        kh_destroy(hash_to_indexes, table);
     }
+
+    bool deserialize(image_reader &reader, bool fingerprints) {
+        this->fingerprints = fingerprints;
+        return fingerprints ? this->wide.deserialize(reader) : this->compact.deserialize(reader);
+    }
+
+private:
+    static uint64_t get_key(bool fingerprints, uint64_t fp) {
+        // a fold of a value less than 2^32 is the value itself
+        return fingerprints ? fp : (uint32_t)(fp ^ (fp >> 32));
+    }
+
+    bool fingerprints = false;
+    fingerprint_index wide;
+    flat_index compact;
+};
+
+/**
+ * Pack the lists of rule indexes of the keys into the compressed sparse rows: the list of the key `k`
+ * is `indexes[offsets[k]..offsets[k + 1])`
+ * @param entries  (key, rule index) pairs (the indexes of a key keep their order in the vector)
+ * @param keys_num number of keys (each key must be less than it)
+ */
+static void pack_lists(const std::vector<std::pair<uint32_t, uint32_t>> &entries, size_t keys_num,
+        flat_array<uint32_t> &offsets, flat_array<uint32_t> &indexes) {
+    // a counting sort by the keys: the pairs are counted, and then placed right where their lists start
+    std::vector<uint32_t> starts(keys_num + 1, 0);
+    for (const auto &[key, _] : entries) {
+        assert(key < keys_num);
+        ++starts[key + 1];
+    }
+    for (size_t k = 1; k < starts.size(); ++k) {
+        starts[k] += starts[k - 1];
+    }
+    std::vector<uint32_t> packed(entries.size());
+    std::vector<uint32_t> ends(starts.begin(), starts.end() - 1);
+    for (const auto &[key, index] : entries) {
+        packed[ends[key]++] = index;
+    }
+    offsets = flat_array<uint32_t>(std::move(starts));
+    indexes = flat_array<uint32_t>(std::move(packed));
 }
 
 struct leftover_entry {
     // @note: each entry must contain either or both of shortcuts and regex
+    //        (except in resident mode, where the regex is stored in the resident rule)
     std::vector<std::string> shortcuts; // list of extracted shortcuts
     std::optional<ag::regex> regex; // compiled regex
-    uint32_t file_idx; // file index
+    uint32_t file_idx; // file index (resident rule index in resident mode)
 };
 
-class filter::impl {
-public:
-    impl()
-        : unique_domains_table(kh_init(hash_to_unique_index))
-        , domains_table(kh_init(hash_to_indexes))
-        , shortcuts_table(kh_init(hash_to_indexes))
-        , badfilter_table(kh_init(hash_to_unique_index))
+// Reference to a string stored in the resident texts storage
+struct text_ref {
+    uint32_t offset;
+    uint32_t length;
+};
+
+static constexpr uint32_t NO_REGEX = UINT32_MAX;
+
+// Pre-parsed rule which is kept in memory in resident mode
+struct resident_rule {
+    text_ref text; // rule text
+    text_ref ip; // IP address of a rule with hosts file syntax (empty if the rule has no IP)
+    uint32_t parts_idx; // index of the first matching part in the parts storage
+    uint32_t parts_num; // number of matching parts
+    uint32_t regex_idx; // index of the compiled regex in the regexes storage, or `NO_REGEX`
+    uint8_t props; // see `ag::dnsfilter::rule_props`
+    uint8_t match_method; // see `rule_utils::rule::match_method_id`
+};
+
+// Hit counters of the rules of a filter (see `filter::enable_hit_counters`)
+struct hit_counters {
+    // sorted indexes of the counted rules: a rule is counted at the position of its index in the list
+    // (empty in resident mode, where the rule indexes are dense and are the positions themselves)
+    std::vector<uint32_t> indexes;
+    std::unique_ptr<std::atomic<uint64_t>[]> rules;
+    size_t rules_num = 0;
+    std::atomic<uint64_t> candidates[ag::dnsfilter::MT_NUM] = {};
+    std::atomic<uint64_t> matches[ag::dnsfilter::MT_NUM] = {};
+};
+
+// Header of a compiled filter image
+// The image is followed by the frozen tables (see `filter::impl::save_image` for the layout)
+struct image_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // `IMAGE_BYTE_ORDER` as it is stored by the machine that wrote the image
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t source_size; // filter file size
+    int64_t source_mtime; // filter file modification time
+    uint64_t source_hash; // filter file content hash
+    uint64_t mem_usage; // memory consumption of the filter loaded from the file (see `filter::memory_usage`)
+};
+
+static constexpr char IMAGE_MAGIC[8] = { 'A', 'G', 'D', 'N', 'S', 'F', 'L', 'T' };
+// Must be incremented on any change of the image layout
+static constexpr uint32_t IMAGE_VERSION = 6;
+static constexpr uint32_t IMAGE_BYTE_ORDER = 0x01020304;
+static constexpr uint32_t IMAGE_FLAG_RESIDENT = 1 << 0;
+static constexpr uint32_t IMAGE_FLAG_FINGERPRINTS = 1 << 1;
+static constexpr uint32_t IMAGE_FLAG_DOMAIN_TRIE = 1 << 2;
+
+// Rule parsed and prepared for putting in the tables (that may be done on a loader thread)
+struct prepared_rule {
+    uint32_t file_idx;
+    rule_utils::rule rule;
+    std::string regex_text; // regex of the rule, if the tables need it compiled
+    std::optional<ag::regex> regex; // compiled `regex_text`
+    std::optional<std::vector<std::string>> address_pattern; // see `rule_utils::get_address_pattern`
+};
+
+// Mutable tables which are filled while a filter is loaded, and then frozen into
+// the flat read-only ones used for matching
+struct tables_builder {
+    tables_builder()
+        : badfilter_table(kh_init(hash_to_unique_index))
     {}
 
-    ~impl() {
-        destroy_unique_index_table(this->unique_domains_table);
-        destroy_multi_index_table(this->domains_table);
-        destroy_multi_index_table(this->shortcuts_table);
+    ~tables_builder() {
         destroy_unique_index_table(this->badfilter_table);
     }
 
-    void put_hash_into_tables(uint32_t hash, uint32_t file_idx,
-                              kh_hash_to_unique_index_t *unique_table,
-                              kh_hash_to_indexes_t *multi_table);
+    tables_builder(const tables_builder &) = delete;
+    tables_builder &operator=(const tables_builder &) = delete;
+
+    // (domain fingerprint, rule string file index) pairs in the rules order
+    // The pairs are only appended while loading, and grouped by the domains on freezing,
+    // so a domain of several rules takes no list of its own
+    std::vector<std::pair<uint64_t, uint32_t>> domains;
+    // the same domains in the trie layout (see `ag::dnsfilter::engine_params::domain_trie`)
+    domain_trie::builder domains_trie;
+    // networks of the address rules
+    ip_radix::builder addresses;
+    // Rules of the shortcuts table, which get their shortcuts on freezing, when it is known
+    // how many rules share each substring (see `filter::impl::assign_shortcuts`)
+    struct shortcut_rule {
+        uint32_t file_idx;
+        uint32_t parts_offset; // offset of the rule parts in `shortcut_parts` (they end where the next rule ones start)
+    };
+    std::vector<shortcut_rule> shortcut_rules;
+    std::string shortcut_parts; // parts long enough for a shortcut, each one followed by `PARTS_SEPARATOR`
+    // (shortcut id, rule string file index) pairs in the rules order (see `domains`)
+    std::vector<std::pair<uint32_t, uint32_t>> shortcuts;
+    // rule text -> badfilter rule file index
+    kh_hash_to_unique_index_t *badfilter_table;
+    // regexes of the leftover entries (empty if an entry has no regex)
+    std::vector<std::string> leftover_regexes;
+
+    std::vector<resident_rule> resident_rules;
+    std::vector<text_ref> resident_parts;
+    std::vector<std::string> resident_regexes; // regexes of the resident rules
+    std::string resident_texts;
+    ag::hash_map<std::string, text_ref> resident_ips; // IP -> its text
+
+    /**
+     * Get memory allocated for the domains and shortcuts entries
+     */
+    size_t entries_memory() const {
+        return this->domains.capacity() * sizeof(this->domains[0])
+                + this->shortcut_rules.capacity() * sizeof(this->shortcut_rules[0]) + this->shortcut_parts.capacity()
+                + this->shortcuts.capacity() * sizeof(this->shortcuts[0]);
+    }
+};
+
+class filter::impl {
+public:
+    impl() = default;
+
+    ~impl() {
+        ag::file::unmap(this->image.first, this->image.second);
+        if (this->source_mapped) {
+            ag::file::unmap(this->source.data(), this->source.size());
+        }
+    }
 
     struct load_line_arg {
         impl *filter;
+        tables_builder *tables;
         size_t approx_mem;  // approximate usage so far
         size_t mem_limit;   // maximum allowed usage, 0 means no limit
         load_result result; // last rule load result
     };
 
+    std::optional<prepared_rule> prepare_rule(uint32_t file_idx, std::string_view line);
+    static bool add_rule(load_line_arg *a, prepared_rule &r);
     static bool load_line(uint32_t file_idx, std::string_view line, void *arg);
+    struct load_chunk_arg {
+        impl *filter;
+        std::vector<prepared_rule> *rules; // rules prepared from the chunk
+    };
+
+    static bool load_chunk(uint32_t file_idx, std::string_view line, void *arg);
+    void reserve_tables(tables_builder &tables, size_t lines_num);
+    int load_in_parallel(const char *data, size_t size, thread_pool &pool, size_t threads_num, load_line_arg *a);
     static bool match_against_line(match_arg &match, std::string_view line);
     static void match_by_file_position(match_arg &match, size_t idx);
+    static void match_by_index(match_arg &match, size_t idx, ag::dnsfilter::match_table table);
+    static void match_leftover_entry(match_arg &match, const leftover_entry &entry, ag::dnsfilter::match_table table);
+    void count_candidate(match_context &ctx, uint32_t idx, ag::dnsfilter::match_table table, bool matched) const;
+    void flush_hit_counts(match_context &ctx) const;
+
+    static text_ref put_resident_text(tables_builder &tables, std::string_view str);
+    static text_ref put_resident_ip(tables_builder &tables, std::string_view ip);
+    uint32_t put_resident_rule(tables_builder &tables, prepared_rule &r, size_t *approx_mem);
+    std::string_view get_resident_text(text_ref ref) const {
+        return { &this->resident_texts[ref.offset], ref.length };
+    }
+    void match_resident_rule(match_arg &match, size_t idx) const;
+
+    template <typename F>
+    void build_leftovers_matcher(F &&regex_of);
+    void assign_shortcuts(tables_builder &tables);
+    void freeze(tables_builder &tables);
+    bool save_image(const std::string &path, const image_header &header, const tables_builder &tables) const;
+    bool load_image(const std::string &path, ag::file::handle source, size_t mem_limit);
+    bool is_source_changed(const image_header &header, ag::file::handle source) const;
+    bool read_image(const char *data, size_t size);
+    bool check_rule_indexes(uint64_t rules_num) const;
+    void clear();
+    size_t merged_tables_memory(bool regex_code) const;
+    size_t memory_usage(bool regex_code) const;
+    size_t load_cost(mem_arena &arena, size_t regex_memory);
+    void move_to(mem_arena &arena);
+    std::string_view rule_text(std::string_view rules, uint32_t idx) const;
+    template <typename F>
+    void for_each_rule(std::string_view rules, F &&on_rule) const;
+    static std::string_view map_rules(const filter &f, std::pair<const char *, size_t> &mapped);
+    std::vector<uint32_t> get_indexed_rules() const;
+    bool is_disabled(uint32_t idx) const {
+        return !this->disabled_rules.empty()
+                && std::binary_search(this->disabled_rules.begin(), this->disabled_rules.end(), idx);
+    }
 
+    void search_by_address(match_arg &match) const;
+    void search_address_patterns(match_arg &match) const;
     void search_by_domains(match_arg &match) const;
     void search_by_shortcuts(match_arg &match) const;
     void search_in_leftovers(match_arg &match) const;
-    void search_badfilter_rules(match_arg &match) const;
 
     ag::logger log;
 
-    // unique domain -> rule string file index
+    // domain -> rule string file indexes
     // This table contains indexes of the rules that match exact domains (and their subdomains)
     // (e.g. `example.org`, but for example not `example.org|` or `example.org^` as they
     // match `eeexample.org` as well)
-    // As the lion's share of rule domains are unique, using a separate table
-    // for such domains saves a lot of memory
-    kh_hash_to_unique_index_t *unique_domains_table;
-    // non-unique domain -> list of rule string file indexes
-    // Similar to the previous one, but contains lists of indexes if the rules that match
-    // the same domain.
-    kh_hash_to_indexes_t *domains_table;
-
-    // shortcut -> rule string file index
+    keyed_index domains_table;
+    // the same table in the trie layout (only one of them is used)
+    domain_trie domains_trie;
+
+    // network -> rule string file indexes
+    // Contains indexes of the rules that match IP addresses by the address itself (e.g. `1.2.3.4`,
+    // `||1.2.3.4^`, or `10.0.0.0/8`), so an address is checked by a walk down the tree
+    // instead of matching its text against the other tables
+    ip_radix addresses_table;
+    // Contains indexes of the other rules that may match an IP address text (e.g. `172.16.*.1`
+    // or `/^192\.168\./`), which are the only ones checked besides `addresses_table` and the regexes
+    // without literal of `leftovers_prefilter` when a raw address is matched
+    // (see `match_context::address_only`), with the parts the text must contain
+    std::vector<leftover_entry> address_patterns;
+
     // Contains indexes of the rules that can be filtered out by checking, if matching domain
     // contains any shortcut
-    kh_hash_to_indexes_t *shortcuts_table;
+    // All the shortcuts are compiled into an automaton which finds the ones contained in
+    // a domain in a single pass over it
+    aho_corasick shortcuts_matcher;
+    // shortcut id -> offset of its list of rule string file indexes in `shortcuts_positions`
+    // (the list ends where the list of the next id starts)
+    flat_array<uint32_t> shortcuts_offsets;
+    flat_array<uint32_t> shortcuts_positions;
 
     // Contains indexes of the rules that are not fitting to place in domains and shortcuts tables
     // due to they are any of:
-    // - a regex rule for which the shortcut at least with length `SHORTCUT_LENGTH` was not found
+    // - a regex rule for which the shortcut at least with length `MIN_SHORTCUT_LENGTH` was not found
     //   (e.g. `/ex.*\.com/`)
-    // - a rule with special symbol for which the shortcut at least with length `SHORTCUT_LENGTH`
+    // - a rule with special symbol for which the shortcut at least with length `MIN_SHORTCUT_LENGTH`
     //   was not found (e.g. `ex*.com`)
     // - a regex rule with some complicated expression (see `rule_utils::parse` for details)
     std::vector<leftover_entry> leftovers_table;
+    // finds the leftover entries which may match a domain (see `leftovers_matcher`)
+    leftovers_matcher leftovers_prefilter;
 
     // rule text -> badfilter rule file index
     // Contains indexes of the badfilter rules that could be found by rule text without
-    // `badfilter` modifier
-    kh_hash_to_unique_index_t *badfilter_table;
+    // `badfilter` modifier, dropped once the rules they disable are found (see `filter::apply_badfilter_rules`)
+    keyed_index badfilter_table;
+    // sorted indexes of the rules disabled by the badfilter rules and of the duplicate rules
+    // (see `filter::deduplicate_rules`), which are left in the tables, but never matched
+    // (a merged index leaves them out, see `merged_index::build`)
+    flat_array<uint32_t> disabled_rules;
+
+    // see `ag::dnsfilter::engine_params::fingerprint_tables`
+    bool fingerprints = false;
+    // see `ag::dnsfilter::engine_params::domain_trie`
+    bool trie = false;
+    // if true, a merged index takes the tables from the filter (see `merged_index::build`)
+    bool merged = false;
+    // the regexes are compiled with the context of the engine arena (see `mem_arena::regex_context`)
+    pcre2_compile_context *regex_context = nullptr;
+
+    // In resident mode the tables above contain indexes in `resident_rules` instead of file
+    // positions, so a domain is matched without reading and parsing the filter file
+    bool resident = false;
+    flat_array<resident_rule> resident_rules;
+    flat_array<text_ref> resident_parts; // matching parts of the resident rules
+    std::vector<ag::regex> resident_regexes; // precompiled regexes of the resident rules
+    flat_array<char> resident_texts; // texts of the resident rules, their matching parts and IPs
+
+    // null unless the rule hits are counted (see `filter::enable_hit_counters`)
+    std::unique_ptr<hit_counters> hits;
+
+    // Mapped compiled image which the tables refer to (if the filter was loaded from it)
+    std::pair<const char *, size_t> image = { nullptr, 0 };
+
+    // Rules in memory, which the file positions in the tables refer to (null if the rules
+    // are read from the file by path): the buffer of `ag::dnsfilter::filter_params::data`
+    // or the mapped file descriptor (not counted in the memory usage, like a file read by path)
+    std::string_view source;
+    std::shared_ptr<const void> source_owner;
+    bool source_mapped = false;
 };
 
 filter::filter()
@@ -152,89 +531,60 @@ filter &filter::operator=(filter &&other) {
     return *this;
 }
 
-void filter::impl::put_hash_into_tables(uint32_t hash, uint32_t file_idx,
-                                        kh_hash_to_unique_index_t *unique_table, kh_hash_to_indexes_t *multi_table) {
-    bool already_exists = false;
-    size_t stored_idx = 0;
-
-    int ret;
-    khiter_t iter = kh_get(hash_to_indexes, multi_table, hash);
-    if (iter == kh_end(multi_table)) {
-        // there is no such domain in non-unique table
-        iter = kh_put(hash_to_unique_index, unique_table, hash, &ret);
-        if (ret < 0) {
-            errlog(log, "Out of memory");
-            return;
-        }
-        already_exists = ret == 0;
-        if (!already_exists) {
-            // domain is unique - save index
-            kh_value(unique_table, iter) = file_idx;
-            return;
-        } else {
-            // we have one record for this domain - remove from unique table
-            stored_idx = kh_value(unique_table, iter);
-            kh_del(hash_to_unique_index, unique_table, iter);
-        }
-    }
+text_ref filter::impl::put_resident_text(tables_builder &tables, std::string_view str) {
+    text_ref ref = { (uint32_t)tables.resident_texts.size(), (uint32_t)str.length() };
+    tables.resident_texts.append(str);
+    return ref;
+}
 
-    // create record in non-unique table
-    iter = kh_put(hash_to_indexes, multi_table, hash, &ret);
-    if (ret < 0) {
-        errlog(log, "Out of memory");
-        return;
-    } else if (ret > 0) {
-        // the record is a new one
-        auto *positions = new(std::nothrow) std::vector<uint32_t>;
-        if (positions == nullptr) {
-            errlog(log, "Out of memory");
-            return;
-        }
-        kh_value(multi_table, iter) = positions;
-    }
-    std::vector<uint32_t> *positions = kh_value(multi_table, iter);
-    if (already_exists) {
-        // put previously stored unique index, if it existed
-        positions->reserve(positions->size() + 2);
-        positions->push_back(stored_idx);
+text_ref filter::impl::put_resident_ip(tables_builder &tables, std::string_view ip) {
+    // The same IP is usually shared by lots of hosts file syntax rules, so it is stored only once
+    auto [iter, inserted] = tables.resident_ips.emplace(std::string(ip), text_ref{});
+    if (inserted) {
+        iter->second = put_resident_text(tables, ip);
     }
-    positions->push_back(file_idx);
+    return iter->second;
 }
 
-struct rules_stat {
-    size_t simple_domain_rules;
-    size_t shortcut_rules;
-    size_t leftover_rules;
-    size_t badfilter_rules;
-};
+uint32_t filter::impl::put_resident_rule(tables_builder &tables, prepared_rule &prepared, size_t *approx_mem) {
+    const rule_utils::rule &rule = prepared.rule;
+    const ag::dnsfilter::rule &pub = rule.public_part;
+    size_t texts_size = tables.resident_texts.size();
 
-static bool count_rules(uint32_t idx, std::string_view line, void *arg) {
-    std::optional<rule_utils::rule> rule = rule_utils::parse(line);
-    if (!rule.has_value()) {
-        return true;
+    resident_rule r = {};
+    r.text = put_resident_text(tables, pub.text);
+    if (pub.ip.has_value()) {
+        r.ip = put_resident_ip(tables, pub.ip.value());
     }
-
-    auto *stat = (rules_stat *)arg;
-    if (rule->public_part.props.test(ag::dnsfilter::RP_BADFILTER)) {
-        ++stat->badfilter_rules;
-        return true;
+    r.parts_idx = tables.resident_parts.size();
+    r.parts_num = rule.matching_parts.size();
+    for (const std::string &part : rule.matching_parts) {
+        // usually a matching part is just a piece of the rule text, so the text is reused
+        size_t pos = pub.text.find(part);
+        tables.resident_parts.push_back((pos != std::string::npos)
+                                        ? text_ref{ r.text.offset + (uint32_t)pos, (uint32_t)part.length() }
+                                        : put_resident_text(tables, part));
     }
-
-    switch (rule->match_method) {
-    case rule_utils::rule::MMID_EXACT:
-    case rule_utils::rule::MMID_SUBDOMAINS:
-        stat->simple_domain_rules += rule->matching_parts.size();
-        break;
-    case rule_utils::rule::MMID_SHORTCUTS:
-    case rule_utils::rule::MMID_SHORTCUTS_AND_REGEX:
-        ++stat->shortcut_rules;
-        break;
-    case rule_utils::rule::MMID_REGEX:
-        ++stat->leftover_rules;
-        break;
+    r.regex_idx = NO_REGEX;
+    if (prepared.regex.has_value()) {
+        r.regex_idx = this->resident_regexes.size();
+        tables.resident_regexes.emplace_back(std::move(prepared.regex_text));
+        this->resident_regexes.emplace_back(std::move(prepared.regex.value()));
+        *approx_mem += sizeof(ag::regex) + this->resident_regexes.back().memory_usage();
     }
+    r.props = pub.props.to_ulong();
+    r.match_method = rule.match_method;
+    tables.resident_rules.push_back(r);
 
-    return true;
+    *approx_mem += sizeof(resident_rule) + rule.matching_parts.size() * sizeof(text_ref)
+            + (tables.resident_texts.size() - texts_size);
+    return tables.resident_rules.size() - 1;
+}
+
+// Check if the rule has a part long enough to take its shortcut from
+static bool has_shortcut(const rule_utils::rule &rule) {
+    return std::any_of(rule.matching_parts.begin(), rule.matching_parts.end(),
+        [] (const std::string &part) { return part.length() >= MIN_SHORTCUT_LENGTH; });
 }
 
 #define CHECK_MEM() do {                                                  \
@@ -243,35 +593,76 @@ static bool count_rules(uint32_t idx, std::string_view line, void *arg) {
         return false;                                                     \
     }                                                                     \
 } while (0)
-bool filter::impl::load_line(uint32_t file_idx, std::string_view line, void *arg) {
-    auto *a = (load_line_arg *) arg;
-    filter::impl *self = a->filter;
-    std::optional<rule_utils::rule> rule = rule_utils::parse(line, &self->log);
-
+std::optional<prepared_rule> filter::impl::prepare_rule(uint32_t file_idx, std::string_view line) {
+    std::optional<rule_utils::rule> rule = rule_utils::parse(line, &this->log);
     if (!rule) {
         if (!line.empty() && !rule_utils::is_comment(line)) {
-            dbglog(self->log, "Failed to parse rule: {}", line);
+            dbglog(this->log, "Failed to parse rule: {}", line);
         }
-        return true;
+        return std::nullopt;
     }
 
+    // resident rules keep their regexes, otherwise only the leftovers table needs them
+    bool regex_needed;
+    rule_utils::rule::match_method_id method = rule->match_method;
+    if (this->resident) {
+        regex_needed = method == rule_utils::rule::MMID_REGEX || method == rule_utils::rule::MMID_SHORTCUTS_AND_REGEX;
+    } else {
+        regex_needed = !rule->public_part.props.test(ag::dnsfilter::RP_BADFILTER)
+                && (method == rule_utils::rule::MMID_REGEX
+                    || (method == rule_utils::rule::MMID_SHORTCUTS_AND_REGEX && !has_shortcut(*rule)));
+    }
+
+    prepared_rule r = { file_idx, std::move(rule.value()), {}, std::nullopt, std::nullopt };
+    if (regex_needed) {
+        r.regex_text = rule_utils::get_regex(r.rule);
+        r.regex.emplace(r.regex_text, PCRE2_CASELESS, true, this->regex_context);
+    }
+    r.address_pattern = rule_utils::get_address_pattern(r.rule);
+    return r;
+}
+
+bool filter::impl::load_line(uint32_t file_idx, std::string_view line, void *arg) {
+    auto *a = (load_line_arg *) arg;
+    std::optional<prepared_rule> r = a->filter->prepare_rule(file_idx, line);
+    return !r.has_value() || add_rule(a, r.value());
+}
+
+bool filter::impl::load_chunk(uint32_t file_idx, std::string_view line, void *arg) {
+    auto *a = (load_chunk_arg *) arg;
+    std::optional<prepared_rule> r = a->filter->prepare_rule(file_idx, line);
+    if (r.has_value()) {
+        a->rules->emplace_back(std::move(r.value()));
+    }
+    return true;
+}
+
+bool filter::impl::add_rule(load_line_arg *a, prepared_rule &r) {
+    filter::impl *self = a->filter;
+    tables_builder *tables = a->tables;
+    uint32_t file_idx = r.file_idx;
+    rule_utils::rule *rule = &r.rule;
+
     size_t approx_rule_mem = 0; // bytes
     const std::string &str = rule->public_part.text;
+    if (self->resident) {
+        file_idx = self->put_resident_rule(*tables, r, &approx_rule_mem);
+    }
 
     if (rule->public_part.props.test(ag::dnsfilter::RP_BADFILTER)) {
         std::string text = rule_utils::get_text_without_badfilter(rule->public_part);
-        uint32_t hash = ag::utils::hash(text);
+        uint64_t hash = fingerprint(text);
 
-        approx_rule_mem = 4 * sizeof(uint32_t); // (k + v) * empty buckets coef
+        approx_rule_mem += self->fingerprints ? FINGERPRINT_TABLE_BYTES_PER_KEY : HASH_TABLE_BYTES_PER_KEY;
         CHECK_MEM();
 
         int ret;
-        khiter_t iter = kh_put(hash_to_unique_index, self->badfilter_table, hash, &ret);
+        khiter_t iter = kh_put(hash_to_unique_index, tables->badfilter_table, hash, &ret);
         if (ret < 0) {
             warnlog(self->log, "Failed to put rule in badfilter table: {}", str);
             return true;
         }
-        kh_value(self->badfilter_table, iter) = file_idx;
+        kh_value(tables->badfilter_table, iter) = file_idx;
         tracelog(self->log, "Rule placed in badfilter table: {}", str);
         goto next_line;
     }
@@ -279,53 +670,32 @@ bool filter::impl::load_line(uint32_t file_idx, std::string_view line, void *arg
     switch (rule->match_method) {
     case rule_utils::rule::MMID_EXACT:
     case rule_utils::rule::MMID_SUBDOMAINS:
-        // count * (k + v) * empty buckets coef (assume non-unique domain rules are rare)
-        approx_rule_mem = rule->matching_parts.size() * 4 * sizeof(uint32_t);
+        // count * key memory (assume non-unique domain rules are rare)
+        approx_rule_mem += rule->matching_parts.size() * (self->trie ? TRIE_BYTES_PER_KEY
+                : self->fingerprints ? FINGERPRINT_TABLE_BYTES_PER_KEY : HASH_TABLE_BYTES_PER_KEY);
         CHECK_MEM();
         tracelog(self->log, "Placing a rule in domains table: {}", str);
         for (const std::string &d : rule->matching_parts) {
-            self->put_hash_into_tables(ag::utils::hash(d), file_idx, self->unique_domains_table, self->domains_table);
+            if (self->trie) {
+                tables->domains_trie.add(d, file_idx);
+            } else {
+                tables->domains.emplace_back(fingerprint(d), file_idx);
+            }
         }
         goto next_line;
     case rule_utils::rule::MMID_SHORTCUTS:
     case rule_utils::rule::MMID_SHORTCUTS_AND_REGEX: {
-        std::string_view sc = {};
-        for (size_t i = 0; i < rule->matching_parts.size(); ++i) {
-            const std::string &part = rule->matching_parts[i];
-            if (sc.empty() && part.length() >= SHORTCUT_LENGTH) {
-                sc = part;
-                break;
-            }
-        }
-        if (!sc.empty()) {
-            std::vector<uint32_t> *positions;
-            uint32_t hash = ag::utils::hash(sc.substr(0, SHORTCUT_LENGTH));
-            khiter_t iter = kh_get(hash_to_indexes, self->shortcuts_table, hash);
-            if (iter == kh_end(self->shortcuts_table)) { // add new
-                int ret;
-                iter = kh_put(hash_to_indexes, self->shortcuts_table, hash, &ret);
-                if (ret < 0) {
-                    warnlog(self->log, "Failed to put rule in shortcuts table: {}", str);
-                    return true;
-                }
-                positions = new(std::nothrow) std::vector<uint32_t>;
-                if (positions == nullptr) {
-                    kh_del(hash_to_indexes, self->shortcuts_table, iter);
-                    errlog(self->log, "Failed to allocate memory for shortcuts table");
-                    return true;
+        if (has_shortcut(*rule)) {
+            approx_rule_mem += SHORTCUT_BYTES_PER_RULE;
+            CHECK_MEM();
+            tracelog(self->log, "Placing a rule in shortcuts table: {}", str);
+            tables->shortcut_rules.push_back({ file_idx, (uint32_t)tables->shortcut_parts.size() });
+            for (const std::string &part : rule->matching_parts) {
+                if (part.length() >= MIN_SHORTCUT_LENGTH) {
+                    tables->shortcut_parts.append(part);
+                    tables->shortcut_parts.push_back(PARTS_SEPARATOR);
                 }
-                // (k + v) * empty buckets coef
-                approx_rule_mem = 2 * (sizeof(uint32_t) + sizeof(std::vector<uint32_t>) + positions->capacity() * sizeof(uint32_t));
-                kh_value(self->shortcuts_table, iter) = positions;
-            } else { // update existing
-                positions = kh_value(self->shortcuts_table, iter);
             }
-            tracelog(self->log, "Placing a rule in shortcuts table: {} ({})", str, hash);
-            approx_rule_mem -= positions->capacity() * sizeof(uint32_t);
-            positions->push_back(file_idx);
-            approx_rule_mem += positions->capacity() * sizeof(uint32_t);
-            approx_rule_mem *= APPROX_FRAGMENTATION_COEF;
-            CHECK_MEM();
             goto next_line;
         }
         [[fallthrough]];
@@ -333,278 +703,1934 @@ bool filter::impl::load_line(uint32_t file_idx, std::string_view line, void *arg
     case rule_utils::rule::MMID_REGEX: {
         std::vector<std::string> shortcuts = std::move(rule->matching_parts);
         std::transform(shortcuts.begin(), shortcuts.end(), shortcuts.begin(), ag::utils::to_lower);
-        std::optional<ag::regex> re = (rule->match_method == rule_utils::rule::MMID_SHORTCUTS)
-                                      ? std::nullopt
-                                      : std::make_optional(ag::regex(rule_utils::get_regex(*rule)));
-        assert(!shortcuts.empty() || re.has_value());
+        // in resident mode the regex is already stored in the resident rule
+        std::string re_text = !self->resident ? std::move(r.regex_text) : std::string();
+        std::optional<ag::regex> re = !self->resident ? std::move(r.regex) : std::nullopt;
+        assert(!shortcuts.empty() || re.has_value() || self->resident);
         approx_rule_mem -= self->leftovers_table.capacity() * sizeof(leftover_entry);
         self->leftovers_table.emplace_back(leftover_entry{ std::move(shortcuts), std::move(re), file_idx });
         approx_rule_mem += self->leftovers_table.capacity() * sizeof(leftover_entry);
+        tables->leftover_regexes.emplace_back(std::move(re_text));
         tracelog(self->log, "Rule placed in leftovers table: {}", str);
         for (auto &s : self->leftovers_table.back().shortcuts) {
             approx_rule_mem += s.size();
         }
         if (self->leftovers_table.back().regex) {
-            approx_rule_mem += APPROX_COMPILED_REGEX_BYTES;
+            approx_rule_mem += self->leftovers_table.back().regex->memory_usage();
         }
-        approx_rule_mem *= APPROX_FRAGMENTATION_COEF;
         CHECK_MEM();
         goto next_line;
     }
+    case rule_utils::rule::MMID_CIDR: {
+        approx_rule_mem += RADIX_BYTES_PER_KEY;
+        CHECK_MEM();
+        const std::string &network = rule->matching_parts[0];
+        tables->addresses.add({ (const uint8_t *)network.data(), network.length() - 1 }, (uint8_t)network.back(),
+            file_idx);
+        tracelog(self->log, "Rule placed in addresses table: {}", str);
+        goto next_line;
+    }
     }
 
 next_line:
+    if (r.address_pattern.has_value()) {
+        // the rule is put in one of the tables above as well, so that it matches domains
+        approx_rule_mem += sizeof(leftover_entry);
+        for (const std::string &part : r.address_pattern.value()) {
+            approx_rule_mem += part.size();
+        }
+        self->address_patterns.emplace_back(leftover_entry{ std::move(r.address_pattern.value()), std::nullopt, file_idx });
+        tracelog(self->log, "Rule placed in address patterns: {}", str);
+    }
     a->approx_mem += approx_rule_mem;
     a->result = LR_OK;
     return true;
 }
 #undef CHECK_MEM
 
-std::pair<filter::load_result, size_t> filter::load(const ag::dnsfilter::filter_params &p, size_t mem_limit) {
-    size_t last_slash = p.path.rfind('/');
-    std::string logger_name = AG_FMT("{}::{}"
-        , p.id, (last_slash != p.path.npos) ? &p.path[last_slash + 1] : p.path.c_str());
-    this->pimpl->log = ag::create_logger(logger_name);
+/**
+ * Get the literal a domain must contain to match the leftover entry (empty if there is no such literal)
+ */
+static std::string_view get_leftover_literal(const leftover_entry &entry) {
+    // the longest shortcut is the least likely to occur in a domain
+    auto longest = std::max_element(entry.shortcuts.begin(), entry.shortcuts.end(),
+        [] (const std::string &l, const std::string &r) { return l.length() < r.length(); });
+    return (longest != entry.shortcuts.end()) ? std::string_view(*longest) : std::string_view();
+}
 
-    ag::file::handle fd = ag::file::open(p.path.data(), ag::file::RDONLY);
-    if (!ag::file::is_valid(fd)) {
-        errlog(pimpl->log, "Failed to read file: {} ({})", p.path, ag::sys::error_string(ag::sys::error_code()));
-        return {LR_ERROR, 0};
+template <typename F>
+void filter::impl::build_leftovers_matcher(F &&regex_of) {
+    std::vector<std::string_view> literals;
+    std::vector<std::pair<uint32_t, std::string>> regexes;
+    literals.reserve(this->leftovers_table.size());
+    for (uint32_t i = 0; i < this->leftovers_table.size(); ++i) {
+        literals.push_back(get_leftover_literal(this->leftovers_table[i]));
+        if (literals.back().empty()) {
+            regexes.emplace_back(i, regex_of(i));
+        }
     }
+    this->leftovers_prefilter.build(literals, std::move(regexes), this->regex_context);
+}
 
-    rules_stat stat = {};
-    ag::file::for_each_line(fd, &count_rules, &stat);
-
-    impl *f = this->pimpl.get();
-    kh_resize(hash_to_unique_index, f->unique_domains_table, stat.simple_domain_rules);
-    kh_resize(hash_to_indexes, f->shortcuts_table, kh_size(f->shortcuts_table));
-    f->leftovers_table.reserve(stat.leftover_rules);
-    kh_resize(hash_to_unique_index, f->badfilter_table, stat.badfilter_rules);
-
-    filter::impl::load_line_arg load_line_arg{};
-    load_line_arg.filter = f;
-    load_line_arg.mem_limit = mem_limit;
-
-    ag::file::set_position(fd, 0);
-    int rc = ag::file::for_each_line(fd, &filter::impl::load_line, &load_line_arg);
-    if (rc == 0) {
-        this->params = p;
+/**
+ * Shrink the vector capacity to its size (`std::vector::shrink_to_fit` does nothing if the exceptions are disabled)
+ */
+template <typename T>
+static void shrink_to_fit(std::vector<T> &v) {
+    if (v.capacity() > v.size()) {
+        v = std::vector<T>(std::make_move_iterator(v.begin()), std::make_move_iterator(v.end()));
     }
-    ag::file::close(fd);
-
-    kh_resize(hash_to_unique_index, f->unique_domains_table, kh_size(f->unique_domains_table));
-    kh_resize(hash_to_indexes, f->domains_table, kh_size(f->domains_table));
-    kh_resize(hash_to_indexes, f->shortcuts_table, kh_size(f->shortcuts_table));
-    f->leftovers_table.shrink_to_fit();
-    kh_resize(hash_to_unique_index, f->badfilter_table, kh_size(f->badfilter_table));
-
-    infolog(pimpl->log, "Unique domains table size: {}", kh_size(f->unique_domains_table));
-    infolog(pimpl->log, "Non-unique domains table size: {}", kh_size(f->domains_table));
-    infolog(pimpl->log, "Shortcuts table size: {}", kh_size(f->shortcuts_table));
-    infolog(pimpl->log, "Leftovers table size: {}", f->leftovers_table.size());
-    infolog(pimpl->log, "Badfilter table size: {}", kh_size(f->badfilter_table));
-    infolog(pimpl->log, "Approximate memory usage: {}K", (load_line_arg.approx_mem / 1024) + 1);
-
-    return {load_line_arg.result, load_line_arg.approx_mem};
 }
 
-static inline bool match_shortcuts(const std::vector<std::string> &shortcuts, std::string_view domain) {
-    size_t seek = 0;
-    bool found = false;
-    for (const std::string &sc : shortcuts) {
-        found = domain.npos != domain.find(sc, seek);
-        if (!found) {
-            break;
+/**
+ * Call `on_gram(std::string_view gram)` on each substring of the parts which may be a shortcut
+ * @param parts matching parts of a rule, each one followed by `PARTS_SEPARATOR`
+ */
+template <typename F>
+static void for_each_gram(std::string_view parts, F &&on_gram) {
+    for (size_t start = 0; start < parts.length(); ) {
+        size_t end = parts.find(PARTS_SEPARATOR, start);
+        std::string_view part = parts.substr(start, end - start);
+        for (size_t len = MIN_SHORTCUT_LENGTH; len <= std::min(MAX_SHORTCUT_LENGTH, part.length()); ++len) {
+            for (size_t pos = 0; pos + len <= part.length(); ++pos) {
+                on_gram(part.substr(pos, len));
+            }
         }
-        seek += sc.length();
+        start = end + 1;
     }
-    return found;
 }
 
-bool filter::impl::match_against_line(match_arg &match, std::string_view line) {
-    bool matched = false;
-    std::optional<rule_utils::rule> rule = rule_utils::parse(line);
-
-    if (!rule.has_value()) {
-        matched = false;
-        goto exit;
-    }
-
-    if (rule->public_part.props.test(ag::dnsfilter::RP_BADFILTER)) {
-        matched = true;
-        goto exit;
-    }
+/**
+ * Give each shortcut rule its shortcut: the substring of its parts which the fewest rules contain
+ * (a common one, like `track` or `ads.`, would make every domain containing it check lots of rules)
+ */
+void filter::impl::assign_shortcuts(tables_builder &tables) {
+    auto parts_of = [&tables] (size_t i) {
+        size_t start = tables.shortcut_rules[i].parts_offset;
+        size_t end = (i + 1 < tables.shortcut_rules.size())
+                ? tables.shortcut_rules[i + 1].parts_offset : tables.shortcut_parts.size();
+        return std::string_view(tables.shortcut_parts).substr(start, end - start);
+    };
 
-    switch (rule->match_method) {
-    case rule_utils::rule::MMID_EXACT:
-        for (auto &part : rule->matching_parts) {
-            if ((matched = (match.ctx.host == part))) {
-                break;
+    // The first pass counts the rules each substring occurs in
+    kh_hash_to_unique_index_t *counts = kh_init(hash_to_unique_index);
+    std::vector<uint64_t> grams;
+    for (size_t i = 0; i < tables.shortcut_rules.size(); ++i) {
+        grams.clear();
+        for_each_gram(parts_of(i), [&grams] (std::string_view gram) { grams.push_back(fingerprint(gram)); });
+        // a substring is counted once per rule
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+        for (uint64_t gram : grams) {
+            int ret;
+            khiter_t iter = kh_put(hash_to_unique_index, counts, gram, &ret);
+            if (ret < 0) {
+                errlog(this->log, "Out of memory");
+                continue;
             }
+            kh_value(counts, iter) = (ret == 0) ? kh_value(counts, iter) + 1 : 1;
         }
-        break;
-    case rule_utils::rule::MMID_SUBDOMAINS: {
-        for (auto &part : rule->matching_parts) {
-            for (auto &subdomain : match.ctx.subdomains) { // assert `subdomains` also contains the full host
-                if ((matched = (subdomain == part))) {
-                    goto loopexit;
-                }
+    }
+
+    // The second pass gives each rule its rarest substring, and the longest one of the equally rare ones,
+    // as a longer substring occurs in fewer domains
+    tables.shortcuts.reserve(tables.shortcut_rules.size());
+    for (size_t i = 0; i < tables.shortcut_rules.size(); ++i) {
+        std::string_view best;
+        uint32_t best_count = UINT32_MAX;
+        for_each_gram(parts_of(i), [&] (std::string_view gram) {
+            khiter_t iter = kh_get(hash_to_unique_index, counts, fingerprint(gram));
+            uint32_t count = (iter != kh_end(counts)) ? kh_value(counts, iter) : 0;
+            if (count < best_count || (count == best_count && gram.length() > best.length())) {
+                best = gram;
+                best_count = count;
             }
-        }
-    loopexit:
-        break;
+        });
+        assert(!best.empty());
+        tables.shortcuts.emplace_back(this->shortcuts_matcher.add(best), tables.shortcut_rules[i].file_idx);
     }
-    case rule_utils::rule::MMID_SHORTCUTS:
-        matched = match_shortcuts(rule->matching_parts, match.ctx.host);
-        break;
-    case rule_utils::rule::MMID_SHORTCUTS_AND_REGEX:
-        assert(rule->matching_parts.size() > 0);
-        if (match_shortcuts(rule->matching_parts, match.ctx.host)) {
-            ag::regex re(rule_utils::get_regex(rule.value()));
-            matched = re.match(match.ctx.host);
+    kh_destroy(hash_to_unique_index, counts);
+    tables.shortcut_rules = {};
+    tables.shortcut_parts = {};
+}
+
+void filter::impl::freeze(tables_builder &tables) {
+    this->domains_table = keyed_index::build(this->fingerprints, tables.domains);
+    tables.domains = {};
+    this->domains_trie = tables.domains_trie.finish();
+    this->addresses_table = tables.addresses.finish();
+    shrink_to_fit(this->address_patterns);
+
+    assign_shortcuts(tables);
+    this->shortcuts_matcher.build();
+    pack_lists(tables.shortcuts, this->shortcuts_matcher.size(), this->shortcuts_offsets, this->shortcuts_positions);
+    tables.shortcuts = {};
+
+    shrink_to_fit(this->leftovers_table);
+    build_leftovers_matcher([this, &tables] (size_t i) -> std::string_view {
+        if (!this->resident) {
+            return tables.leftover_regexes[i];
         }
-        break;
-    case rule_utils::rule::MMID_REGEX: {
-        ag::regex re = ag::regex(rule_utils::get_regex(rule.value()));
-        for (const std::string_view &subdomain : match.ctx.subdomains) {
-            if (re.match(subdomain)) {
-                matched = true;
-                break;
-            }
+        const resident_rule &r = tables.resident_rules[this->leftovers_table[i].file_idx];
+        return (r.regex_idx != NO_REGEX) ? std::string_view(tables.resident_regexes[r.regex_idx]) : std::string_view();
+    });
+
+    std::vector<std::pair<uint64_t, uint32_t>> entries;
+    entries.reserve(kh_size(tables.badfilter_table));
+    for (khiter_t i = kh_begin(tables.badfilter_table); i != kh_end(tables.badfilter_table); ++i) {
+        if (kh_exist(tables.badfilter_table, i)) {
+            entries.emplace_back(kh_key(tables.badfilter_table, i), kh_value(tables.badfilter_table, i));
         }
-        break;
-    }
-    default:
-        matched = true;
-        break;
     }
+    this->badfilter_table = keyed_index::build(this->fingerprints, entries);
+
+    // the spare capacity of the reserved tables is dropped when they are moved to the engine arena
+    this->resident_rules = flat_array<resident_rule>(std::move(tables.resident_rules));
+    this->resident_parts = flat_array<text_ref>(std::move(tables.resident_parts));
+    shrink_to_fit(this->resident_regexes);
+    this->resident_texts = flat_array<char>({ tables.resident_texts.begin(), tables.resident_texts.end() });
+    tables.resident_texts = {};
+}
 
-exit:
-    if (matched) {
-        dbglog(match.f.pimpl->log, "Domain '{}' matched against rule '{}'", match.ctx.host, line);
-        match.ctx.matched_rules.emplace_back(std::move(rule->public_part));
-    }
-    return matched;
+void filter::impl::clear() {
+    this->domains_table = {};
+    this->domains_trie = {};
+    this->addresses_table = {};
+    this->address_patterns = {};
+    this->shortcuts_matcher = {};
+    this->shortcuts_offsets = {};
+    this->shortcuts_positions = {};
+    this->leftovers_table = {};
+    this->leftovers_prefilter = {};
+    this->badfilter_table = {};
+    this->resident_rules = {};
+    this->resident_parts = {};
+    this->resident_regexes = {};
+    this->resident_texts = {};
+    ag::file::unmap(this->image.first, this->image.second);
+    this->image = { nullptr, 0 };
 }
 
-static inline bool is_unique_rule(const std::vector<ag::dnsfilter::rule> &rules, std::string_view line) {
-    return rules.end() == std::find_if(rules.begin(), rules.end(),
-        [&line] (const ag::dnsfilter::rule &rule) { return line == rule.text; });
+/**
+ * Get memory allocated for the string (a short string is stored in the object itself)
+ */
+static size_t string_memory_usage(const std::string &str) {
+    const char *data = str.data();
+    bool local = data >= (const char *)&str && data < (const char *)(&str + 1);
+    return local ? 0 : str.capacity() + 1;
 }
 
-void filter::impl::match_by_file_position(match_arg &match, size_t idx) {
-    if (!ag::file::is_valid(match.file)) {
-        match.file = ag::file::open(match.f.params.path, ag::file::RDONLY);
-        if (!ag::file::is_valid(match.file)) {
-            SPDLOG_ERROR("failed to open file to match a domain: {}", match.f.params.path);
-            return;
-        }
+/**
+ * Get memory consumed by the regex
+ * @param regex_code if false, only the JIT-compiled code is counted, as the rest is allocated
+ *                   through the arena (see `mem_arena::regex_context`), which counts it itself
+ */
+static size_t regex_memory_usage(const ag::regex &re, bool regex_code) {
+    return regex_code ? re.memory_usage() : re.jit_memory_usage();
+}
+
+/**
+ * Get memory allocated for the shortcuts and the regex of the entry (the entry itself is not counted)
+ */
+static size_t leftover_memory_usage(const leftover_entry &entry, bool regex_code = true) {
+    size_t size = entry.shortcuts.capacity() * sizeof(std::string);
+    for (const std::string &sc : entry.shortcuts) {
+        size += string_memory_usage(sc);
     }
+    if (entry.regex.has_value()) {
+        size += regex_memory_usage(*entry.regex, regex_code);
+    }
+    return size;
+}
 
-    std::optional<std::string> line = ag::file::read_line(match.file, idx);
-    if (!line.has_value()) {
-        return;
+static size_t leftovers_memory_usage(const std::vector<leftover_entry> &entries, bool regex_code) {
+    size_t size = entries.capacity() * sizeof(leftover_entry);
+    for (const leftover_entry &entry : entries) {
+        size += leftover_memory_usage(entry, regex_code);
     }
+    return size;
+}
 
-    if (!is_unique_rule(match.ctx.matched_rules, line.value())) {
-        return;
+/**
+ * Get memory of the tables which a merged index takes from the filter (see `merged_index::build`)
+ */
+size_t filter::impl::merged_tables_memory(bool regex_code) const {
+    return this->domains_table.memory_usage() + this->domains_trie.memory_usage()
+            + this->addresses_table.memory_usage() + this->shortcuts_matcher.memory_usage()
+            + this->shortcuts_offsets.memory_usage() + this->shortcuts_positions.memory_usage()
+            + leftovers_memory_usage(this->leftovers_table, regex_code)
+            + this->leftovers_prefilter.memory_usage(regex_code);
+}
+
+size_t filter::impl::memory_usage(bool regex_code) const {
+    size_t size = merged_tables_memory(regex_code) + leftovers_memory_usage(this->address_patterns, regex_code)
+            + this->badfilter_table.memory_usage() + this->disabled_rules.memory_usage()
+            + this->resident_rules.memory_usage() + this->resident_parts.memory_usage()
+            + this->resident_regexes.capacity() * sizeof(ag::regex) + this->resident_texts.memory_usage()
+            + this->image.second;
+    for (const ag::regex &re : this->resident_regexes) {
+        size += regex_memory_usage(re, regex_code);
+    }
+    if (this->hits != nullptr) {
+        size += sizeof(hit_counters) + this->hits->indexes.capacity() * sizeof(uint32_t)
+                + this->hits->rules_num * sizeof(std::atomic<uint64_t>);
     }
+    return size;
+}
 
-    match_against_line(match, line.value());
+/**
+ * Get memory the loaded filter adds to the engine once its tables are moved to the arena:
+ * the regexes compiled in the arena, the chunks the tables would take, and the memory left outside
+ * the arena (the filters must be loaded one at a time for the regexes to be counted exactly)
+ * @param regex_memory regex memory of the arena before the filter was loaded
+ */
+size_t filter::impl::load_cost(mem_arena &arena, size_t regex_memory) {
+    // the tables are kept where they are, as a dry run arena allocates nothing
+    mem_arena dry_run(arena, mem_arena::dry_run_tag{});
+    move_to(dry_run);
+    return (arena.regex_memory() - regex_memory) + (dry_run.chunks_memory() - arena.chunks_memory())
+            + memory_usage(false) - dry_run.released_memory();
 }
 
-void filter::impl::search_by_domains(match_arg &match) const {
-    for (const std::string_view &domain : match.ctx.subdomains) {
-        uint32_t hash = ag::utils::hash(domain);
-        khiter_t iter = kh_get(hash_to_unique_index, this->unique_domains_table, hash);
-        if (iter != kh_end(this->unique_domains_table)) {
-            uint32_t position = kh_value(this->unique_domains_table, iter);
-            match_by_file_position(match, position);
-            continue;
-        }
+/**
+ * Move the frozen tables to the arena (except the badfilter table, which is dropped
+ * after loading, see `filter::apply_badfilter_rules`).
+ * The tables which a merged index takes from the filter are left where they are
+ * (see `merged_index::build`), as the memory of the arena is never reused.
+ */
+void filter::impl::move_to(mem_arena &arena) {
+    if (!this->merged) {
+        this->domains_table.move_to(arena);
+        this->domains_trie.move_to(arena);
+        this->addresses_table.move_to(arena);
+        this->shortcuts_matcher.move_to(arena);
+        this->shortcuts_offsets.move_to(arena);
+        this->shortcuts_positions.move_to(arena);
+        this->leftovers_prefilter.move_to(arena);
+    }
+    this->resident_rules.move_to(arena);
+    this->resident_parts.move_to(arena);
+    this->resident_texts.move_to(arena);
+}
 
-        iter = kh_get(hash_to_indexes, this->domains_table, hash);
-        if (iter != kh_end(this->domains_table)) {
-            const std::vector<uint32_t> &positions = *kh_value(this->domains_table, iter);
-            for (uint32_t p : positions) {
-                match_by_file_position(match, p);
-            }
+/**
+ * Count the lines of the file data (only the line feeds are counted, which is enough for reserving the tables)
+ */
+static size_t count_lines(const char *data, size_t size) {
+    size_t num = 0;
+    for (const char *p = data, *end = data + size; p < end; ++num) {
+        p = (const char *)std::memchr(p, '\n', end - p);
+        if (p == nullptr) {
+            break;
         }
+        ++p;
     }
+    return num + 1;
 }
 
-void filter::impl::search_by_shortcuts(match_arg &match) const {
-    if (match.ctx.host.length() < SHORTCUT_LENGTH) {
-        return;
+/**
+ * Reserve the tables which take an entry of most rules, so that they don't reallocate as they grow
+ * (a line which is not a rule leaves a spare entry, which is dropped along with the domains entries
+ * on freezing, or on moving the resident rules to the engine arena)
+ */
+void filter::impl::reserve_tables(tables_builder &tables, size_t lines_num) {
+    if (this->resident) {
+        tables.resident_rules.reserve(lines_num);
     }
-
-    for (size_t i = 0; i <= match.ctx.host.length() - SHORTCUT_LENGTH; ++i) {
-        size_t hash = ag::utils::hash({ &match.ctx.host[i], SHORTCUT_LENGTH });
-        khiter_t iter = kh_get(hash_to_indexes, this->shortcuts_table, hash);
-        if (iter != kh_end(this->shortcuts_table)) {
-            const std::vector<uint32_t> &positions = *kh_value(this->shortcuts_table, iter);
-            for (uint32_t p : positions) {
-                match_by_file_position(match, p);
-            }
-        }
+    if (!this->trie) {
+        tables.domains.reserve(lines_num);
     }
 }
 
-void filter::impl::search_in_leftovers(match_arg &match) const {
-    for (const leftover_entry &entry : this->leftovers_table) {
-        const std::vector<std::string> &shortcuts = entry.shortcuts;
-        if (!shortcuts.empty() && !match_shortcuts(shortcuts, match.ctx.host)) {
-            continue;
+/**
+ * Split file data into chunks of about the given size ending at line boundaries
+ * @return positions of the chunks starts followed by the data size
+ */
+static std::vector<size_t> split_into_chunks(const char *data, size_t size, size_t chunk_size) {
+    std::vector<size_t> bounds = { 0 };
+    for (size_t pos = chunk_size; pos < size; pos += chunk_size) {
+        while (pos < size && data[pos] != '\r' && data[pos] != '\n') {
+            ++pos;
         }
-
-        const std::optional<ag::regex> &re = entry.regex;
-        if (!re.has_value() || re->match(match.ctx.host)) {
-            match_by_file_position(match, entry.file_idx);
+        if (pos + 1 >= size) {
+            break;
         }
+        bounds.push_back(++pos);
     }
+    bounds.push_back(size);
+    return bounds;
 }
 
-void filter::impl::search_badfilter_rules(match_arg &match) const {
-    for (const ag::dnsfilter::rule &rule : match.ctx.matched_rules) {
-        khiter_t iter = kh_get(hash_to_unique_index, this->badfilter_table, ag::utils::hash(rule.text));
-        if (iter != kh_end(this->badfilter_table)) {
-            match_by_file_position(match, kh_value(this->badfilter_table, iter));
+int filter::impl::load_in_parallel(const char *data, size_t size, thread_pool &pool, size_t threads_num,
+        load_line_arg *a) {
+    size_t chunk_size = std::clamp(size / (threads_num * CHUNKS_PER_THREAD), MIN_LOAD_CHUNK_SIZE, MAX_LOAD_CHUNK_SIZE);
+    std::vector<size_t> bounds = split_into_chunks(data, size, chunk_size);
+    size_t chunks_num = bounds.size() - 1;
+    dbglog(this->log, "Loading {} chunks on {} threads", chunks_num, std::min(chunks_num, threads_num));
+
+    // The rules of a window of chunks are parsed in parallel, and then put in the tables
+    // in the file order, so the tables (and the point where the memory limit is reached)
+    // are exactly the same as if the file was loaded sequentially
+    for (size_t first = 0; first < chunks_num; first += threads_num) {
+        size_t n = std::min(threads_num, chunks_num - first);
+        std::vector<std::vector<prepared_rule>> prepared(n);
+        pool.parallel_for(n, [&] (size_t i) {
+            load_chunk_arg arg = { this, &prepared[i] };
+            size_t begin = bounds[first + i];
+            ag::file::for_each_line(data + begin, bounds[first + i + 1] - begin, begin, &load_chunk, &arg);
+        });
+        for (std::vector<prepared_rule> &rules : prepared) {
+            for (prepared_rule &r : rules) {
+                if (!add_rule(a, r)) {
+                    return 0;
+                }
+            }
         }
     }
-}
-
-void filter::match(match_context &ctx) {
-    match_arg m = { ctx, *this, ag::file::INVALID_HANDLE };
-
-    size_t matched_rule_pos = m.ctx.matched_rules.size();
 
-    this->pimpl->search_by_domains(m);
-    this->pimpl->search_by_shortcuts(m);
-    this->pimpl->search_in_leftovers(m);
-    this->pimpl->search_badfilter_rules(m);
+    return 0;
+}
 
-    for (; matched_rule_pos < m.ctx.matched_rules.size(); ++matched_rule_pos) {
-        m.ctx.matched_rules[matched_rule_pos].filter_id = this->params.id;
+static std::optional<uint64_t> hash_file(ag::file::handle fd) {
+    auto [data, size] = ag::file::map(fd);
+    if (data == nullptr) {
+        return (ag::file::get_size(fd) == 0) ? std::make_optional(hash_content(nullptr, 0)) : std::nullopt;
     }
+    uint64_t hash = hash_content(data, size);
+    ag::file::unmap(data, size);
+    return hash;
+}
 
-    ag::file::close(m.file);
+/**
+ * Get name of the filter rules source: the file name, or the kind of the source if the path is not set
+ */
+static std::string_view get_source_name(const ag::dnsfilter::filter_params &p) {
+    if (p.path.empty()) {
+        return (p.data.data() != nullptr) ? "memory" : "fd";
+    }
+    size_t last_slash = p.path.find_last_of("/\\");
+    return (last_slash != p.path.npos) ? std::string_view(p.path).substr(last_slash + 1) : p.path;
 }
 
-filter::match_context filter::create_match_context(std::string_view host) {
-    match_context ctx = { ag::utils::to_lower(host), {}, {} };
+static std::string get_image_path(const std::string &dir, const ag::dnsfilter::filter_params &p) {
+    return AG_FMT("{}/{}-{}.compiled", dir, p.id, get_source_name(p));
+}
 
-    size_t n = std::count(ctx.host.begin(), ctx.host.end(), '.');
-    if (n > 0) {
-        // all except tld
-        --n;
+/**
+ * Image layout (each item is aligned to `IMAGE_ALIGNMENT`):
+ * - header
+ * - domains table, domains trie
+ * - addresses tree, address patterns number, then for each pattern: file index, parts number, parts
+ * - shortcuts automaton, shortcuts offsets and positions
+ * - leftovers number, then for each entry: file index, regex (may be empty), shortcuts number, shortcuts
+ * - badfilter table
+ * - in resident mode: resident rules, matching parts, texts, regexes number, regexes
+ */
+bool filter::impl::save_image(const std::string &path, const image_header &header, const tables_builder &tables) const {
+    std::string tmp_path = path + ".tmp";
+    ag::file::handle fd = ag::file::open(tmp_path, ag::file::WRONLY | ag::file::CREAT | ag::file::TRUNC);
+    if (!ag::file::is_valid(fd)) {
+        warnlog(this->log, "Failed to create compiled image: {} ({})", tmp_path, ag::sys::error_string(ag::sys::error_code()));
+        return false;
     }
 
-    ctx.subdomains.reserve(n + 1);
-    ctx.subdomains.emplace_back(ctx.host);
-    for (size_t i = 0; i < n; ++i) {
+    image_writer writer(fd);
+    writer.write_value(header);
+    this->domains_table.serialize(writer);
+    this->domains_trie.serialize(writer);
+    this->addresses_table.serialize(writer);
+    writer.write_value<uint64_t>(this->address_patterns.size());
+    for (const leftover_entry &entry : this->address_patterns) {
+        writer.write_value(entry.file_idx);
+        writer.write_value<uint64_t>(entry.shortcuts.size());
+        for (const std::string &part : entry.shortcuts) {
+            writer.write_string(part);
+        }
+    }
+    this->shortcuts_matcher.serialize(writer);
+    writer.write_array(this->shortcuts_offsets);
+    writer.write_array(this->shortcuts_positions);
+    writer.write_value<uint64_t>(this->leftovers_table.size());
+    for (size_t i = 0; i < this->leftovers_table.size(); ++i) {
+        const leftover_entry &entry = this->leftovers_table[i];
+        writer.write_value(entry.file_idx);
+        writer.write_string(tables.leftover_regexes[i]);
+        writer.write_value<uint64_t>(entry.shortcuts.size());
+        for (const std::string &sc : entry.shortcuts) {
+            writer.write_string(sc);
+        }
+    }
+    this->badfilter_table.serialize(writer);
+    if (this->resident) {
+        writer.write_array(this->resident_rules);
+        writer.write_array(this->resident_parts);
+        writer.write_array(this->resident_texts);
+        writer.write_value<uint64_t>(tables.resident_regexes.size());
+        for (const std::string &re : tables.resident_regexes) {
+            writer.write_string(re);
+        }
+    }
+    bool ok = writer.flush();
+    ag::file::close(fd);
+
+#ifdef _WIN32
+    std::remove(path.c_str());
+#endif
+    if (!ok || 0 != std::rename(tmp_path.c_str(), path.c_str())) {
+        warnlog(this->log, "Failed to write compiled image: {} ({})", path, ag::sys::error_string(ag::sys::error_code()));
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool filter::impl::read_image(const char *data, size_t size) {
+    image_reader reader(data, size);
+    image_header header;
+    if (!reader.read_value(header)
+            || !this->domains_table.deserialize(reader, this->fingerprints)
+            || !this->domains_trie.deserialize(reader)
+            || !this->addresses_table.deserialize(reader)) {
+        return false;
+    }
+
+    uint64_t patterns_num;
+    if (!reader.read_value(patterns_num) || patterns_num > size) {
+        return false;
+    }
+    this->address_patterns.reserve(patterns_num);
+    for (uint64_t i = 0; i < patterns_num; ++i) {
+        leftover_entry entry = {};
+        uint64_t parts_num;
+        if (!reader.read_value(entry.file_idx) || !reader.read_value(parts_num) || parts_num > size) {
+            return false;
+        }
+        entry.shortcuts.reserve(parts_num);
+        for (uint64_t j = 0; j < parts_num; ++j) {
+            std::string_view part;
+            if (!reader.read_string(part)) {
+                return false;
+            }
+            entry.shortcuts.emplace_back(part);
+        }
+        this->address_patterns.emplace_back(std::move(entry));
+    }
+
+    if (!this->shortcuts_matcher.deserialize(reader)
+            || !reader.read_array(this->shortcuts_offsets)
+            || !reader.read_array(this->shortcuts_positions)
+            || this->shortcuts_offsets.size() != this->shortcuts_matcher.size() + 1
+            || this->shortcuts_offsets[this->shortcuts_matcher.size()] != this->shortcuts_positions.size()) {
+        return false;
+    }
+
+    uint64_t leftovers_num;
+    if (!reader.read_value(leftovers_num) || leftovers_num > size) {
+        return false;
+    }
+    this->leftovers_table.reserve(leftovers_num);
+    std::vector<std::string_view> leftover_regexes;
+    leftover_regexes.reserve(leftovers_num);
+    for (uint64_t i = 0; i < leftovers_num; ++i) {
+        leftover_entry entry = {};
+        std::string_view re;
+        uint64_t shortcuts_num;
+        if (!reader.read_value(entry.file_idx) || !reader.read_string(re)
+                || !reader.read_value(shortcuts_num) || shortcuts_num > size) {
+            return false;
+        }
+        entry.shortcuts.reserve(shortcuts_num);
+        for (uint64_t j = 0; j < shortcuts_num; ++j) {
+            std::string_view sc;
+            if (!reader.read_string(sc)) {
+                return false;
+            }
+            entry.shortcuts.emplace_back(sc);
+        }
+        if (!re.empty()) {
+            entry.regex.emplace(re, PCRE2_CASELESS, true, this->regex_context);
+        }
+        leftover_regexes.push_back(re);
+        this->leftovers_table.emplace_back(std::move(entry));
+    }
+
+    if (!this->badfilter_table.deserialize(reader, this->fingerprints)) {
+        return false;
+    }
+
+    std::vector<std::string_view> resident_regexes;
+    if (this->resident) {
+        uint64_t regexes_num;
+        if (!reader.read_array(this->resident_rules)
+                || !reader.read_array(this->resident_parts)
+                || !reader.read_array(this->resident_texts)
+                || !reader.read_value(regexes_num)
+                || regexes_num > size) {
+            return false;
+        }
+        this->resident_regexes.reserve(regexes_num);
+        for (uint64_t i = 0; i < regexes_num; ++i) {
+            std::string_view re;
+            if (!reader.read_string(re)) {
+                return false;
+            }
+            this->resident_regexes.emplace_back(re, PCRE2_CASELESS, true, this->regex_context);
+            resident_regexes.push_back(re);
+        }
+    }
+
+    // the tables refer to the resident rules, or to the positions of the rules in the filter file
+    if (!check_rule_indexes(this->resident ? this->resident_rules.size() : header.source_size)) {
+        return false;
+    }
+
+    // the prefilter is not stored in the image, as it is cheap to build from the leftovers
+    build_leftovers_matcher([&] (size_t i) -> std::string_view {
+        if (!this->resident) {
+            return leftover_regexes[i];
+        }
+        uint32_t idx = this->leftovers_table[i].file_idx;
+        uint32_t regex_idx = (idx < this->resident_rules.size()) ? this->resident_rules[idx].regex_idx : NO_REGEX;
+        return (regex_idx < resident_regexes.size()) ? resident_regexes[regex_idx] : std::string_view();
+    });
+
+    return true;
+}
+
+/**
+ * Check that the rule has everything its match method needs
+ */
+static bool is_resident_method(const resident_rule &r) {
+    switch ((rule_utils::rule::match_method_id)r.match_method) {
+    case rule_utils::rule::MMID_EXACT:
+    case rule_utils::rule::MMID_SUBDOMAINS:
+    case rule_utils::rule::MMID_SHORTCUTS:
+        return true;
+    case rule_utils::rule::MMID_REGEX:
+    case rule_utils::rule::MMID_SHORTCUTS_AND_REGEX:
+        return r.regex_idx != NO_REGEX;
+    case rule_utils::rule::MMID_CIDR:
+        return r.parts_num == 1;
+    }
+    return false;
+}
+
+/**
+ * Check that the tables read from an image refer only to the existing rules, and that the resident rules
+ * refer only to the existing texts, parts and regexes (the structure of each table is checked on reading it)
+ * @param rules_num number of the resident rules, or the size of the filter file
+ */
+bool filter::impl::check_rule_indexes(uint64_t rules_num) const {
+    bool valid = true;
+    auto check = [&valid, rules_num] (const uint32_t *indexes, size_t n) {
+        valid = valid && std::all_of(indexes, indexes + n, [rules_num] (uint32_t idx) { return idx < rules_num; });
+    };
+    this->domains_table.for_each([&check] (uint64_t, const uint32_t *indexes, size_t n) { check(indexes, n); });
+    this->domains_trie.for_each([&check] (std::string_view, const uint32_t *indexes, size_t n) { check(indexes, n); });
+    this->addresses_table.for_each([&check] (ag::uint8_view, uint32_t, const uint32_t *indexes, size_t n) {
+        check(indexes, n);
+    });
+    this->badfilter_table.for_each([&check] (uint64_t, const uint32_t *indexes, size_t n) { check(indexes, n); });
+    check(this->shortcuts_positions.data(), this->shortcuts_positions.size());
+    for (const std::vector<leftover_entry> *entries : { &this->leftovers_table, &this->address_patterns }) {
+        for (const leftover_entry &entry : *entries) {
+            check(&entry.file_idx, 1);
+        }
+    }
+    // the list of a shortcut ends where the list of the next one starts
+    valid = valid && (this->shortcuts_matcher.size() == 0
+            || (this->shortcuts_offsets.size() == this->shortcuts_matcher.size() + 1
+                    && this->shortcuts_offsets[this->shortcuts_matcher.size()] <= this->shortcuts_positions.size()));
+    for (size_t k = 1; k < this->shortcuts_offsets.size(); ++k) {
+        valid = valid && this->shortcuts_offsets[k - 1] <= this->shortcuts_offsets[k];
+    }
+    if (!valid || !this->resident) {
+        return valid;
+    }
+
+    auto is_text = [this] (text_ref ref) {
+        return ref.offset <= this->resident_texts.size() && ref.length <= this->resident_texts.size() - ref.offset;
+    };
+    return std::all_of(this->resident_parts.begin(), this->resident_parts.end(), is_text)
+            && std::all_of(this->resident_rules.begin(), this->resident_rules.end(), [&] (const resident_rule &r) {
+                return is_text(r.text) && is_text(r.ip)
+                        && r.parts_idx <= this->resident_parts.size()
+                        && r.parts_num <= this->resident_parts.size() - r.parts_idx
+                        && (r.regex_idx == NO_REGEX || r.regex_idx < this->resident_regexes.size())
+                        && is_resident_method(r);
+            });
+}
+
+bool filter::impl::load_image(const std::string &path, ag::file::handle source, size_t mem_limit) {
+    ag::file::handle fd = ag::file::open(path, ag::file::RDONLY);
+    if (!ag::file::is_valid(fd)) {
+        dbglog(this->log, "Compiled image not found: {}", path);
+        return false;
+    }
+    auto [data, size] = ag::file::map(fd);
+    ag::file::close(fd);
+    if (data == nullptr || size < sizeof(image_header)) {
+        ag::file::unmap(data, size);
+        warnlog(this->log, "Failed to map compiled image: {}", path);
+        return false;
+    }
+    this->image = { data, size };
+
+    image_header header;
+    std::memcpy(&header, data, sizeof(header));
+    if (0 != std::memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC))
+            || header.version != IMAGE_VERSION
+            || header.byte_order != IMAGE_BYTE_ORDER
+            || ((header.flags & IMAGE_FLAG_RESIDENT) != 0) != this->resident
+            || ((header.flags & IMAGE_FLAG_FINGERPRINTS) != 0) != this->fingerprints
+            || ((header.flags & IMAGE_FLAG_DOMAIN_TRIE) != 0) != this->trie) {
+        infolog(this->log, "Compiled image has incompatible format, rebuilding");
+        clear();
+        return false;
+    }
+    if (is_source_changed(header, source)) {
+        infolog(this->log, "Filter file has changed, rebuilding compiled image");
+        clear();
+        return false;
+    }
+    if (ag::file::is_valid(source) && header.source_mtime != ag::file::get_modification_time(source)) {
+        // the file has been rewritten with the same content
+        header.source_mtime = ag::file::get_modification_time(source);
+        fd = ag::file::open(path, ag::file::WRONLY);
+        if (ag::file::is_valid(fd)) {
+            ag::file::write(fd, &header, sizeof(header));
+            ag::file::close(fd);
+        }
+    }
+    if (mem_limit != 0 && mem_limit < header.mem_usage) {
+        // let the rules be loaded from the file until the limit is reached
+        clear();
+        return false;
+    }
+
+    if (!read_image(data, size)) {
+        warnlog(this->log, "Compiled image is corrupted, rebuilding: {}", path);
+        clear();
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * Check if the rules the image was built from have changed
+ * @param source the rules file, or an invalid handle if the rules are only in memory
+ */
+bool filter::impl::is_source_changed(const image_header &header, ag::file::handle source) const {
+    if (!ag::file::is_valid(source)) {
+        // a buffer has no modification time, so its content is always checked
+        return header.source_size != this->source.size()
+                || header.source_hash != hash_content(this->source.data(), this->source.size());
+    }
+    if (header.source_size != (uint64_t)ag::file::get_size(source)) {
+        return true;
+    }
+    // the file may have been rewritten with the same content, check it before rebuilding
+    return header.source_mtime != ag::file::get_modification_time(source)
+            && header.source_hash != hash_file(source);
+}
+
+static std::string describe_table(const keyed_index &table) {
+    if (table.has_fingerprints()) {
+        return AG_FMT("{} (64-bit fingerprints, {}K)", table.size(), (table.memory_usage() / 1024) + 1);
+    }
+    const flat_index &t = table.compact_table();
+    if (t.size() == 0) {
+        return AG_FMT("0 (32-bit hashes, {}K)", (t.memory_usage() / 1024) + 1);
+    }
+    return AG_FMT("{} (32-bit hashes, {}K, bloom filter: {}K, false positive rate: {:.3f}%)", t.size(),
+        (t.memory_usage() / 1024) + 1, t.bloom_memory_usage() / 1024, t.bloom_false_positive_rate() * 100);
+}
+
+/**
+ * Describe the distribution of the lengths of the lists packed by `pack_lists`
+ */
+static std::string describe_lists(const flat_array<uint32_t> &offsets) {
+    if (offsets.size() < 2) {
+        return "none";
+    }
+    std::vector<uint32_t> lengths(offsets.size() - 1);
+    for (size_t k = 0; k < lengths.size(); ++k) {
+        lengths[k] = offsets[k + 1] - offsets[k];
+    }
+    std::sort(lengths.begin(), lengths.end());
+    auto percentile = [&lengths] (size_t p) { return lengths[(lengths.size() - 1) * p / 100]; };
+    return AG_FMT("p50 {}, p90 {}, p99 {}, max {}", percentile(50), percentile(90), percentile(99), lengths.back());
+}
+
+std::pair<filter::load_result, size_t> filter::load(const ag::dnsfilter::filter_params &p,
+                                                    const ag::dnsfilter::engine_params &engine_params,
+                                                    mem_arena &arena, size_t mem_limit, thread_pool *pool,
+                                                    size_t threads_num) {
+    std::string logger_name = AG_FMT("{}::{}", p.id, get_source_name(p));
+    this->pimpl->log = ag::create_logger(logger_name);
+
+    impl *f = this->pimpl.get();
+    // the descriptor is left open if it is passed by the caller
+    ag::file::handle fd = ag::file::INVALID_HANDLE;
+    bool fd_owned = false;
+    if (p.data.data() != nullptr) {
+        f->source = p.data;
+        f->source_owner = p.data_owner;
+    } else if (p.fd != -1) {
+        fd = p.fd;
+        auto [data, size] = ag::file::map(fd);
+        if (data == nullptr && ag::file::get_size(fd) != 0) {
+            errlog(pimpl->log, "Failed to map file descriptor: {} ({})", fd, ag::sys::error_string(ag::sys::error_code()));
+            return {LR_ERROR, 0};
+        }
+        f->source = (data != nullptr) ? std::string_view(data, size) : std::string_view("", 0);
+        f->source_mapped = (data != nullptr);
+    } else {
+        fd = ag::file::open(p.path.data(), ag::file::RDONLY);
+        if (!ag::file::is_valid(fd)) {
+            errlog(pimpl->log, "Failed to read file: {} ({})", p.path, ag::sys::error_string(ag::sys::error_code()));
+            return {LR_ERROR, 0};
+        }
+        fd_owned = true;
+    }
+
+    f->resident = engine_params.resident_rules;
+    f->fingerprints = engine_params.fingerprint_tables;
+    f->trie = engine_params.domain_trie;
+    f->merged = engine_params.merge_filters && engine_params.filters.size() > 1;
+    f->regex_context = arena.regex_context();
+    size_t regex_memory = arena.regex_memory();
+
+    std::string image_path;
+    if (!engine_params.compiled_filters_dir.empty()) {
+        image_path = get_image_path(engine_params.compiled_filters_dir, p);
+        if (f->load_image(image_path, fd, mem_limit)) {
+            this->params = p;
+            if (fd_owned) {
+                ag::file::close(fd);
+            }
+            size_t mem_usage = f->load_cost(arena, regex_memory);
+            infolog(pimpl->log, "Loaded from compiled image: {} ({}K)", image_path, (f->image.second / 1024) + 1);
+            infolog(pimpl->log, "Memory usage: {}K", (mem_usage / 1024) + 1);
+            return {(mem_limit == 0 || mem_usage <= mem_limit) ? LR_OK : LR_MEM_LIMIT_REACHED, mem_usage};
+        }
+    }
+
+    tables_builder tables;
+    filter::impl::load_line_arg load_line_arg{};
+    load_line_arg.filter = f;
+    load_line_arg.tables = &tables;
+    load_line_arg.mem_limit = mem_limit;
+
+    // The rules are loaded in a single pass over the mapped file (a cheap count of the lines
+    // sizes the tables), and only a file that can't be mapped (e.g. a pipe) is read in chunks
+    int rc = 0;
+    auto [data, size] = (f->source.data() == nullptr)
+                        ? ag::file::map(fd)
+                        : std::pair<const char *, size_t>{ f->source.data(), f->source.size() };
+    if (data == nullptr) {
+        rc = ag::file::for_each_line(fd, &filter::impl::load_line, &load_line_arg);
+    } else {
+        f->reserve_tables(tables, count_lines(data, size));
+        if (pool != nullptr && threads_num > 1 && size >= MIN_PARALLEL_LOAD_SIZE) {
+            rc = f->load_in_parallel(data, size, *pool, threads_num, &load_line_arg);
+        } else {
+            ag::file::for_each_line(data, size, 0, &filter::impl::load_line, &load_line_arg);
+        }
+    }
+    if (f->source.data() == nullptr) {
+        ag::file::unmap(data, size);
+    }
+    if (rc == 0) {
+        this->params = p;
+    }
+
+    size_t entries_mem = tables.entries_memory();
+    f->freeze(tables);
+    // the limit is checked against an estimate while the rules are loaded, which only stops loading
+    // a filter that is not going to fit, and then against the memory the filter actually adds to the engine
+    size_t mem_usage = f->load_cost(arena, regex_memory);
+    if (load_line_arg.result == LR_OK && mem_limit != 0 && mem_usage > mem_limit) {
+        load_line_arg.result = LR_MEM_LIMIT_REACHED;
+    }
+
+    // an image is saved only for a completely loaded filter
+    if (!image_path.empty() && rc == 0 && load_line_arg.result == LR_OK) {
+        image_header header = {};
+        std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+        header.version = IMAGE_VERSION;
+        header.byte_order = IMAGE_BYTE_ORDER;
+        header.flags = (f->resident ? IMAGE_FLAG_RESIDENT : 0) | (f->fingerprints ? IMAGE_FLAG_FINGERPRINTS : 0)
+                | (f->trie ? IMAGE_FLAG_DOMAIN_TRIE : 0);
+        std::optional<uint64_t> hash;
+        if (ag::file::is_valid(fd)) {
+            header.source_size = ag::file::get_size(fd);
+            header.source_mtime = ag::file::get_modification_time(fd);
+            hash = hash_file(fd);
+        } else {
+            header.source_size = f->source.size();
+            hash = hash_content(f->source.data(), f->source.size());
+        }
+        header.source_hash = hash.value_or(0);
+        // an estimate which spares reading an image that is not going to fit (the filter loaded
+        // from the image is then checked against the limit exactly)
+        header.mem_usage = f->memory_usage(true);
+        if (hash.has_value() && f->save_image(image_path, header, tables)) {
+            infolog(pimpl->log, "Compiled image saved: {}", image_path);
+        }
+    }
+    if (fd_owned) {
+        ag::file::close(fd);
+    }
+
+    if (f->trie) {
+        infolog(pimpl->log, "Domains trie size: {} (nodes: {}, {}K)", f->domains_trie.size(),
+            f->domains_trie.nodes_num(), (f->domains_trie.memory_usage() / 1024) + 1);
+    } else {
+        infolog(pimpl->log, "Domains table size: {}", describe_table(f->domains_table));
+    }
+    infolog(pimpl->log, "Addresses table size: {} (nodes: {}, {}K, address patterns: {})",
+        f->addresses_table.size(), f->addresses_table.nodes_num(), (f->addresses_table.memory_usage() / 1024) + 1,
+        f->address_patterns.size());
+    infolog(pimpl->log, "Shortcuts table size: {} (automaton states: {}, rules per shortcut: {})",
+        f->shortcuts_matcher.size(), f->shortcuts_matcher.states_num(), describe_lists(f->shortcuts_offsets));
+    infolog(pimpl->log, "Domains and shortcuts entries released on freezing: {}K (frozen tables: {}K)",
+        (entries_mem / 1024) + 1, ((f->domains_table.memory_usage() + f->shortcuts_offsets.memory_usage()
+            + f->shortcuts_positions.memory_usage()) / 1024) + 1);
+    infolog(pimpl->log, "Leftovers table size: {} (found by literal: {}, by {} combined regexes: {}, always checked: {})",
+        f->leftovers_table.size(), f->leftovers_prefilter.literal_entries_num(),
+        f->leftovers_prefilter.combined_regexes_num(),
+        f->leftovers_table.size() - f->leftovers_prefilter.literal_entries_num()
+            - f->leftovers_prefilter.unfiltered_entries_num(),
+        f->leftovers_prefilter.unfiltered_entries_num());
+    infolog(pimpl->log, "Badfilter table size: {}", describe_table(f->badfilter_table));
+    if (f->resident) {
+        infolog(pimpl->log, "Resident rules: {} (texts: {}K)", f->resident_rules.size(), (f->resident_texts.size() / 1024) + 1);
+    }
+    infolog(pimpl->log, "Memory usage: {}K (estimated while loading: {}K)", (mem_usage / 1024) + 1,
+        (load_line_arg.approx_mem / 1024) + 1);
+
+    return {load_line_arg.result, mem_usage};
+}
+
+size_t filter::memory_usage(bool regex_code) const {
+    return this->pimpl->memory_usage(regex_code);
+}
+
+void filter::move_to(mem_arena &arena) {
+    this->pimpl->move_to(arena);
+}
+
+template <typename PartAt>
+static inline bool match_shortcuts(size_t parts_num, PartAt part_at, std::string_view domain) {
+    size_t seek = 0;
+    bool found = false;
+    for (size_t i = 0; i < parts_num; ++i) {
+        std::string_view sc = part_at(i);
+        found = domain.npos != domain.find(sc, seek);
+        if (!found) {
+            break;
+        }
+        seek += sc.length();
+    }
+    return found;
+}
+
+static inline bool match_shortcuts(const std::vector<std::string> &shortcuts, std::string_view domain) {
+    return match_shortcuts(shortcuts.size(), [&shortcuts] (size_t i) -> std::string_view { return shortcuts[i]; },
+        domain);
+}
+
+/**
+ * Check if domain matches the rule
+ * @param ctx       match context
+ * @param method    rule match method
+ * @param parts_num number of the rule matching parts
+ * @param part_at   matching part accessor (`std::string_view (size_t)`)
+ * @param re        compiled rule regex (may be null if the method does not need a regex)
+ */
+template <typename PartAt>
+static bool match_domain(const filter::match_context &ctx, rule_utils::rule::match_method_id method,
+        size_t parts_num, PartAt part_at, const ag::regex *re) {
+    switch (method) {
+    case rule_utils::rule::MMID_EXACT:
+        for (size_t i = 0; i < parts_num; ++i) {
+            if (ctx.host == part_at(i)) {
+                return true;
+            }
+        }
+        return false;
+    case rule_utils::rule::MMID_SUBDOMAINS:
+        for (size_t i = 0; i < parts_num; ++i) {
+            std::string_view part = part_at(i);
+            for (auto &subdomain : ctx.subdomains) { // assert `subdomains` also contains the full host
+                if (subdomain == part) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    case rule_utils::rule::MMID_SHORTCUTS:
+        return match_shortcuts(parts_num, part_at, ctx.host);
+    case rule_utils::rule::MMID_SHORTCUTS_AND_REGEX:
+        // a regex may have no shortcuts at all (e.g. `/^\d+\./`), then only the regex is applied
+        return (parts_num == 0 || match_shortcuts(parts_num, part_at, ctx.host)) && re->match(ctx.host);
+    case rule_utils::rule::MMID_REGEX:
+        for (const std::string_view &subdomain : ctx.subdomains) {
+            if (re->match(subdomain)) {
+                return true;
+            }
+        }
+        return false;
+    case rule_utils::rule::MMID_CIDR: {
+        assert(parts_num == 1);
+        // the network address bytes followed by the prefix length
+        std::string_view network = part_at(0);
+        return ctx.address_length != 0 && !network.empty()
+                && ip_radix::contains({ (const uint8_t *)network.data(), network.length() - 1 },
+                    (uint8_t)network.back(), ctx.address());
+    }
+    }
+    return true;
+}
+
+bool filter::impl::match_against_line(match_arg &match, std::string_view line) {
+    // the parsed rule refers to the parser buffers, which are kept between the calls
+    static thread_local rule_utils::parser parser;
+    const rule_utils::rule_view *rule = parser.parse(line);
+    if (rule == nullptr) {
+        return false;
+    }
+
+    const auto &parts = rule->matching_parts;
+    auto part_at = [&parts] (size_t i) -> std::string_view { return parts[i]; };
+    std::optional<ag::regex> re;
+    if (rule->match_method == rule_utils::rule::MMID_REGEX
+            || rule->match_method == rule_utils::rule::MMID_SHORTCUTS_AND_REGEX) {
+        if (rule->match_method != rule_utils::rule::MMID_REGEX && !parts.empty()
+                && !match_shortcuts(parts.size(), part_at, match.ctx.host)) {
+            return false;
+        }
+        // the regex is used only once, so JIT compilation would not pay off
+        re.emplace(rule_utils::get_regex(*rule), PCRE2_CASELESS, false);
+    }
+    bool matched = match_domain(match.ctx, rule->match_method, parts.size(), part_at,
+        re.has_value() ? &re.value() : nullptr);
+
+    if (matched) {
+        dbglog(match.f.pimpl->log, "Domain '{}' matched against rule '{}'", match.ctx.host, line);
+        match.ctx.add_rule(rule->text, rule->props, rule->ip);
+    }
+    return matched;
+}
+
+/**
+ * Get the line starting at the position of the rules in memory
+ */
+static std::string_view line_at(std::string_view rules, size_t pos) {
+    if (pos >= rules.size()) {
+        return {};
+    }
+    std::string_view line = rules.substr(pos);
+    return ag::utils::trim(line.substr(0, line.find_first_of("\r\n")));
+}
+
+static inline bool is_unique_rule(const filter::match_context &ctx, std::string_view line) {
+    return ctx.matched_rules.end() == std::find_if(ctx.matched_rules.begin(), ctx.matched_rules.end(),
+        [&ctx, &line] (const filter::matched_rule &rule) { return line == ctx.text(rule); });
+}
+
+void filter::impl::match_by_file_position(match_arg &match, size_t idx) {
+    std::string_view source = match.f.pimpl->source;
+    if (source.data() != nullptr) {
+        // the rule is matched right in the buffer
+        std::string_view line = line_at(source, idx);
+        if (!line.empty() && is_unique_rule(match.ctx, line)) {
+            match_against_line(match, line);
+        }
+        return;
+    }
+
+    if (!ag::file::is_valid(match.file)) {
+        match.file = ag::file::open(match.f.params.path, ag::file::RDONLY);
+        if (!ag::file::is_valid(match.file)) {
+            SPDLOG_ERROR("failed to open file to match a domain: {}", match.f.params.path);
+            return;
+        }
+    }
+
+    std::optional<std::string> line = ag::file::read_line(match.file, idx);
+    if (!line.has_value()) {
+        return;
+    }
+
+    if (!is_unique_rule(match.ctx, line.value())) {
+        return;
+    }
+
+    match_against_line(match, line.value());
+}
+
+void filter::impl::match_resident_rule(match_arg &match, size_t idx) const {
+    const resident_rule &r = this->resident_rules[idx];
+    std::string_view text = get_resident_text(r.text);
+    if (!is_unique_rule(match.ctx, text)) {
+        return;
+    }
+
+    const text_ref *parts = &this->resident_parts[r.parts_idx];
+    const ag::regex *re = (r.regex_idx != NO_REGEX) ? &this->resident_regexes[r.regex_idx] : nullptr;
+    bool matched = match_domain(match.ctx, (rule_utils::rule::match_method_id)r.match_method,
+        r.parts_num, [this, parts] (size_t i) { return get_resident_text(parts[i]); }, re);
+    if (!matched) {
+        return;
+    }
+
+    dbglog(this->log, "Domain '{}' matched against rule '{}'", match.ctx.host, text);
+    match.ctx.add_rule(text, r.props, (r.ip.length > 0) ? std::make_optional(get_resident_text(r.ip)) : std::nullopt);
+}
+
+void filter::impl::match_by_index(match_arg &match, size_t idx, ag::dnsfilter::match_table table) {
+    const impl *self = match.f.pimpl.get();
+    if (self->is_disabled(idx)) {
+        return;
+    }
+    size_t matched_num = match.ctx.matched_rules.size();
+    if (self->resident) {
+        self->match_resident_rule(match, idx);
+    } else {
+        match_by_file_position(match, idx);
+    }
+    if (self->hits != nullptr) {
+        self->count_candidate(match.ctx, idx, table, matched_num != match.ctx.matched_rules.size());
+    }
+}
+
+/**
+ * Count the candidate rule checked against the domain of the context (the candidates are added
+ * to the filter counters by `flush_hit_counts`, and the matched rule is counted right away)
+ */
+void filter::impl::count_candidate(match_context &ctx, uint32_t idx, ag::dnsfilter::match_table table,
+        bool matched) const {
+    ++ctx.table_candidates[table];
+    if (!matched) {
+        return;
+    }
+    ++ctx.table_matches[table];
+    size_t pos = idx;
+    if (!this->resident) {
+        const std::vector<uint32_t> &indexes = this->hits->indexes;
+        pos = std::lower_bound(indexes.begin(), indexes.end(), idx) - indexes.begin();
+        assert(pos < indexes.size() && indexes[pos] == idx);
+    }
+    this->hits->rules[pos].fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Add the candidates counted while the filter was matched to its counters, so they are
+ * updated once per match instead of once per candidate
+ */
+void filter::impl::flush_hit_counts(match_context &ctx) const {
+    if (this->hits == nullptr) {
+        return;
+    }
+    for (size_t t = 0; t < ag::dnsfilter::MT_NUM; ++t) {
+        if (ctx.table_candidates[t] != 0) {
+            this->hits->candidates[t].fetch_add(ctx.table_candidates[t], std::memory_order_relaxed);
+        }
+        if (ctx.table_matches[t] != 0) {
+            this->hits->matches[t].fetch_add(ctx.table_matches[t], std::memory_order_relaxed);
+        }
+    }
+    ctx.table_candidates = {};
+    ctx.table_matches = {};
+}
+
+void filter::impl::search_by_address(match_arg &match) const {
+    if (match.ctx.address_length == 0) {
+        return;
+    }
+    this->addresses_table.find(match.ctx.address(), [&match] (uint32_t position) {
+        match_by_index(match, position, ag::dnsfilter::MT_ADDRESSES);
+    });
+}
+
+void filter::impl::search_by_domains(match_arg &match) const {
+    if (this->trie) {
+        this->domains_trie.find(match.ctx.host, [&match] (uint32_t position) {
+            match_by_index(match, position, ag::dnsfilter::MT_DOMAINS);
+        });
+        return;
+    }
+    for (const std::string_view &domain : match.ctx.subdomains) {
+        this->domains_table.find(fingerprint(domain), [&match] (uint32_t position) {
+            match_by_index(match, position, ag::dnsfilter::MT_DOMAINS);
+        });
+    }
+}
+
+void filter::impl::search_by_shortcuts(match_arg &match) const {
+    if (match.ctx.host.length() < MIN_SHORTCUT_LENGTH) {
+        return;
+    }
+
+    this->shortcuts_matcher.search(match.ctx.host, [this, &match] (uint32_t id) {
+        for (uint32_t i = this->shortcuts_offsets[id]; i < this->shortcuts_offsets[id + 1]; ++i) {
+            match_by_index(match, this->shortcuts_positions[i], ag::dnsfilter::MT_SHORTCUTS);
+        }
+    });
+}
+
+static bool match_leftover(const leftover_entry &entry, std::string_view host) {
+    const std::vector<std::string> &shortcuts = entry.shortcuts;
+    if (!shortcuts.empty() && !match_shortcuts(shortcuts, host)) {
+        return false;
+    }
+
+    const std::optional<ag::regex> &re = entry.regex;
+    return !re.has_value() || re->match(host);
+}
+
+/**
+ * Match the rule of the leftover entry if the entry may match the domain
+ */
+void filter::impl::match_leftover_entry(match_arg &match, const leftover_entry &entry,
+        ag::dnsfilter::match_table table) {
+    if (match_leftover(entry, match.ctx.host)) {
+        match_by_index(match, entry.file_idx, table);
+        return;
+    }
+    const impl *self = match.f.pimpl.get();
+    if (self->hits != nullptr && !self->is_disabled(entry.file_idx)) {
+        self->count_candidate(match.ctx, entry.file_idx, table, false);
+    }
+}
+
+void filter::impl::search_in_leftovers(match_arg &match) const {
+    // the entries having a literal are in the address patterns if they may match an address
+    if (match.ctx.address_only) {
+        this->leftovers_prefilter.search_without_literal(match.ctx.host, match.ctx.leftover_candidates);
+    } else {
+        this->leftovers_prefilter.search(match.ctx.host, match.ctx.leftover_candidates);
+    }
+    for (uint32_t i : match.ctx.leftover_candidates) {
+        match_leftover_entry(match, this->leftovers_table[i], ag::dnsfilter::MT_LEFTOVERS);
+    }
+}
+
+void filter::impl::search_address_patterns(match_arg &match) const {
+    for (const leftover_entry &entry : this->address_patterns) {
+        match_leftover_entry(match, entry, ag::dnsfilter::MT_ADDRESS_PATTERNS);
+    }
+}
+
+void filter::match(match_context &ctx) {
+    match_arg m = { ctx, *this, ag::file::INVALID_HANDLE };
+
+    size_t matched_rule_pos = m.ctx.matched_rules.size();
+
+    this->pimpl->search_by_address(m);
+    if (!m.ctx.address_only) {
+        this->pimpl->search_by_domains(m);
+        this->pimpl->search_by_shortcuts(m);
+    } else {
+        this->pimpl->search_address_patterns(m);
+    }
+    this->pimpl->search_in_leftovers(m);
+
+    for (; matched_rule_pos < m.ctx.matched_rules.size(); ++matched_rule_pos) {
+        m.ctx.matched_rules[matched_rule_pos].filter_id = this->params.id;
+    }
+    this->pimpl->flush_hit_counts(m.ctx);
+
+    ag::file::close(m.file);
+}
+
+void filter::enable_hit_counters() {
+    impl *self = this->pimpl.get();
+    std::unique_ptr<hit_counters> counters(new hit_counters{});
+    if (self->resident) {
+        counters->rules_num = self->resident_rules.size();
+    } else {
+        counters->indexes = self->get_indexed_rules();
+        counters->rules_num = counters->indexes.size();
+    }
+    counters->rules.reset(new std::atomic<uint64_t>[counters->rules_num]());
+    self->hits = std::move(counters);
+}
+
+void filter::disable_hit_counters() {
+    this->pimpl->hits = nullptr;
+}
+
+std::optional<filter::hit_stats> filter::get_hit_stats(size_t top_k) const {
+    const impl *self = this->pimpl.get();
+    const hit_counters *counters = self->hits.get();
+    if (counters == nullptr) {
+        return std::nullopt;
+    }
+
+    hit_stats stats = {};
+    for (size_t t = 0; t < ag::dnsfilter::MT_NUM; ++t) {
+        stats.tables[t] = { counters->candidates[t].load(std::memory_order_relaxed),
+            counters->matches[t].load(std::memory_order_relaxed) };
+    }
+
+    // (hits, position) of the matched rules, the most matched first (and the first in the filter of equal ones)
+    std::vector<std::pair<uint64_t, uint32_t>> matched;
+    for (uint32_t i = 0; i < counters->rules_num; ++i) {
+        uint64_t n = counters->rules[i].load(std::memory_order_relaxed);
+        if (n != 0) {
+            matched.emplace_back(n, i);
+        }
+    }
+    size_t n = std::min(top_k, matched.size());
+    std::partial_sort(matched.begin(), matched.begin() + n, matched.end(),
+        [] (const std::pair<uint64_t, uint32_t> &l, const std::pair<uint64_t, uint32_t> &r) {
+            return l.first > r.first || (l.first == r.first && l.second < r.second);
+        });
+
+    std::pair<const char *, size_t> mapped = { nullptr, 0 };
+    std::string_view rules = (n != 0) ? impl::map_rules(*this, mapped) : std::string_view();
+    stats.top_rules.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        auto [hits, pos] = matched[i];
+        uint32_t idx = self->resident ? pos : counters->indexes[pos];
+        stats.top_rules.emplace_back(hits, self->rule_text(rules, idx));
+    }
+    ag::file::unmap(mapped.first, mapped.second);
+    return stats;
+}
+
+/**
+ * Get text of the rule by its index in the tables
+ * @param rules the rules in memory (see `source`), or the mapped filter file (not used in resident mode)
+ */
+std::string_view filter::impl::rule_text(std::string_view rules, uint32_t idx) const {
+    return this->resident ? get_resident_text(this->resident_rules[idx].text) : line_at(rules, idx);
+}
+
+/**
+ * Call `on_rule(uint32_t idx, std::string_view text)` on each rule (on each line unless the rules are resident)
+ * @param rules see `rule_text`
+ */
+template <typename F>
+void filter::impl::for_each_rule(std::string_view rules, F &&on_rule) const {
+    if (this->resident) {
+        for (uint32_t i = 0; i < this->resident_rules.size(); ++i) {
+            on_rule(i, get_resident_text(this->resident_rules[i].text));
+        }
+        return;
+    }
+    if (rules.empty()) {
+        return;
+    }
+    ag::file::for_each_line(rules.data(), rules.size(), 0,
+        [] (uint32_t idx, std::string_view line, void *arg) {
+            (*(F *)arg)(idx, line);
+            return true;
+        }, &on_rule);
+}
+
+/**
+ * Get the rules of the filter to find their texts with `rule_text`: the filter read by path is mapped
+ * @param mapped the mapped file to unmap afterwards (mapped only once)
+ */
+std::string_view filter::impl::map_rules(const filter &f, std::pair<const char *, size_t> &mapped) {
+    const impl *self = f.pimpl.get();
+    if (self->resident || self->source.data() != nullptr) {
+        return self->source;
+    }
+    if (mapped.first == nullptr) {
+        ag::file::handle fd = ag::file::open(f.params.path, ag::file::RDONLY);
+        mapped = ag::file::map(fd);
+        if (mapped.first == nullptr && ag::file::get_size(fd) != 0) {
+            warnlog(self->log, "Failed to map filter file to find rules by text: {}", f.params.path);
+        }
+        ag::file::close(fd);
+    }
+    return { mapped.first, mapped.second };
+}
+
+/**
+ * Get sorted indexes of the rules the tables contain (the disabled rules included)
+ */
+std::vector<uint32_t> filter::impl::get_indexed_rules() const {
+    std::vector<uint32_t> indexes;
+    auto on_key = [&indexes] (auto, const uint32_t *key_indexes, size_t n) {
+        indexes.insert(indexes.end(), key_indexes, key_indexes + n);
+    };
+    this->domains_table.for_each(on_key);
+    this->domains_trie.for_each(on_key);
+    this->addresses_table.for_each([&on_key] (ag::uint8_view, uint32_t, const uint32_t *key_indexes, size_t n) {
+        on_key(0, key_indexes, n);
+    });
+    indexes.insert(indexes.end(), this->shortcuts_positions.begin(), this->shortcuts_positions.end());
+    for (const std::vector<leftover_entry> *entries : { &this->leftovers_table, &this->address_patterns }) {
+        for (const leftover_entry &entry : *entries) {
+            indexes.push_back(entry.file_idx);
+        }
+    }
+    std::sort(indexes.begin(), indexes.end());
+    indexes.erase(std::unique(indexes.begin(), indexes.end()), indexes.end());
+    return indexes;
+}
+
+void filter::apply_badfilter_rules(std::vector<filter> &filters) {
+    // the filters read by path are mapped to find the rules by text
+    std::vector<std::string_view> rules(filters.size());
+    std::vector<std::pair<const char *, size_t>> mapped(filters.size(), { nullptr, 0 });
+    auto map_rules = [&] (size_t i) {
+        rules[i] = impl::map_rules(filters[i], mapped[i]);
+    };
+
+    // the texts the badfilter rules disable, sorted by fingerprint
+    std::vector<std::pair<uint64_t, std::string>> disabled_texts;
+    for (size_t i = 0; i < filters.size(); ++i) {
+        const impl *f = filters[i].pimpl.get();
+        if (f->badfilter_table.size() == 0) {
+            continue;
+        }
+        map_rules(i);
+        f->badfilter_table.for_each([&] (uint64_t, const uint32_t *indexes, size_t num) {
+            for (size_t j = 0; j < num; ++j) {
+                std::string_view text = f->rule_text(rules[i], indexes[j]);
+                std::string disabled = rule_utils::get_text_without_badfilter(text);
+                // the index of a rule which is not a badfilter one may come from a corrupted compiled image
+                if (!text.empty() && disabled != text) {
+                    disabled_texts.emplace_back(fingerprint(disabled), std::move(disabled));
+                }
+            }
+        });
+    }
+    std::sort(disabled_texts.begin(), disabled_texts.end());
+    disabled_texts.erase(std::unique(disabled_texts.begin(), disabled_texts.end()), disabled_texts.end());
+
+    for (size_t i = 0; i < filters.size(); ++i) {
+        impl *f = filters[i].pimpl.get();
+        f->badfilter_table = {};
+        if (disabled_texts.empty()) {
+            continue;
+        }
+        map_rules(i);
+        std::vector<uint32_t> disabled;
+        f->for_each_rule(rules[i], [&] (uint32_t idx, std::string_view text) {
+            uint64_t fp = fingerprint(text);
+            auto it = std::lower_bound(disabled_texts.begin(), disabled_texts.end(), fp,
+                [] (const std::pair<uint64_t, std::string> &l, uint64_t r) { return l.first < r; });
+            for (; it != disabled_texts.end() && it->first == fp; ++it) {
+                if (it->second == text) {
+                    tracelog(f->log, "Rule disabled by badfilter rule: {}", text);
+                    disabled.push_back(idx);
+                    break;
+                }
+            }
+        });
+        if (!disabled.empty()) {
+            dbglog(f->log, "Rules disabled by badfilter rules: {}", disabled.size());
+        }
+        // the indexes are enumerated in ascending order
+        f->disabled_rules = flat_array<uint32_t>(std::move(disabled));
+    }
+
+    for (auto [data, size] : mapped) {
+        ag::file::unmap(data, size);
+    }
+}
+
+std::optional<size_t> filter::deduplicate_rules(std::vector<filter> &filters, size_t mem_limit) {
+    std::vector<std::string_view> rules(filters.size());
+    std::vector<std::pair<const char *, size_t>> mapped(filters.size(), { nullptr, 0 });
+
+    // The enabled rules of all the filters sorted by text fingerprint, and then by filter and index,
+    // so the first rule of a text is the one which is matched first
+    struct rule_key {
+        uint64_t fp;
+        uint32_t filter_idx;
+        uint32_t rule_idx;
+    };
+    std::vector<rule_key> keys;
+    for (size_t i = 0; i < filters.size(); ++i) {
+        const impl *f = filters[i].pimpl.get();
+        rules[i] = impl::map_rules(filters[i], mapped[i]);
+        for (uint32_t idx : f->get_indexed_rules()) {
+            std::string_view text = f->rule_text(rules[i], idx);
+            if (!text.empty() && !f->is_disabled(idx)) {
+                keys.push_back({ fingerprint(text), (uint32_t)i, idx });
+            }
+        }
+    }
+    std::sort(keys.begin(), keys.end(), [] (const rule_key &l, const rule_key &r) {
+        return std::tie(l.fp, l.filter_idx, l.rule_idx) < std::tie(r.fp, r.filter_idx, r.rule_idx);
+    });
+
+    // filter index -> indexes of its rules duplicating the preceding ones
+    std::vector<std::vector<uint32_t>> duplicates(filters.size());
+    size_t duplicates_num = 0;
+    for (size_t run = 0; run < keys.size(); ) {
+        size_t run_end = run + 1;
+        while (run_end < keys.size() && keys[run_end].fp == keys[run].fp) {
+            ++run_end;
+        }
+        // the texts of a fingerprint are almost always the same, but the rare collisions are checked
+        for (size_t i = run + 1; i < run_end; ++i) {
+            const rule_key &k = keys[i];
+            std::string_view text = filters[k.filter_idx].pimpl->rule_text(rules[k.filter_idx], k.rule_idx);
+            for (size_t j = run; j < i; ++j) {
+                const rule_key &prev = keys[j];
+                if (text == filters[prev.filter_idx].pimpl->rule_text(rules[prev.filter_idx], prev.rule_idx)) {
+                    duplicates[k.filter_idx].push_back(k.rule_idx);
+                    ++duplicates_num;
+                    break;
+                }
+            }
+        }
+        run = run_end;
+    }
+    keys = {};
+    for (auto [data, size] : mapped) {
+        ag::file::unmap(data, size);
+    }
+
+    size_t disabled_growth = 0;
+    for (size_t i = 0; i < filters.size(); ++i) {
+        const impl *f = filters[i].pimpl.get();
+        if (!duplicates[i].empty()) {
+            disabled_growth += (f->disabled_rules.size() + duplicates[i].size()) * sizeof(uint32_t)
+                    - f->disabled_rules.memory_usage();
+        }
+    }
+    if (mem_limit != 0 && disabled_growth > mem_limit) {
+        return std::nullopt;
+    }
+
+    for (size_t i = 0; i < filters.size(); ++i) {
+        impl *f = filters[i].pimpl.get();
+        std::vector<uint32_t> &d = duplicates[i];
+        if (d.empty()) {
+            continue;
+        }
+        dbglog(f->log, "Rules found in the preceding filters: {} ({})", d.size(), filters[i].params.path);
+        std::sort(d.begin(), d.end());
+        std::vector<uint32_t> disabled;
+        disabled.reserve(f->disabled_rules.size() + d.size());
+        std::merge(f->disabled_rules.begin(), f->disabled_rules.end(), d.begin(), d.end(),
+            std::back_inserter(disabled));
+        f->disabled_rules = flat_array<uint32_t>(std::move(disabled));
+    }
+    return duplicates_num;
+}
+
+filter::match_context filter::create_match_context(std::string_view host) {
+    match_context ctx;
+    reset_match_context(ctx, host);
+    return ctx;
+}
+
+/**
+ * Split the host of the context into the subdomains
+ */
+static void split_subdomains(filter::match_context &ctx) {
+    ctx.subdomains.clear();
+
+    size_t n = std::count(ctx.host.begin(), ctx.host.end(), '.');
+    if (n > 0) {
+        // all except tld
+        --n;
+    }
+
+    ctx.subdomains.reserve(n + 1);
+    ctx.subdomains.emplace_back(ctx.host);
+    for (size_t i = 0; i < n; ++i) {
         std::array<std::string_view, 2> parts = ag::utils::split2_by(ctx.subdomains[i], '.');
         ctx.subdomains.emplace_back(parts[1]);
     }
+}
 
-    return ctx;
+void filter::reset_match_context(match_context &ctx, std::string_view host) {
+    // the buffers are reused, so matching a batch of domains does not allocate on each one
+    ctx.host.assign(host);
+    std::transform(ctx.host.begin(), ctx.host.end(), ctx.host.begin(), (int (*)(int))std::tolower);
+    ctx.matched_rules.clear();
+    ctx.texts.clear();
+    ctx.address_only = false;
+    ctx.address_length = 0;
+    // an IP address is matched against the address rules as well
+    if (!ctx.host.empty() && ctx.host.find_first_not_of("0123456789abcdef.:") == ctx.host.npos) {
+        ag::socket_address addr(ctx.host, 0);
+        if (addr.valid()) {
+            ctx.address_length = addr.addr().size();
+            std::memcpy(ctx.address_bytes.data(), addr.addr().data(), ctx.address_length);
+        }
+    }
+    split_subdomains(ctx);
+}
+
+void filter::reset_match_context(match_context &ctx, ag::uint8_view address) {
+    assert(address.size() == ag::ipv4_address_size || address.size() == ag::ipv6_address_size);
+    // the text is needed by the address patterns (e.g. `172.16.*.1`) and the badfilter rules
+    ctx.host.assign(ag::utils::addr_to_str(address));
+    ctx.matched_rules.clear();
+    ctx.texts.clear();
+    ctx.address_only = true;
+    ctx.address_length = std::min(address.size(), ctx.address_bytes.size());
+    std::memcpy(ctx.address_bytes.data(), address.data(), ctx.address_length);
+    split_subdomains(ctx);
+}
+
+
+// The merged indexes are stored in `keyed_index`, which tables reserve the highest bit
+static constexpr uint64_t MAX_MERGED_INDEXES = 1u << 31;
+
+class merged_index::impl {
+public:
+    // filter index -> first merged index of the filter rules
+    std::vector<uint32_t> bases;
+
+    // the same tables as the ones of `filter::impl`, but with merged indexes
+    keyed_index domains_table;
+    domain_trie domains_trie;
+    bool trie = false;
+    ip_radix addresses_table;
+    aho_corasick shortcuts_matcher;
+    flat_array<uint32_t> shortcuts_offsets;
+    flat_array<uint32_t> shortcuts_positions;
+    // the leftovers keep the filter rule indexes, as they are already grouped by filter
+    std::vector<leftover_entry> leftovers_table;
+    // filter index -> offset of its leftovers in `leftovers_table`
+    // (the leftovers end where the leftovers of the next filter start)
+    std::vector<uint32_t> leftovers_offsets;
+    leftovers_matcher leftovers_prefilter;
+    // approximate memory of the disabled rules left out of the tables
+    size_t saved_memory = 0;
+
+    size_t filter_of(uint32_t merged_idx) const {
+        return std::upper_bound(this->bases.begin(), this->bases.end(), merged_idx) - this->bases.begin() - 1;
+    }
+
+    size_t memory_usage(bool regex_code) const {
+        return sizeof(*this) + this->bases.capacity() * sizeof(uint32_t)
+                + this->domains_table.memory_usage() + this->domains_trie.memory_usage()
+                + this->addresses_table.memory_usage()
+                + this->shortcuts_matcher.memory_usage()
+                + this->shortcuts_offsets.memory_usage() + this->shortcuts_positions.memory_usage()
+                + leftovers_memory_usage(this->leftovers_table, regex_code)
+                + this->leftovers_offsets.capacity() * sizeof(uint32_t)
+                + this->leftovers_prefilter.memory_usage(regex_code);
+    }
+};
+
+merged_index::merged_index() = default;
+
+merged_index::~merged_index() = default;
+
+merged_index::merged_index(merged_index &&) = default;
+
+merged_index &merged_index::operator=(merged_index &&) = default;
+
+merged_index::build_result merged_index::build(std::vector<filter> &filters, const mem_arena &arena,
+        size_t mem_limit) {
+    std::unique_ptr<impl> index(new impl{});
+
+    // Get number of the indexes the rules of the filter may occupy
+    auto get_indexes_num = [] (const filter::impl *f) -> uint64_t {
+        if (f->resident) {
+            return f->resident_rules.size();
+        }
+        uint64_t num = 0;
+        auto on_key = [&num] (auto, const uint32_t *indexes, size_t n) {
+            num = std::max(num, (uint64_t)*std::max_element(indexes, indexes + n) + 1);
+        };
+        f->domains_table.for_each(on_key);
+        f->domains_trie.for_each(on_key);
+        f->addresses_table.for_each([&on_key] (ag::uint8_view, uint32_t, const uint32_t *indexes, size_t n) {
+            on_key(0, indexes, n);
+        });
+        if (!f->shortcuts_positions.empty()) {
+            num = std::max(num,
+                (uint64_t)*std::max_element(f->shortcuts_positions.begin(), f->shortcuts_positions.end()) + 1);
+        }
+        return num;
+    };
+
+    uint64_t indexes_num = 0;
+    index->bases.reserve(filters.size());
+    for (const filter &f : filters) {
+        index->bases.push_back(indexes_num);
+        indexes_num += get_indexes_num(f.pimpl.get());
+        if (indexes_num > MAX_MERGED_INDEXES) {
+            return BR_TOO_MANY_RULES;
+        }
+    }
+
+    // Domains: the entries of a key keep the filters order, as the merged indexes grow with it
+    std::vector<std::pair<uint64_t, uint32_t>> domains; // key -> merged index
+    size_t domains_num = 0;
+    for (const filter &f : filters) {
+        domains_num += f.pimpl->domains_table.size();
+    }
+    domains.reserve(domains_num);
+    // all the filters of an engine are loaded with the same parameters
+    bool fingerprints = !filters.empty() && filters[0].pimpl->domains_table.has_fingerprints();
+    index->trie = !filters.empty() && filters[0].pimpl->trie;
+    // A disabled rule mostly duplicates an enabled one, so it saves only its index, unless its key
+    // is left out entirely
+    std::vector<uint64_t> disabled_keys;
+    for (size_t i = 0; i < filters.size(); ++i) {
+        const filter::impl *f = filters[i].pimpl.get();
+        uint32_t base = index->bases[i];
+        f->domains_table.for_each([&, f, base] (uint64_t key, const uint32_t *indexes, size_t n) {
+            for (size_t j = 0; j < n; ++j) {
+                if (f->is_disabled(indexes[j])) {
+                    disabled_keys.push_back(key);
+                } else {
+                    domains.emplace_back(key, base + indexes[j]);
+                }
+            }
+        });
+    }
+    index->domains_table = keyed_index::build(fingerprints, domains);
+    domains = {};
+    for (uint64_t key : disabled_keys) {
+        // the keys of a table with folded fingerprints are found by themselves (see `keyed_index::for_each`)
+        bool key_found = false;
+        index->domains_table.find(key, [&key_found] (uint32_t) { key_found = true; });
+        index->saved_memory += key_found ? sizeof(uint32_t)
+                : fingerprints ? FINGERPRINT_TABLE_BYTES_PER_KEY : HASH_TABLE_BYTES_PER_KEY;
+    }
+    disabled_keys = {};
+    if (index->trie) {
+        domain_trie::builder trie;
+        for (size_t i = 0; i < filters.size(); ++i) {
+            const filter::impl *f = filters[i].pimpl.get();
+            uint32_t base = index->bases[i];
+            f->domains_trie.for_each([&, f, base] (std::string_view domain, const uint32_t *indexes, size_t n) {
+                for (size_t j = 0; j < n; ++j) {
+                    if (f->is_disabled(indexes[j])) {
+                        index->saved_memory += sizeof(uint32_t);
+                    } else {
+                        trie.add(domain, base + indexes[j]);
+                    }
+                }
+            });
+        }
+        index->domains_trie = trie.finish();
+    }
+
+    // Addresses: the indexes of a network keep the filters order as well
+    ip_radix::builder addresses;
+    for (size_t i = 0; i < filters.size(); ++i) {
+        const filter::impl *f = filters[i].pimpl.get();
+        uint32_t base = index->bases[i];
+        f->addresses_table.for_each(
+            [&, f, base] (ag::uint8_view network, uint32_t prefix_len, const uint32_t *indexes, size_t n) {
+                for (size_t j = 0; j < n; ++j) {
+                    if (f->is_disabled(indexes[j])) {
+                        index->saved_memory += sizeof(uint32_t);
+                    } else {
+                        addresses.add(network, prefix_len, base + indexes[j]);
+                    }
+                }
+            });
+    }
+    index->addresses_table = addresses.finish();
+
+    // Shortcuts: the identical shortcuts of different filters get the same id
+    std::vector<std::pair<uint32_t, uint32_t>> shortcuts;
+    std::vector<uint32_t> enabled_positions;
+    for (size_t i = 0; i < filters.size(); ++i) {
+        const filter::impl *f = filters[i].pimpl.get();
+        std::vector<std::string> patterns = f->shortcuts_matcher.patterns();
+        for (uint32_t id = 0; id < patterns.size(); ++id) {
+            enabled_positions.clear();
+            for (uint32_t j = f->shortcuts_offsets[id]; j < f->shortcuts_offsets[id + 1]; ++j) {
+                if (f->is_disabled(f->shortcuts_positions[j])) {
+                    index->saved_memory += sizeof(uint32_t);
+                } else {
+                    enabled_positions.push_back(index->bases[i] + f->shortcuts_positions[j]);
+                }
+            }
+            // a shortcut of the disabled rules only is left out too (only its offset is counted
+            // as saved, as its automaton states may be shared with the other shortcuts)
+            if (enabled_positions.empty()) {
+                index->saved_memory += sizeof(uint32_t);
+                continue;
+            }
+            uint32_t merged_id = index->shortcuts_matcher.add(patterns[id]);
+            for (uint32_t position : enabled_positions) {
+                shortcuts.emplace_back(merged_id, position);
+            }
+        }
+    }
+    index->shortcuts_matcher.build();
+    pack_lists(shortcuts, index->shortcuts_matcher.size(), index->shortcuts_offsets, index->shortcuts_positions);
+
+    // Leftovers
+    size_t leftovers_num = 0;
+    for (const filter &f : filters) {
+        leftovers_num += f.pimpl->leftovers_table.size();
+    }
+    index->leftovers_table.reserve(leftovers_num);
+    index->leftovers_offsets.reserve(filters.size() + 1);
+    std::vector<std::string_view> literals;
+    std::vector<std::pair<uint32_t, std::string>> regexes;
+    literals.reserve(leftovers_num);
+    // The entries are moved to the index only once it is known to fit the memory limit,
+    // so the prefilter is built over the entries of the filters
+    std::vector<leftover_entry *> moved_entries;
+    moved_entries.reserve(leftovers_num);
+    size_t moved_memory = 0;
+    std::vector<uint32_t> merged_entries; // entry of a filter -> entry of the index
+    for (filter &f : filters) {
+        filter::impl *fi = f.pimpl.get();
+        index->leftovers_offsets.push_back(moved_entries.size());
+        merged_entries.assign(fi->leftovers_table.size(), UINT32_MAX);
+        for (uint32_t j = 0; j < fi->leftovers_table.size(); ++j) {
+            leftover_entry &entry = fi->leftovers_table[j];
+            if (fi->is_disabled(entry.file_idx)) {
+                index->saved_memory += sizeof(leftover_entry) + leftover_memory_usage(entry);
+                continue;
+            }
+            merged_entries[j] = moved_entries.size();
+            moved_entries.push_back(&entry);
+            moved_memory += leftover_memory_usage(entry, false);
+            literals.push_back(get_leftover_literal(entry));
+        }
+        for (const auto &[entry, text] : fi->leftovers_prefilter.regexes()) {
+            if (merged_entries[entry] != UINT32_MAX) {
+                regexes.emplace_back(merged_entries[entry], text);
+            }
+        }
+    }
+    index->leftovers_offsets.push_back(moved_entries.size());
+    size_t regex_memory = arena.regex_memory();
+    index->leftovers_prefilter.build(literals, std::move(regexes),
+        !filters.empty() ? filters[0].pimpl->regex_context : nullptr);
+
+    // The limit is checked against what the index takes on top of the tables the filters give to it
+    // (the regexes of the prefilters of the filters are not subtracted, as their memory is known
+    // only once they are freed)
+    if (mem_limit != 0) {
+        size_t given = 0;
+        for (const filter &f : filters) {
+            given += f.pimpl->merged_tables_memory(false);
+        }
+        size_t taken = (arena.regex_memory() - regex_memory) + index->memory_usage(false) + moved_memory;
+        if (taken > given && taken - given > mem_limit) {
+            return BR_MEM_LIMIT_REACHED;
+        }
+    }
+    for (leftover_entry *entry : moved_entries) {
+        index->leftovers_table.push_back(std::move(*entry));
+    }
+
+    // The filters keep only their address patterns, as they are few and checked one by one anyway
+    for (filter &f : filters) {
+        filter::impl *fi = f.pimpl.get();
+        fi->domains_table = {};
+        fi->domains_trie = {};
+        fi->addresses_table = {};
+        fi->shortcuts_matcher = {};
+        fi->shortcuts_offsets = {};
+        fi->shortcuts_positions = {};
+        fi->leftovers_table = {};
+        fi->leftovers_prefilter = {};
+    }
+
+    this->pimpl = std::move(index);
+    return BR_OK;
+}
+
+void merged_index::match(std::vector<filter> &filters, filter::match_context &ctx) const {
+    const impl *index = this->pimpl.get();
+    std::vector<uint32_t> &candidates = ctx.candidates;
+    candidates.clear();
+
+    if (ctx.address_length != 0) {
+        index->addresses_table.find(ctx.address(), [&candidates] (uint32_t idx) {
+            candidates.push_back(idx);
+        });
+    }
+    // the candidates of each table follow the ones of the previous table
+    size_t addresses_end = candidates.size();
+    size_t domains_end = candidates.size();
+    // a raw address is matched only against the address tree, the regexes without literal
+    // and the address patterns, which are checked by the filters themselves
+    if (!ctx.address_only) {
+        if (index->trie) {
+            index->domains_trie.find(ctx.host, [&candidates] (uint32_t idx) {
+                candidates.push_back(idx);
+            });
+        } else {
+            for (const std::string_view &domain : ctx.subdomains) {
+                index->domains_table.find(fingerprint(domain), [&candidates] (uint32_t idx) {
+                    candidates.push_back(idx);
+                });
+            }
+        }
+        domains_end = candidates.size();
+        if (ctx.host.length() >= MIN_SHORTCUT_LENGTH) {
+            index->shortcuts_matcher.search(ctx.host, [index, &candidates] (uint32_t id) {
+                candidates.insert(candidates.end(), &index->shortcuts_positions[index->shortcuts_offsets[id]],
+                    &index->shortcuts_positions[0] + index->shortcuts_offsets[id + 1]);
+            });
+        }
+    }
+
+    // The candidates are grouped by filter keeping the order they were found in, so each filter
+    // gets its rules in the same order as if it were matched on its own
+    std::vector<uint64_t> &order = ctx.candidates_order;
+    order.clear();
+    for (uint32_t i = 0; i < candidates.size(); ++i) {
+        order.push_back(((uint64_t)index->filter_of(candidates[i]) << 32) | i);
+    }
+    std::sort(order.begin(), order.end());
+
+    // the leftover candidates are in ascending order, so they are grouped by filter too
+    std::vector<uint32_t> &leftovers = ctx.leftover_candidates;
+    if (ctx.address_only) {
+        index->leftovers_prefilter.search_without_literal(ctx.host, leftovers);
+    } else {
+        index->leftovers_prefilter.search(ctx.host, leftovers);
+    }
+    size_t next_leftover = 0;
+
+    size_t next = 0;
+    for (size_t i = 0; i < filters.size(); ++i) {
+        filter &f = filters[i];
+        match_arg m = { ctx, f, ag::file::INVALID_HANDLE };
+        size_t matched_rule_pos = ctx.matched_rules.size();
+
+        for (; next < order.size() && (order[next] >> 32) == i; ++next) {
+            uint32_t pos = (uint32_t)order[next];
+            ag::dnsfilter::match_table table = (pos < addresses_end) ? ag::dnsfilter::MT_ADDRESSES
+                    : (pos < domains_end) ? ag::dnsfilter::MT_DOMAINS : ag::dnsfilter::MT_SHORTCUTS;
+            filter::impl::match_by_index(m, candidates[pos] - index->bases[i], table);
+        }
+        // the address patterns come before the leftovers, as in `filter::match`
+        if (ctx.address_only) {
+            f.pimpl->search_address_patterns(m);
+        }
+        for (; next_leftover < leftovers.size() && leftovers[next_leftover] < index->leftovers_offsets[i + 1];
+                ++next_leftover) {
+            filter::impl::match_leftover_entry(m, index->leftovers_table[leftovers[next_leftover]],
+                ag::dnsfilter::MT_LEFTOVERS);
+        }
+
+        for (; matched_rule_pos < ctx.matched_rules.size(); ++matched_rule_pos) {
+            ctx.matched_rules[matched_rule_pos].filter_id = f.params.id;
+        }
+        f.pimpl->flush_hit_counts(ctx);
+
+        ag::file::close(m.file);
+    }
+}
+
+size_t merged_index::saved_memory() const {
+    return (this->pimpl != nullptr) ? this->pimpl->saved_memory : 0;
+}
+
+size_t merged_index::memory_usage(bool regex_code) const {
+    return (this->pimpl != nullptr) ? this->pimpl->memory_usage(regex_code) : 0;
 }
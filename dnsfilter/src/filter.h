@@ -1,23 +1,102 @@
 #pragma once
 
 
+#include <string>
 #include <string_view>
 #include <memory>
+#include <optional>
+#include <array>
+#include <bitset>
 #include <vector>
 #include <dnsfilter.h>
 #include "rule_utils.h"
+#include "mem_arena.h"
+
+class thread_pool;
 
 class filter {
 public:
+    // Matched rule, its text and IP are stored in the match context
+    struct matched_rule {
+        int32_t filter_id;
+        std::bitset<ag::dnsfilter::RP_NUM> props;
+        uint32_t text_offset;
+        uint32_t text_length;
+        uint32_t ip_offset;
+        uint32_t ip_length; // 0 if the rule has no IP
+    };
+
     // Context of domain match
+    // All the buffers are kept between matches, so once they have grown, matching a domain
+    // does not allocate memory (unless the rules are read from the filter file)
     struct match_context {
         std::string host; // matching domain name
         std::vector<std::string_view> subdomains; // list of subdomains
-        std::vector<ag::dnsfilter::rule> matched_rules; // list of matched rules
+        std::array<uint8_t, ag::ipv6_address_size> address_bytes; // the host as an IP address
+        size_t address_length = 0; // 0 if the host is not an IP address
+        bool address_only = false; // if true, only the rules which may match an IP address are checked
+                                   // (see `ag::dnsfilter::match_address`)
+        std::vector<matched_rule> matched_rules; // list of matched rules
+        std::string texts; // texts and IPs of the matched rules
+        // scratch buffers of the merged index (see `merged_index::match`)
+        std::vector<uint32_t> candidates;
+        std::vector<uint64_t> candidates_order;
+        // scratch buffer of the leftovers prefilter (see `leftovers_matcher`)
+        std::vector<uint32_t> leftover_candidates;
+        // candidate rules of the filter being matched checked and matched per table, which are added
+        // to the filter hit counters once the filter is matched (see `filter::enable_hit_counters`)
+        std::array<uint32_t, ag::dnsfilter::MT_NUM> table_candidates{};
+        std::array<uint32_t, ag::dnsfilter::MT_NUM> table_matches{};
+
+        void add_rule(std::string_view text, std::bitset<ag::dnsfilter::RP_NUM> props,
+                      std::optional<std::string_view> ip) {
+            matched_rule r = { 0, props, (uint32_t)this->texts.size(), (uint32_t)text.length(), 0, 0 };
+            this->texts.append(text);
+            if (ip.has_value()) {
+                r.ip_offset = this->texts.size();
+                r.ip_length = ip->length();
+                this->texts.append(ip.value());
+            }
+            this->matched_rules.push_back(r);
+        }
+
+        ag::uint8_view address() const {
+            return { this->address_bytes.data(), this->address_length };
+        }
+
+        std::string_view text(const matched_rule &r) const {
+            return { this->texts.data() + r.text_offset, r.text_length };
+        }
+
+        std::optional<std::string_view> ip(const matched_rule &r) const {
+            if (r.ip_length == 0) {
+                return std::nullopt;
+            }
+            return std::string_view{ this->texts.data() + r.ip_offset, r.ip_length };
+        }
+
+        ag::dnsfilter::rule make_rule(const matched_rule &r) const {
+            std::optional<std::string_view> ip = this->ip(r);
+            return { r.filter_id, std::string(text(r)), r.props,
+                ip.has_value() ? std::make_optional(std::string(ip.value())) : std::nullopt };
+        }
     };
 
     static match_context create_match_context(std::string_view host);
 
+    /**
+     * Prepare the context for matching another domain keeping its allocated memory
+     */
+    static void reset_match_context(match_context &ctx, std::string_view host);
+
+    /**
+     * Prepare the context for matching an IP address keeping its allocated memory
+     * (only the rules which may match an IP address are checked, see `match_context::address_only`)
+     * @param ctx     match context
+     * @param address 4 bytes of IPv4 or 16 bytes of IPv6 address
+     */
+    static void reset_match_context(match_context &ctx, ag::uint8_view address);
+
     filter();
     ~filter();
 
@@ -33,11 +112,56 @@ public:
 
     /**
      * Load rule list
-     * @param      params    filter parameters
-     * @param      mem_limit if not 0, stop loading rules when the approximate memory consumption reaches this limit
-     * @return     {load_result, approximate memory consumption}
+     * @param      params        filter parameters
+     * @param      engine_params engine parameters (see `ag::dnsfilter::engine_params` for the loading options)
+     * @param      arena         arena of the engine to compile the regexes in (must outlive the filter)
+     * @param      mem_limit     if not 0, stop loading rules when the memory consumption reaches this limit
+     *                           (the regexes compiled in the arena meanwhile are counted as the ones of the filter,
+     *                           so the filters must be loaded one at a time for the limit to be exact)
+     * @param      pool          threads to parse the rules with (null to parse them on the calling thread)
+     * @param      threads_num   maximum number of chunks of the rules to parse at once
+     * @return     {load_result, memory the filter adds to the engine once it is moved to the arena
+     *             (see `move_to`)}
+     */
+    std::pair<load_result, size_t> load(const ag::dnsfilter::filter_params &params,
+                                        const ag::dnsfilter::engine_params &engine_params, mem_arena &arena,
+                                        size_t mem_limit, thread_pool *pool = nullptr, size_t threads_num = 1);
+
+    /**
+     * Get memory held by the filter: its tables, compiled regexes, and mapped compiled image
+     * (the tables moved to the arena are not counted)
+     * @param regex_code if false, only the JIT-compiled code of the regexes is counted, so the filter
+     *                   memory and the memory of the arena the regexes are compiled in add up exactly
+     */
+    size_t memory_usage(bool regex_code = true) const;
+
+    /**
+     * Move the frozen tables of the loaded filter to the arena (except the ones which a merged index
+     * takes from the filter, see `merged_index::build`). It is done once the engine accepts the filter,
+     * so a filter which is dropped leaves nothing in the arena.
+     * @param arena arena of the engine (must outlive the filter)
+     */
+    void move_to(mem_arena &arena);
+
+    /**
+     * Disable the rules which the badfilter rules of the filters disable, so matching never
+     * looks the badfilter rules up.
+     * A badfilter rule disables the rules having its text without the `badfilter` modifier
+     * in all the filters (including the ones preceding it), and is not matched itself.
+     * @param filters loaded filters
+     */
+    static void apply_badfilter_rules(std::vector<filter> &filters);
+
+    /**
+     * Disable the rules which texts are the same as the ones of the preceding rules of the filters,
+     * so each rule is looked up and matched once (the matched rules are the same, as a rule with the text
+     * of an already matched one is skipped anyway).
+     * @param filters   loaded filters (the badfilter rules must be applied already)
+     * @param mem_limit if not 0, no rules are disabled if the lists of the disabled rules would grow
+     *                  by more than this
+     * @return number of the disabled rules, or nullopt if the lists do not fit the limit
      */
-    std::pair<load_result, size_t> load(const ag::dnsfilter::filter_params &params, size_t mem_limit);
+    static std::optional<size_t> deduplicate_rules(std::vector<filter> &filters, size_t mem_limit = 0);
 
     /**
      * Match domain against rules
@@ -45,9 +169,99 @@ public:
      */
     void match(match_context &ctx);
 
+    /**
+     * Start counting the rule hits (see `ag::dnsfilter::engine_params::count_rule_hits`).
+     * The rules are found by the tables, so it must be called before the filter gives them
+     * to a merged index.
+     */
+    void enable_hit_counters();
+
+    /**
+     * Stop counting the rule hits and free the counters
+     */
+    void disable_hit_counters();
+
+    struct hit_stats {
+        std::array<ag::dnsfilter::table_hits, ag::dnsfilter::MT_NUM> tables;
+        std::vector<std::pair<uint64_t, std::string>> top_rules; // (hits, rule text), the most matched first
+    };
+
+    /**
+     * Get the hit statistics of the filter
+     * @param top_k maximum number of the most matched rules to get
+     * @return nullopt if the hits are not counted
+     */
+    std::optional<hit_stats> get_hit_stats(size_t top_k) const;
+
     // Filter parameters
     ag::dnsfilter::filter_params params;
 
+private:
+    friend class merged_index;
+    class impl;
+    std::unique_ptr<impl> pimpl;
+};
+
+/**
+ * Lookup tables of several filters merged into a single index, so that a domain is looked up
+ * once for all the filters instead of once per filter.
+ * The postings of the index carry both the filter and the rule index. A rule index of a filter
+ * is shifted by the total number of the rules of the preceding filters, so the rules of each
+ * filter occupy their own range of the merged indexes.
+ */
+class merged_index {
+public:
+    merged_index();
+    ~merged_index();
+
+    merged_index(merged_index &&);
+    merged_index &operator=(merged_index &&);
+
+    merged_index(const merged_index &) = delete;
+    merged_index &operator=(const merged_index &) = delete;
+
+    enum build_result {
+        BR_OK, BR_TOO_MANY_RULES, BR_MEM_LIMIT_REACHED
+    };
+
+    /**
+     * Merge the domains, shortcuts and leftovers tables of the filters.
+     * The disabled rules of the filters (see `apply_badfilter_rules` and `deduplicate_rules`)
+     * are left out of the merged tables.
+     * The filters give their tables to the index, so they must not be matched on their own
+     * afterwards, and must not be reordered or destroyed while the index is in use.
+     * Unless the index is built, the filters are kept intact.
+     * @param filters   filters to merge
+     * @param arena     arena the regexes of the filters are compiled in
+     * @param mem_limit if not 0, the index is not built if it takes more than this on top
+     *                  of the memory the filters give to it
+     */
+    build_result build(std::vector<filter> &filters, const mem_arena &arena, size_t mem_limit = 0);
+
+    /**
+     * Check if the index is built
+     */
+    bool empty() const { return this->pimpl == nullptr; }
+
+    /**
+     * Match domain (or IP address) against the merged filters.
+     * The result is the same as of matching the filters one by one in their order.
+     * @param filters filters the index is built from
+     * @param ctx     match context
+     */
+    void match(std::vector<filter> &filters, filter::match_context &ctx) const;
+
+    /**
+     * Get approximate memory consumed by the index
+     * @param regex_code see `filter::memory_usage`
+     */
+    size_t memory_usage(bool regex_code = true) const;
+
+    /**
+     * Get approximate memory the index saves by leaving the disabled rules out
+     */
+    size_t saved_memory() const;
+
 private:
     class impl;
     std::unique_ptr<impl> pimpl;
@@ -0,0 +1,110 @@
+#include <cassert>
+#include "fingerprint_index.h"
+
+
+// Tables are kept at most 7/8 full, as a lookup checks a whole group of slots at once
+static constexpr size_t MAX_LOAD_FACTOR_NUM = 7;
+static constexpr size_t MAX_LOAD_FACTOR_DEN = 8;
+
+
+fingerprint_index::builder::builder(size_t keys_num) {
+    if (keys_num == 0) {
+        return;
+    }
+    size_t n = GROUP_SIZE;
+    // at least one slot is left empty, so that a lookup of an absent key always stops
+    while (n * MAX_LOAD_FACTOR_NUM < keys_num * MAX_LOAD_FACTOR_DEN || n == keys_num) {
+        n <<= 1;
+    }
+    this->ctrl.resize(n, EMPTY);
+    this->keys.resize(n);
+    this->values.resize(n);
+}
+
+void fingerprint_index::builder::add(uint64_t key, const uint32_t *indexes, size_t num) {
+    assert(num > 0);
+    assert(this->keys_num + 1 < this->ctrl.size());
+
+    uint32_t value;
+    if (num == 1) {
+        assert(!(indexes[0] & POSTINGS_FLAG));
+        value = indexes[0];
+    } else {
+        value = this->postings.size() | POSTINGS_FLAG;
+        this->postings.push_back(num);
+        this->postings.insert(this->postings.end(), indexes, indexes + num);
+    }
+
+    uint64_t h = mix(key);
+    size_t mask = this->ctrl.size() / GROUP_SIZE - 1;
+    for (size_t g = get_group(h, mask); ; g = (g + 1) & mask) {
+        uint32_t empty = match_group(&this->ctrl[g * GROUP_SIZE], EMPTY);
+        if (empty != 0) {
+            size_t slot = g * GROUP_SIZE + count_trailing_zeros(empty);
+            this->ctrl[slot] = get_ctrl(h);
+            this->keys[slot] = key;
+            this->values[slot] = value;
+            break;
+        }
+    }
+    ++this->keys_num;
+}
+
+fingerprint_index fingerprint_index::builder::finish() {
+    fingerprint_index index;
+    this->postings.shrink_to_fit();
+    index.ctrl = flat_array<uint8_t>(std::move(this->ctrl));
+    index.keys = flat_array<uint64_t>(std::move(this->keys));
+    index.values = flat_array<uint32_t>(std::move(this->values));
+    index.postings = flat_array<uint32_t>(std::move(this->postings));
+    index.keys_num = this->keys_num;
+    return index;
+}
+
+void fingerprint_index::serialize(image_writer &writer) const {
+    writer.write_value(this->keys_num);
+    writer.write_array(this->ctrl);
+    writer.write_array(this->keys);
+    writer.write_array(this->values);
+    writer.write_array(this->postings);
+}
+
+bool fingerprint_index::deserialize(image_reader &reader) {
+    if (!reader.read_value(this->keys_num)
+            || !reader.read_array(this->ctrl)
+            || !reader.read_array(this->keys)
+            || !reader.read_array(this->values)
+            || !reader.read_array(this->postings)) {
+        return false;
+    }
+    // the lookup relies on the power of 2 number of groups and on the table being never full
+    size_t n = this->ctrl.size();
+    size_t groups = n / GROUP_SIZE;
+    if (n == 0) {
+        return this->keys_num == 0 && this->keys.empty() && this->values.empty();
+    }
+    if (n % GROUP_SIZE != 0 || (groups & (groups - 1)) != 0 || this->keys_num >= n
+            || this->keys.size() != n || this->values.size() != n) {
+        return false;
+    }
+    // the number of the occupied slots must be the number of keys, so an empty slot stops every probe,
+    // and the postings lists must be within the postings
+    size_t occupied = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (this->ctrl[i] == EMPTY) {
+            continue;
+        }
+        if (this->ctrl[i] > get_ctrl(UINT64_MAX)) {
+            return false;
+        }
+        ++occupied;
+        uint32_t value = this->values[i];
+        if (value & POSTINGS_FLAG) {
+            size_t offset = value & ~POSTINGS_FLAG;
+            if (offset >= this->postings.size() || this->postings[offset] > this->postings.size() - offset - 1) {
+                return false;
+            }
+        }
+    }
+    return occupied == this->keys_num;
+}
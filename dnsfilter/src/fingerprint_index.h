@@ -0,0 +1,200 @@
+#pragma once
+
+
+#include <cstdint>
+#include <vector>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FINGERPRINT_INDEX_SSE2
+#endif
+#include "flat_array.h"
+#include "image_io.h"
+
+
+/**
+ * Read-only open-addressing hash table which maps a 64-bit fingerprint (e.g. of a domain)
+ * to one or several rule indexes.
+ * The slots are split into groups of 16, and each slot has a control byte keeping 7 bits of
+ * the fingerprint hash (or marking the slot empty). A lookup compares the control bytes of
+ * a whole group against the looked up ones at once (with SSE2 where available), and reads
+ * the fingerprints only of the matching slots, so a lookup of an absent key usually touches
+ * only the control bytes of one group.
+ * Like `flat_index`, the table consists of plain arrays, so it can be used right from
+ * a mapped compiled filter image.
+ */
+class fingerprint_index {
+public:
+    /**
+     * Helper for building the table
+     */
+    class builder {
+    public:
+        /**
+         * @param keys_num number of keys to be added
+         */
+        explicit builder(size_t keys_num);
+
+        /**
+         * Add key with its indexes (each key must be added only once)
+         * @param key     fingerprint
+         * @param indexes rule indexes (must be less than 2^31)
+         * @param num     number of indexes (must be > 0)
+         */
+        void add(uint64_t key, const uint32_t *indexes, size_t num);
+
+        /**
+         * Get the built table (the builder must not be used afterwards)
+         */
+        fingerprint_index finish();
+
+    private:
+        std::vector<uint8_t> ctrl;
+        std::vector<uint64_t> keys;
+        std::vector<uint32_t> values;
+        std::vector<uint32_t> postings;
+        size_t keys_num = 0;
+    };
+
+    /**
+     * Find indexes of the key
+     * @param key      fingerprint
+     * @param on_index function to call on each found index (`void (uint32_t index)`)
+     */
+    template <typename F>
+    void find(uint64_t key, F &&on_index) const {
+        size_t slot = lookup(key);
+        if (slot == NONE) {
+            return;
+        }
+        uint32_t value = this->values[slot];
+        if (!(value & POSTINGS_FLAG)) {
+            on_index(value);
+            return;
+        }
+        // the first element of a postings list is its length
+        const uint32_t *postings = &this->postings[value & ~POSTINGS_FLAG];
+        for (uint32_t j = 1; j <= postings[0]; ++j) {
+            on_index(postings[j]);
+        }
+    }
+
+    /**
+     * Enumerate all the keys with their indexes
+     * @param on_key function to call on each key (`void (uint64_t key, const uint32_t *indexes, size_t num)`)
+     */
+    template <typename F>
+    void for_each(F &&on_key) const {
+        for (size_t i = 0; i < this->ctrl.size(); ++i) {
+            if (this->ctrl[i] == EMPTY) {
+                continue;
+            }
+            uint32_t value = this->values[i];
+            if (!(value & POSTINGS_FLAG)) {
+                on_key(this->keys[i], &this->values[i], 1);
+            } else {
+                const uint32_t *postings = &this->postings[value & ~POSTINGS_FLAG];
+                on_key(this->keys[i], postings + 1, postings[0]);
+            }
+        }
+    }
+
+    /**
+     * Get number of keys
+     */
+    size_t size() const { return this->keys_num; }
+
+    /**
+     * Get memory allocated for the table (the memory of a mapped image is not counted)
+     */
+    size_t memory_usage() const {
+        return this->ctrl.memory_usage() + this->keys.memory_usage() + this->values.memory_usage()
+                + this->postings.memory_usage();
+    }
+
+    /**
+     * Move the arrays to the arena (see `flat_array::move_to`)
+     */
+    void move_to(mem_arena &arena) {
+        this->ctrl.move_to(arena);
+        this->keys.move_to(arena);
+        this->values.move_to(arena);
+        this->postings.move_to(arena);
+    }
+
+    void serialize(image_writer &writer) const;
+    bool deserialize(image_reader &reader);
+
+private:
+    static constexpr size_t GROUP_SIZE = 16;
+    static constexpr uint8_t EMPTY = 0x80;
+    static constexpr size_t NONE = SIZE_MAX;
+    static constexpr uint32_t POSTINGS_FLAG = 1u << 31;
+
+    // The fingerprints may come from a weak hash function, so they are mixed before being
+    // split into the group number and the control byte
+    static uint64_t mix(uint64_t key) {
+        key ^= key >> 33;
+        key *= 0xff51afd7ed558ccdull;
+        key ^= key >> 33;
+        return key;
+    }
+
+    static uint8_t get_ctrl(uint64_t h) { return h & 0x7f; }
+    static size_t get_group(uint64_t h, size_t mask) { return (h >> 7) & mask; }
+
+    /**
+     * Get the bit mask of the group slots which control bytes are equal to `c`
+     */
+    static uint32_t match_group(const uint8_t *group, uint8_t c) {
+#ifdef FINGERPRINT_INDEX_SSE2
+        __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)c)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_SIZE; ++i) {
+            mask |= (uint32_t)(group[i] == c) << i;
+        }
+        return mask;
+#endif
+    }
+
+    size_t lookup(uint64_t key) const {
+        if (this->ctrl.empty()) {
+            return NONE;
+        }
+        uint64_t h = mix(key);
+        uint8_t c = get_ctrl(h);
+        size_t mask = this->ctrl.size() / GROUP_SIZE - 1;
+        for (size_t g = get_group(h, mask); ; g = (g + 1) & mask) {
+            const uint8_t *group = &this->ctrl[g * GROUP_SIZE];
+            for (uint32_t m = match_group(group, c); m != 0; m &= m - 1) {
+                size_t slot = g * GROUP_SIZE + count_trailing_zeros(m);
+                if (this->keys[slot] == key) {
+                    return slot;
+                }
+            }
+            // the probing of a key stops at the first group having an empty slot
+            if (match_group(group, EMPTY) != 0) {
+                return NONE;
+            }
+        }
+    }
+
+    static uint32_t count_trailing_zeros(uint32_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctz(x);
+#else
+        uint32_t n = 0;
+        for (; !(x & 1); x >>= 1) {
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    flat_array<uint8_t> ctrl; // the size is a power of 2 multiple of `GROUP_SIZE` (if not empty)
+    flat_array<uint64_t> keys;
+    flat_array<uint32_t> values; // rule index, or offset of a postings list if `POSTINGS_FLAG` is set
+    flat_array<uint32_t> postings; // lists of indexes of the keys having more than one index
+    uint64_t keys_num = 0;
+};
@@ -0,0 +1,77 @@
+#pragma once
+
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+#include "mem_arena.h"
+
+
+/**
+ * Read-only contiguous array which either owns its elements, or refers to an external memory
+ * which outlives it (e.g. a mapped compiled filter image, or a memory arena)
+ */
+template <typename T>
+class flat_array {
+public:
+    flat_array() = default;
+
+    /**
+     * Take ownership of the elements
+     */
+    explicit flat_array(std::vector<T> elements)
+        : owned(std::move(elements))
+        , ptr(this->owned.data())
+        , num(this->owned.size())
+    {}
+
+    /**
+     * Refer to the external elements
+     */
+    flat_array(const T *data, size_t size)
+        : ptr(data)
+        , num(size)
+    {}
+
+    // moving a vector keeps its buffer, so the pointer stays valid
+    flat_array(flat_array &&) = default;
+    flat_array &operator=(flat_array &&) = default;
+    flat_array(const flat_array &) = delete;
+    flat_array &operator=(const flat_array &) = delete;
+
+    const T &operator[](size_t i) const { return this->ptr[i]; }
+    const T *data() const { return this->ptr; }
+    size_t size() const { return this->num; }
+    bool empty() const { return this->num == 0; }
+    const T *begin() const { return this->ptr; }
+    const T *end() const { return this->ptr + this->num; }
+
+    /**
+     * Move the owned elements to the arena, which must outlive the array
+     * (the elements are kept where they are if the arena fails to allocate memory)
+     */
+    void move_to(mem_arena &arena) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (this->owned.empty()) {
+            return;
+        }
+        void *mem = arena.allocate(this->num * sizeof(T), alignof(T), this->owned.capacity() * sizeof(T));
+        if (mem != nullptr) {
+            std::memcpy(mem, this->ptr, this->num * sizeof(T));
+            this->ptr = (const T *)mem;
+            // assigning `{}` would keep the capacity
+            std::vector<T>().swap(this->owned);
+        }
+    }
+
+    /**
+     * Get memory allocated for the elements (external memory, including an arena, is not counted)
+     */
+    size_t memory_usage() const { return this->owned.capacity() * sizeof(T); }
+
+private:
+    std::vector<T> owned;
+    const T *ptr = nullptr;
+    size_t num = 0;
+};
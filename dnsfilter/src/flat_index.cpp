@@ -0,0 +1,101 @@
+#include <cassert>
+#include "flat_index.h"
+
+
+// Tables are kept at most 3/4 full, so that unsuccessful lookups stay short
+static constexpr size_t MAX_LOAD_FACTOR_NUM = 3;
+static constexpr size_t MAX_LOAD_FACTOR_DEN = 4;
+
+
+flat_index::builder::builder(size_t keys_num) {
+    if (keys_num == 0) {
+        return;
+    }
+    size_t n = 1;
+    while (n * MAX_LOAD_FACTOR_NUM < keys_num * MAX_LOAD_FACTOR_DEN) {
+        n <<= 1;
+    }
+    this->slots.resize(n, slot{ 0, EMPTY });
+}
+
+void flat_index::builder::add(uint32_t key, const uint32_t *indexes, size_t num) {
+    assert(num > 0);
+    assert(this->keys_num < this->slots.size());
+
+    uint32_t value;
+    if (num == 1) {
+        assert(!(indexes[0] & POSTINGS_FLAG));
+        value = indexes[0];
+    } else {
+        value = this->postings.size() | POSTINGS_FLAG;
+        this->postings.push_back(num);
+        this->postings.insert(this->postings.end(), indexes, indexes + num);
+    }
+
+    size_t mask = this->slots.size() - 1;
+    size_t i = mix(key) & mask;
+    while (this->slots[i].value != EMPTY) {
+        assert(this->slots[i].key != key);
+        i = (i + 1) & mask;
+    }
+    this->slots[i] = { key, value };
+    ++this->keys_num;
+}
+
+flat_index flat_index::builder::finish() {
+    flat_index index;
+    this->postings.shrink_to_fit();
+    index.slots = flat_array<slot>(std::move(this->slots));
+    index.postings = flat_array<uint32_t>(std::move(this->postings));
+    index.keys_num = this->keys_num;
+    index.build_bloom();
+    return index;
+}
+
+void flat_index::build_bloom() {
+    this->bloom = bloom_filter(this->keys_num);
+    for (const slot &s : this->slots) {
+        if (s.value != EMPTY) {
+            this->bloom.add(s.key);
+        }
+    }
+}
+
+void flat_index::serialize(image_writer &writer) const {
+    writer.write_value(this->keys_num);
+    writer.write_array(this->slots);
+    writer.write_array(this->postings);
+}
+
+bool flat_index::deserialize(image_reader &reader) {
+    if (!reader.read_value(this->keys_num)
+            || !reader.read_array(this->slots)
+            || !reader.read_array(this->postings)) {
+        return false;
+    }
+    // the lookup relies on the power of 2 size and on the table being never full
+    size_t n = this->slots.size();
+    if ((n & (n - 1)) != 0 || ((n == 0) ? (this->keys_num != 0) : (this->keys_num >= n))) {
+        return false;
+    }
+    // the number of the occupied slots must be the number of keys, so an empty slot stops every probe,
+    // and the postings lists must be within the postings
+    size_t occupied = 0;
+    for (const slot &s : this->slots) {
+        if (s.value == EMPTY) {
+            continue;
+        }
+        ++occupied;
+        if (s.value & POSTINGS_FLAG) {
+            size_t offset = s.value & ~POSTINGS_FLAG;
+            if (offset >= this->postings.size() || this->postings[offset] > this->postings.size() - offset - 1) {
+                return false;
+            }
+        }
+    }
+    if (occupied != this->keys_num) {
+        return false;
+    }
+    build_bloom();
+    return true;
+}
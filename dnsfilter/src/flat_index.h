@@ -0,0 +1,169 @@
+#pragma once
+
+
+#include <cstdint>
+#include <vector>
+#include "flat_array.h"
+#include "bloom_filter.h"
+#include "image_io.h"
+
+
+/**
+ * Read-only open-addressing hash table which maps a 32-bit key (e.g. a hash of a domain)
+ * to one or several rule indexes.
+ * The table consists of two plain arrays without any pointers, so it can be written into
+ * a compiled filter image and used right from the mapped memory.
+ * As most of the looked up keys are absent, a lookup is preceded by a check of the Bloom filter
+ * of the keys, which is much smaller than the table (the filter is not written into an image,
+ * it is rebuilt on reading).
+ */
+class flat_index {
+private:
+    struct slot {
+        uint32_t key;
+        uint32_t value; // rule index, or offset of a postings list if `POSTINGS_FLAG` is set
+    };
+
+public:
+    /**
+     * Helper for building the table
+     */
+    class builder {
+    public:
+        /**
+         * @param keys_num number of keys to be added
+         */
+        explicit builder(size_t keys_num);
+
+        /**
+         * Add key with its indexes (each key must be added only once)
+         * @param key     key
+         * @param indexes rule indexes (must be less than 2^31)
+         * @param num     number of indexes (must be > 0)
+         */
+        void add(uint32_t key, const uint32_t *indexes, size_t num);
+
+        /**
+         * Get the built table (the builder must not be used afterwards)
+         */
+        flat_index finish();
+
+    private:
+        std::vector<uint32_t> postings;
+        std::vector<slot> slots;
+        size_t keys_num = 0;
+    };
+
+    /**
+     * Find indexes of the key
+     * @param key      key
+     * @param on_index function to call on each found index (`void (uint32_t index)`)
+     */
+    template <typename F>
+    void find(uint32_t key, F &&on_index) const {
+        if (!this->bloom.may_contain(key)) {
+            return;
+        }
+        const slot *s = lookup(key);
+        if (s == nullptr) {
+            return;
+        }
+        if (!(s->value & POSTINGS_FLAG)) {
+            on_index(s->value);
+            return;
+        }
+        // the first element of a postings list is its length
+        const uint32_t *postings = &this->postings[s->value & ~POSTINGS_FLAG];
+        for (uint32_t j = 1; j <= postings[0]; ++j) {
+            on_index(postings[j]);
+        }
+    }
+
+    /**
+     * Enumerate all the keys with their indexes
+     * @param on_key function to call on each key (`void (uint32_t key, const uint32_t *indexes, size_t num)`)
+     */
+    template <typename F>
+    void for_each(F &&on_key) const {
+        for (const slot &s : this->slots) {
+            if (s.value == EMPTY) {
+                continue;
+            }
+            if (!(s.value & POSTINGS_FLAG)) {
+                on_key(s.key, &s.value, 1);
+            } else {
+                const uint32_t *postings = &this->postings[s.value & ~POSTINGS_FLAG];
+                on_key(s.key, postings + 1, postings[0]);
+            }
+        }
+    }
+
+    /**
+     * Get number of keys
+     */
+    size_t size() const { return this->keys_num; }
+
+    /**
+     * Get memory allocated for the table (the memory of a mapped image is not counted)
+     */
+    size_t memory_usage() const {
+        return this->slots.memory_usage() + this->postings.memory_usage() + this->bloom.memory_usage();
+    }
+
+    /**
+     * Get memory allocated for the Bloom filter of the keys
+     */
+    size_t bloom_memory_usage() const { return this->bloom.memory_usage(); }
+
+    /**
+     * Measure the false positive rate of the Bloom filter of the keys
+     */
+    double bloom_false_positive_rate() const {
+        return this->bloom.false_positive_rate([this] (uint32_t key) { return lookup(key) != nullptr; });
+    }
+
+    /**
+     * Move the arrays to the arena, except the Bloom filter (see `flat_array::move_to`)
+     */
+    void move_to(mem_arena &arena) {
+        this->slots.move_to(arena);
+        this->postings.move_to(arena);
+    }
+
+    void serialize(image_writer &writer) const;
+    bool deserialize(image_reader &reader);
+
+private:
+    static constexpr uint32_t EMPTY = UINT32_MAX;
+    static constexpr uint32_t POSTINGS_FLAG = 1u << 31;
+
+    static uint32_t mix(uint32_t key) {
+        key ^= key >> 16;
+        key *= 0x45d9f3b;
+        key ^= key >> 16;
+        return key;
+    }
+
+    const slot *lookup(uint32_t key) const {
+        if (this->slots.empty()) {
+            return nullptr;
+        }
+        size_t mask = this->slots.size() - 1;
+        for (size_t i = mix(key) & mask; ; i = (i + 1) & mask) {
+            const slot &s = this->slots[i];
+            if (s.value == EMPTY) {
+                return nullptr;
+            }
+            if (s.key == key) {
+                return &s;
+            }
+        }
+    }
+
+    void build_bloom();
+
+    flat_array<slot> slots; // the size is a power of 2 (if not empty)
+    flat_array<uint32_t> postings; // lists of indexes of the keys having more than one index
+    uint64_t keys_num = 0;
+    bloom_filter bloom;
+};
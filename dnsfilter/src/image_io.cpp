@@ -0,0 +1,29 @@
+#include "image_io.h"
+
+
+static constexpr size_t WRITE_BUFFER_SIZE = 64 * 1024;
+
+
+void image_writer::write(const void *data, size_t size) {
+    this->buffer.append((const char *)data, size);
+    this->written += size;
+    if (this->buffer.size() >= WRITE_BUFFER_SIZE) {
+        flush();
+    }
+}
+
+void image_writer::pad() {
+    static constexpr char ZEROES[IMAGE_ALIGNMENT] = {};
+    size_t tail = this->written % IMAGE_ALIGNMENT;
+    if (tail != 0) {
+        write(ZEROES, IMAGE_ALIGNMENT - tail);
+    }
+}
+
+bool image_writer::flush() {
+    if (!this->failed && !this->buffer.empty()) {
+        this->failed = (int)this->buffer.size() != ag::file::write(this->fd, this->buffer.data(), this->buffer.size());
+    }
+    this->buffer.clear();
+    return !this->failed;
+}
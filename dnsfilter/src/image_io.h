@@ -0,0 +1,122 @@
+#pragma once
+
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <ag_file.h>
+#include "flat_array.h"
+
+
+// Every item of an image is padded to this boundary, so arrays can be used in place
+// when the image is mapped in memory
+static constexpr size_t IMAGE_ALIGNMENT = 8;
+
+/**
+ * Sequential writer of a compiled filter image
+ */
+class image_writer {
+public:
+    explicit image_writer(ag::file::handle fd) : fd(fd) {}
+
+    /**
+     * Write plain value
+     */
+    template <typename T>
+    void write_value(const T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        write(&value, sizeof(value));
+        pad();
+    }
+
+    /**
+     * Write array of plain values prefixed by its size
+     */
+    template <typename T>
+    void write_array(const T *data, size_t size) {
+        static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= IMAGE_ALIGNMENT);
+        write_value<uint64_t>(size);
+        write(data, size * sizeof(T));
+        pad();
+    }
+
+    template <typename T>
+    void write_array(const flat_array<T> &array) {
+        write_array(array.data(), array.size());
+    }
+
+    void write_string(std::string_view str) {
+        write_array(str.data(), str.size());
+    }
+
+    /**
+     * Write out the buffered data
+     * @return true if all the data was written successfully
+     */
+    bool flush();
+
+private:
+    void write(const void *data, size_t size);
+    void pad();
+
+    ag::file::handle fd;
+    std::string buffer;
+    size_t written = 0;
+    bool failed = false;
+};
+
+/**
+ * Sequential reader of a mapped compiled filter image.
+ * Arrays are not copied, they refer to the image data.
+ * Each method returns false if the image is truncated.
+ */
+class image_reader {
+public:
+    image_reader(const char *data, size_t size) : data(data), size(size) {}
+
+    template <typename T>
+    bool read_value(T &value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (!has(sizeof(value))) {
+            return false;
+        }
+        std::memcpy(&value, this->data + this->pos, sizeof(value));
+        skip(sizeof(value));
+        return true;
+    }
+
+    template <typename T>
+    bool read_array(flat_array<T> &array) {
+        static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= IMAGE_ALIGNMENT);
+        uint64_t num;
+        if (!read_value(num) || num > this->size / sizeof(T) || !has(num * sizeof(T))) {
+            return false;
+        }
+        array = flat_array<T>((const T *)(this->data + this->pos), num);
+        skip(num * sizeof(T));
+        return true;
+    }
+
+    bool read_string(std::string_view &str) {
+        flat_array<char> chars;
+        if (!read_array(chars)) {
+            return false;
+        }
+        str = { chars.data(), chars.size() };
+        return true;
+    }
+
+private:
+    bool has(size_t n) const { return n <= this->size - this->pos; }
+    void skip(size_t n) {
+        this->pos += n;
+        this->pos = std::min(this->size, (this->pos + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT);
+    }
+
+    const char *data;
+    size_t size;
+    size_t pos = 0;
+};
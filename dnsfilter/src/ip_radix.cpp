@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cassert>
+#include "ip_radix.h"
+
+
+/**
+ * Get number of the leading bits the keys have in common
+ */
+static uint32_t common_prefix_len(const uint8_t *l, const uint8_t *r, size_t width) {
+    for (size_t i = 0; i < width; ++i) {
+        uint8_t diff = l[i] ^ r[i];
+        if (diff != 0) {
+            uint32_t n = i * 8;
+            for (; !(diff & 0x80); diff <<= 1) {
+                ++n;
+            }
+            return n;
+        }
+    }
+    return width * 8;
+}
+
+void ip_radix::builder::add(ag::uint8_view network, uint32_t prefix_len, uint32_t index) {
+    assert(!(index & POSTINGS_FLAG));
+    assert(network.size() == ag::ipv4_address_size || network.size() == ag::ipv6_address_size);
+    assert(prefix_len <= network.size() * 8);
+
+    entry e = {};
+    std::memcpy(e.key, network.data(), network.size());
+    for (uint32_t i = prefix_len; i < network.size() * 8; ++i) {
+        e.key[i / 8] &= ~(0x80 >> (i % 8));
+    }
+    e.prefix_len = prefix_len;
+    e.index = index;
+    ((network.size() == ag::ipv4_address_size) ? this->v4_entries : this->v6_entries).push_back(e);
+}
+
+uint64_t ip_radix::builder::build_tree(std::vector<entry> &entries, size_t width, tree &t,
+        std::vector<uint32_t> &postings) {
+    if (entries.empty()) {
+        return 0;
+    }
+
+    // the indexes of a network keep the adding order
+    std::stable_sort(entries.begin(), entries.end(), [width] (const entry &l, const entry &r) {
+        int c = std::memcmp(l.key, r.key, width);
+        return c < 0 || (c == 0 && l.prefix_len < r.prefix_len);
+    });
+
+    // A range of the sorted entries sharing a prefix makes a node: its prefix is the longest one
+    // common to all the entries, the entries ending there are its value, and the rest are split
+    // into the children by the next bit (the entries of the left child precede the ones of the right).
+    // The ranges are processed in the depth-first order, so a child always follows its parent.
+    struct range {
+        size_t begin;
+        size_t end;
+        uint32_t parent;
+        uint32_t side;
+    };
+    std::vector<node> nodes;
+    std::vector<uint8_t> keys;
+    nodes.reserve(2 * entries.size());
+    keys.reserve(2 * entries.size() * width);
+    std::vector<range> stack = { { 0, entries.size(), NONE, 0 } };
+    std::vector<uint32_t> indexes;
+    uint64_t keys_num = 0;
+    while (!stack.empty()) {
+        range r = stack.back();
+        stack.pop_back();
+
+        uint32_t prefix_len = common_prefix_len(entries[r.begin].key, entries[r.end - 1].key, width);
+        for (size_t i = r.begin; i < r.end; ++i) {
+            prefix_len = std::min(prefix_len, entries[i].prefix_len);
+        }
+
+        uint32_t n = nodes.size();
+        if (r.parent != NONE) {
+            nodes[r.parent].child[r.side] = n;
+        }
+        nodes.push_back({ { NONE, NONE }, NO_VALUE, prefix_len });
+        // the first entry has the least key, so it is the node prefix followed by zero bits
+        keys.insert(keys.end(), entries[r.begin].key, entries[r.begin].key + width);
+
+        indexes.clear();
+        size_t i = r.begin;
+        for (; i < r.end && entries[i].prefix_len == prefix_len; ++i) {
+            indexes.push_back(entries[i].index);
+        }
+        if (indexes.size() == 1) {
+            nodes.back().value = indexes[0];
+        } else if (indexes.size() > 1) {
+            nodes.back().value = postings.size() | POSTINGS_FLAG;
+            postings.push_back(indexes.size());
+            postings.insert(postings.end(), indexes.begin(), indexes.end());
+        }
+        keys_num += !indexes.empty();
+        if (i == r.end) {
+            continue;
+        }
+
+        assert(prefix_len < width * 8);
+        size_t middle = std::partition_point(entries.begin() + i, entries.begin() + r.end,
+            [prefix_len] (const entry &e) { return ip_radix::get_bit(e.key, prefix_len) == 0; }) - entries.begin();
+        if (middle < r.end) {
+            stack.push_back({ middle, r.end, n, 1 });
+        }
+        if (i < middle) {
+            stack.push_back({ i, middle, n, 0 });
+        }
+    }
+
+    // the arrays are copied to fit, as `shrink_to_fit` does nothing if the exceptions are disabled
+    t.nodes = flat_array<node>(std::vector<node>(nodes.begin(), nodes.end()));
+    t.keys = flat_array<uint8_t>(std::vector<uint8_t>(keys.begin(), keys.end()));
+    return keys_num;
+}
+
+ip_radix ip_radix::builder::finish() {
+    ip_radix radix;
+    std::vector<uint32_t> postings;
+    radix.keys_num = build_tree(this->v4_entries, ag::ipv4_address_size, radix.v4, postings)
+            + build_tree(this->v6_entries, ag::ipv6_address_size, radix.v6, postings);
+    this->v4_entries = {};
+    this->v6_entries = {};
+    radix.postings = flat_array<uint32_t>(std::vector<uint32_t>(postings.begin(), postings.end()));
+    return radix;
+}
+
+void ip_radix::serialize(image_writer &writer) const {
+    writer.write_value(this->keys_num);
+    writer.write_array(this->v4.nodes);
+    writer.write_array(this->v4.keys);
+    writer.write_array(this->v6.nodes);
+    writer.write_array(this->v6.keys);
+    writer.write_array(this->postings);
+}
+
+bool ip_radix::deserialize_tree(image_reader &reader, tree &t, size_t width) {
+    if (!reader.read_array(t.nodes) || !reader.read_array(t.keys) || t.keys.size() != t.nodes.size() * width) {
+        return false;
+    }
+    // a lookup relies on the children following their parents with longer prefixes
+    for (uint32_t n = 0; n < t.nodes.size(); ++n) {
+        const node &x = t.nodes[n];
+        if (x.prefix_len > width * 8) {
+            return false;
+        }
+        for (uint32_t child : x.child) {
+            if (child != NONE && (child <= n || child >= t.nodes.size()
+                    || t.nodes[child].prefix_len <= x.prefix_len)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool ip_radix::deserialize(image_reader &reader) {
+    if (!reader.read_value(this->keys_num)
+            || !deserialize_tree(reader, this->v4, ag::ipv4_address_size)
+            || !deserialize_tree(reader, this->v6, ag::ipv6_address_size)
+            || !reader.read_array(this->postings)) {
+        return false;
+    }
+    for (const tree *t : { &this->v4, &this->v6 }) {
+        for (const node &x : t->nodes) {
+            if (x.value != NO_VALUE && (x.value & POSTINGS_FLAG)) {
+                size_t offset = x.value & ~POSTINGS_FLAG;
+                if (offset >= this->postings.size() || this->postings[offset] > this->postings.size() - offset - 1) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include <ag_defs.h>
+#include "flat_array.h"
+#include "image_io.h"
+
+
+/**
+ * Read-only binary radix (path-compressed) tree of IPv4 and IPv6 networks, which maps
+ * a network to one or several rule indexes.
+ * A lookup walks the bits of an address from the highest one and finds the indexes of all
+ * the networks containing the address on the way (not only of the longest matching one,
+ * as an exception rule for a subnet must be found together with the rule for the whole network).
+ * A node is created only where the networks branch or end, so the number of nodes is less than
+ * twice the number of the networks. The nodes are stored in plain arrays, so the tree can be used
+ * right from a mapped compiled filter image.
+ */
+class ip_radix {
+private:
+    struct node {
+        uint32_t child[2]; // by the bit following the prefix, `NONE` if there is no child
+        uint32_t value; // rule index, offset of a postings list if `POSTINGS_FLAG` is set, or `NO_VALUE`
+        uint32_t prefix_len; // number of the leading bits of the node key which all the addresses below share
+    };
+
+    // The tree of one address family, the key of the node `i` is at `keys[i * width]`
+    struct tree {
+        flat_array<node> nodes; // in the depth-first order, the root is the first one
+        flat_array<uint8_t> keys;
+    };
+
+public:
+    /**
+     * Helper for building the tree
+     */
+    class builder {
+    public:
+        /**
+         * Add network with a rule index (a network may be added several times)
+         * @param network    network address (4 bytes of IPv4 or 16 bytes of IPv6)
+         * @param prefix_len network prefix length (the bits of the address beyond it are ignored)
+         * @param index      rule index (must be less than 2^31)
+         */
+        void add(ag::uint8_view network, uint32_t prefix_len, uint32_t index);
+
+        /**
+         * Get the built tree (the builder must not be used afterwards)
+         */
+        ip_radix finish();
+
+    private:
+        struct entry {
+            uint8_t key[ag::ipv6_address_size]; // network address with the host bits cleared
+            uint32_t prefix_len;
+            uint32_t index;
+        };
+
+        static uint64_t build_tree(std::vector<entry> &entries, size_t width, tree &t,
+                std::vector<uint32_t> &postings);
+
+        std::vector<entry> v4_entries;
+        std::vector<entry> v6_entries;
+    };
+
+    /**
+     * Find indexes of all the networks containing the address
+     * @param address  4 bytes of IPv4 or 16 bytes of IPv6 address
+     * @param on_index function to call on each found index (`void (uint32_t index)`)
+     */
+    template <typename F>
+    void find(ag::uint8_view address, F &&on_index) const {
+        const tree *t = tree_of(address.size());
+        if (t == nullptr || t->nodes.empty()) {
+            return;
+        }
+        size_t width = address.size();
+        for (uint32_t n = 0; n != NONE; ) {
+            const node &x = t->nodes[n];
+            if (!has_prefix(address.data(), &t->keys[n * width], x.prefix_len)) {
+                return;
+            }
+            on_value(x.value, on_index);
+            if (x.prefix_len == width * 8) {
+                return;
+            }
+            n = x.child[get_bit(address.data(), x.prefix_len)];
+        }
+    }
+
+    /**
+     * Enumerate all the networks with their indexes
+     * @param on_key function to call on each network
+     *               (`void (ag::uint8_view network, uint32_t prefix_len, const uint32_t *indexes, size_t num)`)
+     */
+    template <typename F>
+    void for_each(F &&on_key) const {
+        for (const tree *t : { &this->v4, &this->v6 }) {
+            size_t width = (t == &this->v4) ? ag::ipv4_address_size : ag::ipv6_address_size;
+            for (uint32_t n = 0; n < t->nodes.size(); ++n) {
+                uint32_t value = t->nodes[n].value;
+                if (value == NO_VALUE) {
+                    continue;
+                }
+                ag::uint8_view network = { &t->keys[n * width], width };
+                if (!(value & POSTINGS_FLAG)) {
+                    on_key(network, t->nodes[n].prefix_len, &t->nodes[n].value, 1);
+                } else {
+                    const uint32_t *postings = &this->postings[value & ~POSTINGS_FLAG];
+                    on_key(network, t->nodes[n].prefix_len, postings + 1, postings[0]);
+                }
+            }
+        }
+    }
+
+    /**
+     * Check if the network contains the address
+     */
+    static bool contains(ag::uint8_view network, uint32_t prefix_len, ag::uint8_view address) {
+        return network.size() == address.size() && prefix_len <= network.size() * 8
+                && has_prefix(address.data(), network.data(), prefix_len);
+    }
+
+    /**
+     * Get number of networks
+     */
+    size_t size() const { return this->keys_num; }
+
+    /**
+     * Get number of nodes of both trees
+     */
+    size_t nodes_num() const { return this->v4.nodes.size() + this->v6.nodes.size(); }
+
+    /**
+     * Get memory allocated for the tree (the memory of a mapped image is not counted)
+     */
+    size_t memory_usage() const {
+        return this->v4.nodes.memory_usage() + this->v4.keys.memory_usage()
+                + this->v6.nodes.memory_usage() + this->v6.keys.memory_usage() + this->postings.memory_usage();
+    }
+
+    /**
+     * Move the arrays to the arena (see `flat_array::move_to`)
+     */
+    void move_to(mem_arena &arena) {
+        for (tree *t : { &this->v4, &this->v6 }) {
+            t->nodes.move_to(arena);
+            t->keys.move_to(arena);
+        }
+        this->postings.move_to(arena);
+    }
+
+    void serialize(image_writer &writer) const;
+    bool deserialize(image_reader &reader);
+
+private:
+    static constexpr uint32_t NONE = UINT32_MAX;
+    static constexpr uint32_t NO_VALUE = UINT32_MAX;
+    static constexpr uint32_t POSTINGS_FLAG = 1u << 31;
+
+    static uint32_t get_bit(const uint8_t *key, uint32_t i) {
+        return (key[i / 8] >> (7 - i % 8)) & 1;
+    }
+
+    static bool has_prefix(const uint8_t *address, const uint8_t *key, uint32_t prefix_len) {
+        uint32_t bytes = prefix_len / 8;
+        if (0 != std::memcmp(address, key, bytes)) {
+            return false;
+        }
+        uint32_t bits = prefix_len % 8;
+        return bits == 0 || ((address[bytes] ^ key[bytes]) >> (8 - bits)) == 0;
+    }
+
+    const tree *tree_of(size_t width) const {
+        return (width == ag::ipv4_address_size) ? &this->v4 : (width == ag::ipv6_address_size) ? &this->v6 : nullptr;
+    }
+
+    template <typename F>
+    void on_value(uint32_t value, F &&on_index) const {
+        if (value == NO_VALUE) {
+            return;
+        }
+        if (!(value & POSTINGS_FLAG)) {
+            on_index(value);
+            return;
+        }
+        // the first element of a postings list is its length
+        const uint32_t *postings = &this->postings[value & ~POSTINGS_FLAG];
+        for (uint32_t j = 1; j <= postings[0]; ++j) {
+            on_index(postings[j]);
+        }
+    }
+
+    static bool deserialize_tree(image_reader &reader, tree &t, size_t width);
+
+    tree v4;
+    tree v6;
+    flat_array<uint32_t> postings; // lists of indexes of the networks having more than one index
+    uint64_t keys_num = 0;
+};
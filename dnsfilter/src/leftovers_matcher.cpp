@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <cctype>
+#include <ag_utils.h>
+#include "leftovers_matcher.h"
+
+
+// Maximum number of the regexes combined into a single alternation
+// (a compiled pattern size is limited, and a failed group is not prefiltered at all)
+static constexpr size_t MAX_COMBINED_REGEXES = 32;
+
+/**
+ * Check if the regex keeps its meaning being put in a group of an alternation
+ */
+static bool can_combine(std::string_view re) {
+    // group numbers are shifted in the alternation, and verbs are allowed only at the pattern start
+    static constexpr std::string_view UNSAFE_CONSTRUCTS[] = { "(*", "(?P", "(?R", "(?&", "(?(", "\\g", "\\k" };
+    for (std::string_view c : UNSAFE_CONSTRUCTS) {
+        if (re.find(c) != re.npos) {
+            return false;
+        }
+    }
+    for (size_t i = re.find('\\'); i != re.npos && i + 1 < re.length(); i = re.find('\\', i + 2)) {
+        if (std::isdigit((unsigned char)re[i + 1])) {
+            return false;
+        }
+    }
+    // a recursion by number, e.g. `(?1)` or `(?-1)`
+    for (size_t i = re.find("(?"); i != re.npos && i + 2 < re.length(); i = re.find("(?", i + 2)) {
+        char c = re[i + 2];
+        if (std::isdigit((unsigned char)c) || c == '+' || c == '-') {
+            return false;
+        }
+    }
+    return true;
+}
+
+void leftovers_matcher::build(const std::vector<std::string_view> &literals,
+        std::vector<std::pair<uint32_t, std::string>> regexes, pcre2_compile_context *regex_context) {
+    *this = {};
+
+    std::vector<std::vector<uint32_t>> entries_by_literal;
+    std::vector<bool> covered(literals.size());
+    for (uint32_t i = 0; i < literals.size(); ++i) {
+        if (literals[i].empty()) {
+            continue;
+        }
+        uint32_t id = this->literals_matcher.add(literals[i]);
+        if (id == entries_by_literal.size()) {
+            entries_by_literal.emplace_back();
+        }
+        entries_by_literal[id].push_back(i);
+        covered[i] = true;
+    }
+    this->literals_matcher.build();
+    this->literal_offsets.reserve(entries_by_literal.size() + 1);
+    for (const std::vector<uint32_t> &entries : entries_by_literal) {
+        this->literal_offsets.push_back(this->literal_entries.size());
+        this->literal_entries.insert(this->literal_entries.end(), entries.begin(), entries.end());
+    }
+    this->literal_offsets.push_back(this->literal_entries.size());
+
+    std::string pattern;
+    std::vector<uint32_t> entries;
+    auto flush = [&] () {
+        if (entries.empty()) {
+            return;
+        }
+        ag::regex re(pattern, PCRE2_CASELESS, true, regex_context);
+        if (re.is_valid()) {
+            for (uint32_t e : entries) {
+                covered[e] = true;
+            }
+            this->combined.push_back({ std::move(re), std::move(entries) });
+        }
+        pattern.clear();
+        entries.clear();
+    };
+    for (const auto &[entry, text] : regexes) {
+        if (covered[entry] || text.empty() || !can_combine(text)) {
+            continue;
+        }
+        pattern += AG_FMT("{}(?:{})", pattern.empty() ? "" : "|", text);
+        entries.push_back(entry);
+        if (entries.size() == MAX_COMBINED_REGEXES) {
+            flush();
+        }
+    }
+    flush();
+    this->combined.shrink_to_fit();
+
+    for (uint32_t i = 0; i < literals.size(); ++i) {
+        if (!covered[i]) {
+            this->unfiltered_entries.push_back(i);
+        }
+    }
+
+    regexes.shrink_to_fit();
+    this->entry_regexes = std::move(regexes);
+}
+
+void leftovers_matcher::search(std::string_view host, std::vector<uint32_t> &candidates) const {
+    candidates.clear();
+
+    this->literals_matcher.search(host, [this, &candidates] (uint32_t id) {
+        candidates.insert(candidates.end(), &this->literal_entries[this->literal_offsets[id]],
+            &this->literal_entries[0] + this->literal_offsets[id + 1]);
+    });
+    add_entries_without_literal(host, candidates);
+
+    // a literal may occur in a domain several times
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+}
+
+void leftovers_matcher::search_without_literal(std::string_view host, std::vector<uint32_t> &candidates) const {
+    candidates.clear();
+    add_entries_without_literal(host, candidates);
+    // the groups of the combined regexes don't overlap each other and the unfiltered entries
+    std::sort(candidates.begin(), candidates.end());
+}
+
+void leftovers_matcher::add_entries_without_literal(std::string_view host, std::vector<uint32_t> &candidates) const {
+    for (const combined_regex &c : this->combined) {
+        if (c.regex.match(host)) {
+            candidates.insert(candidates.end(), c.entries.begin(), c.entries.end());
+        }
+    }
+    candidates.insert(candidates.end(), this->unfiltered_entries.begin(), this->unfiltered_entries.end());
+}
+
+size_t leftovers_matcher::memory_usage(bool regex_code) const {
+    size_t size = sizeof(*this) + this->literals_matcher.memory_usage()
+            + (this->literal_offsets.capacity() + this->literal_entries.capacity()
+                + this->unfiltered_entries.capacity()) * sizeof(uint32_t)
+            + this->combined.capacity() * sizeof(combined_regex)
+            + this->entry_regexes.capacity() * sizeof(this->entry_regexes[0]);
+    for (const combined_regex &c : this->combined) {
+        size += (regex_code ? c.regex.memory_usage() : c.regex.jit_memory_usage())
+                + c.entries.capacity() * sizeof(uint32_t);
+    }
+    for (const auto &[_, text] : this->entry_regexes) {
+        size += text.capacity();
+    }
+    return size;
+}
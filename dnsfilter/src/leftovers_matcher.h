@@ -0,0 +1,111 @@
+#pragma once
+
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <utility>
+#include <ag_regex.h>
+#include "aho_corasick.h"
+
+
+/**
+ * Prefilter of the leftover rules, which finds the rules that may match a domain without
+ * checking them one by one.
+ * - an entry which has a literal (a domain must contain it to match the rule) is found by
+ *   a single pass of the literals automaton over the domain
+ * - the regexes of the entries without literal are combined into a few alternations, each one
+ *   rejecting its whole group of entries by a single regex match
+ * - the rest of the entries (e.g. the regexes with backreferences, which can't be combined)
+ *   are always returned as candidates
+ * The candidates still have to be checked against their rules, the prefilter only reduces
+ * the number of the checks.
+ */
+class leftovers_matcher {
+public:
+    leftovers_matcher() = default;
+
+    leftovers_matcher(leftovers_matcher &&) = default;
+    leftovers_matcher &operator=(leftovers_matcher &&) = default;
+
+    leftovers_matcher(const leftovers_matcher &) = delete;
+    leftovers_matcher &operator=(const leftovers_matcher &) = delete;
+
+    /**
+     * Build the prefilter
+     * @param literals literal of each entry (empty if the entry has no literal)
+     * @param regexes  regexes of the entries without literal (entry index -> regex text)
+     *                 in ascending order of the entries
+     * @param regex_context PCRE2 compile context to compile the combined regexes with (may be null)
+     */
+    void build(const std::vector<std::string_view> &literals, std::vector<std::pair<uint32_t, std::string>> regexes,
+            pcre2_compile_context *regex_context = nullptr);
+
+    /**
+     * Find the entries which may match the domain
+     * @param host       lowercased domain
+     * @param candidates the candidate entries in ascending order (the vector is cleared first)
+     */
+    void search(std::string_view host, std::vector<uint32_t> &candidates) const;
+
+    /**
+     * Find the entries without literal which may match the domain (see `search`)
+     * @param host       lowercased domain
+     * @param candidates the candidate entries in ascending order (the vector is cleared first)
+     */
+    void search_without_literal(std::string_view host, std::vector<uint32_t> &candidates) const;
+
+    /**
+     * Get the regexes of the entries without literal (see `build`)
+     */
+    const std::vector<std::pair<uint32_t, std::string>> &regexes() const { return this->entry_regexes; }
+
+    /**
+     * Get number of the entries found by literal
+     */
+    size_t literal_entries_num() const { return this->literal_entries.size(); }
+
+    /**
+     * Get number of the combined regexes
+     */
+    size_t combined_regexes_num() const { return this->combined.size(); }
+
+    /**
+     * Get number of the entries which are always checked
+     */
+    size_t unfiltered_entries_num() const { return this->unfiltered_entries.size(); }
+
+    /**
+     * Get approximate memory consumed by the prefilter
+     * @param regex_code if false, only the JIT-compiled code of the combined regexes is counted
+     *                   (the rest is counted by the arena they are compiled in)
+     */
+    size_t memory_usage(bool regex_code = true) const;
+
+    /**
+     * Move the literals automaton to the arena (see `flat_array::move_to`)
+     */
+    void move_to(mem_arena &arena) { this->literals_matcher.move_to(arena); }
+
+private:
+    /**
+     * Append the entries without literal which may match the domain to the candidates
+     */
+    void add_entries_without_literal(std::string_view host, std::vector<uint32_t> &candidates) const;
+
+    // Several regexes of the entries without literal combined into a single alternation
+    struct combined_regex {
+        ag::regex regex;
+        std::vector<uint32_t> entries; // entries which regexes are combined
+    };
+
+    aho_corasick literals_matcher;
+    // literal id -> offset of its list of entries in `literal_entries`
+    // (the list ends where the list of the next id starts)
+    std::vector<uint32_t> literal_offsets;
+    std::vector<uint32_t> literal_entries;
+    std::vector<combined_regex> combined;
+    std::vector<uint32_t> unfiltered_entries;
+    std::vector<std::pair<uint32_t, std::string>> entry_regexes;
+};
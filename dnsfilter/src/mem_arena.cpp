@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include "mem_arena.h"
+
+
+// The chunks grow along with the arena, so a small engine takes a few small chunks,
+// and a large one takes a few large chunks
+static constexpr size_t MIN_CHUNK_SIZE = 16 * 1024;
+static constexpr size_t MAX_CHUNK_SIZE = 1024 * 1024;
+// A request larger than this share of a chunk gets a chunk of its own, which spares
+// wasting the rest of the current chunk
+static constexpr size_t MAX_CHUNK_SHARE = 4;
+
+// A regex allocation is prefixed with its size, so it is known on freeing
+static constexpr size_t REGEX_HEADER_SIZE = alignof(std::max_align_t);
+
+
+mem_arena::mem_arena()
+    : general_context(pcre2_general_context_create(&regex_malloc, &regex_free, this))
+    , compile_context(pcre2_compile_context_create(this->general_context))
+{}
+
+mem_arena::mem_arena(const mem_arena &target, dry_run_tag)
+    : mem_arena()
+{
+    std::scoped_lock l(target.mtx);
+    this->chunks_size = target.chunks_size;
+    this->free_begin = target.free_begin;
+    this->free_end = target.free_end;
+    this->dry_run = true;
+    // the counted chunks start at an address aligned as the allocated ones, so the padding is the same
+    this->dry_run_chunk = alignof(std::max_align_t);
+}
+
+mem_arena::~mem_arena() {
+    pcre2_compile_context_free(this->compile_context);
+    pcre2_general_context_free(this->general_context);
+    assert(this->regex_bytes == 0);
+    for (void *chunk : this->chunks) {
+        std::free(chunk);
+    }
+}
+
+void *mem_arena::allocate(size_t size, size_t align, size_t released) {
+    assert(align != 0 && (align & (align - 1)) == 0 && align <= alignof(std::max_align_t));
+    if (size == 0) {
+        return nullptr;
+    }
+    std::scoped_lock l(this->mtx);
+
+    uintptr_t p = (this->free_begin + align - 1) & ~(uintptr_t)(align - 1);
+    if (this->free_begin != 0 && p <= this->free_end && size <= this->free_end - p) {
+        this->free_begin = p + size;
+        this->released_bytes += released;
+        return !this->dry_run ? (void *)p : nullptr;
+    }
+
+    size_t chunk_size = std::clamp(this->chunks_size, MIN_CHUNK_SIZE, MAX_CHUNK_SIZE);
+    bool dedicated = size > chunk_size / MAX_CHUNK_SHARE;
+    if (dedicated) {
+        chunk_size = size;
+    }
+    // `malloc` returns memory aligned for any type, so the chunk start needs no alignment
+    uintptr_t chunk = this->dry_run_chunk;
+    if (this->dry_run) {
+        this->dry_run_chunk += (chunk_size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    } else {
+        void *mem = std::malloc(chunk_size);
+        if (mem == nullptr) {
+            return nullptr;
+        }
+        this->chunks.push_back(mem);
+        chunk = (uintptr_t)mem;
+    }
+    this->chunks_size += chunk_size;
+    this->released_bytes += released;
+    if (!dedicated) {
+        this->free_begin = chunk + size;
+        this->free_end = chunk + chunk_size;
+    }
+    return !this->dry_run ? (void *)chunk : nullptr;
+}
+
+size_t mem_arena::chunks_memory() const {
+    std::scoped_lock l(this->mtx);
+    return this->chunks_size;
+}
+
+size_t mem_arena::released_memory() const {
+    std::scoped_lock l(this->mtx);
+    return this->released_bytes;
+}
+
+size_t mem_arena::chunks_num() const {
+    std::scoped_lock l(this->mtx);
+    return this->chunks.size();
+}
+
+void *mem_arena::regex_malloc(size_t size, void *arena) {
+    auto *mem = (char *)std::malloc(REGEX_HEADER_SIZE + size);
+    if (mem == nullptr) {
+        return nullptr;
+    }
+    *(size_t *)mem = size;
+    ((mem_arena *)arena)->regex_bytes.fetch_add(REGEX_HEADER_SIZE + size, std::memory_order_relaxed);
+    return mem + REGEX_HEADER_SIZE;
+}
+
+void mem_arena::regex_free(void *ptr, void *arena) {
+    if (ptr == nullptr) {
+        return;
+    }
+    char *mem = (char *)ptr - REGEX_HEADER_SIZE;
+    ((mem_arena *)arena)->regex_bytes.fetch_sub(REGEX_HEADER_SIZE + *(size_t *)mem, std::memory_order_relaxed);
+    std::free(mem);
+}
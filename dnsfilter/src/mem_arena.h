@@ -0,0 +1,95 @@
+#pragma once
+
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <pcre2.h>
+
+
+/**
+ * Memory arena of a filtering engine, which keeps account of the real bytes the engine holds:
+ * - the frozen lookup tables are moved into large chunks one after another (see `flat_array::move_to`),
+ *   and the chunks are freed all at once along with the arena
+ * - the compiled regexes are allocated through a PCRE2 general context (see `regex_context`), which
+ *   counts the allocated bytes (the regexes are still freed one by one, as PCRE2 frees the temporary
+ *   memory of a compilation itself)
+ * The arena must outlive everything allocated from it.
+ */
+class mem_arena {
+public:
+    mem_arena();
+    ~mem_arena();
+
+    struct dry_run_tag {};
+
+    /**
+     * Create an arena which only counts what moving the tables to the target arena would take:
+     * its chunks grow exactly as the ones of the target would, but `allocate` returns null,
+     * so the tables are kept where they are (see `flat_array::move_to`)
+     * @param target arena to count the allocations for (it is not changed)
+     */
+    mem_arena(const mem_arena &target, dry_run_tag);
+
+    mem_arena(const mem_arena &) = delete;
+    mem_arena &operator=(const mem_arena &) = delete;
+
+    /**
+     * Allocate memory which lives until the arena is destroyed
+     * @param size     number of bytes
+     * @param align    alignment (a power of 2 not greater than `alignof(std::max_align_t)`)
+     * @param released number of bytes the caller frees once the memory is allocated (see `released_memory`)
+     * @return pointer to the memory, or null if it can't be allocated (always null in a dry run)
+     */
+    void *allocate(size_t size, size_t align, size_t released = 0);
+
+    /**
+     * Get the compile context which makes the regexes allocated through the arena (thread-safe)
+     */
+    pcre2_compile_context *regex_context() const { return this->compile_context; }
+
+    /**
+     * Get number of bytes of the chunks
+     */
+    size_t chunks_memory() const;
+
+    /**
+     * Get number of chunks
+     */
+    size_t chunks_num() const;
+
+    /**
+     * Get number of bytes of the currently allocated regexes (the JIT-compiled code is not counted,
+     * as PCRE2 allocates it on its own)
+     */
+    size_t regex_memory() const { return this->regex_bytes.load(std::memory_order_relaxed); }
+
+    /**
+     * Get number of bytes allocated through the arena
+     */
+    size_t memory_usage() const { return chunks_memory() + regex_memory(); }
+
+    /**
+     * Get number of bytes the callers of `allocate` free (or would free in a dry run)
+     */
+    size_t released_memory() const;
+
+private:
+    static void *regex_malloc(size_t size, void *arena);
+    static void regex_free(void *ptr, void *arena);
+
+    mutable std::mutex mtx; // the filters are loaded concurrently
+    std::vector<void *> chunks;
+    size_t chunks_size = 0;
+    uintptr_t free_begin = 0; // free space of the last chunk
+    uintptr_t free_end = 0;
+    size_t released_bytes = 0;
+    bool dry_run = false;
+    uintptr_t dry_run_chunk = 0; // address the next chunk of a dry run is counted at
+
+    std::atomic<size_t> regex_bytes = 0;
+    pcre2_general_context *general_context = nullptr;
+    pcre2_compile_context *compile_context = nullptr;
+};
@@ -0,0 +1,122 @@
+#pragma once
+
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+/**
+ * Get number of threads to use for a work, which may be run in parallel
+ * @param requested requested number of threads (0 means the number of CPU cores)
+ */
+static inline size_t get_threads_num(size_t requested) {
+    return (requested != 0) ? requested : std::max(1u, std::thread::hardware_concurrency());
+}
+
+/**
+ * Threads which run the tasks of `parallel_for` calls, so that the threads are created once
+ * for a whole work instead of once per call.
+ * The calling thread of `parallel_for` runs the tasks too, so a task may call `parallel_for` itself:
+ * the workers take the tasks of the latest call first, and a call returns once its own tasks
+ * are completed.
+ */
+class thread_pool {
+public:
+    /**
+     * @param threads_num number of threads to run the tasks on (including the calling one)
+     */
+    explicit thread_pool(size_t threads_num) {
+        this->workers.reserve(threads_num - 1);
+        for (size_t i = 1; i < threads_num; ++i) {
+            this->workers.emplace_back([this] () { work(); });
+        }
+    }
+
+    ~thread_pool() {
+        {
+            std::unique_lock l(this->mtx);
+            this->stopping = true;
+        }
+        this->job_added.notify_all();
+        for (std::thread &t : this->workers) {
+            t.join();
+        }
+    }
+
+    thread_pool(const thread_pool &) = delete;
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    /**
+     * Get number of threads the tasks run on (including the calling one)
+     */
+    size_t threads_num() const { return this->workers.size() + 1; }
+
+    /**
+     * Run `task(i)` for each `i` in `[0, n)` on the pool threads and the calling one.
+     * Returns once all the tasks are completed.
+     */
+    void parallel_for(size_t n, const std::function<void(size_t)> &task) {
+        if (this->workers.empty() || n < 2) {
+            for (size_t i = 0; i < n; ++i) {
+                task(i);
+            }
+            return;
+        }
+
+        job j = { &task, n };
+        std::unique_lock l(this->mtx);
+        this->jobs.push_back(&j);
+        this->job_added.notify_all();
+        while (j.next < j.n) {
+            size_t i = j.next++;
+            if (j.next == j.n) {
+                this->jobs.erase(std::find(this->jobs.begin(), this->jobs.end(), &j));
+            }
+            l.unlock();
+            task(i);
+            l.lock();
+            ++j.done;
+        }
+        this->job_done.wait(l, [&j] () { return j.done == j.n; });
+    }
+
+private:
+    struct job {
+        const std::function<void(size_t)> *task;
+        size_t n;
+        size_t next = 0; // next task to run
+        size_t done = 0; // number of completed tasks
+    };
+
+    void work() {
+        std::unique_lock l(this->mtx);
+        while (true) {
+            this->job_added.wait(l, [this] () { return this->stopping || !this->jobs.empty(); });
+            if (this->jobs.empty()) {
+                return;
+            }
+            job *j = this->jobs.back();
+            size_t i = j->next++;
+            if (j->next == j->n) {
+                this->jobs.pop_back();
+            }
+            l.unlock();
+            (*j->task)(i);
+            l.lock();
+            if (++j->done == j->n) {
+                this->job_done.notify_all();
+            }
+        }
+    }
+
+    std::mutex mtx;
+    std::condition_variable job_added;
+    std::condition_variable job_done;
+    std::vector<job *> jobs; // the jobs having tasks which are not started yet
+    bool stopping = false;
+    std::vector<std::thread> workers;
+};
@@ -14,7 +14,7 @@
 
 
 static constexpr int MODIFIERS_MARKER = '$';
-static constexpr int MODIFIERS_DELIMITER = ',';
+static constexpr std::string_view MODIFIERS_DELIMITER = ",";
 static constexpr std::string_view EXCEPTION_MARKER = "@@";
 static constexpr std::string_view SKIPPABLE_PREFIXES[] =
     { "https://", "http://", "http*://", "ws://", "wss://", "ws*://", "://", "//" };
@@ -23,15 +23,11 @@ static constexpr std::string_view SPECIAL_SUFFIXES[] =
 static constexpr std::string_view SPECIAL_REGEX_CHARACTERS = "\\^$*+?.()|[]{}";
 
 
-static const ag::regex SHORTCUT_REGEXES[] =
-    {
-        // Strip all types of brackets
-        ag::regex("([^\\\\]*)\\([^\\\\]*\\)"),
-        ag::regex("([^\\\\]*)\\{[^\\\\]*\\}"),
-        ag::regex("([^\\\\]*)\\[[^\\\\]*\\]"),
-        // Strip some escaped characters
-        ag::regex("([^\\\\]*)\\[a-zA-Z]"),
-    };
+static constexpr std::string_view SPECIAL_CHAR_PLACEHOLDER = "...";
+// Bracket pairs stripped from a regex text before extracting the shortcuts
+static constexpr std::array<char, 2> SHORTCUT_BRACKETS[] = { { '(', ')' }, { '{', '}' }, { '[', ']' } };
+// Stripped from a regex text after the brackets, ignoring case (the literal text, not a character class)
+static constexpr std::string_view SHORTCUT_STRIPPED_CLASS = "[a-zA-Z]";
 
 struct supported_modifier_descriptor {
     std::string_view name;
@@ -73,10 +69,57 @@ static inline bool pattern_subdomains(int pattern_mode) {
     return pattern_mode == (MPM_DOMAIN_START_ASSERTED | MPM_LINE_END_ASSERTED);
 }
 
+/**
+ * Range of the pieces of a string split by any of the delimiters, trimmed, with the empty ones
+ * dropped (the same as `ag::utils::split_by_any_of` returns for a non-empty string), which
+ * are found while iterating instead of being collected into a vector
+ */
+class tokens {
+public:
+    class iterator {
+    public:
+        iterator(std::string_view tail, std::string_view delims) : tail(tail), delims(delims) {
+            this->advance();
+        }
+        std::string_view operator*() const { return this->token; }
+        iterator &operator++() {
+            this->advance();
+            return *this;
+        }
+        bool operator==(const iterator &other) const { return this->token.data() == other.token.data(); }
+        bool operator!=(const iterator &other) const { return !(*this == other); }
+
+    private:
+        std::string_view tail;
+        std::string_view delims;
+        std::string_view token;
+
+        void advance() {
+            this->token = {};
+            while (this->token.empty() && !this->tail.empty()) {
+                size_t pos = this->tail.find_first_of(this->delims);
+                this->token = ag::utils::trim(this->tail.substr(0, pos));
+                this->tail.remove_prefix((pos != this->tail.npos) ? pos + 1 : this->tail.length());
+            }
+            if (this->token.empty()) {
+                this->token = {};
+            }
+        }
+    };
+
+    tokens(std::string_view str, std::string_view delims) : str(str), delims(delims) {}
+    iterator begin() const { return { this->str, this->delims }; }
+    iterator end() const { return { {}, {} }; }
+
+private:
+    std::string_view str;
+    std::string_view delims;
+};
+
 static inline bool check_domain_pattern_labels(std::string_view domain) {
-    std::vector<std::string_view> labels = ag::utils::split_by(domain, '.');
-    for (const std::string_view &label : labels) {
-        if (label.length() > MAX_LABEL_LENGTH) {
+    for (size_t start = 0, end; start <= domain.length(); start = end + 1) {
+        end = std::min(domain.find('.', start), domain.length());
+        if (end - start > MAX_LABEL_LENGTH) {
             return false;
         }
     }
@@ -110,50 +153,96 @@ static inline bool is_valid_ip_pattern(std::string_view str) {
     });
 }
 
+/**
+ * Parse an IP address or a network in the CIDR notation (e.g. `10.0.0.0/8`)
+ * @param out the matching part of the network rule (see `rule_utils::rule::MMID_CIDR`)
+ *            is appended to it
+ * @return true if parsed successfully
+ */
+static bool parse_network(std::string_view str, std::string &out) {
+    size_t slash = str.find('/');
+    std::string_view prefix_len_str = (slash != str.npos) ? str.substr(slash + 1) : std::string_view();
+    str = str.substr(0, slash);
+    if (str.empty() || str.length() > MAX_IPADDR_LENTH
+            || (slash != str.npos && (prefix_len_str.empty() || prefix_len_str.length() > 3
+                || prefix_len_str.cend() != std::find_if_not(prefix_len_str.cbegin(), prefix_len_str.cend(),
+                    [] (unsigned char c) { return std::isdigit(c); })))) {
+        return false;
+    }
+
+    ag::socket_address addr{str, 0};
+    if (!addr.valid()) {
+        return false;
+    }
+    ag::uint8_view bytes = addr.addr();
+    size_t prefix_len = bytes.size() * 8;
+    if (!prefix_len_str.empty()) {
+        prefix_len = 0;
+        for (char c : prefix_len_str) {
+            prefix_len = prefix_len * 10 + (c - '0');
+        }
+        if (prefix_len > bytes.size() * 8) {
+            return false;
+        }
+    }
+
+    out.append(bytes.begin(), bytes.end());
+    out.push_back((char)prefix_len);
+    return true;
+}
+
 static inline bool is_ip(std::string_view str) {
     return ag::utils::str_to_socket_address(str).valid();
 }
 
 static inline bool is_domain_name(std::string_view str) {
     return !str.empty() // Duh
-           && !is_ip(str)
            && str.npos != str.find('.') // Single label is probably not a real domain name
            && str.back() != '.' // We consider a domain name ending with '.' a pattern
            && str.front() != '.' // Valid pattern, but not a valid domain
+           && str.npos == str.find("*") // '*' is our special char for pattern matching
            && is_valid_domain_pattern(str) // This is a bit more general than Go dnsproxy's regex, but yolo
-           && str.npos == str.find("*"); // '*' is our special char for pattern matching
+           && !is_ip(str);
+}
+
+/**
+ * Append the lowercased string to the buffer
+ * @return the appended string
+ */
+static std::string_view append_lower(std::string &buf, std::string_view str) {
+    size_t offset = buf.length();
+    std::transform(str.cbegin(), str.cend(), std::back_inserter(buf), (int (*)(int))std::tolower);
+    return { buf.data() + offset, str.length() };
 }
 
 // https://github.com/AdguardTeam/AdguardHome/wiki/Hosts-Blocklists#-etchosts-syntax
-static std::optional<rule_utils::rule> parse_host_file_rule(std::string_view str, ag::logger *log) {
+static bool parse_host_file_rule(std::string_view str, rule_utils::rule_view &r, std::string &buf) {
     str = ag::utils::rtrim(str.substr(0, str.find("#")));
-    std::vector<std::string_view> parts = ag::utils::split_by_any_of(str, " \t");
-    if (parts.size() < 2) {
-        return std::nullopt;
+    tokens parts(str, " \t");
+    tokens::iterator it = parts.begin();
+    if (it == parts.end()) {
+        return false;
     }
-    if (!ag::utils::is_valid_ip4(parts[0]) && !ag::utils::is_valid_ip6(parts[0])) {
-        return std::nullopt;
+    std::string_view ip = *it;
+    if (!ag::utils::is_valid_ip4(ip) && !ag::utils::is_valid_ip6(ip)) {
+        return false;
     }
-    rule_utils::rule r = {};
     r.match_method = rule_utils::rule::MMID_SUBDOMAINS;
-    r.matching_parts.reserve(parts.size() - 1);
-    for (size_t i = 1; i < parts.size(); ++i) {
-        const std::string_view &domain = parts[i];
-        if (domain.empty()) {
-            continue;
-        }
+    for (++it; it != parts.end(); ++it) {
+        std::string_view domain = *it;
         if (!is_valid_domain_pattern(domain) && domain.npos == domain.find('*')) {
-            return std::nullopt;
+            return false;
         }
-        r.matching_parts.emplace_back(ag::utils::to_lower(domain));
+        r.matching_parts.push_back(append_lower(buf, domain));
     }
 
     if (r.matching_parts.empty()) {
-        return std::nullopt;
+        return false;
     }
 
-    r.public_part = { 0, std::string(str), {}, std::make_optional(std::string(parts[0])) };
-    return std::make_optional(std::move(r));
+    r.text = str;
+    r.ip = ip;
+    return true;
 }
 
 // https://github.com/AdguardTeam/AdguardHome/wiki/Hosts-Blocklists#rule-modifiers
@@ -163,8 +252,7 @@ static inline bool extract_modifiers(std::string_view modifiers_str,
         return true;
     }
 
-    std::vector<std::string_view> modifiers = ag::utils::split_by(modifiers_str, MODIFIERS_DELIMITER);
-    for (const std::string_view &modifier : modifiers) {
+    for (std::string_view modifier : tokens(modifiers_str, MODIFIERS_DELIMITER)) {
         const supported_modifier_descriptor *found = nullptr;
         for (const supported_modifier_descriptor &descr : SUPPORTED_MODIFIERS) {
             if (modifier == descr.name) {
@@ -218,15 +306,17 @@ static inline int remove_special_prefixes(std::string_view &rule) {
 static inline int remove_special_suffixes(std::string_view &rule) {
     int r = MPM_NONE;
 
-    std::vector<std::string_view> suffixes_to_remove(SPECIAL_SUFFIXES, SPECIAL_SUFFIXES + std::size(SPECIAL_SUFFIXES));
-    std::vector<std::string_view>::iterator iter;
-    while (suffixes_to_remove.end() != (iter = std::find_if(suffixes_to_remove.begin(), suffixes_to_remove.end(),
-            [&rule] (std::string_view suffix) {
-                return ag::utils::ends_with(rule, suffix);
-            }))) {
-        rule.remove_suffix(iter->length());
-        r = MPM_LINE_END_ASSERTED;
-        suffixes_to_remove.erase(iter);
+    // each suffix is removed once, the first of the remaining ones in the list order goes first
+    bool removed[std::size(SPECIAL_SUFFIXES)] = {};
+    for (bool found = true; found;) {
+        found = false;
+        for (size_t i = 0; i < std::size(SPECIAL_SUFFIXES) && !found; ++i) {
+            if (!removed[i] && ag::utils::ends_with(rule, SPECIAL_SUFFIXES[i])) {
+                rule.remove_suffix(SPECIAL_SUFFIXES[i].length());
+                r = MPM_LINE_END_ASSERTED;
+                removed[i] = found = true;
+            }
+        }
     }
 
     return r;
@@ -283,17 +373,14 @@ static match_info extract_match_info(std::string_view rule) {
 }
 
 static inline bool is_host_rule(std::string_view str) {
-    std::vector<std::string_view> parts = ag::utils::split_by_any_of(str, " \t");
-    return parts.size() > 1
-            && (ag::utils::is_valid_ip4(parts[0]) || ag::utils::is_valid_ip6(parts[0]));
-}
-
-static inline rule_utils::rule make_exact_domain_name_rule(std::string_view name) {
-    rule_utils::rule r{};
-    r.public_part.text = std::string{name};
-    r.match_method = rule_utils::rule::MMID_EXACT;
-    r.matching_parts = {ag::utils::to_lower(name)};
-    return r;
+    tokens parts(str, " \t");
+    tokens::iterator it = parts.begin();
+    if (it == parts.end()) {
+        return false;
+    }
+    std::string_view ip = *it;
+    return ++it != parts.end()
+            && (ag::utils::is_valid_ip4(ip) || ag::utils::is_valid_ip6(ip));
 }
 
 static std::string_view skip_special_chars(std::string_view str) {
@@ -324,45 +411,119 @@ static std::string_view skip_special_chars(std::string_view str) {
 
 }
 
-static std::vector<std::string_view> extract_regex_shortcuts(std::string_view text) {
-    std::vector<std::string_view> shortcuts;
+template <typename F>
+static void extract_regex_shortcuts(std::string_view text, F on_shortcut) {
     while (!text.empty()) {
         size_t seek = text.find_first_of(SPECIAL_REGEX_CHARACTERS);
         if (seek > 0) {
-            shortcuts.emplace_back(text.substr(0, seek));
+            on_shortcut(text.substr(0, seek));
         }
 
         std::string_view tail = text.substr(std::min(text.length(), seek));
         text = skip_special_chars(tail);
     }
+}
 
-    return shortcuts;
+/**
+ * Replace each `<text><open><text><close>` where `<text>` has no backslashes with `<text>...`
+ * (the same as replacing the regex `([^\\]*)\<open>[^\\]*\<close>` with `$1...`: the greedy
+ * match ends at the last closing bracket before a backslash and starts the bracketed part at
+ * the last opening one before it)
+ */
+static void strip_brackets(std::string_view in, char open, char close, std::string &out) {
+    out.clear();
+    size_t p = 0;
+    while (p < in.length()) {
+        size_t e = std::min(in.find('\\', p), in.length());
+        size_t r = in.substr(0, e).rfind(close);
+        size_t k = (r != in.npos && r >= p) ? in.substr(0, r).rfind(open) : in.npos;
+        if (k == in.npos || k < p) {
+            out.append(in.substr(p, e + 1 - p));
+            p = e + 1;
+            continue;
+        }
+        out.append(in.substr(p, k - p));
+        out.append(SPECIAL_CHAR_PLACEHOLDER);
+        p = r + 1;
+    }
 }
 
-std::optional<rule_utils::rule> rule_utils::parse(std::string_view str, ag::logger *log) {
+/**
+ * Replace each `<text><pattern>` where `<text>` has no backslashes with `<text>...`, ignoring case
+ * (the same as replacing the regex `([^\\]*)<pattern>` with `$1...` for a pattern without backslashes)
+ */
+static void strip_text(std::string_view in, std::string_view pattern, std::string &out) {
+    auto equal_caseless = [] (unsigned char l, unsigned char r) {
+        return std::tolower(l) == std::tolower(r);
+    };
+
+    out.clear();
+    size_t p = 0;
+    while (p < in.length()) {
+        size_t e = std::min(in.find('\\', p), in.length());
+        std::string_view run = in.substr(p, e - p);
+        auto found = std::find_end(run.begin(), run.end(), pattern.begin(), pattern.end(), equal_caseless);
+        if (found == run.end()) {
+            out.append(in.substr(p, e + 1 - p));
+            p = e + 1;
+            continue;
+        }
+        size_t k = p + std::distance(run.begin(), found);
+        out.append(in.substr(p, k - p));
+        out.append(SPECIAL_CHAR_PLACEHOLDER);
+        p = k + pattern.length();
+    }
+}
+
+rule_utils::rule rule_utils::rule_view::to_rule() const {
+    rule r = { { 0, std::string(this->text), this->props, std::nullopt }, this->match_method, {} };
+    if (this->ip.has_value()) {
+        r.public_part.ip.emplace(this->ip.value());
+    }
+    r.matching_parts.reserve(this->matching_parts.size());
+    for (std::string_view part : this->matching_parts) {
+        r.matching_parts.emplace_back(part);
+    }
+    return r;
+}
+
+const rule_utils::rule_view *rule_utils::parser::parse(std::string_view str, ag::logger *log) {
+    rule_view &r = this->result;
+    r.text = {};
+    r.props.reset();
+    r.ip.reset();
+    r.match_method = rule::MMID_EXACT;
+    r.matching_parts.clear();
+    // The matching parts are views into the buffer, so it must not reallocate while they
+    // are being added. They are never longer in total than the rule itself, except for
+    // the network address bytes.
+    this->parts.clear();
+    this->parts.reserve(str.length() + ag::ipv6_address_size + 1);
+
     std::string_view orig_str = str;
     if (is_comment(str)) {
-        return std::nullopt;
+        return nullptr;
     }
 
     str = ag::utils::trim(str);
 
     if (str.empty()) {
-        return std::nullopt;
+        return nullptr;
     }
 
     if (is_domain_name(str)) {
-        return make_exact_domain_name_rule(str);
+        r.text = str;
+        r.matching_parts.push_back(append_lower(this->parts, str));
+        return &r;
     }
 
     if (is_host_rule(str)) {
-        return parse_host_file_rule(str, log);
+        return parse_host_file_rule(str, r, this->parts) ? &r : nullptr;
     }
 
-    std::bitset<ag::dnsfilter::RP_NUM> props;
     if (ag::utils::starts_with(str, EXCEPTION_MARKER)) {
         str.remove_prefix(EXCEPTION_MARKER.length());
-        props.set(ag::dnsfilter::RP_EXCEPTION);
+        r.props.set(ag::dnsfilter::RP_EXCEPTION);
     }
 
     std::array<std::string_view, 2> parts = { str, {} };
@@ -375,83 +536,123 @@ std::optional<rule_utils::rule> rule_utils::parse(std::string_view str, ag::logg
     str = info.text;
     if (str.empty() || str.find_first_not_of(".*") == str.npos) {
         ru_dbglog(log, "Too wide rule: {}", str);
-        return std::nullopt;
+        return nullptr;
     }
 
-    if (!info.is_regex_rule && !is_valid_domain_pattern(str) && !is_valid_ip_pattern(str)) {
+    bool is_network = !info.is_regex_rule && parse_network(str, this->parts);
+    if (!info.is_regex_rule && !is_network && !is_valid_domain_pattern(str) && !is_valid_ip_pattern(str)) {
         ru_dbglog(log, "Invalid domain name: {}", str);
-        return std::nullopt;
+        return nullptr;
     }
 
-    if (!extract_modifiers(parts[1], &props, log)) {
-        return std::nullopt;
+    if (!extract_modifiers(parts[1], &r.props, log)) {
+        return nullptr;
     }
 
-    rule r = { { 0, std::string(orig_str), props, std::nullopt }, {}, {} };
-    if (props.test(ag::dnsfilter::RP_BADFILTER)) {
-        return std::make_optional(std::move(r));
+    r.text = orig_str;
+    if (r.props.test(ag::dnsfilter::RP_BADFILTER)) {
+        return &r;
     }
 
     bool exact_pattern = pattern_exact(info.pattern_mode);
     bool subdomains_pattern = pattern_subdomains(info.pattern_mode);
-    ag::socket_address addr{info.text, 0};
-    if (!info.is_regex_rule && exact_pattern && addr.valid()) { // info.text is a valid IP address
-        r.match_method = rule::MMID_EXACT;
-        r.matching_parts.emplace_back(ag::utils::addr_to_str(addr.addr())); // strip port, compress
+    if (is_network) {
+        // an address rule matches exactly the address regardless of the anchors and port
+        // (e.g. `1.2.3.4`, `|1.2.3.4^`, `||1.2.3.4:80^` do not match `1.2.3.45`)
+        r.match_method = rule::MMID_CIDR;
+        r.matching_parts.push_back(this->parts);
     } else if (!info.is_regex_rule && !info.has_wildcard && (exact_pattern || subdomains_pattern)) {
         r.match_method = exact_pattern ? rule::MMID_EXACT : rule::MMID_SUBDOMAINS;
-        r.matching_parts.emplace_back(ag::utils::to_lower(str));
+        r.matching_parts.push_back(append_lower(this->parts, str));
     } else if (!info.is_regex_rule && info.pattern_mode == 0) {
         r.match_method = rule::MMID_SHORTCUTS;
-        std::vector<std::string_view> shortcuts = ag::utils::split_by(str, '*');
-        r.matching_parts.reserve(shortcuts.size());
-        for (const std::string_view &sc : shortcuts) {
-            r.matching_parts.emplace_back(ag::utils::to_lower(sc));
+        for (std::string_view sc : tokens(str, "*")) {
+            r.matching_parts.push_back(append_lower(this->parts, sc));
         }
     } else {
         if (str.find('?') != str.npos) {
             r.match_method = rule::MMID_REGEX;
         } else {
-            #define SPECIAL_CHAR_PLACEHOLDER "..."
-            std::string text(str);
-            for (const ag::regex &re : SHORTCUT_REGEXES) {
-                if (re.is_valid()) {
-                    text = re.replace(text, "$1" SPECIAL_CHAR_PLACEHOLDER);
-                }
+            std::string *text = &this->scratch[0];
+            std::string *tmp = &this->scratch[1];
+            text->assign(str);
+            for (const std::array<char, 2> &brackets : SHORTCUT_BRACKETS) {
+                strip_brackets(*text, brackets[0], brackets[1], *tmp);
+                std::swap(text, tmp);
             }
-
-            std::vector<std::string_view> shortcuts = extract_regex_shortcuts(text);
-            if (shortcuts.size() > 1
-                    || std::string_view::npos != SPECIAL_REGEX_CHARACTERS.find(text.front())
-                    || std::string_view::npos != SPECIAL_REGEX_CHARACTERS.find(text.back())) {
+            strip_text(*text, SHORTCUT_STRIPPED_CLASS, *tmp);
+            std::swap(text, tmp);
+
+            size_t shortcuts_num = 0;
+            extract_regex_shortcuts(*text, [&shortcuts_num] (std::string_view) { ++shortcuts_num; });
+            if (shortcuts_num > 1
+                    || std::string_view::npos != SPECIAL_REGEX_CHARACTERS.find(text->front())
+                    || std::string_view::npos != SPECIAL_REGEX_CHARACTERS.find(text->back())) {
                 r.match_method = rule::MMID_SHORTCUTS_AND_REGEX;
-                r.matching_parts.reserve(shortcuts.size());
-                for (const std::string_view &sc : shortcuts) {
-                    r.matching_parts.emplace_back(ag::utils::to_lower(sc));
-                }
+                extract_regex_shortcuts(*text, [&] (std::string_view sc) {
+                    r.matching_parts.push_back(append_lower(this->parts, sc));
+                });
             } else {
                 r.match_method = rule::MMID_REGEX;
-                r.matching_parts.emplace_back(ag::utils::to_lower(str));
+                r.matching_parts.push_back(append_lower(this->parts, str));
             }
         }
 
         std::string re = rule_utils::get_regex(r);
-        if (!ag::regex(re).is_valid()) {
+        if (!ag::regex(re, PCRE2_CASELESS, false).is_valid()) {
             ru_dbglog(log, "Invalid regex: {}", re);
-            return std::nullopt;
+            return nullptr;
         }
     }
 
-    return std::make_optional(std::move(r));
+    return &r;
 }
 
-std::string rule_utils::get_regex(const rule &r) {
-    assert(r.match_method == rule::MMID_REGEX || r.match_method == rule::MMID_SHORTCUTS_AND_REGEX);
+std::optional<rule_utils::rule> rule_utils::parse(std::string_view str, ag::logger *log) {
+    static thread_local parser p;
+    const rule_view *r = p.parse(str, log);
+    if (r == nullptr) {
+        return std::nullopt;
+    }
+    return r->to_rule();
+}
+
+std::optional<std::vector<std::string>> rule_utils::get_address_pattern(const rule &r) {
+    if (r.match_method == rule::MMID_CIDR || r.public_part.ip.has_value()
+            || r.public_part.props.test(ag::dnsfilter::RP_BADFILTER)) {
+        return std::nullopt;
+    }
 
     std::string_view text = r.public_part.text;
     if (ag::utils::starts_with(text, EXCEPTION_MARKER)) {
         text.remove_prefix(EXCEPTION_MARKER.length());
     }
+    if (check_regex(text)) {
+        // the shortcuts of a regex rule are its parts (a regex without shortcuts has no pattern,
+        // it is found by the leftovers prefilter instead)
+        bool address_parts = !r.matching_parts.empty()
+                && std::all_of(r.matching_parts.begin(), r.matching_parts.end(), [] (const std::string &part) {
+                    return part.find_first_not_of("0123456789abcdef.:") == part.npos;
+                });
+        return address_parts ? std::make_optional(r.matching_parts) : std::nullopt;
+    }
+    match_info info = extract_match_info(ag::utils::rsplit2_by(text, MODIFIERS_MARKER)[0]);
+    // an address text consists of hex digits, dots and colons only
+    if (info.text.empty() || info.text.find_first_not_of("0123456789abcdefABCDEF.:*") != info.text.npos) {
+        return std::nullopt;
+    }
+
+    std::vector<std::string> parts;
+    for (std::string_view part : ag::utils::split_by(info.text, '*')) {
+        parts.emplace_back(ag::utils::to_lower(part));
+    }
+    return parts;
+}
+
+static std::string make_regex(std::string_view text) {
+    if (ag::utils::starts_with(text, EXCEPTION_MARKER)) {
+        text.remove_prefix(EXCEPTION_MARKER.length());
+    }
 
     if (text.front() != '/' || text.back() != '/') {
         std::array<std::string_view, 2> parts = ag::utils::rsplit2_by(text, MODIFIERS_MARKER);
@@ -493,11 +694,28 @@ std::string rule_utils::get_regex(const rule &r) {
     return re;
 }
 
+std::string rule_utils::get_regex(const rule &r) {
+    assert(r.match_method == rule::MMID_REGEX || r.match_method == rule::MMID_SHORTCUTS_AND_REGEX);
+    return make_regex(r.public_part.text);
+}
+
+std::string rule_utils::get_regex(const rule_view &r) {
+    assert(r.match_method == rule::MMID_REGEX || r.match_method == rule::MMID_SHORTCUTS_AND_REGEX);
+    return make_regex(r.text);
+}
+
 std::string rule_utils::get_text_without_badfilter(const ag::dnsfilter::rule &r) {
+    return get_text_without_badfilter(std::string_view(r.text));
+}
+
+std::string rule_utils::get_text_without_badfilter(std::string_view text) {
     constexpr std::string_view BADFILTER_MODIFIER = "badfilter";
 
-    std::array<std::string_view, 2> parts = ag::utils::rsplit2_by(r.text, MODIFIERS_MARKER);
+    std::array<std::string_view, 2> parts = ag::utils::rsplit2_by(text, MODIFIERS_MARKER);
     size_t bf_pos = parts[1].find(BADFILTER_MODIFIER.data());
+    if (bf_pos == std::string_view::npos) {
+        return std::string(text);
+    }
     size_t after_bf_pos = bf_pos + BADFILTER_MODIFIER.length();
 
     std::string_view prefix = { parts[0].data(), parts[0].length() + 1 + bf_pos };
@@ -1,7 +1,10 @@
 #pragma once
 
 
+#include <array>
+#include <string>
 #include <string_view>
+#include <vector>
 #include <ag_logger.h>
 #include <dnsfilter.h>
 
@@ -27,7 +30,12 @@ namespace rule_utils {
                                       // some shortcuts will be extracted from a rule (e.g.
                                       // `/exampl.*\.com/` -> { `exampl`, `.com` }), and if a domain
                                       // contains these shortcuts in corresponding order and matches
-                                      // the regex, it is matched against the rule
+                                      // the regex, it is matched against the rule (a regex like
+                                      // `/^\d+\./` has no shortcuts, then only the regex is applied)
+            MMID_CIDR, // an IP address is matched against such rule, if it belongs to the network
+                       // (e.g. `10.0.0.0/8`, or `||1.2.3.4^` as a single address network), the only
+                       // item of `matching_parts` is the network address bytes followed by the prefix
+                       // length byte
         };
 
         // public part of rule structure (see `ag::dnsfilter::rule`)
@@ -39,6 +47,80 @@ namespace rule_utils {
     };
 
 
+    /**
+     * Vector which keeps up to `N` elements in place and moves them to the heap only if
+     * there are more of them. Once the heap storage has grown, `clear` keeps it, so refilling
+     * the container does not allocate memory.
+     */
+    template <typename T, size_t N>
+    class small_vector {
+    public:
+        void push_back(const T &x) {
+            if (this->num < N) {
+                this->local[this->num] = x;
+            } else {
+                if (this->num == N) {
+                    this->heap.assign(this->local.begin(), this->local.end());
+                }
+                this->heap.push_back(x);
+            }
+            ++this->num;
+        }
+        void clear() {
+            this->num = 0;
+            this->heap.clear();
+        }
+        size_t size() const { return this->num; }
+        bool empty() const { return this->num == 0; }
+        const T *begin() const { return (this->num <= N) ? this->local.data() : this->heap.data(); }
+        const T *end() const { return this->begin() + this->num; }
+        const T &operator[](size_t i) const { return this->begin()[i]; }
+
+    private:
+        std::array<T, N> local;
+        std::vector<T> heap;
+        size_t num = 0;
+    };
+
+    /**
+     * Parsed rule which refers to the parsed text and the parser buffers instead of owning
+     * its strings (see `rule` for the meaning of the fields)
+     */
+    struct rule_view {
+        std::string_view text;
+        std::bitset<ag::dnsfilter::RP_NUM> props;
+        std::optional<std::string_view> ip;
+        rule::match_method_id match_method;
+        small_vector<std::string_view, 4> matching_parts;
+
+        /**
+         * Make a rule owning copies of the strings
+         */
+        rule to_rule() const;
+    };
+
+    /**
+     * Rule parser which keeps its buffers between the calls, so once they have grown,
+     * parsing a rule does not allocate memory (except compiling the regex of a regex rule
+     * to check its validity)
+     */
+    class parser {
+    public:
+        /**
+         * Parse rule from given string (see `rule_utils::parse`)
+         * @param[in]  str   input string
+         * @param[in]  log   logger (if null, rule parsing errors won't be logged)
+         * @return     A rule valid until the next call, if parsed successfully,
+         *             null otherwise
+         */
+        const rule_view *parse(std::string_view str, ag::logger *log = nullptr);
+
+    private:
+        rule_view result;
+        std::string parts; // matching parts of the result
+        std::array<std::string, 2> scratch; // regex text with the shortcut patterns stripped
+    };
+
     /**
      * Check if string is a commentary
      */
@@ -55,6 +137,18 @@ namespace rule_utils {
      */
     std::optional<rule> parse(std::string_view str, ag::logger *log = nullptr);
 
+    /**
+     * Get the parts an IP address text must contain in their order to match the rule,
+     * e.g. { `172.16.`, `.1` } for `172.16.*.1`, or { `192`, `168` } for `/^192\.168\./`
+     * @param[in]  r     rule
+     * @return     The parts if the rule may match an IP address text (the address and network
+     *             rules are matched by the address itself, the hosts file syntax rules are not
+     *             considered to match addresses, and a regex rule may match one only if its
+     *             shortcuts may occur in an address text),
+     *             nullopt otherwise
+     */
+    std::optional<std::vector<std::string>> get_address_pattern(const rule &r);
+
     /**
      * Extract a regular expression text from rule
      * @param[in]  r     rule
@@ -62,6 +156,13 @@ namespace rule_utils {
      */
     std::string get_regex(const rule &r);
 
+    /**
+     * Extract a regular expression text from rule
+     * @param[in]  r     rule
+     * @return     Regular expression text
+     */
+    std::string get_regex(const rule_view &r);
+
     /**
      * Generate the rule text without badfilter modifier
      * @param[in]  r     rule
@@ -69,4 +170,11 @@ namespace rule_utils {
      */
     std::string get_text_without_badfilter(const ag::dnsfilter::rule &r);
 
+    /**
+     * Generate the rule text without badfilter modifier
+     * @param[in]  text  text of the rule
+     * @return     Text without badfilter modifier (the text itself if the rule has no such modifier)
+     */
+    std::string get_text_without_badfilter(std::string_view text);
+
 } // namespace rule_utils
@@ -2,17 +2,27 @@
 #include <cstdarg>
 #include <string_view>
 #include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
 #include <ag_utils.h>
 #include <ag_file.h>
 #include <ag_logger.h>
 #include <ag_sys.h>
+#include <ag_regex.h>
 #include <dnsfilter.h>
+#include <rule_utils.h>
+#include <spdlog/sinks/stdout_sinks.h>
 
 #undef max // `nanoseconds::max()` conflicts with `max` macro from `minwindef.h` on Windows
 #include <chrono>
 
 #define DEFAULT_FILTER_PATH "./bench_filter.txt"
 #define DEFAULT_DOMAINS_BASE_PATH "./bench_domains.txt"
+#define DEFAULT_RULES_MIX "hosts=20,adblock=70,wildcard=7,regex=2,badfilter=1"
 
 #define FAIL_WITH_MSG(msg, ...) SPDLOG_ERROR(msg, ##__VA_ARGS__); exit(1)
 
@@ -23,7 +33,212 @@
 using time_point = std::chrono::time_point<std::chrono::steady_clock>;
 using nanoseconds = std::chrono::nanoseconds;
 
+// Synthetic filter lists and queries
+// The generator does not use the standard distributions, as their results differ between
+// the standard library implementations, so a seed gives the same lists everywhere
+
+enum rule_kind {
+    RK_HOSTS, // `0.0.0.0 example.org`
+    RK_ADBLOCK, // `||example.org^`, some are exceptions or important
+    RK_WILDCARD, // `||ads*.example.org^`, `*tracker12*`
+    RK_REGEX, // `/^ads[0-9]+\.example\.org$/`
+    RK_BADFILTER, // one of the adblock or wildcard rules generated before with `$badfilter`
+    RK_NUM
+};
+
+static constexpr std::string_view RULE_KIND_NAMES[] = { "hosts", "adblock", "wildcard", "regex", "badfilter" };
+static_assert(std::size(RULE_KIND_NAMES) == RK_NUM);
+
+static constexpr std::string_view TLDS[] = { "com", "com", "com", "net", "org", "ru", "de", "io", "co.uk", "info" };
+static constexpr std::string_view AD_WORDS[] = {
+    "ads", "adserver", "analytics", "banner", "beacon", "click", "counter", "metrics", "pixel", "promo",
+    "stats", "telemetry", "track", "tracker",
+};
+static constexpr std::string_view SUBDOMAINS[] = { "www", "cdn", "api", "static", "img", "m" };
+
 typedef struct {
+    size_t lists;
+    size_t rules_per_list;
+    double mix[RK_NUM]; // weights of the rule kinds
+    size_t queries;
+    double zipf_exponent;
+    uint64_t seed;
+} generator_params_t;
+
+// splitmix64
+class random_gen {
+public:
+    explicit random_gen(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (this->state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+
+    // the bias is negligible for the small bounds the generator uses
+    size_t below(size_t n) { return next() % n; }
+
+    // in [0, 1)
+    double uniform() { return (next() >> 11) * (1.0 / (UINT64_C(1) << 53)); }
+
+    template <typename T, size_t N>
+    const T &pick(const T (&items)[N]) { return items[below(N)]; }
+
+private:
+    uint64_t state;
+};
+
+static bool parse_rules_mix(std::string_view str, double (&mix)[RK_NUM]) {
+    std::fill(std::begin(mix), std::end(mix), 0.0);
+    for (std::string_view item : ag::utils::split_by(str, ',')) {
+        std::array<std::string_view, 2> kv = ag::utils::split2_by(item, '=');
+        auto kind = std::find(std::begin(RULE_KIND_NAMES), std::end(RULE_KIND_NAMES), kv[0]);
+        if (kind == std::end(RULE_KIND_NAMES) || kv[1].empty()) {
+            return false;
+        }
+        mix[kind - std::begin(RULE_KIND_NAMES)] = strtod(std::string(kv[1]).c_str(), nullptr);
+    }
+    return std::any_of(std::begin(mix), std::end(mix), [] (double w) { return w > 0; });
+}
+
+static std::string make_label(random_gen &rng) {
+    static constexpr std::string_view CONSONANTS = "bcdfghklmnprstvz";
+    static constexpr std::string_view VOWELS = "aeiou";
+    std::string label;
+    for (size_t i = 0, n = 2 + rng.below(3); i < n; ++i) {
+        label += CONSONANTS[rng.below(CONSONANTS.size())];
+        label += VOWELS[rng.below(VOWELS.size())];
+    }
+    if (rng.below(5) == 0) {
+        label += std::to_string(rng.below(100));
+    }
+    return label;
+}
+
+static std::string make_domain(random_gen &rng) {
+    return AG_FMT("{}.{}", make_label(rng), rng.pick(TLDS));
+}
+
+static std::string escape_dots(std::string_view domain) {
+    std::string escaped;
+    for (char c : domain) {
+        if (c == '.') {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+/**
+ * Generate filter lists and queries
+ * @param p       generator parameters
+ * @param lists   generated lists
+ * @param queries generated queries, Zipf-distributed over the domains matching the rules
+ *                and the same number of random domains
+ */
+static void generate(const generator_params_t &p, std::vector<std::string> &lists, std::vector<std::string> &queries) {
+    random_gen rng(p.seed);
+    double mix_sum = 0;
+    for (double w : p.mix) {
+        mix_sum += w;
+    }
+
+    std::vector<std::string> badfilter_targets;
+    std::vector<std::string> matching_domains; // a domain matching each rule
+    lists.assign(p.lists, {});
+    for (std::string &list : lists) {
+        for (size_t i = 0; i < p.rules_per_list; ++i) {
+            double r = rng.uniform() * mix_sum;
+            size_t kind = 0;
+            while (kind < RK_NUM - 1 && r >= p.mix[kind]) {
+                r -= p.mix[kind++];
+            }
+            if (kind == RK_BADFILTER && badfilter_targets.empty()) {
+                kind = RK_ADBLOCK;
+            }
+
+            std::string domain = make_domain(rng);
+            std::string rule;
+            switch (kind) {
+            case RK_HOSTS:
+                rule = AG_FMT("{} {}", (rng.below(4) == 0) ? "127.0.0.1" : "0.0.0.0", domain);
+                matching_domains.push_back(domain);
+                break;
+            case RK_ADBLOCK:
+                rule = AG_FMT("{}||{}^{}", (rng.below(20) == 0) ? "@@" : "", domain,
+                    (rng.below(30) == 0) ? "$important" : "");
+                badfilter_targets.push_back(rule);
+                matching_domains.push_back((rng.below(2) == 0) ? domain : AG_FMT("{}.{}", rng.pick(SUBDOMAINS), domain));
+                break;
+            case RK_WILDCARD: {
+                std::string_view word = rng.pick(AD_WORDS);
+                if (rng.below(2) == 0) {
+                    rule = AG_FMT("||{}*.{}^", word, domain);
+                    matching_domains.push_back(AG_FMT("{}{}.{}", word, rng.below(10), domain));
+                } else {
+                    size_t n = rng.below(100000);
+                    rule = AG_FMT("*{}{}*", word, n);
+                    matching_domains.push_back(AG_FMT("{}{}.{}", word, n, domain));
+                }
+                badfilter_targets.push_back(rule);
+                break;
+            }
+            case RK_REGEX: {
+                std::string_view word = rng.pick(AD_WORDS);
+                rule = AG_FMT("/^{}[0-9]+\\.{}$/", word, escape_dots(domain));
+                matching_domains.push_back(AG_FMT("{}{}.{}", word, rng.below(1000), domain));
+                break;
+            }
+            case RK_BADFILTER: {
+                const std::string &target = badfilter_targets[rng.below(badfilter_targets.size())];
+                rule = target + ((target.find('$') != std::string::npos) ? ",badfilter" : "$badfilter");
+                break;
+            }
+            }
+            list += rule;
+            list += '\n';
+        }
+    }
+
+    // the ranks of the domains are shuffled, so the popular ones are both matching and not
+    std::vector<std::string> universe = std::move(matching_domains);
+    for (size_t i = 0, n = universe.size(); i < n; ++i) {
+        universe.push_back(make_domain(rng));
+    }
+    for (size_t i = universe.size(); i > 1; --i) {
+        std::swap(universe[i - 1], universe[rng.below(i)]);
+    }
+    if (universe.empty()) {
+        universe.push_back(make_domain(rng));
+    }
+
+    std::vector<double> cdf(universe.size());
+    double sum = 0;
+    for (size_t i = 0; i < universe.size(); ++i) {
+        sum += 1.0 / std::pow(i + 1, p.zipf_exponent);
+        cdf[i] = sum;
+    }
+    queries.clear();
+    queries.reserve(p.queries);
+    for (size_t i = 0; i < p.queries; ++i) {
+        size_t rank = std::lower_bound(cdf.begin(), cdf.end(), rng.uniform() * sum) - cdf.begin();
+        queries.push_back(universe[std::min(rank, universe.size() - 1)]);
+    }
+}
+
+typedef struct {
+    size_t filter_lists;
+    bool merged_tables;
+    bool deduplicated_rules;
+    bool fingerprint_tables;
+    bool domain_trie;
+    bool resident_rules;
+    bool use_context;
+    std::optional<generator_params_t> generator; // nullopt if the lists are read from the files
+
     struct {
         time_point start_ts;
         time_point end_ts;
@@ -33,13 +248,14 @@ typedef struct {
 
     struct {
         size_t tries;
+        size_t threads;
         size_t total_matches;
         size_t effective_blocking_matches;
         size_t effective_exception_matches;
         time_point start_ts;
         time_point end_ts;
-        nanoseconds min_per_domain;
-        nanoseconds max_per_domain;
+        std::vector<uint64_t> latencies; // of each try in nanoseconds, sorted
+        ag::dnsfilter::match_cache_stats cache_stats;
         int start_rss;
         int end_rss;
     } match_domains;
@@ -59,8 +275,44 @@ static constexpr std::string_view HELP_MESSAGE =
     "Usage: dnsfilter_benchmark [options...]\n"
     "\n"
     "    -h           print this message\n"
-    "    -f <path>    path to filter list file (default='" DEFAULT_FILTER_PATH "')\n"
-    "    -d <path>    path to domains list file (default='" DEFAULT_DOMAINS_BASE_PATH "')\n";
+    "    -f <path>    path to filter list file (default='" DEFAULT_FILTER_PATH "'), may be specified\n"
+    "                 several times to load several lists\n"
+    "    -d <path>    path to domains list file (default='" DEFAULT_DOMAINS_BASE_PATH "')\n"
+    "    -c <path>    directory for the compiled filter images (the first run creates the image,\n"
+    "                 the next ones load the filter from it)\n"
+    "    -t <num>     number of threads to load the filter with (default=0, i.e. the number of CPU cores)\n"
+    "    -k <num>     cache the match results of up to <num> domains (default=0, i.e. no caching)\n"
+    "    -p <num>     number of threads matching the domains concurrently with the same filter (default=1)\n"
+    "    -H <num>     count the rule hits, and report the <num> most matched rules and the candidates\n"
+    "                 of each lookup table after matching (default=0, i.e. no counting)\n"
+    "    -m           keep the rules in memory instead of reading them from the filter files on matching\n"
+    "    -b           read the filter lists into memory buffers, and load the filters from the buffers\n"
+    "                 (so matching reads the rules from the buffers instead of the filter files)\n"
+    "    -x           match with a reusable context, which does not copy the matched rules out\n"
+    "    -w           look the domains up by 64-bit fingerprints instead of 32-bit hashes behind\n"
+    "                 a Bloom filter (to compare the memory and the matching time of the layouts)\n"
+    "    -e           look the exact domain and subdomain rules up in a trie of the domain labels\n"
+    "                 instead of the hash tables\n"
+    "    -s           keep separate lookup tables for each filter list instead of merging them\n"
+    "                 into a single index (to compare the matching time)\n"
+    "    -u           look up and match the rules found in several filter lists only once\n"
+    "                 (to compare the memory of overlapping lists)\n"
+    "    -r           measure matching the domains against the regex rules of the filter list\n"
+    "                 with the interpreter and with the JIT-compiled regexes instead of\n"
+    "                 running the whole filtering engine\n"
+    "    -P           measure parsing the rules of the filter lists (both owning rules and views\n"
+    "                 into a reusable parser) instead of running the whole filtering engine\n"
+    "    -J <path>    write the results in JSON to the file ('-' means the standard output),\n"
+    "                 to compare the runs of different library versions\n"
+    "\n"
+    "Synthetic lists (the same seed gives the same lists and queries on any platform):\n"
+    "    -g <num>     generate <num> rules for each filter list instead of reading the lists given by -f\n"
+    "                 (the lists are loaded from memory)\n"
+    "    -l <num>     number of the generated filter lists (default=1)\n"
+    "    -M <mix>     weights of the generated rule kinds (default='" DEFAULT_RULES_MIX "')\n"
+    "    -q <num>     number of the generated queries, which are used unless -d is given (default=100000)\n"
+    "    -z <s>       exponent of the Zipf distribution of the generated queries (default=1.0)\n"
+    "    -S <seed>    seed of the generator (default=1)\n";
 
 
 static std::vector<std::string> domains;
@@ -86,90 +338,383 @@ static int parse_domains_base(std::string_view path) {
     return 0;
 }
 
-static int apply_filter_to_base(test_result_t *tr, ag::dnsfilter *filter, ag::dnsfilter::handle handle) {
-    time_point before = {};
-    time_point after = {};
-    nanoseconds elapsed = {};
-    nanoseconds min_elapsed = nanoseconds::max();
-    nanoseconds max_elapsed = {};
+static bool add_regex(uint32_t idx, std::string_view line, void *arg) {
+    std::optional<rule_utils::rule> rule = rule_utils::parse(line);
+    if (rule.has_value() && !rule->public_part.props.test(ag::dnsfilter::RP_BADFILTER)
+            && (rule->match_method == rule_utils::rule::MMID_REGEX
+                || rule->match_method == rule_utils::rule::MMID_SHORTCUTS_AND_REGEX)) {
+        auto *regexes = (std::vector<std::string> *)arg;
+        regexes->emplace_back(rule_utils::get_regex(rule.value()));
+    }
+    return true;
+}
 
-    TICK(tr->match_domains.start_ts);
+static void report_hit_stats(const ag::dnsfilter::hit_stats &stats) {
+    static constexpr std::string_view TABLE_NAMES[] =
+        { "addresses", "domains", "shortcuts", "leftovers", "address patterns" };
+    static_assert(std::size(TABLE_NAMES) == ag::dnsfilter::MT_NUM);
+
+    SPDLOG_INFO("Rule hits:");
+    SPDLOG_INFO("\tCandidates checked/matched:  {}/{}", stats.candidates, stats.matched);
+    for (size_t t = 0; t < ag::dnsfilter::MT_NUM; ++t) {
+        ag::dnsfilter::table_hits total = {};
+        for (const ag::dnsfilter::filter_hit_stats &f : stats.filters) {
+            total.candidates += f.tables[t].candidates;
+            total.matched += f.tables[t].matched;
+        }
+        SPDLOG_INFO("\t\t{}: {}/{}", TABLE_NAMES[t], total.candidates, total.matched);
+    }
+    SPDLOG_INFO("\tMost matched rules:");
+    for (const ag::dnsfilter::rule_hits &r : stats.top_rules) {
+        SPDLOG_INFO("\t\t{} (filter {}): {}", r.text, r.filter_id, r.hits);
+    }
+}
 
-    size_t domains_num = domains.size();
-    size_t report_step = domains_num / 10;
+static int run_regex_benchmark(std::string_view filter_list_path) {
+    std::vector<std::string> regex_texts;
+    ag::file::handle file = ag::file::open(filter_list_path, ag::file::RDONLY);
+    if (!ag::file::is_valid(file)) {
+        SPDLOG_ERROR("failed to read file: {} ({})",
+            filter_list_path, ag::sys::error_string(ag::sys::error_code()));
+        return -1;
+    }
+    ag::file::for_each_line(file, &add_regex, &regex_texts);
+    ag::file::close(file);
 
-    for (size_t i = 0; i < domains_num; ++i) {
-        TICK(before);
-        std::vector<ag::dnsfilter::rule> rules = filter->match(handle, domains[i]);
-        std::vector<const ag::dnsfilter::rule *> effective_rules = ag::dnsfilter::get_effective_rules(rules);
-        TICK(after);
+    SPDLOG_INFO("============================================");
+    SPDLOG_INFO("Regex rules:                  {}", regex_texts.size());
+    SPDLOG_INFO("Domains:                      {}", domains.size());
+    for (bool jit : { false, true }) {
+        time_point start_ts = {};
+        time_point end_ts = {};
+
+        TICK(start_ts);
+        std::vector<ag::regex> regexes;
+        regexes.reserve(regex_texts.size());
+        size_t jit_compiled = 0;
+        for (const std::string &text : regex_texts) {
+            const ag::regex &re = regexes.emplace_back(text, PCRE2_CASELESS, jit);
+            jit_compiled += re.is_jit_compiled();
+        }
+        TICK(end_ts);
+        std::chrono::duration compile_elapsed = std::chrono::duration<double, std::ratio<1>>(end_ts - start_ts);
+
+        size_t matches = 0;
+        TICK(start_ts);
+        for (const std::string &domain : domains) {
+            for (const ag::regex &re : regexes) {
+                matches += re.match(domain);
+            }
+        }
+        TICK(end_ts);
+        std::chrono::duration match_elapsed = std::chrono::duration<double, std::ratio<1>>(end_ts - start_ts);
+
+        SPDLOG_INFO("{}:", jit ? "JIT" : "Interpreter");
+        SPDLOG_INFO("\tJIT-compiled regexes:       {}", jit_compiled);
+        SPDLOG_INFO("\tCompilation time elapsed:   {}s", compile_elapsed.count());
+        SPDLOG_INFO("\tMatching time elapsed:      {}s", match_elapsed.count());
+        SPDLOG_INFO("\tAverage per-domain:         {}ns",
+            domains.empty() ? 0 : uint64_t(match_elapsed.count() * std::nano::den / domains.size()));
+        SPDLOG_INFO("\tTotal matches:              {}", matches);
+    }
+    SPDLOG_INFO("============================================");
 
-        tr->match_domains.total_matches += rules.size();
+    return 0;
+}
 
-        if (!effective_rules.empty()) {
-            if (!effective_rules[0]->props.test(ag::dnsfilter::RP_EXCEPTION)) {
-                ++tr->match_domains.effective_blocking_matches;
+static bool add_line(uint32_t idx, std::string_view line, void *arg) {
+    ((std::vector<std::string> *)arg)->emplace_back(line);
+    return true;
+}
+
+static int run_parse_benchmark(const std::vector<std::string> &lines) {
+    SPDLOG_INFO("============================================");
+    SPDLOG_INFO("Lines:                        {}", lines.size());
+    for (bool views : { false, true }) {
+        time_point start_ts = {};
+        time_point end_ts = {};
+
+        rule_utils::parser parser;
+        size_t parsed = 0;
+        TICK(start_ts);
+        for (const std::string &line : lines) {
+            if (views) {
+                parsed += parser.parse(line) != nullptr;
             } else {
-                ++tr->match_domains.effective_exception_matches;
+                parsed += rule_utils::parse(line).has_value();
             }
         }
+        TICK(end_ts);
+        std::chrono::duration elapsed = std::chrono::duration<double, std::ratio<1>>(end_ts - start_ts);
+
+        SPDLOG_INFO("{}:", views ? "Rule views" : "Rules");
+        SPDLOG_INFO("\tParsed rules:               {}", parsed);
+        SPDLOG_INFO("\tTime elapsed:               {}s", elapsed.count());
+        SPDLOG_INFO("\tThroughput:                 {} lines/s",
+            elapsed.count() > 0 ? uint64_t(lines.size() / elapsed.count()) : 0);
+    }
+    SPDLOG_INFO("============================================");
 
-        elapsed = std::chrono::duration_cast<nanoseconds>(after - before);
-        if (elapsed.count() != 0) {
-            if (elapsed < min_elapsed) {
-                min_elapsed = elapsed;
-            } else if (elapsed > max_elapsed) {
-                max_elapsed = elapsed;
-            }
+    return 0;
+}
+
+typedef struct {
+    size_t total_matches;
+    size_t effective_blocking_matches;
+    size_t effective_exception_matches;
+    std::vector<uint64_t> latencies;
+} match_counters_t;
+
+template <typename R>
+static void count_matches(match_counters_t *counters, const std::vector<R> &rules) {
+    std::vector<const R *> effective_rules = ag::dnsfilter::get_effective_rules(rules);
+
+    counters->total_matches += rules.size();
+
+    if (!effective_rules.empty()) {
+        if (!effective_rules[0]->props.test(ag::dnsfilter::RP_EXCEPTION)) {
+            ++counters->effective_blocking_matches;
+        } else {
+            ++counters->effective_exception_matches;
         }
+    }
+}
+
+// Match the domains `thread`, `thread + threads_num`, ... (the first thread reports the progress)
+static void match_domains_share(ag::dnsfilter *filter, ag::dnsfilter::handle handle, bool use_context,
+        size_t thread, size_t threads_num, match_counters_t *counters) {
+    time_point before = {};
+    time_point after = {};
 
-        if (i % report_step == 0 && i != 0) {
+    size_t domains_num = domains.size();
+    size_t report_step = std::max(domains_num / 10, (size_t)1);
+    ag::dnsfilter::match_context ctx;
+    counters->latencies.reserve(domains_num / threads_num + 1);
+
+    for (size_t i = thread; i < domains_num; i += threads_num) {
+        TICK(before);
+        if (use_context) {
+            count_matches(counters, filter->match(handle, domains[i], ctx));
+        } else {
+            count_matches(counters, filter->match(handle, domains[i]));
+        }
+        TICK(after);
+        counters->latencies.push_back(std::chrono::duration_cast<nanoseconds>(after - before).count());
+
+        if (thread == 0 && i % report_step < threads_num && i != 0) {
             SPDLOG_INFO("matched {} domains", i);
         }
     }
+}
+
+static int apply_filter_to_base(test_result_t *tr, ag::dnsfilter *filter, ag::dnsfilter::handle handle,
+        bool use_context, size_t threads_num) {
+    std::vector<match_counters_t> counters(threads_num);
 
+    TICK(tr->match_domains.start_ts);
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < threads_num; ++i) {
+        threads.emplace_back(match_domains_share, filter, handle, use_context, i, threads_num, &counters[i]);
+    }
+    match_domains_share(filter, handle, use_context, 0, threads_num, &counters[0]);
+    for (std::thread &t : threads) {
+        t.join();
+    }
     TICK(tr->match_domains.end_ts);
 
-    tr->match_domains.min_per_domain = min_elapsed;
-    tr->match_domains.max_per_domain = max_elapsed;
+    tr->match_domains.threads = threads_num;
+    tr->match_domains.cache_stats = filter->get_match_cache_stats(handle);
+    std::vector<uint64_t> &latencies = tr->match_domains.latencies;
+    for (match_counters_t &c : counters) {
+        tr->match_domains.total_matches += c.total_matches;
+        tr->match_domains.effective_blocking_matches += c.effective_blocking_matches;
+        tr->match_domains.effective_exception_matches += c.effective_exception_matches;
+        latencies.insert(latencies.end(), c.latencies.begin(), c.latencies.end());
+    }
+    std::sort(latencies.begin(), latencies.end());
 
     return 0;
 }
 
+static constexpr std::pair<std::string_view, double> PERCENTILES[] = {
+    { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p99.9", 0.999 },
+};
+
+// Nearest-rank percentile of the sorted latencies
+static uint64_t percentile(const std::vector<uint64_t> &latencies, double q) {
+    if (latencies.empty()) {
+        return 0;
+    }
+    size_t rank = std::ceil(q * latencies.size());
+    return latencies[std::clamp(rank, (size_t)1, latencies.size()) - 1];
+}
+
+static uint64_t average(const std::vector<uint64_t> &latencies) {
+    uint64_t sum = 0;
+    for (uint64_t l : latencies) {
+        sum += l;
+    }
+    return latencies.empty() ? 0 : sum / latencies.size();
+}
+
+// Number of latencies in the power-of-2 ranges: the bucket `i` counts the ones in [2^i, 2^(i+1)) ns
+static std::vector<size_t> make_histogram(const std::vector<uint64_t> &latencies) {
+    std::vector<size_t> buckets;
+    for (uint64_t l : latencies) {
+        size_t i = 0;
+        while ((l >> (i + 1)) != 0) {
+            ++i;
+        }
+        if (buckets.size() <= i) {
+            buckets.resize(i + 1);
+        }
+        ++buckets[i];
+    }
+    return buckets;
+}
+
+static double seconds(time_point start, time_point end) {
+    return std::chrono::duration<double, std::ratio<1>>(end - start).count();
+}
+
+static std::string_view domain_keys_name(const test_result_t *result) {
+    return result->domain_trie ? "labels trie" : result->fingerprint_tables ? "64-bit fingerprints" : "32-bit hashes";
+}
+
 static void report_results(const test_result_t *result) {
     SPDLOG_INFO("============================================");
+    SPDLOG_INFO("Filter lists:                 {} ({} lookup tables{})", result->filter_lists,
+        result->merged_tables ? "merged" : "separate", result->deduplicated_rules ? ", deduplicated rules" : "");
+    SPDLOG_INFO("Domain keys:                  {}", domain_keys_name(result));
+    if (result->generator.has_value()) {
+        const generator_params_t &g = result->generator.value();
+        std::string mix;
+        for (size_t i = 0; i < RK_NUM; ++i) {
+            mix += AG_FMT("{}{}={}", mix.empty() ? "" : ",", RULE_KIND_NAMES[i], g.mix[i]);
+        }
+        SPDLOG_INFO("Generated lists:              {} rules each ({}), seed {}", g.rules_per_list, mix, g.seed);
+    }
     SPDLOG_INFO("Load rules measurements:");
-    std::chrono::duration elapsed = std::chrono::duration<double, std::ratio<1>>(result->load_rules.end_ts - result->load_rules.start_ts);
-    SPDLOG_INFO("\tTime elapsed:               {}s", elapsed.count());
+    SPDLOG_INFO("\tTime elapsed:               {}s", seconds(result->load_rules.start_ts, result->load_rules.end_ts));
     SPDLOG_INFO("\tRSS before:                 {}kB", result->load_rules.start_rss);
     SPDLOG_INFO("\tRSS after:                  {}kB", result->load_rules.end_rss);
     SPDLOG_INFO("\tRSS diff:                   {}kB", result->load_rules.end_rss - result->load_rules.start_rss);
     SPDLOG_INFO("Match domains measurements:");
     SPDLOG_INFO("\tTotal tries:                {}", result->match_domains.tries);
+    SPDLOG_INFO("\tThreads:                    {}", result->match_domains.threads);
     SPDLOG_INFO("\tTotal rules matched:        {}", result->match_domains.total_matches);
     SPDLOG_INFO("\tEffective blocking rules:   {}", result->match_domains.effective_blocking_matches);
     SPDLOG_INFO("\tEffective exception rules:  {}", result->match_domains.effective_exception_matches);
-    elapsed = std::chrono::duration<double, std::ratio<1>>(result->match_domains.end_ts - result->match_domains.start_ts);
-    SPDLOG_INFO("\tTime elapsed:               {}s", elapsed.count());
-    SPDLOG_INFO("\tMin per-domain:             {}ns", result->match_domains.min_per_domain.count());
-    SPDLOG_INFO("\tMax per-domain:             {}ns", result->match_domains.max_per_domain.count());
-    SPDLOG_INFO("\tAverage per-domain:         {}ns", uint64_t(elapsed.count() * std::nano::den / result->match_domains.tries));
+    double elapsed = seconds(result->match_domains.start_ts, result->match_domains.end_ts);
+    SPDLOG_INFO("\tTime elapsed:               {}s", elapsed);
+    SPDLOG_INFO("\tThroughput:                 {} domains/s", uint64_t(result->match_domains.tries / elapsed));
+    SPDLOG_INFO("\tCache hits/misses:          {}/{}", result->match_domains.cache_stats.hits,
+        result->match_domains.cache_stats.misses);
+    const std::vector<uint64_t> &latencies = result->match_domains.latencies;
+    SPDLOG_INFO("\tMin per-domain:             {}ns", latencies.empty() ? 0 : latencies.front());
+    SPDLOG_INFO("\tMax per-domain:             {}ns", latencies.empty() ? 0 : latencies.back());
+    SPDLOG_INFO("\tAverage per-domain:         {}ns", average(latencies));
+    for (const auto &[name, q] : PERCENTILES) {
+        SPDLOG_INFO("\t{:<28}{}ns", AG_FMT("{} per-domain:", name), percentile(latencies, q));
+    }
+    SPDLOG_INFO("\tLatency histogram:");
+    std::vector<size_t> histogram = make_histogram(latencies);
+    for (size_t i = 0; i < histogram.size(); ++i) {
+        if (histogram[i] != 0) {
+            SPDLOG_INFO("\t\t[{}ns, {}ns): {}", UINT64_C(1) << i, UINT64_C(1) << (i + 1), histogram[i]);
+        }
+    }
     SPDLOG_INFO("\tRSS before:                 {}kB", result->match_domains.start_rss);
     SPDLOG_INFO("\tRSS after:                  {}kB", result->match_domains.end_rss);
     SPDLOG_INFO("\tRSS diff:                   {}kB", result->match_domains.end_rss - result->match_domains.start_rss);
     SPDLOG_INFO("Overall measurements:");
-    elapsed = std::chrono::duration<double, std::ratio<1>>(result->overall.end_ts - result->overall.start_ts);
-    SPDLOG_INFO("\tTime elapsed:               {}s", elapsed.count());
+    SPDLOG_INFO("\tTime elapsed:               {}s", seconds(result->overall.start_ts, result->overall.end_ts));
     SPDLOG_INFO("\tRSS before:                 {}kB", result->overall.start_rss);
     SPDLOG_INFO("\tRSS after:                  {}kB", result->overall.end_rss);
     SPDLOG_INFO("\tRSS diff:                   {}kB", result->overall.end_rss - result->overall.start_rss);
     SPDLOG_INFO("============================================");
 }
 
+static bool write_json(const test_result_t *result, std::string_view path) {
+    const auto &m = result->match_domains;
+    std::string json = "{\n";
+    json += AG_FMT("  \"config\": {{\"filter_lists\": {}, \"merged_tables\": {}, \"deduplicated_rules\": {}, "
+        "\"domain_keys\": \"{}\", \"resident_rules\": {}, \"use_context\": {}, \"match_threads\": {}, "
+        "\"generator\": ",
+        result->filter_lists, result->merged_tables, result->deduplicated_rules, domain_keys_name(result),
+        result->resident_rules,
+        result->use_context, m.threads);
+    if (result->generator.has_value()) {
+        const generator_params_t &g = result->generator.value();
+        json += AG_FMT("{{\"lists\": {}, \"rules_per_list\": {}, \"mix\": {{", g.lists, g.rules_per_list);
+        for (size_t i = 0; i < RK_NUM; ++i) {
+            json += AG_FMT("{}\"{}\": {}", (i != 0) ? ", " : "", RULE_KIND_NAMES[i], g.mix[i]);
+        }
+        json += AG_FMT("}}, \"queries\": {}, \"zipf_exponent\": {}, \"seed\": {}}}", g.queries, g.zipf_exponent, g.seed);
+    } else {
+        json += "null";
+    }
+    json += "},\n";
+    json += AG_FMT("  \"load\": {{\"time_s\": {}, \"rss_before_kb\": {}, \"rss_after_kb\": {}}},\n",
+        seconds(result->load_rules.start_ts, result->load_rules.end_ts),
+        result->load_rules.start_rss, result->load_rules.end_rss);
+    double elapsed = seconds(m.start_ts, m.end_ts);
+    json += AG_FMT("  \"match\": {{\"tries\": {}, \"total_matches\": {}, \"effective_blocking\": {}, "
+        "\"effective_exception\": {}, \"time_s\": {}, \"throughput_per_s\": {}, \"cache_hits\": {}, "
+        "\"cache_misses\": {}, \"rss_before_kb\": {}, \"rss_after_kb\": {},\n",
+        m.tries, m.total_matches, m.effective_blocking_matches, m.effective_exception_matches, elapsed,
+        uint64_t(m.tries / elapsed), m.cache_stats.hits, m.cache_stats.misses, m.start_rss, m.end_rss);
+    json += AG_FMT("    \"latency_ns\": {{\"min\": {}, \"avg\": {}, ", m.latencies.empty() ? 0 : m.latencies.front(),
+        average(m.latencies));
+    for (const auto &[name, q] : PERCENTILES) {
+        json += AG_FMT("\"{}\": {}, ", name, percentile(m.latencies, q));
+    }
+    json += AG_FMT("\"max\": {}}},\n", m.latencies.empty() ? 0 : m.latencies.back());
+    json += "    \"histogram_ns\": [";
+    std::vector<size_t> histogram = make_histogram(m.latencies);
+    for (size_t i = 0; i < histogram.size(); ++i) {
+        json += AG_FMT("{}{{\"from\": {}, \"to\": {}, \"count\": {}}}", (i != 0) ? ", " : "",
+            UINT64_C(1) << i, UINT64_C(1) << (i + 1), histogram[i]);
+    }
+    json += "]},\n";
+    json += AG_FMT("  \"overall\": {{\"time_s\": {}, \"rss_before_kb\": {}, \"rss_after_kb\": {}}}\n",
+        seconds(result->overall.start_ts, result->overall.end_ts), result->overall.start_rss, result->overall.end_rss);
+    json += "}\n";
+
+    if (path == "-") {
+        return json.size() == fwrite(json.data(), 1, json.size(), stdout);
+    }
+    FILE *file = fopen(std::string(path).c_str(), "w");
+    if (file == nullptr) {
+        return false;
+    }
+    bool ok = json.size() == fwrite(json.data(), 1, json.size(), file);
+    return 0 == fclose(file) && ok;
+}
+
 
 int main(int argc, char **argv) {
-    std::string_view filter_list_path = DEFAULT_FILTER_PATH;
+    std::vector<std::string_view> filter_list_paths;
     std::string_view domains_base_path = DEFAULT_DOMAINS_BASE_PATH;
+    std::string_view compiled_filters_dir;
+    size_t load_threads_num = 0;
+    bool merge_filters = true;
+    bool deduplicate_rules = false;
+    bool resident_rules = false;
+    size_t match_cache_size = 0;
+    bool regex_benchmark = false;
+    bool parse_benchmark = false;
+    bool use_context = false;
+    bool fingerprint_tables = false;
+    bool domain_trie = false;
+    bool rules_in_buffers = false;
+    size_t match_threads_num = 1;
+    size_t top_rules_num = 0;
+    std::string_view json_path;
+    bool domains_base_given = false;
+    std::optional<generator_params_t> generator;
+    generator_params_t generator_params = { 1, 0, {}, 100000, 1.0, 1 };
+    parse_rules_mix(DEFAULT_RULES_MIX, generator_params.mix);
 
     for (int i = 1; i < argc; ++i) {
         if (0 == strcmp(argv[i], "-h")) {
@@ -179,28 +724,211 @@ int main(int argc, char **argv) {
             if (i + 1 == argc) {
                 FAIL_WITH_MSG("option 'f' needs a value\n{}", HELP_MESSAGE);
             }
-            filter_list_path = argv[i+1];
+            filter_list_paths.emplace_back(argv[i+1]);
             ++i;
         } else if (0 == strcmp(argv[i], "-d")) {
             if (i + 1 == argc) {
                 FAIL_WITH_MSG("option 'd' needs a value\n{}", HELP_MESSAGE);
             }
             domains_base_path = argv[i+1];
+            domains_base_given = true;
+            ++i;
+        } else if (0 == strcmp(argv[i], "-c")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'c' needs a value\n{}", HELP_MESSAGE);
+            }
+            compiled_filters_dir = argv[i+1];
+            ++i;
+        } else if (0 == strcmp(argv[i], "-t")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 't' needs a value\n{}", HELP_MESSAGE);
+            }
+            load_threads_num = strtoul(argv[i+1], nullptr, 10);
+            ++i;
+        } else if (0 == strcmp(argv[i], "-k")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'k' needs a value\n{}", HELP_MESSAGE);
+            }
+            match_cache_size = strtoul(argv[i+1], nullptr, 10);
+            ++i;
+        } else if (0 == strcmp(argv[i], "-p")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'p' needs a value\n{}", HELP_MESSAGE);
+            }
+            match_threads_num = std::max(strtoul(argv[i+1], nullptr, 10), 1ul);
+            ++i;
+        } else if (0 == strcmp(argv[i], "-H")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'H' needs a value\n{}", HELP_MESSAGE);
+            }
+            top_rules_num = strtoul(argv[i+1], nullptr, 10);
+            ++i;
+        } else if (0 == strcmp(argv[i], "-J")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'J' needs a value\n{}", HELP_MESSAGE);
+            }
+            json_path = argv[i+1];
             ++i;
+        } else if (0 == strcmp(argv[i], "-g")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'g' needs a value\n{}", HELP_MESSAGE);
+            }
+            generator_params.rules_per_list = strtoul(argv[i+1], nullptr, 10);
+            generator = generator_params;
+            ++i;
+        } else if (0 == strcmp(argv[i], "-l")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'l' needs a value\n{}", HELP_MESSAGE);
+            }
+            generator_params.lists = std::max(strtoul(argv[i+1], nullptr, 10), 1ul);
+            ++i;
+        } else if (0 == strcmp(argv[i], "-M")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'M' needs a value\n{}", HELP_MESSAGE);
+            }
+            if (!parse_rules_mix(argv[i+1], generator_params.mix)) {
+                FAIL_WITH_MSG("invalid rules mix: {}\n{}", argv[i+1], HELP_MESSAGE);
+            }
+            ++i;
+        } else if (0 == strcmp(argv[i], "-q")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'q' needs a value\n{}", HELP_MESSAGE);
+            }
+            generator_params.queries = strtoul(argv[i+1], nullptr, 10);
+            ++i;
+        } else if (0 == strcmp(argv[i], "-z")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'z' needs a value\n{}", HELP_MESSAGE);
+            }
+            generator_params.zipf_exponent = strtod(argv[i+1], nullptr);
+            ++i;
+        } else if (0 == strcmp(argv[i], "-S")) {
+            if (i + 1 == argc) {
+                FAIL_WITH_MSG("option 'S' needs a value\n{}", HELP_MESSAGE);
+            }
+            generator_params.seed = strtoull(argv[i+1], nullptr, 10);
+            ++i;
+        } else if (0 == strcmp(argv[i], "-m")) {
+            resident_rules = true;
+        } else if (0 == strcmp(argv[i], "-b")) {
+            rules_in_buffers = true;
+        } else if (0 == strcmp(argv[i], "-x")) {
+            use_context = true;
+        } else if (0 == strcmp(argv[i], "-w")) {
+            fingerprint_tables = true;
+        } else if (0 == strcmp(argv[i], "-e")) {
+            domain_trie = true;
+        } else if (0 == strcmp(argv[i], "-s")) {
+            merge_filters = false;
+        } else if (0 == strcmp(argv[i], "-u")) {
+            deduplicate_rules = true;
+        } else if (0 == strcmp(argv[i], "-r")) {
+            regex_benchmark = true;
+        } else if (0 == strcmp(argv[i], "-P")) {
+            parse_benchmark = true;
         } else {
             FAIL_WITH_MSG("unknown option %s\n{}", argv[i], HELP_MESSAGE);
         }
     }
 
+    if (json_path == "-") {
+        // the log goes to the standard error, so the standard output has only the results
+        spdlog::set_default_logger(spdlog::stderr_logger_mt("benchmark"));
+        ag::set_logger_factory_callback([] (const std::string &name) { return spdlog::stderr_logger_mt(name); });
+    }
+
+    if (generator.has_value()) {
+        // the options following `-g` are applied too
+        generator_params.rules_per_list = generator->rules_per_list;
+        generator = generator_params;
+    }
+
+    if (filter_list_paths.empty() && !generator.has_value()) {
+        filter_list_paths.emplace_back(DEFAULT_FILTER_PATH);
+    }
+
     test_result_t result = {};
 
-    SPDLOG_INFO("Parsing domains base...");
-    if (0 != parse_domains_base(domains_base_path)) {
-        FAIL_WITH_MSG("failed to parse domains base");
+    std::vector<std::string> generated_lists;
+    std::vector<std::string> generated_names;
+    if (generator.has_value()) {
+        SPDLOG_INFO("Generating filter lists...");
+        std::vector<std::string> generated_queries;
+        generate(generator.value(), generated_lists, generated_queries);
+        filter_list_paths.clear();
+        for (size_t i = 0; i < generated_lists.size(); ++i) {
+            generated_names.emplace_back(AG_FMT("generated{}", i));
+        }
+        filter_list_paths.assign(generated_names.begin(), generated_names.end());
+        if (!domains_base_given) {
+            domains = std::move(generated_queries);
+        }
+        SPDLOG_INFO("...{} lists of {} rules generated", generated_lists.size(), generator->rules_per_list);
+    }
+
+    if (domains.empty()) {
+        SPDLOG_INFO("Parsing domains base...");
+        if (0 != parse_domains_base(domains_base_path)) {
+            FAIL_WITH_MSG("failed to parse domains base");
+        }
+        SPDLOG_INFO("...domains base parsed");
+    }
+
+    if (regex_benchmark) {
+        if (generator.has_value()) {
+            FAIL_WITH_MSG("option 'r' reads the filter list from a file, so it can't be used with 'g'");
+        }
+        return run_regex_benchmark(filter_list_paths[0]);
+    }
+
+    if (parse_benchmark) {
+        std::vector<std::string> lines;
+        for (std::string_view list : generated_lists) {
+            for (std::string_view line : ag::utils::split_by(list, '\n')) {
+                lines.emplace_back(line);
+            }
+        }
+        for (size_t i = 0; !generator.has_value() && i < filter_list_paths.size(); ++i) {
+            ag::file::handle file = ag::file::open(filter_list_paths[i], ag::file::RDONLY);
+            if (!ag::file::is_valid(file)) {
+                FAIL_WITH_MSG("failed to open filter list: {}", filter_list_paths[i]);
+            }
+            ag::file::for_each_line(file, &add_line, &lines);
+            ag::file::close(file);
+        }
+        return run_parse_benchmark(lines);
+    }
+
+    // the buffers are read before the start, as they are not a part of the engine
+    std::vector<std::shared_ptr<std::string>> buffers;
+    if (generator.has_value()) {
+        for (std::string &list : generated_lists) {
+            buffers.emplace_back(std::make_shared<std::string>(std::move(list)));
+        }
+    } else if (rules_in_buffers) {
+        for (std::string_view path : filter_list_paths) {
+            ag::file::handle fd = ag::file::open(path, ag::file::RDONLY);
+            if (!ag::file::is_valid(fd)) {
+                FAIL_WITH_MSG("failed to open filter list: {}", path);
+            }
+            auto buffer = std::make_shared<std::string>(std::max(0, ag::file::get_size(fd)), '\0');
+            if ((int)buffer->size() != ag::file::read(fd, buffer->data(), buffer->size())) {
+                FAIL_WITH_MSG("failed to read filter list: {}", path);
+            }
+            ag::file::close(fd);
+            buffers.emplace_back(std::move(buffer));
+        }
     }
-    SPDLOG_INFO("...domains base parsed");
 
     result.match_domains.tries = domains.size();
+    result.filter_lists = filter_list_paths.size();
+    result.merged_tables = merge_filters && filter_list_paths.size() > 1;
+    result.deduplicated_rules = deduplicate_rules;
+    result.fingerprint_tables = fingerprint_tables;
+    result.domain_trie = domain_trie;
+    result.resident_rules = resident_rules;
+    result.use_context = use_context;
+    result.generator = generator;
 
     result.overall.start_rss = ag::sys::current_rss();
     TICK(result.overall.start_ts);
@@ -209,7 +937,23 @@ int main(int argc, char **argv) {
 
     SPDLOG_INFO("Loading rules in filter...");
     ag::dnsfilter filter;
-    ag::dnsfilter::engine_params filter_params = { { { 0, std::string(filter_list_path) } } };
+    ag::dnsfilter::engine_params filter_params;
+    for (size_t i = 0; i < filter_list_paths.size(); ++i) {
+        filter_params.filters.push_back({ (int32_t)i, std::string(filter_list_paths[i]) });
+        if (!buffers.empty()) {
+            filter_params.filters.back().data = *buffers[i];
+            filter_params.filters.back().data_owner = std::move(buffers[i]);
+        }
+    }
+    filter_params.merge_filters = merge_filters;
+    filter_params.deduplicate_rules = deduplicate_rules;
+    filter_params.resident_rules = resident_rules;
+    filter_params.fingerprint_tables = fingerprint_tables;
+    filter_params.domain_trie = domain_trie;
+    filter_params.match_cache_size = match_cache_size;
+    filter_params.compiled_filters_dir = compiled_filters_dir;
+    filter_params.load_threads_num = load_threads_num;
+    filter_params.count_rule_hits = top_rules_num != 0;
 
     TICK(result.load_rules.start_ts);
     auto [handle, err_or_warn] = filter.create(filter_params);
@@ -227,14 +971,22 @@ int main(int argc, char **argv) {
 
     SPDLOG_INFO("Matching domains against rules...");
     result.match_domains.start_rss = ag::sys::current_rss();
-    apply_filter_to_base(&result, &filter, handle);
+    apply_filter_to_base(&result, &filter, handle, use_context, match_threads_num);
     result.match_domains.end_rss = ag::sys::current_rss();
     SPDLOG_INFO("...domains matched");
 
+    if (top_rules_num != 0) {
+        report_hit_stats(filter.get_hit_stats(handle, top_rules_num));
+    }
+
     filter.destroy(handle);
 
     TICK(result.overall.end_ts);
     result.overall.end_rss = ag::sys::current_rss();
 
     report_results(&result);
+
+    if (!json_path.empty() && !write_json(&result, json_path)) {
+        FAIL_WITH_MSG("failed to write results to {}", json_path);
+    }
 }
@@ -2,11 +2,22 @@
 #include <numeric>
 #include <string>
 #include <ag_file.h>
+#include <ag_utils.h>
 #include <ag_sys.h>
 #include <ag_logger.h>
+#include <ag_regex.h>
 #include <dnsfilter.h>
 #include <spdlog/spdlog.h>
 #include <rule_utils.h>
+#include <aho_corasick.h>
+#include <leftovers_matcher.h>
+#include <bloom_filter.h>
+#include <fingerprint_index.h>
+#include <domain_trie.h>
+#include <ip_radix.h>
+#include <mem_arena.h>
+#include <filter.h>
+#include <ag_socket_address.h>
 
 class dnsfilter_test : public ::testing::Test {
 protected:
@@ -17,6 +28,8 @@ protected:
 
     const std::string TEST_FILTER_NAME = "dnsfilter_test";
 
+    size_t lists_num = 0; // number of the filter files written by `write_filter_lists`
+
     void SetUp() override {
         ag::set_default_log_level(ag::TRACE);
         file = ag::file::open(file_by_filter_name(TEST_FILTER_NAME), ag::file::CREAT|ag::file::RDONLY);
@@ -26,6 +39,9 @@ protected:
 
     void TearDown() override {
         std::remove(file_by_filter_name(TEST_FILTER_NAME).data());
+        for (size_t i = 0; i < lists_num; ++i) {
+            std::remove(file_by_filter_name(AG_FMT("{}{}", TEST_FILTER_NAME, i)).c_str());
+        }
     }
 
     static void add_rule_in_filter(std::string_view filter, std::string_view rule) {
@@ -38,6 +54,24 @@ protected:
         ag::file::close(file);
     }
 
+    /**
+     * Write each list of rules into its own filter file and add the files to the engine parameters
+     * (the filter id of a list is its index)
+     */
+    void write_filter_lists(const std::vector<std::vector<std::string>> &lists, ag::dnsfilter::engine_params &params) {
+        lists_num = std::max(lists_num, lists.size());
+        for (size_t i = 0; i < lists.size(); ++i) {
+            std::string name = file_by_filter_name(AG_FMT("{}{}", TEST_FILTER_NAME, i));
+            ag::file::handle file = ag::file::open(name, ag::file::CREAT | ag::file::WRONLY | ag::file::TRUNC);
+            ASSERT_TRUE(ag::file::is_valid(file)) << ag::sys::error_string(ag::sys::error_code());
+            ag::file::close(file);
+            for (const std::string &rule : lists[i]) {
+                ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(name, rule));
+            }
+            params.filters.push_back({ (int32_t)i, name });
+        }
+    }
+
     static std::string file_by_filter_name(std::string filter) {
         return filter + ".txt";
     }
@@ -93,23 +127,27 @@ TEST_F(dnsfilter_test, successful_rule_parsing) {
             { "|https://example31.org/", { {}, rule_utils::rule::MMID_EXACT } },
             { "/127.0.0.1/", { {}, rule_utils::rule::MMID_SHORTCUTS_AND_REGEX } },
             { "/12:34:56:78::90/", { {}, rule_utils::rule::MMID_REGEX } },
-            { "123.123.123.123", { {}, rule_utils::rule::MMID_SHORTCUTS } },
-            { "12:34:56:78::90", { {}, rule_utils::rule::MMID_SHORTCUTS } },
+            { "123.123.123.123", { {}, rule_utils::rule::MMID_CIDR } },
+            { "12:34:56:78::90", { {}, rule_utils::rule::MMID_CIDR } },
             { "123.123.123.123$badfilter", { { .props = { 1 << ag::dnsfilter::RP_BADFILTER } }, rule_utils::rule::MMID_EXACT } },
             { "12:34:56:78::90$badfilter", { { .props = { 1 << ag::dnsfilter::RP_BADFILTER } }, rule_utils::rule::MMID_EXACT } },
-            { "@@123.123.123.123", { { .props = { 1 << ag::dnsfilter::RP_EXCEPTION } }, rule_utils::rule::MMID_SHORTCUTS } },
-            { "@@12:34:56:78::90", { { .props = { 1 << ag::dnsfilter::RP_EXCEPTION } }, rule_utils::rule::MMID_SHORTCUTS } },
-            { "0.0.0.0", { {}, rule_utils::rule::MMID_SHORTCUTS } },
-            { "::", { {}, rule_utils::rule::MMID_SHORTCUTS } },
-            { "::1", { {}, rule_utils::rule::MMID_SHORTCUTS } },
-            { "|123.123.123.123^", { {}, rule_utils::rule::MMID_EXACT } },
-            { "|12:34:56:78::90^", { {}, rule_utils::rule::MMID_EXACT } },
-            { "||123.123.123.123^", { {}, rule_utils::rule::MMID_SUBDOMAINS } },
-            { "||12:34:56:78::90^", { {}, rule_utils::rule::MMID_SUBDOMAINS } },
-            { "http://123.123.123.123", { {}, rule_utils::rule::MMID_SHORTCUTS_AND_REGEX } },
-            { "http://12:34:56:78::90^", { {}, rule_utils::rule::MMID_SUBDOMAINS } },
-            { "https://123.123.123.123", { {}, rule_utils::rule::MMID_SHORTCUTS_AND_REGEX } },
-            { "https://12:34:56:78::90^", { {}, rule_utils::rule::MMID_SUBDOMAINS } },
+            { "@@123.123.123.123", { { .props = { 1 << ag::dnsfilter::RP_EXCEPTION } }, rule_utils::rule::MMID_CIDR } },
+            { "@@12:34:56:78::90", { { .props = { 1 << ag::dnsfilter::RP_EXCEPTION } }, rule_utils::rule::MMID_CIDR } },
+            { "0.0.0.0", { {}, rule_utils::rule::MMID_CIDR } },
+            { "::", { {}, rule_utils::rule::MMID_CIDR } },
+            { "::1", { {}, rule_utils::rule::MMID_CIDR } },
+            { "|123.123.123.123^", { {}, rule_utils::rule::MMID_CIDR } },
+            { "|12:34:56:78::90^", { {}, rule_utils::rule::MMID_CIDR } },
+            { "||123.123.123.123^", { {}, rule_utils::rule::MMID_CIDR } },
+            { "||12:34:56:78::90^", { {}, rule_utils::rule::MMID_CIDR } },
+            { "http://123.123.123.123", { {}, rule_utils::rule::MMID_CIDR } },
+            { "http://12:34:56:78::90^", { {}, rule_utils::rule::MMID_CIDR } },
+            { "https://123.123.123.123", { {}, rule_utils::rule::MMID_CIDR } },
+            { "https://12:34:56:78::90^", { {}, rule_utils::rule::MMID_CIDR } },
+            { "10.0.0.0/8", { {}, rule_utils::rule::MMID_CIDR } },
+            { "||192.168.1.0/24^", { {}, rule_utils::rule::MMID_CIDR } },
+            { "@@2001:db8::/32$important", { { .props = { (1 << ag::dnsfilter::RP_EXCEPTION) | (1 << ag::dnsfilter::RP_IMPORTANT) } }, rule_utils::rule::MMID_CIDR } },
+            { "0.0.0.0/0", { {}, rule_utils::rule::MMID_CIDR } },
             { "172.16.*.1", { {}, rule_utils::rule::MMID_SHORTCUTS } },
             { "172.16.*.1:80", { {}, rule_utils::rule::MMID_SHORTCUTS_AND_REGEX } },
             { "|172.16.*.1:80^", { {}, rule_utils::rule::MMID_SHORTCUTS_AND_REGEX } },
@@ -192,6 +230,10 @@ TEST_F(dnsfilter_test, wrong_rule_parsing) {
             "///example.com",
             "333.333.333.333 example.org",
             "45:67 example.org",
+            "10.0.0.0/33",
+            "2001:db8::/129",
+            "10.0.0.0/8x",
+            "10.0.0/8",
         };
 
     ag::logger log = ag::create_logger("dnsfilter_test");
@@ -203,6 +245,105 @@ TEST_F(dnsfilter_test, wrong_rule_parsing) {
     }
 }
 
+// Shortcuts of a regex rule pattern extracted as the parser did it with the regex substitutions:
+// the brackets and `[a-zA-Z]` are stripped, and the rest is split by the special characters
+// and the escape sequences
+static std::vector<std::string> reference_regex_shortcuts(std::string_view pattern) {
+    static const ag::regex STRIP_REGEXES[] =
+        {
+            ag::regex("([^\\\\]*)\\([^\\\\]*\\)"),
+            ag::regex("([^\\\\]*)\\{[^\\\\]*\\}"),
+            ag::regex("([^\\\\]*)\\[[^\\\\]*\\]"),
+            ag::regex("([^\\\\]*)\\[a-zA-Z]"),
+        };
+    static constexpr std::string_view SPECIAL_CHARACTERS = "\\^$*+?.()|[]{}";
+    static constexpr std::string_view ESCAPED_SEQUENCES = "nrtdDwWsSbB<>AZ";
+
+    std::string text(pattern);
+    for (const ag::regex &re : STRIP_REGEXES) {
+        text = re.replace(text, "$1...");
+    }
+
+    std::vector<std::string> shortcuts;
+    for (size_t i = 0; i < text.length();) {
+        size_t end = std::min(text.find_first_of(SPECIAL_CHARACTERS, i), text.length());
+        if (end > i) {
+            shortcuts.emplace_back(ag::utils::to_lower(std::string_view(text).substr(i, end - i)));
+            i = end;
+        } else if (text[i] == '\\' && i + 1 < text.length() && ESCAPED_SEQUENCES.npos != ESCAPED_SEQUENCES.find(text[i + 1])) {
+            i += 2;
+        } else {
+            i += 1;
+        }
+    }
+    if (shortcuts.size() <= 1 && SPECIAL_CHARACTERS.npos == SPECIAL_CHARACTERS.find(text.front())
+            && SPECIAL_CHARACTERS.npos == SPECIAL_CHARACTERS.find(text.back())) {
+        // matched by the regex only
+        return { ag::utils::to_lower(pattern) };
+    }
+    return shortcuts;
+}
+
+TEST_F(dnsfilter_test, rule_parser_differential) {
+    const std::string TEST_DATA[] =
+        {
+            // the texts of the parsing and matching tests
+            "||*.example.*", "||*example*", "example.org", "@@example.org", "example.org$important",
+            "@@example.org$important", "|example.org", "example.org|", "|example.org|", "example", ".example",
+            "example.", "*example.org", "||example.org|", "||example.org^", "||example.org", "/example.org/",
+            "/example.org/$badfilter", "/ex[a]?mple.org/", "/ex[ab]mple.org/", "example.org$badfilter",
+            "-ad-banner.", "-ad-unit/", "-ad-unit^", "-ad-unit/^", "-ad-unit^/", "example.org:8080",
+            "//example.org:8080", "://example.org", "://example.org/", "http://example.org/", "ws://example.org|",
+            "example.org^|", "example.org|^", "|https://example31.org/", "/127.0.0.1/", "/12:34:56:78::90/",
+            "123.123.123.123", "12:34:56:78::90", "123.123.123.123$badfilter", "@@12:34:56:78::90", "::1",
+            "||192.168.1.0/24^", "@@2001:db8::/32$important", "172.16.*.1", "|172.16.*.1:80^",
+            "0.0.0.0 example.org", "::FFFF:1.1.1.1 example.org", "0.0.0.0 example.org #comment",
+            "", "!example.com", "@example", "||||example", "||example$unknown", "||example$important,important",
+            "?example.org", "*", "/[example.org/", "example.com^some", "|||example.com", "example.com//",
+            "333.333.333.333 example.org", "10.0.0.0/33", "10.0.0/8",
+            "/mple1.org/", "/mp.*le2.org/", "/mple[34].org/", "/mple[56]?.org/", "/example-1\\.org/",
+            "/^eXaMpLe-2\\.oRg$/", "/example\\d{4}.org/",
+            // more parts than the parser keeps in place
+            "0.0.0.0 a.example b.example c.example d.example e.example f.example",
+            "a*b*c*d*e*f", "  Mixed*CASE*ex*am*ple  ",
+            // the patterns stripped before extracting the regex shortcuts
+            "/ex()ample/", "/a(b)c(d)e/", "/(ads|track)\\.example\\.(com|net)/", "/^ad[0-9]+\\.example\\.com$/",
+            "/a{2,3}b\\{c\\}/", "/\\d+\\.tracker\\.[a-z]{2,}/", "/x[a-zA-Z]y/", "/x[a-z][A-Z]y/",
+            "/x[a-zA-Z][A-Z]y\\w/", "/a\\(b(c)d\\)e/", "/AB[cD]eF\\.com/", "@@/ad\\d\\.(Net|Org)/$important",
+        };
+
+    rule_utils::parser parser;
+    for (const std::string &text : TEST_DATA) {
+        SPDLOG_INFO("testing {}", text);
+        std::optional<rule_utils::rule> rule = rule_utils::parse(text);
+        const rule_utils::rule_view *view = parser.parse(text);
+        ASSERT_EQ(rule.has_value(), view != nullptr);
+        if (!rule.has_value()) {
+            continue;
+        }
+
+        ASSERT_EQ(rule->public_part.text, view->text);
+        ASSERT_EQ(rule->public_part.props, view->props);
+        ASSERT_EQ(rule->public_part.ip, view->ip.has_value() ? std::make_optional(std::string(*view->ip)) : std::nullopt);
+        ASSERT_EQ(rule->match_method, view->match_method);
+        ASSERT_EQ(rule->matching_parts, std::vector<std::string>(view->matching_parts.begin(), view->matching_parts.end()));
+
+        std::string_view pattern = text;
+        if (ag::utils::starts_with(pattern, "@@")) {
+            pattern.remove_prefix(2);
+        }
+        if (pattern.back() != '/') {
+            pattern = ag::utils::rsplit2_by(pattern, '$')[0];
+        }
+        if (pattern.length() > 1 && pattern.front() == '/' && pattern.back() == '/'
+                && pattern.npos == pattern.find('?')
+                && !rule->public_part.props.test(ag::dnsfilter::RP_BADFILTER)) {
+            pattern = pattern.substr(1, pattern.length() - 2);
+            ASSERT_EQ(rule->matching_parts, reference_regex_shortcuts(pattern));
+        }
+    }
+}
+
 TEST_F(dnsfilter_test, basic_rules_match) {
     struct test_data {
         std::vector<std::string> rules;
@@ -484,15 +625,47 @@ TEST_F(dnsfilter_test, badfilter) {
     auto [handle, err_or_warn] = filter.create(params);
     ASSERT_TRUE(handle) << *err_or_warn;
 
+    // neither the disabled rule nor the badfilter rule is matched
     for (const test_data &entry : TEST_DATA) {
         SPDLOG_INFO("testing {}", entry.domain);
         std::vector<ag::dnsfilter::rule> rules = filter.match(handle, entry.domain);
-        ASSERT_EQ(rules.size(), 2);
-        std::vector<const ag::dnsfilter::rule *> effective_rules = ag::dnsfilter::get_effective_rules(rules);
-        ASSERT_EQ(effective_rules.size(), 0);
+        ASSERT_EQ(rules.size(), 0);
     }
 
     filter.destroy(handle);
+
+    // a badfilter rule disables the rules of all the lists, the preceding and the following ones
+    const std::vector<std::vector<std::string>> LISTS =
+        {
+            { "example4.org$badfilter", "||example5.org^", "*example6*" },
+            { "example4.org", "||example5.org^$important", "*example6*$badfilter" },
+            { "||example5.org^$badfilter", "*example6*" },
+        };
+    // domain -> matched rule
+    const std::vector<std::pair<std::string, std::string>> TESTS =
+        {
+            { "example4.org", "" },
+            { "sub.example5.org", "||example5.org^$important" },
+            { "example6.org", "" },
+        };
+    params = {};
+    ASSERT_NO_FATAL_FAILURE(write_filter_lists(LISTS, params));
+    for (bool resident : { false, true }) {
+        for (bool merge : { false, true }) {
+            params.resident_rules = resident;
+            params.merge_filters = merge;
+            std::tie(handle, err_or_warn) = filter.create(params);
+            ASSERT_TRUE(handle) << *err_or_warn;
+            for (const auto &[domain, expected] : TESTS) {
+                std::vector<ag::dnsfilter::rule> rules = filter.match(handle, domain);
+                ASSERT_EQ(rules.size(), expected.empty() ? 0 : 1) << domain << " " << resident << merge;
+                if (!expected.empty()) {
+                    ASSERT_EQ(rules[0].text, expected) << domain << " " << resident << merge;
+                }
+            }
+            filter.destroy(handle);
+        }
+    }
 }
 
 TEST_F(dnsfilter_test, multifilters) {
@@ -541,6 +714,137 @@ TEST_F(dnsfilter_test, multifilters) {
     std::remove(file_by_filter_name(TEST_FILTER_NAME + "2").c_str());
 }
 
+TEST_F(dnsfilter_test, batch_match) {
+    const std::vector<std::string> RULES =
+        {
+            "||example.org^",
+            "@@sub.example.org",
+            "0.0.0.0 hosts.example.com",
+            "/ba[dn]ner/",
+            "1.2.3.4",
+        };
+    for (const std::string &rule : RULES) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), rule));
+    }
+
+    ag::dnsfilter::engine_params params = { { { 0, file_by_filter_name(TEST_FILTER_NAME) } } };
+    auto [handle, err_or_warn] = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+
+    // the batch is expected to give the same results as the one-by-one matching
+    const std::vector<std::string_view> DOMAINS =
+        {
+            "example.org", "SUB.EXAMPLE.ORG", "hosts.example.com", "banner.com", "example.com",
+            "1.2.3.4", "1.2.3.5", "", "a.b.c.d.e.sub.example.org",
+        };
+    std::vector<ag::dnsfilter::match_target> targets;
+    for (std::string_view domain : DOMAINS) {
+        targets.push_back({ domain, {} });
+    }
+    // the addresses are matched along with the domains (e.g. the CNAMEs and the addresses of a response)
+    ag::socket_address addr("1.2.3.4", 0);
+    targets.push_back({ {}, addr.addr() });
+
+    ag::dnsfilter::match_context ctx;
+    std::vector<std::vector<ag::dnsfilter::rule_view>> &results =
+        filter.match_batch(handle, targets.data(), targets.size(), ctx);
+    ASSERT_EQ(results.size(), targets.size());
+    for (size_t i = 0; i < targets.size(); ++i) {
+        std::vector<ag::dnsfilter::rule> expected;
+        if (targets[i].address.empty()) {
+            expected = filter.match(handle, targets[i].domain);
+        } else {
+            ag::dnsfilter::match_context address_ctx;
+            for (const ag::dnsfilter::rule_view &r : filter.match_address(handle, targets[i].address, address_ctx)) {
+                expected.push_back(r.to_rule());
+            }
+        }
+        ASSERT_EQ(results[i].size(), expected.size()) << i;
+        for (size_t j = 0; j < expected.size(); ++j) {
+            ASSERT_EQ(results[i][j].text, expected[j].text) << i;
+            ASSERT_EQ(results[i][j].filter_id, expected[j].filter_id) << i;
+            ASSERT_EQ(results[i][j].ip, expected[j].ip) << i;
+        }
+    }
+    ASSERT_EQ(results[0].size(), 1);
+    ASSERT_EQ(results[1].size(), 2);
+    ASSERT_EQ(results[2].size(), 1);
+    ASSERT_EQ(results[4].size(), 0);
+    ASSERT_EQ(results[5].size(), 1);
+    ASSERT_EQ(results[9].size(), 1);
+
+    ASSERT_TRUE(filter.match_batch(handle, nullptr, 0, ctx).empty());
+
+    filter.destroy(handle);
+}
+
+TEST_F(dnsfilter_test, match_context) {
+    const std::vector<std::string> RULES =
+        {
+            "||example.org^",
+            "@@sub.example.org",
+            "0.0.0.0 hosts.example.com",
+            "1.1.1.1 hosts.example.com",
+            "/ba[dn]ner/",
+            "||banner.com^$important",
+            "||banner.com^$important,badfilter",
+        };
+    for (const std::string &rule : RULES) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), rule));
+    }
+
+    // matching with a context is expected to give the same results as the plain matching
+    const std::vector<std::string_view> DOMAINS =
+        {
+            "example.org", "SUB.EXAMPLE.ORG", "hosts.example.com", "banner.com", "example.com",
+            "", "a.b.c.d.e.sub.example.org", "example.org",
+        };
+    for (bool resident_rules : { false, true }) {
+        ag::dnsfilter::engine_params params = { { { 0, file_by_filter_name(TEST_FILTER_NAME) } } };
+        params.resident_rules = resident_rules;
+        auto [handle, err_or_warn] = filter.create(params);
+        ASSERT_TRUE(handle) << *err_or_warn;
+
+        ag::dnsfilter::match_context ctx;
+        for (std::string_view domain : DOMAINS) {
+            std::vector<ag::dnsfilter::rule> expected = filter.match(handle, domain);
+            const std::vector<ag::dnsfilter::rule_view> &rules = filter.match(handle, domain, ctx);
+            ASSERT_EQ(&rules, &ctx.rules());
+            ASSERT_EQ(rules.size(), expected.size()) << domain;
+            for (size_t i = 0; i < expected.size(); ++i) {
+                ASSERT_EQ(rules[i].text, expected[i].text) << domain;
+                ASSERT_EQ(rules[i].filter_id, expected[i].filter_id) << domain;
+                ASSERT_EQ(rules[i].props, expected[i].props) << domain;
+                ASSERT_EQ(rules[i].ip.has_value(), expected[i].ip.has_value()) << domain;
+                if (rules[i].ip.has_value()) {
+                    ASSERT_EQ(rules[i].ip.value(), expected[i].ip.value()) << domain;
+                }
+                ag::dnsfilter::rule copy = rules[i].to_rule();
+                ASSERT_EQ(copy.text, expected[i].text) << domain;
+                ASSERT_EQ(copy.ip, expected[i].ip) << domain;
+            }
+
+            std::vector<const ag::dnsfilter::rule *> expected_effective = ag::dnsfilter::get_effective_rules(expected);
+            std::vector<const ag::dnsfilter::rule_view *> effective = ag::dnsfilter::get_effective_rules(rules);
+            ASSERT_EQ(effective.size(), expected_effective.size()) << domain;
+            for (size_t i = 0; i < effective.size(); ++i) {
+                ASSERT_EQ(effective[i]->text, expected_effective[i]->text) << domain;
+            }
+        }
+        ASSERT_EQ(filter.match(handle, "hosts.example.com", ctx).size(), 2);
+        ASSERT_EQ(ag::dnsfilter::get_effective_rules(ctx.rules()).size(), 2);
+        // the badfilter rule disables the important one
+        filter.match(handle, "banner.com", ctx);
+        ASSERT_EQ(ctx.rules().size(), 1);
+        std::vector<const ag::dnsfilter::rule_view *> effective = ag::dnsfilter::get_effective_rules(ctx.rules());
+        ASSERT_EQ(effective.size(), 1);
+        ASSERT_EQ(effective[0]->text, "/ba[dn]ner/");
+        ASSERT_TRUE(filter.match(handle, "example.com", ctx).empty());
+
+        filter.destroy(handle);
+    }
+}
+
 TEST_F(dnsfilter_test, rule_selection) {
     struct test_data {
         std::vector<std::string> rules;
@@ -584,3 +888,1279 @@ TEST_F(dnsfilter_test, rule_selection) {
         ASSERT_EQ(effective_rules.size(), 0);
     }
 }
+
+TEST_F(dnsfilter_test, resident_rules) {
+    const std::vector<std::string> RULES =
+        {
+            "example1.org",
+            "@@example2.org",
+            "||example3.org^$important",
+            "*mple4.org",
+            "/mp.*le5.org/",
+            "/ex[a]?mple6.org/",
+            "1.1.1.1 example7.org example77.org",
+            "1.1.1.1 example8.org",
+            "example9.org",
+            "example9.org$badfilter",
+            "|192.168.*.1^",
+        };
+    const std::vector<std::string> DOMAINS =
+        {
+            "example1.org", "example2.org", "sub.example3.org", "example4.org", "subd.example5.org",
+            "example6.org", "sub.example77.org", "example8.org", "example9.org", "192.168.35.1",
+            "example10.org",
+        };
+
+    for (const std::string &rule : RULES) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), rule));
+    }
+
+    ag::dnsfilter::engine_params params = { { { 0, file_by_filter_name(TEST_FILTER_NAME) } } };
+    auto [handle, err_or_warn] = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+    params.resident_rules = true;
+    auto [resident_handle, resident_err_or_warn] = filter.create(params);
+    ASSERT_TRUE(resident_handle) << *resident_err_or_warn;
+
+    for (const std::string &d : DOMAINS) {
+        SPDLOG_INFO("testing {}", d);
+        std::vector<ag::dnsfilter::rule> rules = filter.match(handle, d);
+        std::vector<ag::dnsfilter::rule> resident_rules = filter.match(resident_handle, d);
+        ASSERT_EQ(rules.size(), resident_rules.size());
+        for (size_t i = 0; i < rules.size(); ++i) {
+            ASSERT_EQ(rules[i].text, resident_rules[i].text);
+            ASSERT_EQ(rules[i].props, resident_rules[i].props);
+            ASSERT_EQ(rules[i].ip, resident_rules[i].ip);
+            ASSERT_EQ(rules[i].filter_id, resident_rules[i].filter_id);
+        }
+    }
+
+    // the resident engine does not need the filter file anymore
+    std::remove(file_by_filter_name(TEST_FILTER_NAME).data());
+    std::vector<ag::dnsfilter::rule> rules = filter.match(resident_handle, "sub.example77.org");
+    ASSERT_EQ(rules.size(), 1);
+    ASSERT_EQ(rules[0].text, RULES[6]);
+    ASSERT_EQ(rules[0].ip, "1.1.1.1");
+
+    filter.destroy(handle);
+    filter.destroy(resident_handle);
+}
+
+TEST_F(dnsfilter_test, compiled_image) {
+    const std::vector<std::string> RULES =
+        {
+            "example1.org",
+            "example1.org$important",
+            "@@example2.org",
+            "||example3.org^$important",
+            "*mple4.org",
+            "/mp.*le5.org/",
+            "/ex[a]?mple6.org/",
+            "1.1.1.1 example7.org example77.org",
+            "example9.org",
+            "example9.org$badfilter",
+            "|192.168.*.1^",
+            "10.0.0.0/8",
+            "@@10.1.0.0/16",
+        };
+    const std::vector<std::string> DOMAINS =
+        {
+            "example1.org", "example2.org", "sub.example3.org", "example4.org", "subd.example5.org",
+            "example6.org", "sub.example77.org", "example9.org", "192.168.35.1", "example10.org",
+            "10.1.2.3", "10.2.0.1",
+        };
+    const std::string IMAGE_PATH = "./0-" + file_by_filter_name(TEST_FILTER_NAME) + ".compiled";
+
+    for (const std::string &rule : RULES) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), rule));
+    }
+
+    for (bool resident : { false, true }) {
+        std::remove(IMAGE_PATH.c_str());
+
+        ag::dnsfilter::engine_params params = { { { 0, file_by_filter_name(TEST_FILTER_NAME) } } };
+        params.resident_rules = resident;
+        auto [handle, err_or_warn] = filter.create(params);
+        ASSERT_TRUE(handle) << *err_or_warn;
+
+        // the first load compiles the image, the second one maps it
+        params.compiled_filters_dir = ".";
+        auto [compiling_handle, compiling_err_or_warn] = filter.create(params);
+        ASSERT_TRUE(compiling_handle) << *compiling_err_or_warn;
+        ag::file::handle image = ag::file::open(IMAGE_PATH, ag::file::RDONLY);
+        ASSERT_TRUE(ag::file::is_valid(image));
+        ag::file::close(image);
+        auto [image_handle, image_err_or_warn] = filter.create(params);
+        ASSERT_TRUE(image_handle) << *image_err_or_warn;
+
+        for (const std::string &d : DOMAINS) {
+            SPDLOG_INFO("testing {}", d);
+            std::vector<ag::dnsfilter::rule> rules = filter.match(handle, d);
+            for (ag::dnsfilter::handle h : { compiling_handle, image_handle }) {
+                std::vector<ag::dnsfilter::rule> image_rules = filter.match(h, d);
+                ASSERT_EQ(rules.size(), image_rules.size());
+                for (size_t i = 0; i < rules.size(); ++i) {
+                    ASSERT_EQ(rules[i].text, image_rules[i].text);
+                    ASSERT_EQ(rules[i].props, image_rules[i].props);
+                    ASSERT_EQ(rules[i].ip, image_rules[i].ip);
+                }
+            }
+        }
+
+        filter.destroy(handle);
+        filter.destroy(compiling_handle);
+        filter.destroy(image_handle);
+    }
+
+    // the image is rebuilt once the filter file changes
+    ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), "example10.org"));
+    ag::dnsfilter::engine_params params = { { { 0, file_by_filter_name(TEST_FILTER_NAME) } } };
+    params.resident_rules = true;
+    params.compiled_filters_dir = ".";
+    auto [handle, err_or_warn] = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+    std::vector<ag::dnsfilter::rule> rules = filter.match(handle, "example10.org");
+    ASSERT_EQ(rules.size(), 1);
+    ASSERT_EQ(rules[0].text, "example10.org");
+    filter.destroy(handle);
+
+    std::remove(IMAGE_PATH.c_str());
+}
+
+TEST_F(dnsfilter_test, corrupted_compiled_image) {
+    const std::vector<std::string> RULES =
+        {
+            "example1.org", "example1.org$important", "@@example2.org", "||example3.org^", "*mple4.org",
+            "/mp.*le5.org/", "/ex[a]?mple6.org/", "1.1.1.1 example7.org", "example9.org$badfilter",
+            "|192.168.*.1^", "10.0.0.0/8",
+        };
+    const std::vector<std::string> DOMAINS =
+        { "example1.org", "sub.example3.org", "example4.org", "example5.org", "192.168.3.1", "10.1.2.3" };
+    const std::string IMAGE_PATH = "./0-" + file_by_filter_name(TEST_FILTER_NAME) + ".compiled";
+
+    for (const std::string &rule : RULES) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), rule));
+    }
+
+    // (resident rules, fingerprint tables)
+    for (auto [resident, fingerprints] : { std::pair{ false, false }, { true, false }, { false, true }, { true, true } }) {
+        std::remove(IMAGE_PATH.c_str());
+        ag::dnsfilter::engine_params params = { { { 0, file_by_filter_name(TEST_FILTER_NAME) } } };
+        params.resident_rules = resident;
+        params.fingerprint_tables = fingerprints;
+        params.compiled_filters_dir = ".";
+        auto [handle, err_or_warn] = filter.create(params);
+        ASSERT_TRUE(handle) << *err_or_warn;
+        filter.destroy(handle);
+
+        ag::file::handle fd = ag::file::open(IMAGE_PATH, ag::file::RDONLY);
+        ASSERT_TRUE(ag::file::is_valid(fd));
+        std::string image(ag::file::get_size(fd), '\0');
+        ASSERT_EQ(ag::file::read(fd, image.data(), image.size()), (int)image.size());
+        ag::file::close(fd);
+
+        // Each word of the tables is replaced in turn by a huge rule index, a postings offset or a zero:
+        // the engine must either reject the image and rebuild it, or use it without reading out of the tables
+        const uint32_t WORDS[] = { INT32_MAX - 1, UINT32_MAX - 1, (1u << 31) | 1, 0 };
+        for (size_t pos = 64; pos + sizeof(uint32_t) <= image.size(); pos += sizeof(uint32_t)) {
+            std::string corrupted = image;
+            uint32_t word = WORDS[(pos / sizeof(uint32_t)) % std::size(WORDS)];
+            std::memcpy(&corrupted[pos], &word, sizeof(word));
+            fd = ag::file::open(IMAGE_PATH, ag::file::WRONLY | ag::file::TRUNC);
+            ASSERT_TRUE(ag::file::is_valid(fd));
+            ASSERT_EQ(ag::file::write(fd, corrupted.data(), corrupted.size()), (int)corrupted.size());
+            ag::file::close(fd);
+
+            std::tie(handle, err_or_warn) = filter.create(params);
+            ASSERT_TRUE(handle) << *err_or_warn;
+            for (const std::string &d : DOMAINS) {
+                filter.match(handle, d);
+            }
+            filter.destroy(handle);
+        }
+    }
+    std::remove(IMAGE_PATH.c_str());
+}
+
+TEST_F(dnsfilter_test, parallel_loading) {
+    // big enough to be split into chunks
+    const std::string BIG_FILTER_NAME = "dnsfilter_test_big";
+    std::string big_filter;
+    for (size_t i = 0; i < 20000; ++i) {
+        switch (i % 8) {
+        case 0: big_filter += AG_FMT("domain{}.org\n", i); break;
+        case 1: big_filter += AG_FMT("@@||sub.domain{}.org^\n", i - 1); break;
+        case 2: big_filter += AG_FMT("*main{}.org\n", i); break;
+        case 3: big_filter += AG_FMT("/do[m]?ain{}\\.org/\n", i); break;
+        case 4: big_filter += AG_FMT("1.2.3.4 host{}.com host{}.net\n", i, i); break;
+        case 5: big_filter += AG_FMT("domain{}.org$badfilter\n", i - 5); break;
+        case 6: big_filter += AG_FMT("! comment {}\r\n", i); break;
+        case 7: big_filter += AG_FMT("domain{}.org$important\n", i - 7); break;
+        }
+    }
+    ag::file::handle file = ag::file::open(file_by_filter_name(BIG_FILTER_NAME), ag::file::CREAT | ag::file::WRONLY | ag::file::TRUNC);
+    ASSERT_TRUE(ag::file::is_valid(file)) << ag::sys::error_string(ag::sys::error_code());
+    ASSERT_EQ(ag::file::write(file, big_filter.data(), big_filter.size()), big_filter.size());
+    ag::file::close(file);
+    ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), "example.org"));
+
+    std::vector<std::string> domains;
+    for (size_t i = 0; i < 20000; i += 1000) {
+        domains.emplace_back(AG_FMT("domain{}.org", i));
+        domains.emplace_back(AG_FMT("sub.domain{}.org", i));
+        domains.emplace_back(AG_FMT("xdomain{}.org", i + 2));
+        domains.emplace_back(AG_FMT("doain{}.org", i + 3));
+        domains.emplace_back(AG_FMT("host{}.net", i + 4));
+    }
+    domains.emplace_back("example.org");
+
+    ag::dnsfilter::engine_params params = {
+        { { 0, file_by_filter_name(TEST_FILTER_NAME) }, { 1, file_by_filter_name(BIG_FILTER_NAME) } } };
+    for (bool resident : { false, true }) {
+        // the small list fits the limit along with the arena chunk its tables take, the big one does not
+        for (size_t mem_limit : { (size_t)0, (size_t)64 * 1024 }) {
+            params.resident_rules = resident;
+            params.mem_limit = mem_limit;
+            params.load_threads_num = 1;
+            auto [handle, err_or_warn] = filter.create(params);
+            ASSERT_TRUE(handle) << *err_or_warn;
+            params.load_threads_num = 4;
+            auto [parallel_handle, parallel_err_or_warn] = filter.create(params);
+            ASSERT_TRUE(parallel_handle) << *parallel_err_or_warn;
+            ASSERT_EQ(err_or_warn, parallel_err_or_warn);
+            ASSERT_EQ(mem_limit != 0, err_or_warn.has_value());
+
+            for (const std::string &d : domains) {
+                std::vector<ag::dnsfilter::rule> rules = filter.match(handle, d);
+                std::vector<ag::dnsfilter::rule> parallel_rules = filter.match(parallel_handle, d);
+                ASSERT_EQ(rules.size(), parallel_rules.size()) << d;
+                ASSERT_EQ(mem_limit == 0 || d == "example.org", !rules.empty()) << d;
+                for (size_t i = 0; i < rules.size(); ++i) {
+                    ASSERT_EQ(rules[i].text, parallel_rules[i].text);
+                    ASSERT_EQ(rules[i].filter_id, parallel_rules[i].filter_id);
+                }
+            }
+
+            filter.destroy(handle);
+            filter.destroy(parallel_handle);
+        }
+    }
+
+    std::remove(file_by_filter_name(BIG_FILTER_NAME).c_str());
+}
+
+TEST_F(dnsfilter_test, match_cache) {
+    ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), "||example.org^"));
+    ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), "@@sub.example.org"));
+
+    ag::dnsfilter::engine_params params = { { { 0, file_by_filter_name(TEST_FILTER_NAME) } } };
+    params.match_cache_size = 2;
+    auto [handle, err_or_warn] = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+
+    ASSERT_EQ(filter.match(handle, "sub.example.org").size(), 2);
+    ASSERT_EQ(filter.match(handle, "SUB.EXAMPLE.ORG").size(), 2);
+    ASSERT_EQ(filter.match(handle, "example.com").size(), 0);
+    ag::dnsfilter::match_cache_stats stats = filter.get_match_cache_stats(handle);
+    ASSERT_EQ(stats.hits, 1);
+    ASSERT_EQ(stats.misses, 2);
+    ASSERT_EQ(stats.size, 2);
+    ASSERT_EQ(stats.capacity, 2);
+
+    // the rules are not read from the file anymore for the cached domains
+    std::remove(file_by_filter_name(TEST_FILTER_NAME).c_str());
+    std::vector<ag::dnsfilter::rule> rules = filter.match(handle, "sub.example.org");
+    ASSERT_EQ(rules.size(), 2);
+    ASSERT_EQ(rules[0].text, "||example.org^");
+    ASSERT_EQ(rules[1].text, "@@sub.example.org");
+
+    // the least recently used domain is evicted
+    ASSERT_EQ(filter.match(handle, "example.net").size(), 0);
+    ASSERT_EQ(filter.match(handle, "example.org").size(), 0);
+    stats = filter.get_match_cache_stats(handle);
+    ASSERT_EQ(stats.hits, 2);
+    ASSERT_EQ(stats.misses, 4);
+    ASSERT_EQ(stats.size, 2);
+
+    const ag::dnsfilter::match_target TARGETS[] = { { "example.org", {} }, { "example.com", {} } };
+    ag::dnsfilter::match_context ctx;
+    std::vector<std::vector<ag::dnsfilter::rule_view>> &batch =
+        filter.match_batch(handle, TARGETS, std::size(TARGETS), ctx);
+    ASSERT_EQ(batch[0].size(), 0);
+    ASSERT_EQ(batch[1].size(), 0);
+    ASSERT_EQ(filter.get_match_cache_stats(handle).hits, 3);
+
+    filter.destroy(handle);
+
+    // the cache is disabled by default
+    ag::file::close(ag::file::open(file_by_filter_name(TEST_FILTER_NAME), ag::file::CREAT | ag::file::WRONLY));
+    ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), "||example.org^"));
+    params.match_cache_size = 0;
+    std::tie(handle, err_or_warn) = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+    ASSERT_EQ(filter.match(handle, "example.org").size(), 1);
+    stats = filter.get_match_cache_stats(handle);
+    ASSERT_EQ(stats.hits + stats.misses + stats.size + stats.capacity, 0);
+    filter.destroy(handle);
+}
+
+TEST_F(dnsfilter_test, merged_filters) {
+    // the lists share rules and shortcuts, and badfilter rules of a list affect the other lists
+    const std::vector<std::vector<std::string>> LISTS =
+        {
+            {
+                "example.org", "||tracker.com^", "*banner*", "/ad[sv]ert/", "1.2.3.4 hosts.net", "10.0.0.0/8",
+                "/^\\d+\\.\\d+\\.\\d+\\.\\d{3}$/", "10.*.100",
+            },
+            { "example.org", "@@||sub.example.org^", "banners.com", "/ad[sv]ert/", "*track*", "@@10.1.0.0/16" },
+            { "example.org$badfilter", "0.0.0.0 hosts.net", "||tracker.com^$important", "@@*banner*", "10.0.0.0/8" },
+            {},
+            { "*track*$badfilter", "example.org$important", "10.0.0.0/8$badfilter" },
+        };
+    const std::vector<std::string> DOMAINS =
+        {
+            "example.org", "sub.example.org", "a.tracker.com", "tracker.com", "banners.com", "xbanner.net",
+            "advert.org", "hosts.net", "example.com", "", "1.2.3.4", "10.1.2.3", "10.2.0.1", "10.1.2.100",
+        };
+
+    ag::dnsfilter::engine_params params;
+    ASSERT_NO_FATAL_FAILURE(write_filter_lists(LISTS, params));
+
+    for (bool resident : { false, true }) {
+        params.resident_rules = resident;
+        params.merge_filters = false;
+        auto [handle, err_or_warn] = filter.create(params);
+        ASSERT_TRUE(handle) << *err_or_warn;
+        params.merge_filters = true;
+        auto [merged_handle, merged_err_or_warn] = filter.create(params);
+        ASSERT_TRUE(merged_handle) << *merged_err_or_warn;
+
+        ag::dnsfilter::match_context ctx;
+        ag::dnsfilter::match_context merged_ctx;
+        for (const std::string &d : DOMAINS) {
+            std::vector<ag::dnsfilter::rule> rules = filter.match(handle, d);
+            std::vector<ag::dnsfilter::rule> merged_rules = filter.match(merged_handle, d);
+            ASSERT_EQ(rules.size(), merged_rules.size()) << d;
+            for (size_t i = 0; i < rules.size(); ++i) {
+                ASSERT_EQ(rules[i].text, merged_rules[i].text) << d;
+                ASSERT_EQ(rules[i].filter_id, merged_rules[i].filter_id) << d;
+                ASSERT_EQ(rules[i].props, merged_rules[i].props) << d;
+            }
+
+            // the raw addresses are matched against the same rules in the same order as well
+            ag::socket_address addr(d, 0);
+            if (!addr.valid()) {
+                continue;
+            }
+            std::vector<ag::dnsfilter::rule_view> &views = filter.match_address(handle, addr.addr(), ctx);
+            std::vector<ag::dnsfilter::rule_view> &merged_views =
+                filter.match_address(merged_handle, addr.addr(), merged_ctx);
+            ASSERT_EQ(views.size(), merged_views.size()) << d;
+            for (size_t i = 0; i < views.size(); ++i) {
+                ASSERT_EQ(views[i].text, merged_views[i].text) << d;
+                ASSERT_EQ(views[i].filter_id, merged_views[i].filter_id) << d;
+            }
+        }
+        // an address pattern and a regex without literal of the same list, and an exception network
+        // (the `10.0.0.0/8` networks are disabled by the badfilter rule)
+        ag::socket_address addr("10.1.2.100", 0);
+        ASSERT_EQ(filter.match_address(merged_handle, addr.addr(), merged_ctx).size(), 3);
+
+        std::vector<ag::dnsfilter::rule> rules = filter.match(merged_handle, "example.org");
+        ASSERT_EQ(rules.size(), 1);
+        ASSERT_EQ(rules[0].filter_id, 4);
+
+        filter.destroy(handle);
+        filter.destroy(merged_handle);
+    }
+}
+
+TEST_F(dnsfilter_test, deduplicate_rules) {
+    // the lists share rules of each kind, a list has a rule twice, and a badfilter rule disables
+    // one of the shared rules
+    const std::vector<std::vector<std::string>> LISTS =
+        {
+            { "||example.org^", "0.0.0.0 hosts.net", "*banner*", "/ad[sv]ert/", "/^x.*y$/", "10.0.0.0/8" },
+            { "@@||sub.example.org^", "||example.org^", "*banner*", "||example.org^", "/^x.*y$/", "10.0.0.0/8" },
+            { "0.0.0.0 hosts.net", "/ad[sv]ert/", "@@||sub.example.org^", "*banner*$badfilter", "example.com" },
+            { "example.com", "||example.org^" },
+        };
+    const std::vector<std::string> DOMAINS =
+        {
+            "example.org", "sub.example.org", "hosts.net", "xbanner.net", "advert.org", "xzy",
+            "example.com", "10.1.2.3", "example.net",
+        };
+
+    ag::dnsfilter::engine_params params;
+    ASSERT_NO_FATAL_FAILURE(write_filter_lists(LISTS, params));
+
+    for (bool resident : { false, true }) {
+        for (bool merge : { false, true }) {
+            for (bool trie : { false, true }) {
+                params.resident_rules = resident;
+                params.merge_filters = merge;
+                params.domain_trie = trie;
+                params.deduplicate_rules = false;
+                auto [handle, err_or_warn] = filter.create(params);
+                ASSERT_TRUE(handle) << *err_or_warn;
+                params.deduplicate_rules = true;
+                auto [dedup_handle, dedup_err_or_warn] = filter.create(params);
+                ASSERT_TRUE(dedup_handle) << *dedup_err_or_warn;
+
+                // the same rules are matched with the same filter ids
+                for (const std::string &d : DOMAINS) {
+                    std::vector<ag::dnsfilter::rule> rules = filter.match(handle, d);
+                    std::vector<ag::dnsfilter::rule> dedup_rules = filter.match(dedup_handle, d);
+                    ASSERT_EQ(rules.size(), dedup_rules.size()) << d << " " << resident << merge << trie;
+                    for (size_t i = 0; i < rules.size(); ++i) {
+                        ASSERT_EQ(rules[i].text, dedup_rules[i].text) << d;
+                        ASSERT_EQ(rules[i].filter_id, dedup_rules[i].filter_id) << d;
+                        ASSERT_EQ(rules[i].props, dedup_rules[i].props) << d;
+                    }
+                }
+
+                // a shared rule is reported once with the id of the first list containing it
+                std::vector<ag::dnsfilter::rule> rules = filter.match(dedup_handle, "example.org");
+                ASSERT_EQ(rules.size(), 1);
+                ASSERT_EQ(rules[0].filter_id, 0);
+                rules = filter.match(dedup_handle, "sub.example.org");
+                ASSERT_EQ(rules.size(), 2);
+                std::vector<const ag::dnsfilter::rule *> effective = ag::dnsfilter::get_effective_rules(rules);
+                ASSERT_EQ(effective.size(), 1);
+                ASSERT_EQ(effective[0]->text, "@@||sub.example.org^");
+                ASSERT_EQ(effective[0]->filter_id, 1);
+                rules = filter.match(dedup_handle, "example.com");
+                ASSERT_EQ(rules.size(), 1);
+                ASSERT_EQ(rules[0].filter_id, 2);
+                // the rules disabled by a badfilter rule stay disabled
+                ASSERT_EQ(filter.match(dedup_handle, "xbanner.net").size(), 0);
+
+                filter.destroy(handle);
+                filter.destroy(dedup_handle);
+            }
+        }
+    }
+}
+
+TEST_F(dnsfilter_test, leftovers_prefilter) {
+    const std::vector<std::string> RULES =
+        {
+            "/^ad[0-9]+\\./",
+            "ex*le",
+            "/^x[0-9]+\\.net$/",
+            "/^\\d+\\.\\d+\\./", // no shortcuts at all
+        };
+    const std::string FILTER1 = file_by_filter_name(TEST_FILTER_NAME + "1");
+    const std::string FILTER2 = file_by_filter_name(TEST_FILTER_NAME + "2");
+    ag::file::close(ag::file::open(FILTER1, ag::file::CREAT | ag::file::WRONLY));
+    ag::file::close(ag::file::open(FILTER2, ag::file::CREAT | ag::file::WRONLY));
+    for (size_t i = 0; i < RULES.size(); ++i) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), RULES[i]));
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter((i % 2 == 0) ? FILTER1 : FILTER2, RULES[i]));
+    }
+
+    const std::vector<std::pair<std::string_view, size_t>> DOMAINS =
+        {
+            { "ad1.example.com", 2 },
+            { "x1234.net", 1 },
+            { "ad12345.com", 1 },
+            { "abcd.com", 0 },
+            { "adx.org", 0 },
+            { "1.2.test.org", 1 },
+            { "a.1.2.org", 0 },
+        };
+    for (bool resident_rules : { false, true }) {
+        for (bool several_lists : { false, true }) {
+            ag::dnsfilter::engine_params params;
+            if (several_lists) {
+                params.filters = { { 1, FILTER1 }, { 2, FILTER2 } };
+            } else {
+                params.filters = { { 0, file_by_filter_name(TEST_FILTER_NAME) } };
+            }
+            params.resident_rules = resident_rules;
+            auto [handle, err_or_warn] = filter.create(params);
+            ASSERT_TRUE(handle) << *err_or_warn;
+
+            for (const auto &[domain, matches_num] : DOMAINS) {
+                std::vector<ag::dnsfilter::rule> rules = filter.match(handle, domain);
+                ASSERT_EQ(rules.size(), matches_num) << domain << " resident=" << resident_rules;
+            }
+
+            filter.destroy(handle);
+        }
+    }
+
+    std::remove(FILTER1.c_str());
+    std::remove(FILTER2.c_str());
+}
+
+TEST_F(dnsfilter_test, rarest_shortcuts) {
+    // the rules share `track`, so each one has to get a rarer substring,
+    // and the rule with a 3-byte literal only is found by it instead of being a leftover
+    const std::vector<std::string> RULES =
+        {
+            "*trk*",
+            "track*er1",
+            "*tracker2*",
+            "*tracker3*",
+            "ex*le",
+        };
+    const std::string FILTER1 = file_by_filter_name(TEST_FILTER_NAME + "1");
+    const std::string FILTER2 = file_by_filter_name(TEST_FILTER_NAME + "2");
+    ag::file::close(ag::file::open(FILTER1, ag::file::CREAT | ag::file::WRONLY));
+    ag::file::close(ag::file::open(FILTER2, ag::file::CREAT | ag::file::WRONLY));
+    for (size_t i = 0; i < RULES.size(); ++i) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), RULES[i]));
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter((i % 2 == 0) ? FILTER1 : FILTER2, RULES[i]));
+    }
+
+    const std::vector<std::pair<std::string_view, size_t>> DOMAINS =
+        {
+            { "trk.example.com", 2 },
+            { "tracker1.com", 1 },
+            { "tracker2.tracker3.org", 2 },
+            { "tracking.org", 0 },
+            { "tr.com", 0 },
+        };
+    for (bool resident_rules : { false, true }) {
+        for (bool several_lists : { false, true }) {
+            ag::dnsfilter::engine_params params;
+            if (several_lists) {
+                params.filters = { { 1, FILTER1 }, { 2, FILTER2 } };
+            } else {
+                params.filters = { { 0, file_by_filter_name(TEST_FILTER_NAME) } };
+            }
+            params.resident_rules = resident_rules;
+            auto [handle, err_or_warn] = filter.create(params);
+            ASSERT_TRUE(handle) << *err_or_warn;
+
+            for (const auto &[domain, matches_num] : DOMAINS) {
+                std::vector<ag::dnsfilter::rule> rules = filter.match(handle, domain);
+                ASSERT_EQ(rules.size(), matches_num) << domain << " resident=" << resident_rules;
+            }
+
+            filter.destroy(handle);
+        }
+    }
+
+    std::remove(FILTER1.c_str());
+    std::remove(FILTER2.c_str());
+}
+
+TEST_F(dnsfilter_test, shortcuts_matcher) {
+    const std::vector<std::string> PATTERNS =
+        { "examp", "xampl", "ample", "mple.", "ple.o", "le.or", "e.org", "ads.e", "a", "aa", "aaa", "ads", "xampl" };
+    const std::vector<std::string> TEXTS =
+        { "", "a", "aaaa", "example.org", "ads.example.org", "sub.eexample.orgg", "aads.exampl", "nothing.com" };
+
+    aho_corasick matcher;
+    std::vector<uint32_t> ids;
+    for (const std::string &p : PATTERNS) {
+        ids.push_back(matcher.add(p));
+    }
+    matcher.build();
+    ASSERT_EQ(matcher.size(), PATTERNS.size() - 1); // one pattern is duplicated
+    ASSERT_EQ(ids.front() + 1, ids[1]);
+    ASSERT_EQ(ids[1], ids.back());
+
+    for (const std::string &text : TEXTS) {
+        SPDLOG_INFO("testing {}", text);
+        std::vector<uint32_t> found;
+        matcher.search(text, [&found] (uint32_t id) { found.push_back(id); });
+
+        std::vector<uint32_t> expected;
+        for (size_t i = 0; i < text.length(); ++i) {
+            for (size_t j = 0; j < PATTERNS.size() - 1; ++j) {
+                const std::string &p = PATTERNS[j];
+                if (i + 1 >= p.length() && 0 == text.compare(i + 1 - p.length(), p.length(), p)) {
+                    expected.push_back(ids[j]);
+                }
+            }
+        }
+
+        std::sort(found.begin(), found.end());
+        std::sort(expected.begin(), expected.end());
+        ASSERT_EQ(found, expected);
+    }
+}
+
+TEST_F(dnsfilter_test, leftovers_matcher) {
+    const std::vector<std::string_view> LITERALS = { "ab", "", "", "", "cd" };
+    std::vector<std::pair<uint32_t, std::string>> regexes =
+        {
+            { 1, "^ad[0-9]+\\." },
+            { 2, "(ab)\\1" }, // can't be combined with the other regexes
+            { 3, "" },
+        };
+
+    leftovers_matcher matcher;
+    matcher.build(LITERALS, regexes);
+    ASSERT_EQ(matcher.literal_entries_num(), 2);
+    ASSERT_EQ(matcher.combined_regexes_num(), 1);
+    ASSERT_EQ(matcher.unfiltered_entries_num(), 2);
+    ASSERT_EQ(matcher.regexes(), regexes);
+
+    const std::vector<std::pair<std::string_view, std::vector<uint32_t>>> TESTS =
+        {
+            { "xxcd.ab.com", { 0, 2, 3, 4 } },
+            { "abab.ab.com", { 0, 2, 3 } },
+            { "ad1.com", { 1, 2, 3 } },
+            { "xad1.com", { 2, 3 } },
+            { "", { 2, 3 } },
+        };
+    std::vector<uint32_t> candidates = { 42 };
+    for (const auto &[host, expected] : TESTS) {
+        matcher.search(host, candidates);
+        ASSERT_EQ(candidates, expected) << host;
+    }
+}
+
+TEST_F(dnsfilter_test, bloom_filter) {
+    constexpr uint32_t KEYS_NUM = 50000;
+    auto key_of = [] (uint32_t i) { return ag::utils::hash(AG_FMT("domain{}.com", i)); };
+
+    bloom_filter bloom(KEYS_NUM);
+    ASSERT_GT(bloom.memory_usage(), 0);
+    for (uint32_t i = 0; i < KEYS_NUM; i += 2) {
+        bloom.add(key_of(i));
+    }
+    // no false negatives
+    for (uint32_t i = 0; i < KEYS_NUM; i += 2) {
+        ASSERT_TRUE(bloom.may_contain(key_of(i))) << i;
+    }
+    size_t false_positives = 0;
+    for (uint32_t i = 1; i < KEYS_NUM; i += 2) {
+        false_positives += bloom.may_contain(key_of(i));
+    }
+    // the filter is half-full, so the rate is well below the nominal one
+    ASSERT_LT(false_positives, KEYS_NUM / 2 / 100);
+    ASSERT_LT(bloom.false_positive_rate([] (uint32_t) { return false; }), 0.01);
+
+    // an empty filter does not reject anything, but it is not checked either, so it has no false positives
+    ASSERT_TRUE(bloom_filter().may_contain(key_of(0)));
+    ASSERT_EQ(bloom_filter().false_positive_rate([] (uint32_t) { return false; }), 0);
+}
+
+TEST_F(dnsfilter_test, fingerprint_index) {
+    static constexpr uint64_t KEYS_NUM = 10000;
+    // the low halves of the keys are the same, so a table of 32-bit hashes would mix them up
+    auto key_of = [] (uint64_t i) { return (i << 32) | 0xdeadbeef; };
+
+    fingerprint_index::builder builder(KEYS_NUM);
+    for (uint64_t i = 0; i < KEYS_NUM; ++i) {
+        // every 10th key has several indexes
+        std::vector<uint32_t> indexes(1 + (i % 10 == 0) * 2, (uint32_t)i);
+        builder.add(key_of(i), indexes.data(), indexes.size());
+    }
+    fingerprint_index index = builder.finish();
+    ASSERT_EQ(index.size(), KEYS_NUM);
+
+    auto check = [&key_of] (const fingerprint_index &index) {
+        for (uint64_t i = 0; i < KEYS_NUM; ++i) {
+            std::vector<uint32_t> found;
+            index.find(key_of(i), [&found] (uint32_t idx) { found.push_back(idx); });
+            ASSERT_EQ(found, std::vector<uint32_t>(1 + (i % 10 == 0) * 2, (uint32_t)i)) << i;
+        }
+        for (uint64_t i = KEYS_NUM; i < 2 * KEYS_NUM; ++i) {
+            index.find(key_of(i), [i] (uint32_t) { FAIL() << i; });
+        }
+        size_t keys_num = 0;
+        index.for_each([&keys_num] (uint64_t, const uint32_t *, size_t) { ++keys_num; });
+        ASSERT_EQ(keys_num, KEYS_NUM);
+    };
+    ASSERT_NO_FATAL_FAILURE(check(index));
+
+    // the table is used right from a mapped image
+    std::string path = file_by_filter_name(TEST_FILTER_NAME);
+    ag::file::handle fd = ag::file::open(path, ag::file::WRONLY|ag::file::TRUNC);
+    ASSERT_TRUE(ag::file::is_valid(fd));
+    image_writer writer(fd);
+    index.serialize(writer);
+    ASSERT_TRUE(writer.flush());
+    ag::file::close(fd);
+
+    fd = ag::file::open(path, ag::file::RDONLY);
+    ASSERT_TRUE(ag::file::is_valid(fd));
+    std::vector<uint64_t> image(ag::file::get_size(fd) / sizeof(uint64_t));
+    ASSERT_EQ(ag::file::read(fd, (char *)image.data(), image.size() * sizeof(uint64_t)),
+        (int)(image.size() * sizeof(uint64_t)));
+    ag::file::close(fd);
+
+    fingerprint_index mapped;
+    image_reader reader((const char *)image.data(), image.size() * sizeof(uint64_t));
+    ASSERT_TRUE(mapped.deserialize(reader));
+    ASSERT_EQ(mapped.memory_usage(), 0);
+    ASSERT_NO_FATAL_FAILURE(check(mapped));
+
+    // a truncated image is rejected
+    image_reader truncated((const char *)image.data(), image.size() * sizeof(uint64_t) / 2);
+    ASSERT_FALSE(fingerprint_index().deserialize(truncated));
+
+    // so is a corrupted one: a table without empty slots, where a lookup of an absent key would never stop,
+    // and a postings list which is out of the postings
+    // (the image is the keys number, then the control bytes, the keys, the values and the postings arrays)
+    size_t slots_num = image[1];
+    std::vector<uint64_t> corrupted = image;
+    auto *ctrl = (uint8_t *)&corrupted[2];
+    std::fill(ctrl, ctrl + slots_num, 0);
+    image_reader full((const char *)corrupted.data(), corrupted.size() * sizeof(uint64_t));
+    ASSERT_FALSE(fingerprint_index().deserialize(full));
+
+    corrupted = image;
+    auto *values = (uint32_t *)&corrupted[2 + slots_num / sizeof(uint64_t) + 1 + slots_num + 1];
+    uint32_t *list = std::find_if(values, values + slots_num, [] (uint32_t v) { return (v & (1u << 31)) != 0; });
+    ASSERT_NE(list, values + slots_num);
+    *list = UINT32_MAX - 1;
+    image_reader out_of_postings((const char *)corrupted.data(), corrupted.size() * sizeof(uint64_t));
+    ASSERT_FALSE(fingerprint_index().deserialize(out_of_postings));
+}
+
+TEST_F(dnsfilter_test, table_layouts) {
+    const std::vector<std::string> RULES = { "||example.org^", "@@sub.example.org", "example.com$badfilter",
+        "example.com", "||example.net^" };
+    for (const std::string &rule : RULES) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), rule));
+    }
+
+    // domain -> (number of matched rules, number of effective rules)
+    const std::vector<std::pair<std::string_view, std::pair<size_t, size_t>>> TESTS =
+        {
+            { "example.org", { 1, 1 } },
+            { "sub.example.org", { 2, 1 } },
+            { "example.com", { 0, 0 } },
+            { "a.example.net", { 1, 1 } },
+            { "example.edu", { 0, 0 } },
+        };
+    // (fingerprint tables, domain trie)
+    for (auto [fingerprints, trie] : { std::pair{ true, false }, { false, false }, { true, true } }) {
+        ag::dnsfilter::engine_params params = { { { 10, file_by_filter_name(TEST_FILTER_NAME) } } };
+        params.fingerprint_tables = fingerprints;
+        params.domain_trie = trie;
+        auto [handle, err_or_warn] = filter.create(params);
+        ASSERT_TRUE(handle) << *err_or_warn;
+        for (const auto &[domain, expected] : TESTS) {
+            std::vector<ag::dnsfilter::rule> rules = filter.match(handle, domain);
+            ASSERT_EQ(rules.size(), expected.first) << domain << " " << fingerprints << trie;
+            ASSERT_EQ(ag::dnsfilter::get_effective_rules(rules).size(), expected.second)
+                << domain << " " << fingerprints << trie;
+        }
+        filter.destroy(handle);
+    }
+}
+
+TEST_F(dnsfilter_test, domain_trie) {
+    const std::vector<std::pair<std::string_view, uint32_t>> DOMAINS =
+        {
+            { "example.org", 0 },
+            { "sub.example.org", 1 },
+            { "example.org", 2 },
+            { "org", 3 },
+            { "example.com", 4 },
+            { "a.b.example.com", 5 },
+            { "com.", 6 },
+        };
+    domain_trie::builder builder;
+    for (const auto &[domain, index] : DOMAINS) {
+        builder.add(domain, index);
+    }
+    domain_trie trie = builder.finish();
+    ASSERT_EQ(trie.size(), DOMAINS.size() - 1);
+    // `com` is shared by `example.com` and `a.b.example.com`, and `com.` has the empty label
+    ASSERT_EQ(trie.nodes_num(), 9);
+
+    // the top-level domain is found only by itself
+    const std::vector<std::pair<std::string_view, std::vector<uint32_t>>> TESTS =
+        {
+            { "example.org", { 0, 2 } },
+            { "x.sub.example.org", { 1, 0, 2 } },
+            { "org", { 3 } },
+            { "xorg", {} },
+            { "b.example.com", { 4 } },
+            { "a.b.example.com", { 5, 4 } },
+            { "example.com.", { 6 } },
+            { "com.", { 6 } },
+            { "", {} },
+        };
+    for (const auto &[domain, expected] : TESTS) {
+        std::vector<uint32_t> found;
+        trie.find(domain, [&found] (uint32_t idx) { found.push_back(idx); });
+        std::sort(found.begin(), found.end());
+        std::vector<uint32_t> sorted_expected = expected;
+        std::sort(sorted_expected.begin(), sorted_expected.end());
+        ASSERT_EQ(found, sorted_expected) << domain;
+    }
+
+    std::vector<std::pair<std::string, uint32_t>> enumerated;
+    trie.for_each([&enumerated] (std::string_view domain, const uint32_t *indexes, size_t n) {
+        for (size_t i = 0; i < n; ++i) {
+            enumerated.emplace_back(domain, indexes[i]);
+        }
+    });
+    std::sort(enumerated.begin(), enumerated.end(), [] (const auto &l, const auto &r) { return l.second < r.second; });
+    ASSERT_EQ(enumerated.size(), DOMAINS.size());
+    for (size_t i = 0; i < DOMAINS.size(); ++i) {
+        ASSERT_EQ(enumerated[i].first, DOMAINS[i].first);
+        ASSERT_EQ(enumerated[i].second, DOMAINS[i].second);
+    }
+
+    ASSERT_EQ(domain_trie::builder().finish().size(), 0);
+}
+
+TEST_F(dnsfilter_test, ip_radix) {
+    const std::vector<std::pair<std::string_view, uint32_t>> NETWORKS =
+        {
+            { "10.0.0.0/8", 0 },
+            { "10.1.0.0/16", 1 },
+            { "10.1.2.3/32", 2 },
+            { "10.1.2.3/32", 3 },
+            { "0.0.0.0/0", 4 },
+            { "2001:db8::/32", 5 },
+            { "::1/128", 6 },
+            { "192.168.1.77/24", 7 }, // the host bits are ignored
+        };
+    ip_radix::builder builder;
+    for (const auto &[network, index] : NETWORKS) {
+        std::array<std::string_view, 2> parts = ag::utils::split2_by(network, '/');
+        ag::socket_address addr(parts[0], 0);
+        builder.add(addr.addr(), std::stoi(std::string(parts[1])), index);
+    }
+    ip_radix radix = builder.finish();
+    ASSERT_EQ(radix.size(), NETWORKS.size() - 1);
+    ASSERT_LT(radix.nodes_num(), 2 * NETWORKS.size());
+
+    const std::vector<std::pair<std::string_view, std::vector<uint32_t>>> TESTS =
+        {
+            { "10.1.2.3", { 0, 1, 2, 3, 4 } },
+            { "10.1.2.4", { 0, 1, 4 } },
+            { "10.200.0.1", { 0, 4 } },
+            { "11.0.0.1", { 4 } },
+            { "192.168.1.5", { 4, 7 } },
+            { "192.168.2.5", { 4 } },
+            { "2001:db8:1::1", { 5 } },
+            { "2001:db9::1", {} },
+            { "::1", { 6 } },
+            { "::2", {} },
+        };
+    for (const auto &[address, expected] : TESTS) {
+        std::vector<uint32_t> found;
+        radix.find(ag::socket_address(address, 0).addr(), [&found] (uint32_t idx) { found.push_back(idx); });
+        std::sort(found.begin(), found.end());
+        ASSERT_EQ(found, expected) << address;
+    }
+
+    size_t indexes_num = 0;
+    radix.for_each([&indexes_num] (ag::uint8_view, uint32_t, const uint32_t *, size_t n) { indexes_num += n; });
+    ASSERT_EQ(indexes_num, NETWORKS.size());
+
+    ag::socket_address net("172.16.0.0", 0);
+    ASSERT_TRUE(ip_radix::contains(net.addr(), 12, ag::socket_address("172.31.255.255", 0).addr()));
+    ASSERT_FALSE(ip_radix::contains(net.addr(), 12, ag::socket_address("172.32.0.0", 0).addr()));
+    ASSERT_FALSE(ip_radix::contains(net.addr(), 12, ag::socket_address("::ffff:172.16.0.1", 0).addr()));
+
+    ASSERT_EQ(ip_radix::builder().finish().size(), 0);
+}
+
+TEST_F(dnsfilter_test, address_rules) {
+    const std::vector<std::vector<std::string>> LISTS =
+        {
+            {
+                "10.0.0.0/8", "@@10.1.0.0/16", "||1.2.3.4^", "1.2.3.45", "1.2.3.45$badfilter",
+                "5.6.7.8$important", "@@5.6.7.8", "2001:db8::/32", "172.16.*.1", "/^192\\.168\\./",
+                "||example.org^", "/^\\d+\\.\\d+\\.\\d+\\.\\d{3}$/", "/^exam.*\\.1$/",
+            },
+            { "11.0.0.0/8", "||5.6.7.8^" },
+        };
+    // address -> (number of matched rules, whether it is blocked)
+    const std::vector<std::pair<std::string_view, std::pair<size_t, bool>>> TESTS =
+        {
+            { "10.2.3.4", { 1, true } },
+            { "10.1.2.3", { 2, false } },
+            { "1.2.3.4", { 1, true } },
+            { "1.2.3.44", { 0, false } },
+            { "1.2.3.45", { 0, false } },
+            { "5.6.7.8", { 3, true } },
+            { "2001:db8::1", { 1, true } },
+            { "2001:db9::1", { 0, false } },
+            { "172.16.35.1", { 1, true } },
+            { "192.168.1.1", { 1, true } },
+            { "9.9.9.100", { 1, true } },
+            { "11.1.1.1", { 1, true } },
+            { "8.8.8.8", { 0, false } },
+        };
+
+    ag::dnsfilter::engine_params params;
+    ASSERT_NO_FATAL_FAILURE(write_filter_lists(LISTS, params));
+
+    for (bool resident : { false, true }) {
+        for (bool merge : { false, true }) {
+            params.resident_rules = resident;
+            params.merge_filters = merge;
+            auto [handle, err_or_warn] = filter.create(params);
+            ASSERT_TRUE(handle) << *err_or_warn;
+
+            ag::dnsfilter::match_context ctx;
+            for (const auto &[address, expected] : TESTS) {
+                ag::socket_address addr(address, 0);
+                ASSERT_TRUE(addr.valid()) << address;
+                std::vector<ag::dnsfilter::rule_view> &rules = filter.match_address(handle, addr.addr(), ctx);
+                ASSERT_EQ(rules.size(), expected.first) << address << " " << resident << merge;
+                std::vector<const ag::dnsfilter::rule_view *> effective = ag::dnsfilter::get_effective_rules(rules);
+                ASSERT_EQ(!effective.empty() && !effective[0]->props.test(ag::dnsfilter::RP_EXCEPTION), expected.second)
+                    << address << " " << resident << merge;
+                // the address text matches the same rules
+                ASSERT_EQ(filter.match(handle, address).size(), expected.first) << address << " " << resident << merge;
+            }
+
+            // an address rule does not match the domains containing the address
+            ASSERT_EQ(filter.match(handle, "1.2.3.4.example.com").size(), 0);
+
+            filter.destroy(handle);
+        }
+    }
+}
+
+TEST_F(dnsfilter_test, mem_arena) {
+    mem_arena arena;
+    ASSERT_EQ(arena.chunks_memory(), 0);
+
+    std::vector<std::pair<uint8_t *, size_t>> blocks;
+    size_t total = 0;
+    for (size_t i = 1; i <= 200; ++i) {
+        size_t size = i * 37;
+        size_t align = (size_t)1 << (i % 4);
+        auto *p = (uint8_t *)arena.allocate(size, align);
+        ASSERT_NE(p, nullptr);
+        ASSERT_EQ((uintptr_t)p % align, 0);
+        std::memset(p, (int)i, size);
+        blocks.emplace_back(p, size);
+        total += size;
+    }
+    // a large block gets a chunk of its own
+    size_t chunks_num = arena.chunks_num();
+    auto *large = (uint8_t *)arena.allocate(1024 * 1024, 8);
+    ASSERT_NE(large, nullptr);
+    std::memset(large, 0xff, 1024 * 1024);
+    ASSERT_EQ(arena.chunks_num(), chunks_num + 1);
+    total += 1024 * 1024;
+
+    // the blocks do not overlap
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        ASSERT_EQ(blocks[i].first[0], (uint8_t)(i + 1));
+        ASSERT_EQ(blocks[i].first[blocks[i].second - 1], (uint8_t)(i + 1));
+    }
+    ASSERT_GE(arena.chunks_memory(), total);
+    ASSERT_LT(arena.chunks_memory(), total * 2);
+
+    flat_array<uint32_t> array(std::vector<uint32_t>{ 1, 2, 3 });
+    ASSERT_GT(array.memory_usage(), 0);
+    // a dry run counts the chunks and the released memory without moving the array
+    for (size_t size : { (size_t)3, (size_t)300 * 1024 }) {
+        flat_array<uint32_t> big(std::vector<uint32_t>(size, 7));
+        mem_arena dry_run(arena, mem_arena::dry_run_tag{});
+        big.move_to(dry_run);
+        ASSERT_EQ(big.memory_usage(), dry_run.released_memory());
+        ASSERT_EQ(dry_run.chunks_num(), 0);
+        size_t chunks_memory = arena.chunks_memory();
+        big.move_to(arena);
+        ASSERT_EQ(big.memory_usage(), 0);
+        ASSERT_EQ(arena.chunks_memory(), dry_run.chunks_memory());
+        ASSERT_EQ(arena.chunks_memory() != chunks_memory, size > 3);
+    }
+    array.move_to(arena);
+    ASSERT_EQ(array.memory_usage(), 0);
+    ASSERT_EQ(std::vector<uint32_t>(array.begin(), array.end()), (std::vector<uint32_t>{ 1, 2, 3 }));
+
+    // the regexes compiled with the arena context are accounted in the arena
+    size_t regex_memory = arena.regex_memory();
+    {
+        ag::regex re("^ex(am|an)ple[0-9]+\\.org$", PCRE2_CASELESS, true, arena.regex_context());
+        ASSERT_TRUE(re.is_valid());
+        ASSERT_TRUE(re.match("EXAMPLE1.org"));
+        ASSERT_GT(arena.regex_memory(), regex_memory);
+        ASSERT_GE(re.memory_usage(), arena.regex_memory() - regex_memory - 2 * alignof(std::max_align_t));
+        ag::regex copy = re;
+        ASSERT_TRUE(copy.match("example2.org"));
+    }
+    ASSERT_EQ(arena.regex_memory(), regex_memory);
+}
+
+TEST_F(dnsfilter_test, exact_mem_limit) {
+    const std::vector<std::string> RULES =
+        {
+            "example.org", "||example.com^", "*banner*", "/ad[sv]ert/", "/^track[0-9]+\\./",
+            "1.2.3.4 hosts.net", "10.0.0.0/8", "example.net$badfilter",
+        };
+    std::string name = file_by_filter_name(TEST_FILTER_NAME);
+    for (const std::string &rule : RULES) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(name, rule));
+    }
+
+    for (bool resident : { false, true }) {
+        ag::dnsfilter::engine_params params = { { { 0, name } } };
+        params.resident_rules = resident;
+        mem_arena arena;
+        auto [result, mem_usage] = ::filter().load(params.filters[0], params, arena, 0);
+        ASSERT_EQ(result, ::filter::LR_OK);
+        ASSERT_GT(mem_usage, 0);
+
+        // the limit is enforced against the memory the filter actually takes
+        ASSERT_EQ(::filter().load(params.filters[0], params, arena, mem_usage),
+            std::make_pair(::filter::LR_OK, mem_usage));
+        ASSERT_EQ(::filter().load(params.filters[0], params, arena, mem_usage - 1).first,
+            ::filter::LR_MEM_LIMIT_REACHED);
+
+        // the memory is what the arena and the filter hold once the tables are moved to the arena
+        // (the arena takes a bit for its regex compile context from the start)
+        size_t arena_memory = arena.memory_usage();
+        ::filter f;
+        ASSERT_EQ(f.load(params.filters[0], params, arena, 0), std::make_pair(::filter::LR_OK, mem_usage));
+        f.move_to(arena);
+        ASSERT_EQ(arena.memory_usage() - arena_memory + f.memory_usage(false), mem_usage);
+    }
+}
+
+TEST_F(dnsfilter_test, mem_limit_of_merged_index) {
+    std::vector<std::vector<std::string>> lists =
+        {
+            { "example.org", "||example.com^", "*banner*" },
+            { "example.net", "@@||example.com^", "*track*", "10.0.0.0/8" },
+        };
+    // The regexes without a literal are combined by the prefilter of the index anew, while
+    // the combined regexes of the filters stay in the arena, so the index takes more than it saves
+    for (size_t n = 1; n <= 32; ++n) {
+        lists[0].push_back(AG_FMT("/^\\d{{{}}}\\./", n));
+        lists[1].push_back(AG_FMT("/^\\w{{{}}}-/", n));
+    }
+    ag::dnsfilter::engine_params params;
+    ASSERT_NO_FATAL_FAILURE(write_filter_lists(lists, params));
+
+    // As the limit goes down, the index is left out before the second list
+    bool merged = false;
+    bool not_merged = false;
+    for (size_t limit = 64 * 1024; !(merged && not_merged) && limit > 0; limit -= 16) {
+        params.mem_limit = limit;
+        auto [handle, err_or_warn] = filter.create(params);
+        ASSERT_TRUE(handle);
+        std::string warnings = err_or_warn.value_or("");
+        if (warnings.find("some rules were not loaded") == std::string::npos) {
+            bool index_left_out = warnings.find("tables of filters were not merged") != std::string::npos;
+            ASSERT_TRUE(index_left_out || !not_merged) << limit;
+            (index_left_out ? not_merged : merged) = true;
+            // the index only speeds the matching up
+            ASSERT_EQ(filter.match(handle, "sub.example.com").size(), 2);
+            ASSERT_EQ(filter.match(handle, "my.tracker.org").size(), 1);
+            ASSERT_EQ(filter.match(handle, "12345.org").size(), 1);
+            ASSERT_EQ(filter.match(handle, "abc-12.org").size(), 1);
+        }
+        filter.destroy(handle);
+    }
+    ASSERT_TRUE(merged);
+    ASSERT_TRUE(not_merged);
+}
+
+TEST_F(dnsfilter_test, rules_in_memory) {
+    const std::vector<std::string> RULES =
+        {
+            "example1.org",
+            "@@example2.org",
+            "||example3.org^$important",
+            "*mple4.org",
+            "/mp.*le5.org/",
+            "1.1.1.1 example7.org",
+            "example9.org",
+            "example9.org$badfilter",
+            "10.0.0.0/8",
+        };
+    const std::vector<std::string> DOMAINS =
+        {
+            "example1.org", "example2.org", "sub.example3.org", "example4.org", "subd.example5.org",
+            "example7.org", "example9.org", "example10.org", "10.1.2.3",
+        };
+    const std::string IMAGE_PATH = "./0-memory.compiled";
+
+    std::string rules_text;
+    for (const std::string &rule : RULES) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(file_by_filter_name(TEST_FILTER_NAME), rule));
+        rules_text += rule + "\r\n";
+    }
+    rules_text.resize(rules_text.size() - 2); // the last line has no line break
+
+    for (bool resident : { false, true }) {
+        std::remove(IMAGE_PATH.c_str());
+
+        ag::dnsfilter::engine_params params = { { { 0, file_by_filter_name(TEST_FILTER_NAME) } } };
+        params.resident_rules = resident;
+        auto [handle, err_or_warn] = filter.create(params);
+        ASSERT_TRUE(handle) << *err_or_warn;
+
+        // the engine keeps the buffer alive
+        auto buffer = std::make_shared<std::string>(rules_text);
+        params.filters = { { 0, "", *buffer, buffer } };
+        buffer.reset();
+        auto [buffer_handle, buffer_err_or_warn] = filter.create(params);
+        ASSERT_TRUE(buffer_handle) << *buffer_err_or_warn;
+
+        // the first load compiles the image, the second one maps it
+        params.compiled_filters_dir = ".";
+        auto [compiling_handle, compiling_err_or_warn] = filter.create(params);
+        ASSERT_TRUE(compiling_handle) << *compiling_err_or_warn;
+        auto [image_handle, image_err_or_warn] = filter.create(params);
+        ASSERT_TRUE(image_handle) << *image_err_or_warn;
+        params.compiled_filters_dir.clear();
+
+        // the engine loaded by path reads the file while matching
+        std::vector<std::vector<ag::dnsfilter::rule>> expected;
+        for (const std::string &d : DOMAINS) {
+            expected.emplace_back(filter.match(handle, d));
+        }
+
+        // the descriptor and the file are not needed once the engine is created
+        ag::file::handle fd = ag::file::open(file_by_filter_name(TEST_FILTER_NAME), ag::file::RDONLY);
+        ASSERT_TRUE(ag::file::is_valid(fd));
+        params.filters = { { 0, "" } };
+        params.filters[0].fd = fd;
+        auto [fd_handle, fd_err_or_warn] = filter.create(params);
+        ASSERT_TRUE(fd_handle) << *fd_err_or_warn;
+        ag::file::close(fd);
+        std::string moved_path = file_by_filter_name(TEST_FILTER_NAME + "_moved");
+        ASSERT_EQ(0, std::rename(file_by_filter_name(TEST_FILTER_NAME).c_str(), moved_path.c_str()));
+
+        for (size_t j = 0; j < DOMAINS.size(); ++j) {
+            SPDLOG_INFO("testing {}", DOMAINS[j]);
+            const std::vector<ag::dnsfilter::rule> &rules = expected[j];
+            for (ag::dnsfilter::handle h : { buffer_handle, compiling_handle, image_handle, fd_handle }) {
+                std::vector<ag::dnsfilter::rule> memory_rules = filter.match(h, DOMAINS[j]);
+                ASSERT_EQ(rules.size(), memory_rules.size());
+                for (size_t i = 0; i < rules.size(); ++i) {
+                    ASSERT_EQ(rules[i].text, memory_rules[i].text);
+                    ASSERT_EQ(rules[i].props, memory_rules[i].props);
+                    ASSERT_EQ(rules[i].ip, memory_rules[i].ip);
+                }
+            }
+        }
+
+        ASSERT_EQ(0, std::rename(moved_path.c_str(), file_by_filter_name(TEST_FILTER_NAME).c_str()));
+        filter.destroy(handle);
+        filter.destroy(buffer_handle);
+        filter.destroy(compiling_handle);
+        filter.destroy(image_handle);
+        filter.destroy(fd_handle);
+    }
+
+    // a buffer has no modification time, so the image is rebuilt once the content changes,
+    // even if the size is the same
+    rules_text.replace(rules_text.find("example1.org"), 12, "example0.org");
+    ag::dnsfilter::engine_params params = { { { 0, "", rules_text } } };
+    params.resident_rules = true;
+    params.compiled_filters_dir = ".";
+    auto [handle, err_or_warn] = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+    ASSERT_TRUE(filter.match(handle, "example1.org").empty());
+    std::vector<ag::dnsfilter::rule> rules = filter.match(handle, "example0.org");
+    ASSERT_EQ(rules.size(), 1);
+    ASSERT_EQ(rules[0].text, "example0.org");
+    filter.destroy(handle);
+
+    // an empty buffer makes an empty filter
+    params = { { { 0, "", std::string_view("", 0) } } };
+    std::tie(handle, err_or_warn) = filter.create(params);
+    ASSERT_TRUE(handle) << *err_or_warn;
+    ASSERT_TRUE(filter.match(handle, "example0.org").empty());
+    filter.destroy(handle);
+
+    std::remove(IMAGE_PATH.c_str());
+}
+
+TEST_F(dnsfilter_test, rule_hit_counters) {
+    const std::string FILTER1 = file_by_filter_name(TEST_FILTER_NAME + "1");
+    const std::string FILTER2 = file_by_filter_name(TEST_FILTER_NAME + "2");
+    ag::file::close(ag::file::open(FILTER1, ag::file::CREAT | ag::file::WRONLY));
+    ag::file::close(ag::file::open(FILTER2, ag::file::CREAT | ag::file::WRONLY));
+    for (const char *rule : { "||example.org^", "tracker*ads", "/a.c/" }) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(FILTER1, rule));
+    }
+    for (const char *rule : { "example.org", "1.2.3.4", "172.16.*.1" }) {
+        ASSERT_NO_FATAL_FAILURE(add_rule_in_filter(FILTER2, rule));
+    }
+
+    const std::vector<std::string_view> DOMAINS =
+        { "example.org", "sub.example.org", "trackerXads.com", "example.org", "abc.net", "trackeradS.net",
+          "nothing.com", "example.org" };
+    const std::vector<std::string_view> ADDRESSES = { "1.2.3.4", "172.16.5.1", "5.6.7.8" };
+    // the ties are in the filters order, and in the order of the rules in a filter
+    const std::vector<std::tuple<int32_t, std::string_view, uint64_t>> EXPECTED_TOP =
+        {
+            { 1, "||example.org^", 4 },
+            { 2, "example.org", 3 },
+            { 1, "tracker*ads", 2 },
+            { 1, "/a.c/", 1 },
+            { 2, "1.2.3.4", 1 },
+            { 2, "172.16.*.1", 1 },
+        };
+    // filter -> matched per table
+    const uint64_t EXPECTED_MATCHED[2][ag::dnsfilter::MT_NUM] =
+        {
+            { 0, 4, 2, 1, 0 },
+            { 1, 3, 0, 0, 1 },
+        };
+
+    for (bool resident_rules : { false, true }) {
+        for (bool merge_filters : { false, true }) {
+            ag::dnsfilter::engine_params params = { { { 1, FILTER1 }, { 2, FILTER2 } } };
+            params.resident_rules = resident_rules;
+            params.merge_filters = merge_filters;
+            params.count_rule_hits = true;
+            auto [handle, err_or_warn] = filter.create(params);
+            ASSERT_TRUE(handle) << *err_or_warn;
+
+            ag::dnsfilter::match_context ctx;
+            for (std::string_view domain : DOMAINS) {
+                filter.match(handle, domain, ctx);
+            }
+            for (std::string_view address : ADDRESSES) {
+                ag::socket_address addr(address, 0);
+                filter.match_address(handle, addr.addr(), ctx);
+            }
+
+            ag::dnsfilter::hit_stats stats = filter.get_hit_stats(handle, 3);
+            ASSERT_EQ(stats.top_rules.size(), 3);
+            stats = filter.get_hit_stats(handle, 100);
+            ASSERT_EQ(stats.top_rules.size(), EXPECTED_TOP.size());
+            for (size_t i = 0; i < EXPECTED_TOP.size(); ++i) {
+                const auto &[filter_id, text, hits] = EXPECTED_TOP[i];
+                ASSERT_EQ(stats.top_rules[i].filter_id, filter_id) << i;
+                ASSERT_EQ(stats.top_rules[i].text, text) << i;
+                ASSERT_EQ(stats.top_rules[i].hits, hits) << i;
+            }
+
+            ASSERT_EQ(stats.filters.size(), 2);
+            uint64_t matched = 0;
+            for (size_t f = 0; f < stats.filters.size(); ++f) {
+                ASSERT_EQ(stats.filters[f].filter_id, (int32_t)f + 1);
+                for (size_t t = 0; t < ag::dnsfilter::MT_NUM; ++t) {
+                    const ag::dnsfilter::table_hits &table = stats.filters[f].tables[t];
+                    ASSERT_EQ(table.matched, EXPECTED_MATCHED[f][t]) << f << " " << t;
+                    ASSERT_GE(table.candidates, table.matched) << f << " " << t;
+                    matched += table.matched;
+                }
+            }
+            ASSERT_EQ(stats.matched, matched);
+            ASSERT_GE(stats.candidates, stats.matched);
+
+            filter.destroy(handle);
+        }
+    }
+
+    // the hits are not counted unless asked
+    auto [handle, err_or_warn] = filter.create({ { { 1, FILTER1 } } });
+    ASSERT_TRUE(handle) << *err_or_warn;
+    filter.match(handle, "example.org");
+    ag::dnsfilter::hit_stats stats = filter.get_hit_stats(handle, 10);
+    ASSERT_TRUE(stats.top_rules.empty());
+    ASSERT_TRUE(stats.filters.empty());
+    ASSERT_EQ(stats.candidates, 0);
+    filter.destroy(handle);
+
+    std::remove(FILTER1.c_str());
+    std::remove(FILTER2.c_str());
+}
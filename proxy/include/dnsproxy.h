@@ -35,6 +35,21 @@ public:
      */
     void deinit();
 
+    /**
+     * @brief Replace the filtering engine without reinitializing the proxy
+     *
+     * The new engine is created on the calling thread, meanwhile the messages are being
+     * filtered by the current one. Once created, the new engine is used for the messages
+     * processed after the call, while the ones in process finish with the previous engine.
+     * The cached responses filtered by the previous engine are not used anymore.
+     * If the new engine fails to be created, the current one is kept.
+     * Must not be called concurrently with `get_settings`.
+     *
+     * @param filter_params new filtering engine parameters (see `dnsfilter::engine_params`)
+     * @return {true, opt_warning_description} or {false, error_description}
+     */
+    std::pair<bool, err_string> update_filter(dnsfilter::engine_params filter_params);
+
     /**
      * @brief Get the DNS proxy settings
      * @return Current settings
@@ -596,7 +596,7 @@ std::pair<bool, err_string> dns_forwarder::init(const dnsproxy_settings &setting
         this->deinit();
         return {false, std::move(err_or_warn)};
     }
-    this->filter_handle = handle;
+    this->engine.replace(handle);
     if (err_or_warn) {
         warnlog(log, "Filtering module initialized with warnings:\n{}", *err_or_warn);
     } else {
@@ -663,13 +663,31 @@ void dns_forwarder::deinit() {
     this->settings = nullptr;
     this->upstreams.clear();
     this->fallbacks.clear();
-    this->filter.destroy(this->filter_handle);
+    this->engine.replace(nullptr);
     {
         std::scoped_lock l(this->response_cache.mtx);
         this->response_cache.val.clear();
     }
 }
 
+std::pair<bool, err_string> dns_forwarder::update_filter(const dnsfilter::engine_params &filter_params) {
+    infolog(log, "Updating the filtering module...");
+    auto [handle, err_or_warn] = this->filter.create(filter_params);
+    if (!handle) {
+        errlog(log, "Failed to update the filtering module, the previous one is kept");
+        return {false, std::move(err_or_warn)};
+    }
+    // the cached responses are not used anymore since they have passed the previous engine
+    // (see `create_response_from_cache`)
+    this->engine.replace(handle);
+    if (err_or_warn) {
+        warnlog(log, "Filtering module updated with warnings:\n{}", *err_or_warn);
+    } else {
+        infolog(log, "Filtering module updated");
+    }
+    return {true, std::move(err_or_warn)};
+}
+
 static bool has_unsupported_extensions(const ldns_pkt *pkt) {
     return ldns_pkt_edns_data(pkt)
            || ldns_pkt_edns_extended_rcode(pkt)
@@ -677,7 +695,8 @@ static bool has_unsupported_extensions(const ldns_pkt *pkt) {
 }
 
 // Returns a response synthesized from the cached template, or nullptr if no cache entry satisfies the given key
-cached_result dns_forwarder::create_response_from_cache(const std::string &key, const ldns_pkt *request) {
+cached_result dns_forwarder::create_response_from_cache(const std::string &key, const ldns_pkt *request,
+                                                        uint32_t filter_generation) {
     if (!this->settings->dns_cache_size) { // Caching disabled
         return {nullptr, std::nullopt};
     }
@@ -700,6 +719,13 @@ cached_result dns_forwarder::create_response_from_cache(const std::string &key,
             return {nullptr, std::nullopt};
         }
 
+        if (cached_response_acc->filter_generation != filter_generation) {
+            // the filtering engine has been replaced since the response was cached
+            cache.make_lru(cached_response_acc);
+            dbglog(log, "{}: Cache entry for key {} was filtered by the previous engine", __func__, key);
+            return {nullptr, std::nullopt};
+        }
+
         upstream_id = cached_response_acc->upstream_id;
         auto cached_response_ttl = ceil<seconds>(cached_response_acc->expires_at - ag::steady_clock::now());
         if (cached_response_ttl.count() <= 0) {
@@ -757,7 +783,8 @@ uint32_t compute_min_rr_ttl(const ldns_pkt *pkt) {
 }
 
 // Checks cacheability and puts an eligible response to the cache
-void dns_forwarder::put_response_to_cache(std::string key, ldns_pkt_ptr response, std::optional<int32_t> upstream_id) {
+void dns_forwarder::put_response_to_cache(std::string key, ldns_pkt_ptr response, std::optional<int32_t> upstream_id,
+                                          uint32_t filter_generation) {
     if (!this->settings->dns_cache_size) {
         // Caching disabled
         return;
@@ -808,6 +835,7 @@ void dns_forwarder::put_response_to_cache(std::string key, ldns_pkt_ptr response
         .response = std::move(response),
         .expires_at = ag::steady_clock::now() + seconds(min_rr_ttl),
         .upstream_id = upstream_id,
+        .filter_generation = filter_generation,
     };
 
     std::unique_lock l(this->response_cache.mtx);
@@ -848,7 +876,10 @@ std::vector<uint8_t> dns_forwarder::handle_message(uint8_view message) {
 
     std::string cache_key = get_cache_key(request);
 
-    auto [cached_response, upstream_id] = create_response_from_cache(cache_key, request);
+    // The generation is taken before any filtering, so a response filtered by the engine
+    // published in the middle of the processing is not reused after that
+    uint32_t filter_generation = this->engine.generation();
+    auto [cached_response, upstream_id] = create_response_from_cache(cache_key, request, filter_generation);
     if (cached_response) {
         dbglog_fid(log, request, "Cached response found");
         log_packet(log, cached_response.get(), "Cached response");
@@ -942,20 +973,9 @@ have_answer:
     const auto rcode = ldns_pkt_get_rcode(response.get());
 
     if (LDNS_RCODE_NOERROR == rcode) {
-        for (size_t i = 0; i < ancount; ++i) {
-            // CNAME response blocking
-            auto rr = ldns_rr_list_rr(ldns_pkt_answer(response.get()), i);
-            if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_CNAME) {
-                if (auto raw_response = apply_cname_filter(rr, request, response.get(), event, effective_rules)) {
-                    return *raw_response;
-                }
-            }
-            // IP response blocking
-            if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_A || ldns_rr_get_type(rr) == LDNS_RR_TYPE_AAAA) {
-                if (auto raw_response = apply_ip_filter(rr, request, response.get(), event, effective_rules)) {
-                    return *raw_response;
-                }
-            }
+        // CNAME and IP response blocking
+        if (auto raw_response = apply_response_filter(request, response.get(), event, effective_rules)) {
+            return *raw_response;
         }
 
         // DNS64 synthesis
@@ -982,25 +1002,22 @@ have_answer:
     finalize_processed_event(event, request, response.get(), nullptr,
             (successful_upstream ? std::make_optional(successful_upstream->options().id) : std::nullopt), std::nullopt);
     put_response_to_cache(std::move(cache_key), std::move(response),
-            (successful_upstream ? std::make_optional(successful_upstream->options().id) : std::nullopt));
+            (successful_upstream ? std::make_optional(successful_upstream->options().id) : std::nullopt),
+            filter_generation);
     return raw_response;
 }
 
-std::optional<uint8_vector> dns_forwarder::apply_cname_filter(const ldns_rr *cname_rr,
-                                                              const ldns_pkt *request,
-                                                              const ldns_pkt *response,
-                                                              dns_request_processed_event &event,
-                                                              std::vector<dnsfilter::rule> &last_effective_rules) {
+bool dns_forwarder::get_response_cname(const ldns_rr *cname_rr, const ldns_pkt *response, std::string &out) {
     assert(ldns_rr_get_type(cname_rr) == LDNS_RR_TYPE_CNAME);
 
     auto rdf = ldns_rr_rdf(cname_rr, 0);
     if (!rdf) {
-        return std::nullopt;
+        return false;
     }
 
     allocated_ptr<char> cname_ptr(ldns_rdf2str(rdf));
     if (!cname_ptr) {
-        return std::nullopt;
+        return false;
     }
 
     std::string_view cname = cname_ptr.get();
@@ -1010,14 +1027,11 @@ std::optional<uint8_vector> dns_forwarder::apply_cname_filter(const ldns_rr *cna
 
     tracelog_fid(log, response, "Response CNAME: {}", cname);
 
-    return apply_filter(cname, request, response, event, last_effective_rules);
+    out.assign(cname);
+    return true;
 }
 
-std::optional<uint8_vector> dns_forwarder::apply_ip_filter(const ldns_rr *rr,
-                                                           const ldns_pkt *request,
-                                                           const ldns_pkt *response,
-                                                           dns_request_processed_event &event,
-                                                           std::vector<dnsfilter::rule> &last_effective_rules) {
+std::optional<uint8_view> dns_forwarder::get_response_ip(const ldns_rr *rr, const ldns_pkt *response) {
     assert(ldns_rr_get_type(rr) == LDNS_RR_TYPE_A || ldns_rr_get_type(rr) == LDNS_RR_TYPE_AAAA);
 
     auto rdf = ldns_rr_rdf(rr, 0);
@@ -1026,11 +1040,57 @@ std::optional<uint8_vector> dns_forwarder::apply_ip_filter(const ldns_rr *rr,
         return std::nullopt;
     }
     uint8_view addr{ldns_rdf_data(rdf), ldns_rdf_size(rdf)};
-    std::string addr_str = ag::utils::addr_to_str(addr);
 
-    tracelog_fid(log, response, "Response IP: {}", addr_str);
+    tracelog_fid(log, response, "Response IP: {}", ag::utils::addr_to_str(addr));
 
-    return apply_filter(addr_str, request, response, event, last_effective_rules);
+    return addr;
+}
+
+// Matches all the CNAMEs and addresses of the answer section in a single batch, then applies the results
+// in the answer order, so the effective rules are chained the same way as with one-by-one matching.
+// The addresses are matched by their raw bytes against the address rules, without formatting them.
+std::optional<uint8_vector> dns_forwarder::apply_response_filter(const ldns_pkt *request,
+                                                                 const ldns_pkt *response,
+                                                                 dns_request_processed_event &event,
+                                                                 std::vector<dnsfilter::rule> &last_effective_rules) {
+    // the context and the targets are reused by all the responses processed on the thread
+    static thread_local dnsfilter::match_context match_ctx;
+    static thread_local std::vector<std::string> cnames;
+    static thread_local std::vector<dnsfilter::match_target> targets;
+    const size_t ancount = ldns_pkt_ancount(response);
+    // the targets refer to the CNAMEs, so the CNAMEs vector must not be reallocated while it is filled
+    if (cnames.size() < ancount) {
+        cnames.resize(ancount);
+    }
+    size_t cnames_num = 0;
+    targets.clear();
+    for (size_t i = 0; i < ancount; ++i) {
+        auto rr = ldns_rr_list_rr(ldns_pkt_answer(response), i);
+        if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_CNAME) {
+            if (get_response_cname(rr, response, cnames[cnames_num])) {
+                targets.push_back({cnames[cnames_num++], {}});
+            }
+        } else if (ldns_rr_get_type(rr) == LDNS_RR_TYPE_A || ldns_rr_get_type(rr) == LDNS_RR_TYPE_AAAA) {
+            if (std::optional<uint8_view> addr = get_response_ip(rr, response)) {
+                targets.push_back({{}, addr.value()});
+            }
+        }
+    }
+
+    // a response passed the request filtering, so without the engine nothing can block it
+    filter_engine::ref engine = this->engine.acquire();
+    if (engine.handle() == nullptr || targets.empty()) {
+        return std::nullopt;
+    }
+    // the rules refer to the engine, so they are applied while it is held
+    const std::vector<std::vector<dnsfilter::rule_view>> &rules =
+            this->filter.match_batch(engine.handle(), targets.data(), targets.size(), match_ctx);
+    for (const std::vector<dnsfilter::rule_view> &target_rules : rules) {
+        if (auto raw_response = apply_rules(target_rules, request, response, event, last_effective_rules)) {
+            return raw_response;
+        }
+    }
+    return std::nullopt;
 }
 
 std::optional<uint8_vector> dns_forwarder::apply_filter(std::string_view hostname, const ldns_pkt *request,
@@ -1038,20 +1098,51 @@ std::optional<uint8_vector> dns_forwarder::apply_filter(std::string_view hostnam
                                                         dns_request_processed_event &event,
                                                         std::vector<dnsfilter::rule> &last_effective_rules,
                                                         bool fire_event, ldns_pkt_rcode *out_rcode) {
-    auto rules = this->filter.match(this->filter_handle, hostname);
-    for (const dnsfilter::rule &rule : rules) {
+    // the context is reused by all the requests processed on the thread, so matching a domain
+    // which does not match any rule does not allocate memory
+    static thread_local dnsfilter::match_context match_ctx;
+    if (filter_engine::ref engine = this->engine.acquire(); engine.handle() != nullptr) {
+        // the rules refer to the engine, so they are applied while it is held
+        const std::vector<dnsfilter::rule_view> &rules = this->filter.match(engine.handle(), hostname, match_ctx);
+        return apply_rules(rules, request, original_response, event, last_effective_rules, fire_event, out_rcode);
+    }
+    return std::nullopt;
+}
+
+std::optional<uint8_vector> dns_forwarder::apply_rules(const std::vector<dnsfilter::rule_view> &rules,
+                                                       const ldns_pkt *request,
+                                                       const ldns_pkt *original_response,
+                                                       dns_request_processed_event &event,
+                                                       std::vector<dnsfilter::rule> &last_effective_rules,
+                                                       bool fire_event, ldns_pkt_rcode *out_rcode) {
+    // the previous effective rules did not block the query, and they are selected anew the same way
+    if (rules.empty()) {
+        return std::nullopt;
+    }
+    for (const dnsfilter::rule_view &rule : rules) {
         tracelog_fid(log, request, "Matched rule: {}", rule.text);
     }
-    rules.insert(rules.cend(), last_effective_rules.cbegin(), last_effective_rules.cend());
-    auto effective_rules = dnsfilter::get_effective_rules(rules);
-
-    event_append_rules(event, effective_rules);
+    // the rules are selected by their views, and only the effective ones are copied
+    static thread_local std::vector<dnsfilter::rule_view> candidates;
+    candidates.assign(rules.cbegin(), rules.cend());
+    for (const dnsfilter::rule &rule : last_effective_rules) {
+        candidates.push_back(dnsfilter::rule_view::of(rule));
+    }
+    std::vector<dnsfilter::rule> effective;
+    for (const dnsfilter::rule_view *rule : dnsfilter::get_effective_rules(candidates)) {
+        effective.emplace_back(rule->to_rule());
+    }
+    // the candidates may refer to the previous effective rules, so those are replaced only now
+    last_effective_rules = std::move(effective);
 
-    last_effective_rules.clear();
-    for (auto effective_rule : effective_rules) {
-        last_effective_rules.push_back(*effective_rule);
+    std::vector<const dnsfilter::rule *> effective_rules;
+    effective_rules.reserve(last_effective_rules.size());
+    for (const dnsfilter::rule &rule : last_effective_rules) {
+        effective_rules.push_back(&rule);
     }
 
+    event_append_rules(event, effective_rules);
+
     if (effective_rules.empty() || effective_rules[0]->props.test(dnsfilter::RP_EXCEPTION)) {
         return std::nullopt;
     }
@@ -12,6 +12,7 @@
 #include <upstream.h>
 #include <certificate_verifier.h>
 #include <shared_mutex>
+#include "filter_engine.h"
 
 namespace ag {
 
@@ -19,6 +20,7 @@ struct cached_response {
     ldns_pkt_ptr response;
     ag::steady_clock::time_point expires_at;
     std::optional<int32_t> upstream_id;
+    uint32_t filter_generation; // generation of the filtering engine which the response has passed
 };
 
 using cached_result = std::pair<ldns_pkt_ptr, std::optional<int32_t>>;
@@ -45,9 +47,18 @@ public:
 
     std::vector<uint8_t> handle_message(uint8_view message);
 
+    /**
+     * Replace the filtering engine with a new one created from the given parameters.
+     * The messages are being filtered by the current engine until the new one is created.
+     * @return {true, opt_warning_description} or {false, error_description}
+     */
+    std::pair<bool, err_string> update_filter(const dnsfilter::engine_params &filter_params);
+
 private:
-    cached_result create_response_from_cache(const std::string &key, const ldns_pkt *request);
-    void put_response_to_cache(std::string key, ldns_pkt_ptr response, std::optional<int32_t> upstream_id);
+    cached_result create_response_from_cache(const std::string &key, const ldns_pkt *request,
+                                             uint32_t filter_generation);
+    void put_response_to_cache(std::string key, ldns_pkt_ptr response, std::optional<int32_t> upstream_id,
+                               uint32_t filter_generation);
 
     std::optional<uint8_vector> apply_filter(std::string_view hostname,
                                              const ldns_pkt *request,
@@ -56,13 +67,20 @@ private:
                                              std::vector<dnsfilter::rule> &last_effective_rules,
                                              bool fire_event = true, ldns_pkt_rcode *out_rcode = nullptr);
 
-    std::optional<uint8_vector> apply_cname_filter(const ldns_rr *cname_rr, const ldns_pkt *request,
-                                                   const ldns_pkt *response, dns_request_processed_event &event,
-                                                   std::vector<dnsfilter::rule> &last_effective_rules);
+    std::optional<uint8_vector> apply_rules(const std::vector<dnsfilter::rule_view> &rules,
+                                            const ldns_pkt *request,
+                                            const ldns_pkt *original_response,
+                                            dns_request_processed_event &event,
+                                            std::vector<dnsfilter::rule> &last_effective_rules,
+                                            bool fire_event = true, ldns_pkt_rcode *out_rcode = nullptr);
+
+    std::optional<uint8_vector> apply_response_filter(const ldns_pkt *request, const ldns_pkt *response,
+                                                      dns_request_processed_event &event,
+                                                      std::vector<dnsfilter::rule> &last_effective_rules);
+
+    bool get_response_cname(const ldns_rr *cname_rr, const ldns_pkt *response, std::string &out);
 
-    std::optional<uint8_vector> apply_ip_filter(const ldns_rr *rr, const ldns_pkt *request,
-                                                const ldns_pkt *response, dns_request_processed_event &event,
-                                                std::vector<dnsfilter::rule> &last_effective_rules);
+    std::optional<uint8_view> get_response_ip(const ldns_rr *rr, const ldns_pkt *response);
 
     ldns_pkt_ptr try_dns64_aaaa_synthesis(upstream *upstream, const ldns_pkt_ptr &request) const;
 
@@ -76,7 +94,7 @@ private:
     std::vector<upstream_ptr> upstreams;
     std::vector<upstream_ptr> fallbacks;
     dnsfilter filter;
-    dnsfilter::handle filter_handle = nullptr;
+    filter_engine engine; // current filtering engine (may be replaced in runtime)
     dns64::prefixes dns64_prefixes;
     std::shared_ptr<certificate_verifier> cert_verifier;
 
@@ -5,6 +5,7 @@
 #include <ag_logger.h>
 #include <default_verifier.h>
 #include <algorithm>
+#include <mutex>
 
 
 using namespace ag;
@@ -35,6 +36,7 @@ struct dnsproxy::impl {
     dnsproxy_settings settings;
     dnsproxy_events events;
     std::vector<listener_ptr> listeners;
+    std::mutex filter_update_guard;
 };
 
 
@@ -98,6 +100,17 @@ void dnsproxy::deinit() {
     infolog(proxy->log, "Proxy module deinitialized...");
 }
 
+std::pair<bool, err_string> dnsproxy::update_filter(dnsfilter::engine_params filter_params) {
+    std::unique_ptr<impl> &proxy = this->pimpl;
+    std::scoped_lock l(proxy->filter_update_guard);
+
+    auto [result, err_or_warn] = proxy->forwarder.update_filter(filter_params);
+    if (result) {
+        proxy->settings.filter_params = std::move(filter_params);
+    }
+    return {result, std::move(err_or_warn)};
+}
+
 const dnsproxy_settings &dnsproxy::get_settings() const {
     return this->pimpl->settings;
 }
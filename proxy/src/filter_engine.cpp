@@ -0,0 +1,44 @@
+#include <chrono>
+#include <thread>
+#include "filter_engine.h"
+
+
+using namespace ag;
+
+static constexpr auto READERS_POLL_INTERVAL = std::chrono::milliseconds(1);
+
+
+filter_engine::~filter_engine() {
+    this->replace(nullptr);
+}
+
+filter_engine::ref filter_engine::acquire() {
+    for (;;) {
+        slot *s = this->current.load();
+        s->readers.fetch_add(1);
+        // If the slot is still the current one, the replacing thread will wait for
+        // this reference to be released before destroying the engine. Otherwise, the slot
+        // has been replaced in the meantime, and its engine must not be used.
+        if (s == this->current.load()) {
+            return ref(s);
+        }
+        s->readers.fetch_sub(1);
+    }
+}
+
+void filter_engine::replace(dnsfilter::handle handle) {
+    std::scoped_lock l(this->replace_guard);
+
+    slot *old = this->current.load();
+    slot *next = (old == &this->slots[0]) ? &this->slots[1] : &this->slots[0];
+    // The readers could see the `next` slot only after it is published
+    next->handle = handle;
+    this->current.store(next);
+    this->replacements.fetch_add(1);
+
+    while (old->readers.load() != 0) {
+        std::this_thread::sleep_for(READERS_POLL_INTERVAL);
+    }
+    this->filter.destroy(old->handle);
+    old->handle = nullptr;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <dnsfilter.h>
+
+namespace ag {
+
+/**
+ * Holder of a filtering engine, which may be replaced while the other threads are matching
+ * domains against it.
+ * The replacement is RCU-like: the new engine is published with an atomic pointer swap, so
+ * the matches started after the swap see the new engine, while the ones in flight finish
+ * on the previous engine, which is destroyed once it is not referenced anymore.
+ * Acquiring the engine never takes a lock.
+ */
+class filter_engine {
+private:
+    struct slot {
+        dnsfilter::handle handle = nullptr;
+        std::atomic<size_t> readers = 0; // number of references to the slot
+    };
+
+public:
+    /**
+     * Reference to the engine, which keeps it alive
+     */
+    class ref {
+    public:
+        ref(ref &&other) : s(other.s) { other.s = nullptr; }
+        ref(const ref &) = delete;
+        ref &operator=(const ref &) = delete;
+        ref &operator=(ref &&) = delete;
+
+        ~ref() {
+            if (this->s != nullptr) {
+                this->s->readers.fetch_sub(1);
+            }
+        }
+
+        /**
+         * Get the engine handle (null if the engine is not set)
+         */
+        dnsfilter::handle handle() const { return this->s->handle; }
+
+    private:
+        friend class filter_engine;
+        explicit ref(slot *s) : s(s) {}
+
+        slot *s;
+    };
+
+    filter_engine() = default;
+    ~filter_engine();
+
+    filter_engine(const filter_engine &) = delete;
+    filter_engine(filter_engine &&) = delete;
+    filter_engine &operator=(const filter_engine &) = delete;
+    filter_engine &operator=(filter_engine &&) = delete;
+
+    /**
+     * Get reference to the current engine
+     */
+    ref acquire();
+
+    /**
+     * Publish the new engine, then wait until the previous one is not referenced and destroy it
+     * @param handle the new engine handle (the holder takes the ownership), may be null
+     */
+    void replace(dnsfilter::handle handle);
+
+    /**
+     * Get the number of the engine replacements.
+     * The counter is incremented after the new engine is published, so the engine acquired after
+     * reading the counter is never older than the one the counter corresponds to.
+     */
+    uint32_t generation() const { return this->replacements.load(); }
+
+private:
+    dnsfilter filter;
+    // While an engine is published in one slot, the other slot is prepared for the next engine
+    slot slots[2];
+    std::atomic<slot *> current = &slots[0];
+    std::atomic<uint32_t> replacements = 0;
+    std::mutex replace_guard;
+};
+
+} // namespace ag
@@ -677,3 +677,47 @@ TEST_F(dnsproxy_test, warnings) {
         ASSERT_TRUE(err_or_warn); // Mem usage warning
     }
 }
+
+TEST_F(dnsproxy_test, filter_update) {
+    ag::dnsproxy_settings settings = ag::dnsproxy_settings::get_default();
+    settings.filter_params = {{ {-3, "blocking_modes_test_filter.txt"}, }};
+
+    ag::dns_request_processed_event last_event{};
+    ag::dnsproxy_events events{
+        .on_request_processed = [&last_event](const ag::dns_request_processed_event &event) {
+            last_event = event;
+        }
+    };
+
+    auto [ret, err] = proxy.init(settings, events);
+    ASSERT_TRUE(ret) << *err;
+
+    ag::ldns_pkt_ptr res;
+
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("adb-style.com", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_EQ(1, last_event.filter_list_ids.size());
+    ASSERT_EQ(-3, last_event.filter_list_ids[0]);
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("google.com", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("google.com", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_TRUE(last_event.cache_hit);
+
+    // Failed update keeps the current engine
+    std::tie(ret, err) = proxy.update_filter({{ {15, "nonexistent_test_filter.txt"}, }});
+    ASSERT_FALSE(ret);
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("adb-style.com", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_EQ(1, last_event.filter_list_ids.size());
+    ASSERT_EQ(-3, last_event.filter_list_ids[0]);
+
+    std::tie(ret, err) = proxy.update_filter({{ {15, "cname_blocking_test_filter.txt"}, }});
+    ASSERT_TRUE(ret) << *err;
+    ASSERT_EQ(15, proxy.get_settings().filter_params.filters[0].id);
+
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("adb-style.com", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_EQ(0, last_event.filter_list_ids.size());
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request(CNAME_BLOCKING_HOST, LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_EQ(1, last_event.filter_list_ids.size());
+    ASSERT_EQ(15, last_event.filter_list_ids[0]);
+    // The response cached before the update has passed the previous engine
+    ASSERT_NO_FATAL_FAILURE(perform_request(proxy, create_request("google.com", LDNS_RR_TYPE_A, LDNS_RD), res));
+    ASSERT_FALSE(last_event.cache_hit);
+}